@@ -170,7 +170,9 @@ sub build_pgprobackup
 		'util.c',
 		'validate.c',
 		'checkdb.c',
-		'ptrack.c'
+		'ptrack.c',
+		'walpack.c',
+		'walstate.c'
 		);
 	$probackup->AddFiles(
 		"$currpath/src/utils",
@@ -180,6 +182,7 @@ sub build_pgprobackup
 		'json.c',
 		'logger.c',
 		'parray.c',
+		'pagemap.c',
 		'pgut.c',
 		'thread.c',
 		'remote.c'
@@ -197,8 +200,6 @@ sub build_pgprobackup
 		$probackup->AddFile("$pgsrc/src/bin/pg_basebackup/walmethods.c");
 	}
 
-	$probackup->AddFile("$pgsrc/src/bin/pg_rewind/datapagemap.c");
-
 	$probackup->AddFile("$pgsrc/src/interfaces/libpq/pthread-win32.c");
 	$probackup->AddFile("$pgsrc/src/timezone/strftime.c");
 
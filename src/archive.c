@@ -13,41 +13,150 @@
 #include "utils/thread.h"
 #include "instr_time.h"
 
+#ifndef WIN32
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+/*
+ * WAL file copied into the archive as temp file, which is waiting
+ * to be synced and renamed together with other files of the batch.
+ */
+typedef struct PushPending
+{
+	char		wal_file_name[MAXFNAMELEN];
+	char		part_path[MAXPGPATH];
+	char		path[MAXPGPATH];
+	bool		dst_exists;		/* file is going to be overwritten */
+	bool		is_wal;			/* write checksum file */
+	pg_crc32	wal_crc;
+	uint64		wal_size;
+	bool		ready_rename;
+} PushPending;
+
 static int push_file_internal_uncompressed(const char *wal_file_name, const char *pg_xlog_dir,
 								  const char *archive_dir, bool overwrite, bool no_sync,
-								  int thread_num, uint32 archive_timeout);
+								  int thread_num, uint32 archive_timeout,
+								  PushPending *pending);
 #ifdef HAVE_LIBZ
 static int push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 									 const char *archive_dir, bool overwrite, bool no_sync,
-									 int compress_level, int thread_num, uint32 archive_timeout);
+									 int compress_level, int thread_num, uint32 archive_timeout,
+									 PushPending *pending);
 #endif
+static void commit_push_group(parray *group, const char *archive_dir,
+							  const char *archive_status_dir, bool no_sync,
+							  int thread_num);
+static void abort_push_group(void *arg);
+static void abort_push_group_callback(bool fatal, void *userdata);
+static void rename_ready_file(const char *archive_status_dir,
+							  const char *wal_file_name, int thread_num);
 static void *push_files(void *arg);
 static void *get_files(void *arg);
 static bool get_wal_file(const char *filename, const char *from_path, const char *to_path,
 													bool prefetch_mode, int thread_num);
 static int get_wal_file_internal(const char *from_path, const char *to_path, FILE *out,
 								 bool is_decompress, int thread_num);
+static int get_wal_file_from_pack(const char *filename, const char *from_fullpath,
+								  FILE *out, int thread_num);
 #ifdef HAVE_LIBZ
 static const char *get_gz_error(gzFile gzf, int errnum);
+static bool open_gz_part(const char *path, int compress_level, bool parallel,
+						 gzFile *out, int *out_fd);
+static void gz_write_parallel(FILE *in, size_t in_size, int out_fd, int compress_level,
+							  pg_crc32 *wal_crc, const char *from_fullpath, const char *to_fullpath_gz_part,
+							  int thread_num);
 #endif
 //static void copy_file_attributes(const char *from_path,
 //								 fio_location from_location,
 //								 const char *to_path, fio_location to_location,
 //								 bool unlink_on_error);
 
+static void write_wal_checksum(const char *archive_dir, const char *wal_file_name,
+							   const char *archived_path, pg_crc32 wal_crc,
+							   uint64 wal_size, bool no_sync, int thread_num);
+static void unlink_wal_checksum(const char *archive_dir, const char *wal_file_name);
+
 static bool next_wal_segment_exists(TimeLineID tli, XLogSegNo segno, const char *prefetch_dir, uint32 wal_seg_size);
 static uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir, TimeLineID tli,
 							   XLogSegNo first_segno, int num_threads, bool inclusive, int batch_size,
 							   uint32 wal_seg_size);
+static uint32 fetch_wal_files(parray *batch_files, const char *prefetch_dir,
+							  const char *archive_dir, int num_threads);
 static bool wal_satisfy_from_prefetch(TimeLineID tli, XLogSegNo segno, const char *wal_file_name,
 									  const char *prefetch_dir, const char *absolute_wal_file_path,
 									  uint32 wal_seg_size, bool parse_wal, int thread_num);
 
 static uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32 wal_seg_size);
+static bool wal_segment_is_staged(const char *pg_xlog_dir, const char *wal_file_name);
 
 static bool prefetch_stop = false;
 static uint32 xlog_seg_size;
 
+/*
+ * Background prefetch worker of archive-get (--async-prefetch).
+ * Worker keeps segments ahead of the last requested one in prefetch
+ * directory. Segments are copied into staging directory first and
+ * moved into prefetch directory only after validation.
+ * archive-get sends requested segments to the worker through a FIFO in
+ * prefetch directory, one "<segment> <miss>" line per request.
+ */
+#define PREFETCH_STAGING_DIR		"pbk_staging"
+#define PREFETCH_FILE_PREFIX		"prefetch."
+#define PREFETCH_PID_FILE			"prefetch.pid"
+#define PREFETCH_REQUEST_FIFO		"prefetch.fifo"
+#define PREFETCH_IDLE_TIMEOUT		60		/* seconds */
+#define PREFETCH_RETRY_INTERVAL		1		/* seconds */
+#define PREFETCH_MAX_WINDOW			8		/* in batches */
+
+#ifndef WIN32
+static bool start_prefetch_worker(InstanceConfig *instance, const char *prefetch_dir,
+								  const char *wal_file_name, int batch_size,
+								  bool validate_wal);
+static bool prefetch_worker_is_running(const char *prefetch_dir);
+static void run_prefetch_worker(InstanceConfig *instance, const char *prefetch_dir,
+								const char *wal_file_name, int batch_size,
+								bool validate_wal);
+static bool write_prefetch_request(const char *prefetch_dir, const char *wal_file_name,
+								   bool miss);
+static bool take_prefetch_request(char *buf, int *buf_len, char *wal_file_name,
+								  bool *miss);
+#endif
+
+/*
+ * Checksum file written next to each archived WAL segment, so that
+ * duplicates and prefetched segments can be checked without reading
+ * the archived segment.
+ */
+#define WAL_CHECKSUM_MAGIC		0x43524357	/* "WCRC" */
+#define WAL_CHECKSUM_VERSION	1
+
+typedef struct WalChecksum
+{
+	uint32		magic;
+	uint32		version;
+	uint64		wal_size;		/* size of uncompressed WAL segment */
+	uint64		archived_size;	/* size of the file in the archive */
+	pg_crc32	wal_crc;		/* CRC32C of uncompressed WAL segment */
+	pg_crc32	crc;			/* CRC32C of the fields above */
+} WalChecksum;
+
+/*
+ * Number of threads available for compression of a single WAL segment.
+ * Threads not needed for pushing the batch are used to compress large
+ * segments block by block.
+ */
+static int	wal_compress_threads = 1;
+
+#ifdef HAVE_LIBZ
+#define GZ_BLOCK_SIZE			(256 * 1024)
+#define GZ_DICT_SIZE			(32 * 1024)
+#define GZ_BLOCKS_PER_THREAD	4
+#endif
+
 typedef struct
 {
 	const char *first_filename;
@@ -58,6 +167,8 @@ typedef struct
 	bool        compress;
 	bool        no_sync;
 	bool        no_ready_rename;
+	bool        block_summary;
+	bool        recovery_index;
 	uint32      archive_timeout;
 
 	CompressAlg compress_alg;
@@ -97,10 +208,13 @@ static int push_file(WALSegno *xlogfile, const char *archive_status_dir,
 								   const char *pg_xlog_dir, const char *archive_dir,
 								   bool overwrite, bool no_sync, uint32 archive_timeout,
 								   bool no_ready_rename, bool is_compress,
-								   int compress_level, int thread_num);
+								   int compress_level, bool block_summary,
+								   bool recovery_index, int thread_num,
+								   parray *commit_group);
 
 static parray *setup_push_filelist(const char *archive_status_dir,
 								   const char *first_file, int batch_size);
+static void push_batch(archive_push_arg *args);
 
 /*
  * At this point, we already done one roundtrip to archive server
@@ -115,7 +229,8 @@ static parray *setup_push_filelist(const char *archive_status_dir,
 void
 do_archive_push(InstanceConfig *instance, char *wal_file_path,
 				char *wal_file_name, int batch_size, bool overwrite,
-				bool no_sync, bool no_ready_rename)
+				bool no_sync, bool no_ready_rename, bool block_summary,
+				bool recovery_index)
 {
 	uint64		i;
 	char		current_dir[MAXPGPATH];
@@ -167,6 +282,8 @@ do_archive_push(InstanceConfig *instance, char *wal_file_path,
 	join_path_components(pg_xlog_dir, current_dir, XLOGDIR);
 	join_path_components(archive_status_dir, pg_xlog_dir, "archive_status");
 
+	xlog_seg_size = instance->xlog_seg_size;
+
 	/* Create 'archlog_path' directory. Do nothing if it already exists. */
 	//fio_mkdir(instance->arclog_path, DIR_PERMISSION, FIO_BACKUP_HOST);
 
@@ -182,6 +299,9 @@ do_archive_push(InstanceConfig *instance, char *wal_file_path,
 	if (num_threads > parray_num(batch_files))
 		n_threads = parray_num(batch_files);
 
+	/* spare threads are used for compression of individual segments */
+	wal_compress_threads = Max(1, num_threads / Max(1, n_threads));
+
 	elog(INFO, "PID [%d]: pg_probackup archive-push WAL file: %s, "
 					"threads: %i/%i, batch: %lu/%i, compression: %s",
 						my_pid, wal_file_name, n_threads, num_threads,
@@ -202,6 +322,15 @@ do_archive_push(InstanceConfig *instance, char *wal_file_path,
 	 */
 	if (num_threads == 1 || (parray_num(batch_files) == 1))
 	{
+		parray *commit_group = NULL;
+
+		/* there is nothing to group for a single file */
+		if (parray_num(batch_files) > 1)
+		{
+			commit_group = parray_new();
+			pgut_atexit_push(abort_push_group_callback, commit_group);
+		}
+
 		INSTR_TIME_SET_CURRENT(start_time);
 		for (i = 0; i < parray_num(batch_files); i++)
 		{
@@ -214,13 +343,21 @@ do_archive_push(InstanceConfig *instance, char *wal_file_path,
 						   instance->archive_timeout,
 						   no_ready_rename || (strcmp(xlogfile->name, wal_file_name) == 0) ? true : false,
 						   is_compress && IsXLogFileName(xlogfile->name) ? true : false,
-						   instance->compress_level, 1);
+						   instance->compress_level, block_summary,
+						   recovery_index, 1, commit_group);
 			if (rc == 0)
 				n_total_pushed++;
 			else
 				n_total_skipped++;
 		}
 
+		if (commit_group)
+		{
+			pgut_atexit_pop(abort_push_group_callback, commit_group);
+			commit_push_group(commit_group, instance->arclog_path,
+							  archive_status_dir, no_sync, 1);
+		}
+
 		push_isok = true;
 		goto push_done;
 	}
@@ -241,6 +378,8 @@ do_archive_push(InstanceConfig *instance, char *wal_file_path,
 		arg->compress = is_compress;
 		arg->no_sync = no_sync;
 		arg->no_ready_rename = no_ready_rename;
+		arg->block_summary = block_summary;
+		arg->recovery_index = recovery_index;
 		arg->archive_timeout = instance->archive_timeout;
 
 		arg->compress_alg = instance->compress_alg;
@@ -308,10 +447,34 @@ push_done:
  */
 static void *
 push_files(void *arg)
+{
+	archive_push_arg *args = (archive_push_arg *) arg;
+
+	push_batch(args);
+
+	/* close ssh connection */
+	fio_disconnect();
+
+	args->ret = 0;
+	return NULL;
+}
+
+/*
+ * Push files of the batch not taken by other threads yet.
+ */
+static void
+push_batch(archive_push_arg *args)
 {
 	int		i;
 	int		rc;
-	archive_push_arg *args = (archive_push_arg *) arg;
+	parray *commit_group = NULL;
+
+	/* there is nothing to group for a single file */
+	if (parray_num(args->files) > 1)
+		commit_group = parray_new();
+
+	/* do not leave temp files behind if the thread fails */
+	pthread_cleanup_push(abort_push_group, commit_group);
 
 	for (i = 0; i < parray_num(args->files); i++)
 	{
@@ -334,7 +497,8 @@ push_files(void *arg)
 					   args->archive_timeout, no_ready_rename,
 					   /* do not compress .backup, .partial and .history files */
 					   args->compress && IsXLogFileName(xlogfile->name) ? true : false,
-					   args->compress_level, args->thread_num);
+					   args->compress_level, args->block_summary,
+					   args->recovery_index, args->thread_num, commit_group);
 
 		if (rc == 0)
 			args->n_pushed++;
@@ -342,61 +506,349 @@ push_files(void *arg)
 			args->n_skipped++;
 	}
 
-	/* close ssh connection */
-	fio_disconnect();
+	pthread_cleanup_pop(0);
 
-	args->ret = 0;
-	return NULL;
+	if (commit_group)
+		commit_push_group(commit_group, args->archive_dir,
+						  args->archive_status_dir, args->no_sync,
+						  args->thread_num);
 }
 
+/*
+ * Push WAL file into the archive.
+ *
+ * If commit_group is provided, the file is left as temp file in the archive
+ * and is appended to commit_group, commit_push_group() must be called then
+ * to make it durable and rename its ready file.
+ */
 int
 push_file(WALSegno *xlogfile, const char *archive_status_dir,
 		  const char *pg_xlog_dir, const char *archive_dir,
 		  bool overwrite, bool no_sync, uint32 archive_timeout,
 		  bool no_ready_rename, bool is_compress,
-		  int compress_level, int thread_num)
+		  int compress_level, bool block_summary, bool recovery_index,
+		  int thread_num, parray *commit_group)
 {
 	int     rc;
-	char	wal_file_dummy[MAXPGPATH];
-
-	join_path_components(wal_file_dummy, archive_status_dir, xlogfile->name);
+	PushPending *pending = NULL;
 
 	elog(LOG, "Thread [%d]: pushing file \"%s\"", thread_num, xlogfile->name);
 
+	if (commit_group)
+		pending = pgut_new(PushPending);
+
 	/* If compression is not required, then just copy it as is */
 	if (!is_compress)
 		rc = push_file_internal_uncompressed(xlogfile->name, pg_xlog_dir,
 											 archive_dir, overwrite, no_sync,
-											 thread_num, archive_timeout);
+											 thread_num, archive_timeout,
+											 pending);
 #ifdef HAVE_LIBZ
 	else
 		rc = push_file_internal_gz(xlogfile->name, pg_xlog_dir, archive_dir,
 								   overwrite, no_sync, compress_level,
-								   thread_num, archive_timeout);
+								   thread_num, archive_timeout, pending);
 #endif
 
+	/*
+	 * Summarize blocks changed by the segment for PAGE backups and index
+	 * restore points for validation. Do it before the ready file is
+	 * renamed, so the segment cannot be recycled yet.
+	 */
+	if ((block_summary || recovery_index) && rc == 0 &&
+		IsXLogFileName(xlogfile->name))
+		summarize_wal_segment(xlogfile->name, pg_xlog_dir, archive_dir,
+							  xlog_seg_size, block_summary, recovery_index,
+							  no_sync, thread_num);
+
+	/* ready file is renamed after group commit */
+	if (pending && rc == 0)
+	{
+		pending->ready_rename = !no_ready_rename;
+		parray_append(commit_group, pending);
+		return rc;
+	}
+	pg_free(pending);
+
 	/* take '--no-ready-rename' flag into account */
 	if (!no_ready_rename)
+		rename_ready_file(archive_status_dir, xlogfile->name, thread_num);
+
+	return rc;
+}
+
+/*
+ * Rename ready file of WAL file pushed into the archive.
+ */
+static void
+rename_ready_file(const char *archive_status_dir, const char *wal_file_name,
+				  int thread_num)
+{
+	char	wal_file_dummy[MAXPGPATH];
+	char	wal_file_ready[MAXPGPATH];
+	char	wal_file_done[MAXPGPATH];
+
+	join_path_components(wal_file_dummy, archive_status_dir, wal_file_name);
+
+	snprintf(wal_file_ready, MAXPGPATH, "%s.%s", wal_file_dummy, "ready");
+	snprintf(wal_file_done, MAXPGPATH, "%s.%s", wal_file_dummy, "done");
+
+	canonicalize_path(wal_file_ready);
+	canonicalize_path(wal_file_done);
+	/* It is ok to rename status file in archive_status directory */
+	elog(VERBOSE, "Thread [%d]: Rename \"%s\" to \"%s\"", thread_num,
+									wal_file_ready, wal_file_done);
+
+	/* do not error out, if rename failed */
+	if (fio_rename(wal_file_ready, wal_file_done, FIO_DB_HOST) < 0)
+		elog(WARNING, "Thread [%d]: Cannot rename ready file \"%s\" to \"%s\": %s",
+			thread_num, wal_file_ready, wal_file_done, strerror(errno));
+}
+
+/*
+ * Remove temp files of the group which is not going to be committed
+ * because of an error, so they do not stall the next archive-push.
+ */
+static void
+abort_push_group(void *arg)
+{
+	parray	   *group = (parray *) arg;
+	int			i;
+
+	if (group == NULL)
+		return;
+
+	for (i = 0; i < parray_num(group); i++)
+		fio_unlink(((PushPending *) parray_get(group, i))->part_path,
+				   FIO_BACKUP_HOST);
+}
+
+static void
+abort_push_group_callback(bool fatal, void *userdata)
+{
+	abort_push_group(userdata);
+}
+
+/*
+ * Make WAL files of the group durable in the archive: sync all temp files
+ * at once, rename them and sync the archive directory once. Ready files
+ * are renamed only after that. The group is freed.
+ */
+static void
+commit_push_group(parray *group, const char *archive_dir,
+				  const char *archive_status_dir, bool no_sync,
+				  int thread_num)
+{
+	int			n_files = parray_num(group);
+	int			i;
+
+	if (n_files == 0)
+	{
+		parray_free(group);
+		return;
+	}
+
+	elog(VERBOSE, "Thread [%d]: Commit %i WAL files into archive",
+		 thread_num, n_files);
+
+	/* sync temp files */
+	if (!no_sync)
 	{
-		char	wal_file_ready[MAXPGPATH];
-		char	wal_file_done[MAXPGPATH];
+		char const **paths = pgut_malloc(sizeof(char *) * n_files);
 
-		snprintf(wal_file_ready, MAXPGPATH, "%s.%s", wal_file_dummy, "ready");
-		snprintf(wal_file_done, MAXPGPATH, "%s.%s", wal_file_dummy, "done");
+		for (i = 0; i < n_files; i++)
+			paths[i] = ((PushPending *) parray_get(group, i))->part_path;
 
-		canonicalize_path(wal_file_ready);
-		canonicalize_path(wal_file_done);
-		/* It is ok to rename status file in archive_status directory */
-		elog(VERBOSE, "Thread [%d]: Rename \"%s\" to \"%s\"", thread_num,
-										wal_file_ready, wal_file_done);
+		if (fio_sync_files(paths, n_files, FIO_BACKUP_HOST) != 0)
+		{
+			int		save_errno = errno;
+
+			for (i = 0; i < n_files; i++)
+				fio_unlink(paths[i], FIO_BACKUP_HOST);
+			elog(ERROR, "Thread [%d]: Failed to sync temp WAL files in \"%s\": %s",
+				 thread_num, archive_dir, strerror(save_errno));
+		}
 
-		/* do not error out, if rename failed */
-		if (fio_rename(wal_file_ready, wal_file_done, FIO_DB_HOST) < 0)
-			elog(WARNING, "Thread [%d]: Cannot rename ready file \"%s\" to \"%s\": %s",
-				thread_num, wal_file_ready, wal_file_done, strerror(errno));
+		pg_free(paths);
 	}
 
-	return rc;
+	/* rename temp files to destination files */
+	for (i = 0; i < n_files; i++)
+	{
+		PushPending *pending = (PushPending *) parray_get(group, i);
+
+		/* checksum file of overwritten segment is not valid anymore */
+		if (pending->is_wal && pending->dst_exists)
+			unlink_wal_checksum(archive_dir, pending->wal_file_name);
+
+		elog(VERBOSE, "Thread [%d]: Rename \"%s\" to \"%s\"",
+			 thread_num, pending->part_path, pending->path);
+
+		if (fio_rename(pending->part_path, pending->path, FIO_BACKUP_HOST) < 0)
+		{
+			int		save_errno = errno;
+			int		j;
+
+			for (j = i; j < n_files; j++)
+				fio_unlink(((PushPending *) parray_get(group, j))->part_path,
+						   FIO_BACKUP_HOST);
+			elog(ERROR, "Thread [%d]: Cannot rename file \"%s\" to \"%s\": %s",
+				 thread_num, pending->part_path, pending->path,
+				 strerror(save_errno));
+		}
+
+		wal_state_add(pending->path, -1);
+
+		/*
+		 * Checksum file is validated on read, so it is made durable
+		 * by the directory sync below along with the WAL file.
+		 */
+		if (pending->is_wal)
+			write_wal_checksum(archive_dir, pending->wal_file_name,
+							   pending->path, pending->wal_crc,
+							   pending->wal_size, true, thread_num);
+	}
+
+	/* sync archive directory once for all renames */
+#ifndef WIN32
+	if (!no_sync && fio_sync(archive_dir, FIO_BACKUP_HOST) != 0)
+		elog(ERROR, "Thread [%d]: Failed to sync directory \"%s\": %s",
+			 thread_num, archive_dir, strerror(errno));
+#endif
+
+	/* WAL files are durable in the archive now */
+	for (i = 0; i < n_files; i++)
+	{
+		PushPending *pending = (PushPending *) parray_get(group, i);
+
+		if (pending->ready_rename)
+			rename_ready_file(archive_status_dir, pending->wal_file_name,
+							  thread_num);
+	}
+
+	parray_walk(group, pfree);
+	parray_free(group);
+}
+
+/*
+ * Find archived file of WAL segment and return its size, compressed file
+ * is looked up first. Returns false if segment is missing.
+ */
+static bool
+get_archived_wal_size(const char *archive_dir, const char *wal_file_name,
+					  uint64 *size)
+{
+	char		path[MAXPGPATH];
+	struct stat	st;
+
+	snprintf(path, MAXPGPATH, "%s/%s.gz", archive_dir, wal_file_name);
+	if (fio_stat(path, &st, true, FIO_BACKUP_HOST) < 0)
+	{
+		snprintf(path, MAXPGPATH, "%s/%s", archive_dir, wal_file_name);
+		if (fio_stat(path, &st, true, FIO_BACKUP_HOST) < 0)
+			return false;
+	}
+
+	*size = st.st_size;
+	return true;
+}
+
+/*
+ * Write checksum file of WAL segment just pushed into the archive.
+ * Failure is not an error, the checksum will be calculated from the
+ * archived segment itself then.
+ */
+static void
+write_wal_checksum(const char *archive_dir, const char *wal_file_name,
+				   const char *archived_path, pg_crc32 wal_crc,
+				   uint64 wal_size, bool no_sync, int thread_num)
+{
+	WalChecksum	checksum;
+	char		path[MAXPGPATH];
+	struct stat	st;
+
+	MemSet(&checksum, 0, sizeof(checksum));
+	checksum.magic = WAL_CHECKSUM_MAGIC;
+	checksum.version = WAL_CHECKSUM_VERSION;
+	checksum.wal_size = wal_size;
+	checksum.wal_crc = wal_crc;
+
+	if (fio_stat(archived_path, &st, true, FIO_BACKUP_HOST) < 0)
+		return;
+	checksum.archived_size = st.st_size;
+
+	INIT_FILE_CRC32(true, checksum.crc);
+	COMP_FILE_CRC32(true, checksum.crc, &checksum, offsetof(WalChecksum, crc));
+	FIN_FILE_CRC32(true, checksum.crc);
+
+	snprintf(path, MAXPGPATH, "%s/%s.crc", archive_dir, wal_file_name);
+	write_wal_sidecar(path, (char *) &checksum, sizeof(checksum),
+					  no_sync, WARNING, thread_num);
+}
+
+/*
+ * Read checksum file of archived WAL segment. Checksum file is trusted only
+ * if the size of archived segment is the same as at the time of push.
+ */
+bool
+read_wal_checksum(const char *archive_dir, const char *wal_file_name,
+				  pg_crc32 *wal_crc, uint64 *wal_size)
+{
+	WalChecksum	checksum;
+	char		path[MAXPGPATH];
+	pg_crc32	crc;
+	uint64		archived_size;
+	int			fd;
+	ssize_t		rc;
+
+	snprintf(path, MAXPGPATH, "%s/%s.crc", archive_dir, wal_file_name);
+
+	fd = fio_open(path, O_RDONLY | PG_BINARY, FIO_BACKUP_HOST);
+	if (fd < 0)
+		return false;
+
+	rc = fio_read(fd, &checksum, sizeof(checksum));
+	fio_close(fd);
+
+	if (rc != (ssize_t) sizeof(checksum) ||
+		checksum.magic != WAL_CHECKSUM_MAGIC ||
+		checksum.version != WAL_CHECKSUM_VERSION)
+		goto corrupted;
+
+	INIT_FILE_CRC32(true, crc);
+	COMP_FILE_CRC32(true, crc, &checksum, offsetof(WalChecksum, crc));
+	FIN_FILE_CRC32(true, crc);
+
+	if (!EQ_CRC32C(crc, checksum.crc))
+		goto corrupted;
+
+	if (!get_archived_wal_size(archive_dir, wal_file_name, &archived_size) ||
+		archived_size != checksum.archived_size)
+	{
+		elog(LOG, "WAL checksum file \"%s\" is stale, ignore it", path);
+		return false;
+	}
+
+	*wal_crc = checksum.wal_crc;
+	*wal_size = checksum.wal_size;
+	return true;
+
+corrupted:
+	elog(WARNING, "WAL checksum file \"%s\" is corrupted, ignore it", path);
+	return false;
+}
+
+/*
+ * Remove checksum file of WAL segment which is going to be overwritten.
+ */
+static void
+unlink_wal_checksum(const char *archive_dir, const char *wal_file_name)
+{
+	char		path[MAXPGPATH];
+
+	snprintf(path, MAXPGPATH, "%s/%s.crc", archive_dir, wal_file_name);
+	fio_unlink(path, FIO_BACKUP_HOST);
+	wal_state_remove(path);
 }
 
 /*
@@ -410,7 +862,8 @@ push_file(WALSegno *xlogfile, const char *archive_status_dir,
 int
 push_file_internal_uncompressed(const char *wal_file_name, const char *pg_xlog_dir,
 								const char *archive_dir, bool overwrite, bool no_sync,
-								int thread_num, uint32 archive_timeout)
+								int thread_num, uint32 archive_timeout,
+								PushPending *pending)
 {
 	FILE	   *in = NULL;
 	int			out = -1;
@@ -423,6 +876,11 @@ push_file_internal_uncompressed(const char *wal_file_name, const char *pg_xlog_d
 	int			partial_try_count = 0;
 	int			partial_file_size = 0;
 	bool		partial_is_stale = true;
+	/* checksum file */
+	bool		is_wal = IsXLogFileName(wal_file_name);
+	bool		dst_exists = false;
+	pg_crc32	crc32_wal;
+	uint64		wal_size = 0;
 
 	/* from path */
 	join_path_components(from_fullpath, pg_xlog_dir, wal_file_name);
@@ -542,9 +1000,14 @@ part_opened:
 	{
 		pg_crc32 crc32_src;
 		pg_crc32 crc32_dst;
+		uint64   dst_size;
 
+		dst_exists = true;
 		crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, false);
-		crc32_dst = fio_get_crc32(to_fullpath, FIO_BACKUP_HOST, false);
+
+		/* use checksum file instead of reading archived segment, if possible */
+		if (!is_wal || !read_wal_checksum(archive_dir, wal_file_name, &crc32_dst, &dst_size))
+			crc32_dst = fio_get_crc32(to_fullpath, FIO_BACKUP_HOST, false);
 
 		if (crc32_src == crc32_dst)
 		{
@@ -574,6 +1037,7 @@ part_opened:
 	}
 
 	/* copy content */
+	INIT_FILE_CRC32(true, crc32_wal);
 	for (;;)
 	{
 		size_t  read_len = 0;
@@ -594,10 +1058,15 @@ part_opened:
 						thread_num, to_fullpath_part, strerror(errno));
 		}
 
+		COMP_FILE_CRC32(true, crc32_wal, buf, read_len);
+		wal_size += read_len;
+
 		if (feof(in))
 			break;
 	}
 
+	FIN_FILE_CRC32(true, crc32_wal);
+
 	/* close source file */
 	fclose(in);
 
@@ -609,6 +1078,20 @@ part_opened:
 					thread_num, to_fullpath_part, strerror(errno));
 	}
 
+	/* leave sync and rename to group commit */
+	if (pending)
+	{
+		strncpy(pending->wal_file_name, wal_file_name, MAXFNAMELEN);
+		strcpy(pending->part_path, to_fullpath_part);
+		strcpy(pending->path, to_fullpath);
+		pending->dst_exists = dst_exists;
+		pending->is_wal = is_wal;
+		pending->wal_crc = crc32_wal;
+		pending->wal_size = wal_size;
+		pg_free(buf);
+		return 0;
+	}
+
 	/* sync temp file to disk */
 	if (!no_sync)
 	{
@@ -622,6 +1105,10 @@ part_opened:
 
 	//copy_file_attributes(from_path, FIO_DB_HOST, to_path_temp, FIO_BACKUP_HOST, true);
 
+	/* checksum file of overwritten segment is not valid anymore */
+	if (is_wal && dst_exists)
+		unlink_wal_checksum(archive_dir, wal_file_name);
+
 	/* Rename temp file to destination file */
 	if (fio_rename(to_fullpath_part, to_fullpath, FIO_BACKUP_HOST) < 0)
 	{
@@ -630,6 +1117,12 @@ part_opened:
 					thread_num, to_fullpath_part, to_fullpath, strerror(errno));
 	}
 
+	wal_state_add(to_fullpath, -1);
+
+	if (is_wal)
+		write_wal_checksum(archive_dir, wal_file_name, to_fullpath,
+						   crc32_wal, wal_size, no_sync, thread_num);
+
 	pg_free(buf);
 	return 0;
 }
@@ -645,15 +1138,21 @@ part_opened:
 int
 push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 					  const char *archive_dir, bool overwrite, bool no_sync,
-					  int compress_level, int thread_num, uint32 archive_timeout)
+					  int compress_level, int thread_num, uint32 archive_timeout,
+					  PushPending *pending)
 {
 	FILE	   *in = NULL;
 	gzFile		out = NULL;
+	int			out_fd = -1;
 	char       *buf = pgut_malloc(OUT_BUF_SIZE);
 	char		from_fullpath[MAXPGPATH];
 	char		to_fullpath[MAXPGPATH];
 	char		to_fullpath_gz[MAXPGPATH];
 
+	/* parallel compression */
+	bool		parallel = false;
+	size_t		in_size = 0;
+
 	/* partial handling */
 	struct stat		st;
 
@@ -662,6 +1161,11 @@ push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 	int			partial_file_size = 0;
 	bool		partial_is_stale = true;
 
+	/* checksum file */
+	bool		dst_exists = false;
+	pg_crc32	crc32_wal;
+	uint64		wal_size = 0;
+
 	/* from path */
 	join_path_components(from_fullpath, pg_xlog_dir, wal_file_name);
 	canonicalize_path(from_fullpath);
@@ -683,9 +1187,19 @@ push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 	/* disable stdio buffering for input file */
 	setvbuf(in, NULL, _IONBF, BUFSIZ);
 
+	/*
+	 * Large segment is compressed by several threads, if there are
+	 * threads to spare.
+	 */
+	if (wal_compress_threads > 1 && fstat(fileno(in), &st) == 0 &&
+		st.st_size > GZ_BLOCK_SIZE)
+	{
+		parallel = true;
+		in_size = st.st_size;
+	}
+
 	/* Grab lock by creating temp file in exclusive mode */
-	out = fio_gzopen(to_fullpath_gz_part, PG_BINARY_W, compress_level, FIO_BACKUP_HOST);
-	if (out == NULL)
+	if (!open_gz_part(to_fullpath_gz_part, compress_level, parallel, &out, &out_fd))
 	{
 		if (errno != EEXIST)
 			elog(ERROR, "Thread [%d]: Cannot open temp WAL file \"%s\": %s",
@@ -715,8 +1229,7 @@ push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 			if (errno == ENOENT)
 			{
 				//part file is gone, lets try to grab it
-				out = fio_gzopen(to_fullpath_gz_part, PG_BINARY_W, compress_level, FIO_BACKUP_HOST);
-				if (out == NULL)
+				if (!open_gz_part(to_fullpath_gz_part, compress_level, parallel, &out, &out_fd))
 				{
 					if (errno != EEXIST)
 						elog(ERROR, "Thread [%d]: Failed to open temp WAL file \"%s\": %s",
@@ -757,7 +1270,7 @@ push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 	 * If temp file was not grabbed for ARCHIVE_TIMEOUT and temp file is not stale,
 	 * then exit with error.
 	 */
-	if (out == NULL)
+	if (out == NULL && out_fd < 0)
 	{
 		if (!partial_is_stale)
 			elog(ERROR, "Thread [%d]: Failed to open temp WAL file \"%s\" in %i seconds",
@@ -768,8 +1281,7 @@ push_file_internal_gz(const char *wal_file_name, const char *pg_xlog_dir,
 											thread_num, to_fullpath_gz_part);
 		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
 
-		out = fio_gzopen(to_fullpath_gz_part, PG_BINARY_W, compress_level, FIO_BACKUP_HOST);
-		if (out == NULL)
+		if (!open_gz_part(to_fullpath_gz_part, compress_level, parallel, &out, &out_fd))
 			elog(ERROR, "Thread [%d]: Cannot open temp WAL file \"%s\": %s",
 								thread_num, to_fullpath_gz_part, strerror(errno));
 	}
@@ -783,10 +1295,16 @@ part_opened:
 	{
 		pg_crc32 crc32_src;
 		pg_crc32 crc32_dst;
+		uint64   dst_size;
+
+		dst_exists = true;
 
 		/* TODO: what if one of them goes missing? */
 		crc32_src = fio_get_crc32(from_fullpath, FIO_DB_HOST, false);
-		crc32_dst = fio_get_crc32(to_fullpath_gz, FIO_BACKUP_HOST, true);
+
+		/* use checksum file instead of decompressing archived segment, if possible */
+		if (!read_wal_checksum(archive_dir, wal_file_name, &crc32_dst, &dst_size))
+			crc32_dst = fio_get_crc32(to_fullpath_gz, FIO_BACKUP_HOST, true);
 
 		if (crc32_src == crc32_dst)
 		{
@@ -794,7 +1312,10 @@ part_opened:
 					"checksum, skip pushing: \"%s\"", thread_num, from_fullpath);
 			/* cleanup */
 			fclose(in);
-			fio_gzclose(out);
+			if (parallel)
+				fio_close(out_fd);
+			else
+				fio_gzclose(out);
 			fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
 			return 1;
 		}
@@ -816,41 +1337,70 @@ part_opened:
 	}
 
 	/* copy content */
-	for (;;)
+	INIT_FILE_CRC32(true, crc32_wal);
+	if (parallel)
 	{
-		size_t  read_len = 0;
+		gz_write_parallel(in, in_size, out_fd, compress_level, &crc32_wal,
+						  from_fullpath, to_fullpath_gz_part, thread_num);
+		wal_size = in_size;
+	}
+	else
+	{
+		for (;;)
+		{
+			size_t  read_len = 0;
 
-		read_len = fread(buf, 1, OUT_BUF_SIZE, in);
+			read_len = fread(buf, 1, OUT_BUF_SIZE, in);
 
-		if (ferror(in))
-		{
-			fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
-			elog(ERROR, "Thread [%d]: Cannot read from source file \"%s\": %s",
-								thread_num, from_fullpath, strerror(errno));
-		}
+			if (ferror(in))
+			{
+				fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+				elog(ERROR, "Thread [%d]: Cannot read from source file \"%s\": %s",
+									thread_num, from_fullpath, strerror(errno));
+			}
 
-		if (read_len > 0 && fio_gzwrite(out, buf, read_len) != read_len)
-		{
-			fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
-			elog(ERROR, "Thread [%d]: Cannot write to compressed temp WAL file \"%s\": %s",
-						 thread_num, to_fullpath_gz_part, get_gz_error(out, errno));
-		}
+			if (read_len > 0 && fio_gzwrite(out, buf, read_len) != read_len)
+			{
+				fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+				elog(ERROR, "Thread [%d]: Cannot write to compressed temp WAL file \"%s\": %s",
+							 thread_num, to_fullpath_gz_part, get_gz_error(out, errno));
+			}
 
-		if (feof(in))
-			break;
+			COMP_FILE_CRC32(true, crc32_wal, buf, read_len);
+			wal_size += read_len;
+
+			if (feof(in))
+				break;
+		}
 	}
 
+	FIN_FILE_CRC32(true, crc32_wal);
+
 	/* close source file */
 	fclose(in);
 
 	/* close temp file */
-	if (fio_gzclose(out) != 0)
+	if ((parallel ? fio_close(out_fd) : fio_gzclose(out)) != 0)
 	{
 		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
 		elog(ERROR, "Thread [%d]: Cannot close compressed temp WAL file \"%s\": %s",
 					thread_num, to_fullpath_gz_part, strerror(errno));
 	}
 
+	/* leave sync and rename to group commit */
+	if (pending)
+	{
+		strncpy(pending->wal_file_name, wal_file_name, MAXFNAMELEN);
+		strcpy(pending->part_path, to_fullpath_gz_part);
+		strcpy(pending->path, to_fullpath_gz);
+		pending->dst_exists = dst_exists;
+		pending->is_wal = true;
+		pending->wal_crc = crc32_wal;
+		pending->wal_size = wal_size;
+		pg_free(buf);
+		return 0;
+	}
+
 	/* sync temp file to disk */
 	if (!no_sync)
 	{
@@ -864,6 +1414,10 @@ part_opened:
 
 	//copy_file_attributes(from_path, FIO_DB_HOST, to_path_temp, FIO_BACKUP_HOST, true);
 
+	/* checksum file of overwritten segment is not valid anymore */
+	if (dst_exists)
+		unlink_wal_checksum(archive_dir, wal_file_name);
+
 	/* Rename temp file to destination file */
 	if (fio_rename(to_fullpath_gz_part, to_fullpath_gz, FIO_BACKUP_HOST) < 0)
 	{
@@ -872,6 +1426,11 @@ part_opened:
 					thread_num, to_fullpath_gz_part, to_fullpath_gz, strerror(errno));
 	}
 
+	wal_state_add(to_fullpath_gz, -1);
+
+	write_wal_checksum(archive_dir, wal_file_name, to_fullpath_gz,
+					   crc32_wal, wal_size, no_sync, thread_num);
+
 	pg_free(buf);
 
 	return 0;
@@ -896,47 +1455,288 @@ get_gz_error(gzFile gzf, int errnum)
 }
 #endif
 
-/* Copy file attributes */
-//static void
-//copy_file_attributes(const char *from_path, fio_location from_location,
-//		  const char *to_path, fio_location to_location,
-//		  bool unlink_on_error)
-//{
-//	struct stat st;
-//
-//	if (fio_stat(from_path, &st, true, from_location) == -1)
-//	{
-//		if (unlink_on_error)
-//			fio_unlink(to_path, to_location);
-//		elog(ERROR, "Cannot stat file \"%s\": %s",
-//			 from_path, strerror(errno));
-//	}
-//
-//	if (fio_chmod(to_path, st.st_mode, to_location) == -1)
-//	{
-//		if (unlink_on_error)
-//			fio_unlink(to_path, to_location);
-//		elog(ERROR, "Cannot change mode of file \"%s\": %s",
-//			 to_path, strerror(errno));
-//	}
-//}
-
-/* Look for files with '.ready' suffix in archive_status directory
- * and pack such files into batch sized array.
+#ifdef HAVE_LIBZ
+/*
+ * Create temp file for compressed WAL segment in exclusive mode.
+ * In parallel mode gzip stream is assembled by gz_write_parallel(),
+ * so plain file descriptor is opened instead of gzFile.
  */
-parray *
-setup_push_filelist(const char *archive_status_dir, const char *first_file,
-					int batch_size)
+static bool
+open_gz_part(const char *path, int compress_level, bool parallel,
+			 gzFile *out, int *out_fd)
 {
-	int i;
-	WALSegno *xlogfile = NULL;
-	parray  *status_files = NULL;
-	parray  *batch_files = parray_new();
+	if (parallel)
+	{
+		*out_fd = fio_open(path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY,
+						   FIO_BACKUP_HOST);
+		return *out_fd >= 0;
+	}
 
-	/* guarantee that first filename is in batch list */
-	xlogfile = palloc(sizeof(WALSegno));
-	pg_atomic_init_flag(&xlogfile->lock);
-	snprintf(xlogfile->name, MAXFNAMELEN, "%s", first_file);
+	*out = fio_gzopen(path, PG_BINARY_W, compress_level, FIO_BACKUP_HOST);
+	return *out != NULL;
+}
+
+typedef struct
+{
+	Bytef	   *data;		/* uncompressed block, preceded by dictionary */
+	uInt		len;
+	uInt		dict_len;
+	bool		last;
+
+	Bytef	   *out;
+	uInt		out_size;
+	uInt		out_len;
+	uLong		crc;
+	int			rc;			/* zlib error code */
+} gz_block;
+
+typedef struct
+{
+	gz_block   *blocks;
+	int			n_blocks;
+	int			first;
+	int			step;
+	int			level;
+} gz_compress_arg;
+
+/*
+ * Compress blocks as raw deflate streams. Every block is primed with the
+ * last 32kB of the previous one and is terminated by sync flush, so
+ * concatenation of the blocks is a valid deflate stream.
+ */
+static void *
+gz_compress_blocks(void *arg)
+{
+	gz_compress_arg *args = (gz_compress_arg *) arg;
+	int			i;
+
+	for (i = args->first; i < args->n_blocks; i += args->step)
+	{
+		gz_block   *block = &args->blocks[i];
+		z_stream	z;
+
+		memset(&z, 0, sizeof(z));
+		block->rc = deflateInit2(&z, args->level, Z_DEFLATED, -MAX_WBITS,
+								 8, Z_DEFAULT_STRATEGY);
+		if (block->rc != Z_OK)
+			continue;
+
+		if (block->dict_len > 0)
+			block->rc = deflateSetDictionary(&z, block->data - block->dict_len,
+											 block->dict_len);
+
+		if (block->rc == Z_OK)
+		{
+			z.next_in = block->data;
+			z.avail_in = block->len;
+			z.next_out = block->out;
+			z.avail_out = block->out_size;
+
+			block->rc = deflate(&z, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+			if (block->last)
+				block->rc = (block->rc == Z_STREAM_END) ? Z_OK : Z_BUF_ERROR;
+			else if (block->rc == Z_OK && (z.avail_in != 0 || z.avail_out == 0))
+				block->rc = Z_BUF_ERROR;
+
+			block->out_len = block->out_size - z.avail_out;
+			block->crc = crc32(0, block->data, block->len);
+		}
+
+		deflateEnd(&z);
+	}
+
+	return NULL;
+}
+
+/*
+ * Compress WAL segment using wal_compress_threads threads, pigz-style.
+ * Segment is split into blocks which are deflated independently and
+ * written out in order as a single gzip member, so the result can be
+ * read by any gzip reader.
+ */
+static void
+gz_write_parallel(FILE *in, size_t in_size, int out_fd, int compress_level,
+				  pg_crc32 *wal_crc, const char *from_fullpath,
+				  const char *to_fullpath_gz_part, int thread_num)
+{
+	static const unsigned char gz_header[10] =
+		{0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03};
+	unsigned char gz_trailer[8];
+	int			n_threads = wal_compress_threads;
+	int			max_blocks = n_threads * GZ_BLOCKS_PER_THREAD;
+	size_t		round_size = (size_t) max_blocks * GZ_BLOCK_SIZE;
+	uInt		out_size = compressBound(GZ_BLOCK_SIZE) + 16;
+	Bytef	   *in_buf;
+	gz_block   *blocks;
+	gz_compress_arg *threads_args;
+	pthread_t  *threads;
+	size_t		remaining = in_size;
+	bool		first_round = true;
+	uLong		crc = crc32(0, NULL, 0);
+	int			i;
+
+	in_buf = (Bytef *) pgut_malloc(GZ_DICT_SIZE + round_size);
+	blocks = (gz_block *) pgut_malloc(sizeof(gz_block) * max_blocks);
+	threads_args = (gz_compress_arg *) pgut_malloc(sizeof(gz_compress_arg) * n_threads);
+	threads = (pthread_t *) pgut_malloc(sizeof(pthread_t) * n_threads);
+
+	for (i = 0; i < max_blocks; i++)
+	{
+		blocks[i].out = (Bytef *) pgut_malloc(out_size);
+		blocks[i].out_size = out_size;
+	}
+
+	elog(VERBOSE, "Thread [%d]: Compressing WAL file \"%s\" using %i threads",
+		 thread_num, from_fullpath, n_threads);
+
+	if (fio_write(out_fd, gz_header, sizeof(gz_header)) != (ssize_t) sizeof(gz_header))
+	{
+		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Thread [%d]: Cannot write to compressed temp WAL file \"%s\": %s",
+			 thread_num, to_fullpath_gz_part, strerror(errno));
+	}
+
+	while (remaining > 0)
+	{
+		size_t		read_size = Min(remaining, round_size);
+		int			n_blocks = (read_size + GZ_BLOCK_SIZE - 1) / GZ_BLOCK_SIZE;
+		int			n_started = 0;
+
+		if (fread(in_buf + GZ_DICT_SIZE, 1, read_size, in) != read_size)
+		{
+			fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+			elog(ERROR, "Thread [%d]: Cannot read from source file \"%s\": %s",
+				 thread_num, from_fullpath,
+				 ferror(in) ? strerror(errno) : "unexpected end of file");
+		}
+		remaining -= read_size;
+
+		COMP_FILE_CRC32(true, *wal_crc, in_buf + GZ_DICT_SIZE, read_size);
+
+		for (i = 0; i < n_blocks; i++)
+		{
+			size_t		offset = (size_t) i * GZ_BLOCK_SIZE;
+
+			blocks[i].data = in_buf + GZ_DICT_SIZE + offset;
+			blocks[i].len = Min(GZ_BLOCK_SIZE, read_size - offset);
+			blocks[i].dict_len = (first_round && i == 0) ? 0 : GZ_DICT_SIZE;
+			blocks[i].last = (remaining == 0 && i == n_blocks - 1);
+			blocks[i].rc = Z_OK;
+		}
+
+		for (i = 0; i < n_threads && i < n_blocks; i++)
+		{
+			threads_args[i].blocks = blocks;
+			threads_args[i].n_blocks = n_blocks;
+			threads_args[i].first = i;
+			threads_args[i].step = n_threads;
+			threads_args[i].level = compress_level;
+
+			if (pthread_create(&threads[i], NULL, gz_compress_blocks, &threads_args[i]) != 0)
+				break;
+			n_started++;
+		}
+
+		for (i = 0; i < n_started; i++)
+			pthread_join(threads[i], NULL);
+
+		if (n_started < Min(n_threads, n_blocks))
+		{
+			fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+			elog(ERROR, "Thread [%d]: Cannot start compression thread: %s",
+				 thread_num, strerror(errno));
+		}
+
+		for (i = 0; i < n_blocks; i++)
+		{
+			if (blocks[i].rc != Z_OK)
+			{
+				fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+				elog(ERROR, "Thread [%d]: Cannot compress WAL file \"%s\": %s",
+					 thread_num, from_fullpath, zError(blocks[i].rc));
+			}
+
+			if (fio_write(out_fd, blocks[i].out, blocks[i].out_len) != blocks[i].out_len)
+			{
+				fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+				elog(ERROR, "Thread [%d]: Cannot write to compressed temp WAL file \"%s\": %s",
+					 thread_num, to_fullpath_gz_part, strerror(errno));
+			}
+
+			crc = crc32_combine(crc, blocks[i].crc, blocks[i].len);
+		}
+
+		/* keep the tail of this round as dictionary for the next one */
+		if (remaining > 0)
+			memmove(in_buf, in_buf + read_size, GZ_DICT_SIZE);
+		first_round = false;
+	}
+
+	/* gzip trailer: CRC32 and ISIZE, both little-endian */
+	for (i = 0; i < 4; i++)
+	{
+		gz_trailer[i] = (crc >> (8 * i)) & 0xFF;
+		gz_trailer[4 + i] = ((uint32) in_size >> (8 * i)) & 0xFF;
+	}
+
+	if (fio_write(out_fd, gz_trailer, sizeof(gz_trailer)) != (ssize_t) sizeof(gz_trailer))
+	{
+		fio_unlink(to_fullpath_gz_part, FIO_BACKUP_HOST);
+		elog(ERROR, "Thread [%d]: Cannot write to compressed temp WAL file \"%s\": %s",
+			 thread_num, to_fullpath_gz_part, strerror(errno));
+	}
+
+	for (i = 0; i < max_blocks; i++)
+		pg_free(blocks[i].out);
+	pg_free(blocks);
+	pg_free(threads_args);
+	pg_free(threads);
+	pg_free(in_buf);
+}
+#endif
+
+/* Copy file attributes */
+//static void
+//copy_file_attributes(const char *from_path, fio_location from_location,
+//		  const char *to_path, fio_location to_location,
+//		  bool unlink_on_error)
+//{
+//	struct stat st;
+//
+//	if (fio_stat(from_path, &st, true, from_location) == -1)
+//	{
+//		if (unlink_on_error)
+//			fio_unlink(to_path, to_location);
+//		elog(ERROR, "Cannot stat file \"%s\": %s",
+//			 from_path, strerror(errno));
+//	}
+//
+//	if (fio_chmod(to_path, st.st_mode, to_location) == -1)
+//	{
+//		if (unlink_on_error)
+//			fio_unlink(to_path, to_location);
+//		elog(ERROR, "Cannot change mode of file \"%s\": %s",
+//			 to_path, strerror(errno));
+//	}
+//}
+
+/* Look for files with '.ready' suffix in archive_status directory
+ * and pack such files into batch sized array.
+ */
+parray *
+setup_push_filelist(const char *archive_status_dir, const char *first_file,
+					int batch_size)
+{
+	int i;
+	WALSegno *xlogfile = NULL;
+	parray  *status_files = NULL;
+	parray  *batch_files = parray_new();
+
+	/* guarantee that first filename is in batch list */
+	xlogfile = palloc(sizeof(WALSegno));
+	pg_atomic_init_flag(&xlogfile->lock);
+	snprintf(xlogfile->name, MAXFNAMELEN, "%s", first_file);
 	parray_append(batch_files, xlogfile);
 
 	if (batch_size < 2)
@@ -959,28 +1759,657 @@ setup_push_filelist(const char *archive_status_dir, const char *first_file,
 		if (result != 2)
 			continue;
 
-		if (strcmp(suffix, ".ready") != 0)
-			continue;
+		if (strcmp(suffix, ".ready") != 0)
+			continue;
+
+		/* first filename already in batch list */
+		if (strcmp(filename, first_file) == 0)
+			continue;
+
+		xlogfile = palloc(sizeof(WALSegno));
+		pg_atomic_init_flag(&xlogfile->lock);
+
+		snprintf(xlogfile->name, MAXFNAMELEN, "%s", filename);
+		parray_append(batch_files, xlogfile);
+
+		if (parray_num(batch_files) >= batch_size)
+			break;
+	}
+
+	/* cleanup */
+	parray_walk(status_files, pgFileFree);
+	parray_free(status_files);
+
+	return batch_files;
+}
+
+/*
+ * archive-push daemon.
+ *
+ * Every archive-push run reads the configuration, checks pg_control and,
+ * in remote mode, establishes an ssh connection per thread. It is too slow
+ * when WAL is generated quickly, so "archive-push --daemon" does it once and
+ * then waits for requests on a UNIX socket. archive_command runs
+ * "archive-push --socket", which just hands the segment over to the daemon
+ * and waits for the result.
+ *
+ * The daemon pushes the requested segment along with the batch of ready
+ * segments following it, as archive-push does, using the pool of threads
+ * which keep their connections between requests. The client pushes the
+ * segment itself if the daemon isn't available, has failed or has rejected
+ * the request because the client was run with other options.
+ */
+#define ARCHIVE_PUSH_REQUEST_MAGIC	0x48535550	/* "PUSH" */
+
+/* Result of the request sent back to the client */
+#define ARCHIVE_PUSH_OK			0
+#define ARCHIVE_PUSH_FAILED		1
+#define ARCHIVE_PUSH_REJECTED	2
+
+typedef struct ArchivePushRequest
+{
+	uint32		magic;
+	uint32		version;		/* AGENT_PROTOCOL_VERSION of the client */
+	char		wal_file_name[MAXFNAMELEN];
+	char		pgdata[MAXPGPATH];	/* current directory of archive_command */
+
+	/* options of the client, empty or undefined if not specified */
+	char		backup_path[MAXPGPATH];
+	char		instance_name[MAXPGPATH];
+	uint32		overwrite;
+	uint32		no_sync;
+	uint32		no_ready_rename;
+	uint32		block_summary;
+	uint32		recovery_index;
+	int32		compress_alg;
+	int32		compress_level;
+} ArchivePushRequest;
+
+#ifndef WIN32
+
+/* Thread of the daemon pool */
+typedef struct
+{
+	archive_push_arg arg;
+	pthread_t	thread;
+	uint32		batch_done;		/* number of the last pushed batch */
+	bool		exited;
+} archive_push_worker;
+
+static pthread_mutex_t push_daemon_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled on any change of the state below, protected by the mutex */
+static pthread_cond_t push_daemon_cond = PTHREAD_COND_INITIALIZER;
+/* Number of the batch to push, workers wait for it to change */
+static uint32 push_daemon_batch = 0;
+static bool push_daemon_stop = false;
+
+static ssize_t
+socket_read_all(int fd, void *buf, size_t size)
+{
+	size_t		offs = 0;
+
+	while (offs < size)
+	{
+		ssize_t		rc = read(fd, (char *) buf + offs, size - offs);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		offs += rc;
+	}
+	return offs;
+}
+
+static ssize_t
+socket_write_all(int fd, const void *buf, size_t size)
+{
+	size_t		offs = 0;
+
+	while (offs < size)
+	{
+		ssize_t		rc = write(fd, (const char *) buf + offs, size - offs);
+
+		if (rc <= 0)
+		{
+			if (rc < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		offs += rc;
+	}
+	return offs;
+}
+
+static bool
+push_daemon_sockaddr(const char *socket_path, struct sockaddr_un *addr)
+{
+	if (strlen(socket_path) >= sizeof(addr->sun_path))
+	{
+		elog(WARNING, "Socket path \"%s\" is too long", socket_path);
+		return false;
+	}
+
+	MemSet(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, socket_path);
+	return true;
+}
+
+/* Called on thread exit, including exit on ERROR */
+static void
+push_daemon_worker_exit(void *arg)
+{
+	archive_push_worker *worker = (archive_push_worker *) arg;
+
+	pthread_lock(&push_daemon_mutex);
+	worker->exited = true;
+	pthread_cond_broadcast(&push_daemon_cond);
+	pthread_mutex_unlock(&push_daemon_mutex);
+}
+
+static void *
+push_daemon_worker(void *arg)
+{
+	archive_push_worker *worker = (archive_push_worker *) arg;
+	uint32		batch = worker->batch_done;
+
+	pthread_cleanup_push(push_daemon_worker_exit, worker);
+
+	for (;;)
+	{
+		uint32		next_batch;
+		bool		stop;
+
+		pthread_lock(&push_daemon_mutex);
+		while (push_daemon_batch == batch && !push_daemon_stop)
+			pthread_cond_wait(&push_daemon_cond, &push_daemon_mutex);
+		next_batch = push_daemon_batch;
+		stop = push_daemon_stop;
+		pthread_mutex_unlock(&push_daemon_mutex);
+
+		if (stop)
+			break;
+
+		worker->arg.ret = 1;
+		worker->arg.n_pushed = 0;
+		worker->arg.n_skipped = 0;
+		push_batch(&worker->arg);
+		worker->arg.ret = 0;
+
+		batch = next_batch;
+		pthread_lock(&push_daemon_mutex);
+		worker->batch_done = batch;
+		pthread_cond_broadcast(&push_daemon_cond);
+		pthread_mutex_unlock(&push_daemon_mutex);
+	}
+
+	/* close ssh connection */
+	fio_disconnect();
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static void
+push_daemon_start_worker(archive_push_worker *worker)
+{
+	worker->exited = false;
+	worker->batch_done = push_daemon_batch;
+	pthread_create(&worker->thread, NULL, push_daemon_worker, worker);
+}
+
+/*
+ * Check that flag of the client has the same value as the daemon one.
+ */
+static bool
+push_daemon_check_flag(ArchivePushRequest *request, const char *option,
+					   uint32 client_value, bool daemon_value)
+{
+	if ((client_value != 0) == daemon_value)
+		return true;
+
+	elog(WARNING, "Reject archive-push request for WAL file %s: "
+		 "option --%s is %s for the daemon",
+		 request->wal_file_name, option, daemon_value ? "set" : "not set");
+	return false;
+}
+
+/*
+ * Check that the client was run with the same options as the daemon.
+ * The daemon cannot push WAL on behalf of a client, which asks for another
+ * archive, overwrite mode, compression, sync mode or additional files
+ * (block summaries, recovery index).
+ */
+static bool
+push_daemon_check_options(ArchivePushRequest *request, InstanceConfig *instance,
+						  bool overwrite, bool no_sync, bool no_ready_rename,
+						  bool block_summary, bool recovery_index)
+{
+	request->backup_path[MAXPGPATH - 1] = '\0';
+	request->instance_name[MAXPGPATH - 1] = '\0';
+
+	if (request->backup_path[0] != '\0' &&
+		strcmp(request->backup_path, backup_path) != 0)
+	{
+		elog(WARNING, "Reject archive-push request for WAL file %s: "
+			 "backup path \"%s\" differs from \"%s\"",
+			 request->wal_file_name, request->backup_path, backup_path);
+		return false;
+	}
+
+	if (request->instance_name[0] != '\0' &&
+		strcmp(request->instance_name, instance->name) != 0)
+	{
+		elog(WARNING, "Reject archive-push request for WAL file %s: "
+			 "instance \"%s\" differs from \"%s\"",
+			 request->wal_file_name, request->instance_name, instance->name);
+		return false;
+	}
+
+	if (!push_daemon_check_flag(request, "overwrite", request->overwrite, overwrite) ||
+		!push_daemon_check_flag(request, "no-sync", request->no_sync, no_sync) ||
+		!push_daemon_check_flag(request, "no-ready-rename",
+								request->no_ready_rename, no_ready_rename) ||
+		!push_daemon_check_flag(request, "block-summary",
+								request->block_summary, block_summary) ||
+		!push_daemon_check_flag(request, "recovery-index",
+								request->recovery_index, recovery_index))
+		return false;
+
+	/* client without compression options uses the instance config */
+	if (request->compress_alg != NOT_DEFINED_COMPRESS &&
+		(request->compress_alg != instance->compress_alg ||
+		 (request->compress_alg == ZLIB_COMPRESS &&
+		  request->compress_level != instance->compress_level)))
+	{
+		elog(WARNING, "Reject archive-push request for WAL file %s: "
+			 "compression options differ, the daemon uses %s, level %i",
+			 request->wal_file_name,
+			 deparse_compress_alg(instance->compress_alg),
+			 instance->compress_level);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Push the requested segment and the batch of ready segments following it
+ * by the pool of threads.
+ */
+static bool
+push_daemon_request(ArchivePushRequest *request, archive_push_worker *workers,
+					int n_workers, int batch_size, uint64 system_identifier)
+{
+	static char	checked_pgdata[MAXPGPATH] = "";
+	static char	pg_xlog_dir[MAXPGPATH];
+	static char	archive_status_dir[MAXPGPATH];
+	parray	   *batch_files;
+	uint32		n_pushed = 0;
+	uint32		n_skipped = 0;
+	bool		push_isok = true;
+	instr_time  start_time, end_time;
+	char        pretty_time_str[20];
+	int			i;
+
+	if (request->magic != ARCHIVE_PUSH_REQUEST_MAGIC ||
+		request->version != AGENT_PROTOCOL_VERSION)
+	{
+		elog(WARNING, "Unexpected archive-push request, client version mismatch");
+		return false;
+	}
+
+	request->wal_file_name[MAXFNAMELEN - 1] = '\0';
+	request->pgdata[MAXPGPATH - 1] = '\0';
+	if (request->wal_file_name[0] == '\0' ||
+		strchr(request->wal_file_name, '/') != NULL)
+	{
+		elog(WARNING, "Invalid WAL file name in archive-push request: \"%s\"",
+			 request->wal_file_name);
+		return false;
+	}
+
+	/* verify that archive-push --instance parameter is valid */
+	if (strcmp(request->pgdata, checked_pgdata) != 0)
+	{
+		uint64		system_id = get_system_identifier(request->pgdata);
+
+		if (system_id != system_identifier)
+		{
+			elog(WARNING, "Refuse to push WAL segment %s into archive. Instance parameters mismatch."
+						"Instance '%s' should have SYSTEM_ID = " UINT64_FORMAT " instead of " UINT64_FORMAT,
+				 request->wal_file_name, instance_config.name,
+				 system_identifier, system_id);
+			return false;
+		}
+
+		strcpy(checked_pgdata, request->pgdata);
+		join_path_components(pg_xlog_dir, checked_pgdata, XLOGDIR);
+		join_path_components(archive_status_dir, pg_xlog_dir, "archive_status");
+	}
+
+	INSTR_TIME_SET_CURRENT(start_time);
+
+	batch_files = setup_push_filelist(archive_status_dir,
+									  request->wal_file_name, batch_size);
+
+	/* spare workers are used for compression of individual segments */
+	wal_compress_threads = Max(1, n_workers / Max(1, (int) parray_num(batch_files)));
+
+	/* Workers are idle now, hand the batch over to them */
+	pthread_lock(&push_daemon_mutex);
+	for (i = 0; i < n_workers; i++)
+	{
+		archive_push_arg *arg = &workers[i].arg;
+
+		arg->first_filename = request->wal_file_name;
+		arg->pg_xlog_dir = pg_xlog_dir;
+		arg->archive_status_dir = archive_status_dir;
+		arg->files = batch_files;
+	}
+	push_daemon_batch++;
+	pthread_cond_broadcast(&push_daemon_cond);
+	pthread_mutex_unlock(&push_daemon_mutex);
+
+	/* Wait for workers */
+	for (i = 0; i < n_workers; i++)
+	{
+		archive_push_worker *worker = &workers[i];
+
+		pthread_lock(&push_daemon_mutex);
+		while (worker->batch_done != push_daemon_batch && !worker->exited)
+			pthread_cond_wait(&push_daemon_cond, &push_daemon_mutex);
+		pthread_mutex_unlock(&push_daemon_mutex);
+
+		if (worker->exited)
+		{
+			/* The thread has failed, replace it */
+			push_isok = false;
+			pthread_join(worker->thread, NULL);
+			thread_interrupted = false;
+			push_daemon_start_worker(worker);
+			continue;
+		}
+
+		n_pushed += worker->arg.n_pushed;
+		n_skipped += worker->arg.n_skipped;
+	}
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_SUBTRACT(end_time, start_time);
+	pretty_time_interval(INSTR_TIME_GET_DOUBLE(end_time), pretty_time_str, 20);
+
+	elog(push_isok ? INFO : WARNING,
+		 "archive-push daemon %s WAL file: %s, batch: %lu/%i, "
+		 "pushed: %u, skipped: %u, time elapsed: %s",
+		 push_isok ? "pushed" : "failed to push",
+		 request->wal_file_name, parray_num(batch_files), batch_size,
+		 n_pushed, n_skipped, pretty_time_str);
+
+	parray_walk(batch_files, pfree);
+	parray_free(batch_files);
+
+	return push_isok;
+}
+
+#endif
+
+/*
+ * Run archive-push daemon listening on socket_path until interrupted.
+ */
+void
+do_archive_push_daemon(InstanceConfig *instance, const char *socket_path,
+					   int batch_size, bool overwrite, bool no_sync, bool no_ready_rename,
+					   bool block_summary, bool recovery_index)
+{
+#ifndef WIN32
+	struct sockaddr_un addr;
+	struct stat st;
+	archive_push_worker *workers;
+	bool		is_compress = false;
+	mode_t		oumask;
+	int			listen_sock;
+	int			i;
+
+	if (socket_path == NULL)
+		elog(ERROR, "Required parameter is not specified: --socket");
+
+	if (instance->pgdata == NULL)
+		elog(ERROR, "Cannot read pg_probackup.conf for this instance");
+
+	if (instance->compress_alg == PGLZ_COMPRESS)
+		elog(ERROR, "Cannot use pglz for WAL compression");
+
+#ifdef HAVE_LIBZ
+	if (instance->compress_alg == ZLIB_COMPRESS)
+		is_compress = true;
+#endif
+
+	xlog_seg_size = instance->xlog_seg_size;
+
+	if (!push_daemon_sockaddr(socket_path, &addr))
+		elog(ERROR, "Cannot start archive-push daemon");
+
+	/* Client may go away before it gets the result */
+	signal(SIGPIPE, SIG_IGN);
+
+	listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_sock < 0)
+		elog(ERROR, "Cannot create socket: %s", strerror(errno));
+
+	/* Remove the socket left by the previous daemon, but nothing else */
+	if (lstat(socket_path, &st) == 0)
+	{
+		if (!S_ISSOCK(st.st_mode))
+			elog(ERROR, "Cannot listen on socket \"%s\": file exists and is not a socket",
+				 socket_path);
+		unlink(socket_path);
+	}
+
+	/* Only owner of the daemon may connect to the socket */
+	oumask = umask(S_IRWXG | S_IRWXO);
+	if (bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		elog(ERROR, "Cannot bind socket \"%s\": %s",
+			 socket_path, strerror(errno));
+	umask(oumask);
+
+	if (listen(listen_sock, 5) < 0)
+		elog(ERROR, "Cannot listen on socket \"%s\": %s",
+			 socket_path, strerror(errno));
+
+	workers = (archive_push_worker *) palloc0(sizeof(archive_push_worker) * num_threads);
+	for (i = 0; i < num_threads; i++)
+	{
+		archive_push_arg *arg = &workers[i].arg;
+
+		arg->archive_dir = instance->arclog_path;
+		arg->overwrite = overwrite;
+		arg->compress = is_compress;
+		arg->no_sync = no_sync;
+		arg->no_ready_rename = no_ready_rename;
+		arg->block_summary = block_summary;
+		arg->recovery_index = recovery_index;
+		arg->archive_timeout = instance->archive_timeout;
+		arg->compress_alg = instance->compress_alg;
+		arg->compress_level = instance->compress_level;
+		arg->thread_num = i + 1;
+
+		push_daemon_start_worker(&workers[i]);
+	}
+
+	elog(INFO, "PID [%d]: pg_probackup archive-push daemon is listening on \"%s\", "
+		 "threads: %i, batch: %i, compression: %s",
+		 getpid(), socket_path, num_threads, batch_size,
+		 is_compress ? "zlib" : "none");
+
+	while (!interrupted)
+	{
+		ArchivePushRequest request;
+		fd_set		rfds;
+		struct timeval timeout;
+		int32		status;
+		int			sock;
+		int			rc;
+
+		FD_ZERO(&rfds);
+		FD_SET(listen_sock, &rfds);
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+
+		rc = select(listen_sock + 1, &rfds, NULL, NULL, &timeout);
+		if (rc < 0 && errno != EINTR)
+			elog(ERROR, "select() failed: %s", strerror(errno));
+		if (rc <= 0)
+			continue;
+
+		sock = accept(listen_sock, NULL, NULL);
+		if (sock < 0)
+		{
+			if (errno != EINTR)
+				elog(WARNING, "Cannot accept connection: %s", strerror(errno));
+			continue;
+		}
+
+		if (socket_read_all(sock, &request, sizeof(request)) != sizeof(request))
+		{
+			elog(WARNING, "Cannot read archive-push request: %s",
+				 strerror(errno));
+			close(sock);
+			continue;
+		}
+
+		if (request.magic == ARCHIVE_PUSH_REQUEST_MAGIC &&
+			request.version == AGENT_PROTOCOL_VERSION &&
+			!push_daemon_check_options(&request, instance, overwrite, no_sync,
+									   no_ready_rename, block_summary,
+									   recovery_index))
+			status = ARCHIVE_PUSH_REJECTED;
+		else if (push_daemon_request(&request, workers, num_threads,
+									 batch_size, instance->system_identifier))
+			status = ARCHIVE_PUSH_OK;
+		else
+			status = ARCHIVE_PUSH_FAILED;
+
+		if (socket_write_all(sock, &status, sizeof(status)) != sizeof(status))
+			elog(WARNING, "Cannot send archive-push result for WAL file %s: %s",
+				 request.wal_file_name, strerror(errno));
+		close(sock);
+	}
+
+	close(listen_sock);
+	unlink(socket_path);
+
+	/* Stop the pool */
+	pthread_lock(&push_daemon_mutex);
+	push_daemon_stop = true;
+	pthread_cond_broadcast(&push_daemon_cond);
+	pthread_mutex_unlock(&push_daemon_mutex);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	elog(INFO, "PID [%d]: pg_probackup archive-push daemon is stopped", getpid());
+#else
+	elog(ERROR, "archive-push daemon is not supported on this platform");
+#endif
+}
+
+/*
+ * Hand WAL file over to archive-push daemon listening on socket_path and
+ * wait for the result.
+ *
+ * Options of the client are sent along, the daemon rejects the request if
+ * they differ from its own ones.
+ *
+ * Returns false if the daemon isn't available, has failed to push the file
+ * or has rejected the request, the caller should push it by itself then.
+ */
+bool
+archive_push_client(const char *socket_path, const char *wal_file_name,
+					const char *backup_dir, const char *instance,
+					bool overwrite, bool no_sync, bool no_ready_rename,
+					bool block_summary, bool recovery_index,
+					CompressAlg compress_alg, int compress_level)
+{
+#ifndef WIN32
+	struct sockaddr_un addr;
+	ArchivePushRequest request;
+	int32		status;
+	int			sock;
+
+	if (wal_file_name == NULL || !push_daemon_sockaddr(socket_path, &addr))
+		return false;
 
-		/* first filename already in batch list */
-		if (strcmp(filename, first_file) == 0)
-			continue;
+	MemSet(&request, 0, sizeof(request));
+	request.magic = ARCHIVE_PUSH_REQUEST_MAGIC;
+	request.version = AGENT_PROTOCOL_VERSION;
+	strncpy(request.wal_file_name, wal_file_name, MAXFNAMELEN - 1);
 
-		xlogfile = palloc(sizeof(WALSegno));
-		pg_atomic_init_flag(&xlogfile->lock);
+	if (!getcwd(request.pgdata, sizeof(request.pgdata)))
+		elog(ERROR, "getcwd() error");
 
-		snprintf(xlogfile->name, MAXFNAMELEN, "%s", filename);
-		parray_append(batch_files, xlogfile);
+	if (backup_dir)
+	{
+		strncpy(request.backup_path, backup_dir, MAXPGPATH - 1);
+		canonicalize_path(request.backup_path);
+	}
+	if (instance)
+		strncpy(request.instance_name, instance, MAXPGPATH - 1);
+	request.overwrite = overwrite;
+	request.no_sync = no_sync;
+	request.no_ready_rename = no_ready_rename;
+	request.block_summary = block_summary;
+	request.recovery_index = recovery_index;
+	request.compress_alg = compress_alg;
+	request.compress_level = compress_level;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		elog(ERROR, "Cannot create socket: %s", strerror(errno));
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		elog(WARNING, "Cannot connect to archive-push daemon on \"%s\": %s",
+			 socket_path, strerror(errno));
+		close(sock);
+		return false;
+	}
 
-		if (parray_num(batch_files) >= batch_size)
-			break;
+	if (socket_write_all(sock, &request, sizeof(request)) != sizeof(request) ||
+		socket_read_all(sock, &status, sizeof(status)) != sizeof(status))
+	{
+		elog(WARNING, "Lost connection to archive-push daemon on \"%s\"",
+			 socket_path);
+		close(sock);
+		return false;
 	}
+	close(sock);
 
-	/* cleanup */
-	parray_walk(status_files, pgFileFree);
-	parray_free(status_files);
+	if (status == ARCHIVE_PUSH_REJECTED)
+	{
+		elog(WARNING, "archive-push daemon has rejected WAL file %s, "
+			 "options of archive-push differ from the daemon ones",
+			 wal_file_name);
+		return false;
+	}
+	else if (status != ARCHIVE_PUSH_OK)
+	{
+		elog(WARNING, "archive-push daemon failed to push WAL file %s",
+			 wal_file_name);
+		return false;
+	}
 
-	return batch_files;
+	elog(INFO, "WAL file %s is pushed by archive-push daemon", wal_file_name);
+	return true;
+#else
+	elog(WARNING, "archive-push daemon is not supported on this platform");
+	return false;
+#endif
 }
 
 /*
@@ -995,13 +2424,12 @@ setup_push_filelist(const char *archive_status_dir, const char *first_file,
  * TODO: add support of -D option.
  * TOTHINK: what can be done about ssh connection been broken?
  * TOTHINk: do we need our own rmtree function ?
- * TOTHINk: so sort of async prefetch ?
 
  */
 void
 do_archive_get(InstanceConfig *instance, const char *prefetch_dir_arg,
 			   char *wal_file_path, char *wal_file_name, int batch_size,
-			   bool validate_wal)
+			   bool validate_wal, bool async_prefetch)
 {
 	int         fail_count = 0;
 	char        backup_wal_file_path[MAXPGPATH];
@@ -1041,17 +2469,79 @@ do_archive_get(InstanceConfig *instance, const char *prefetch_dir_arg,
 	 * backup_path/wal/instance_name/000000010000000000000001 */
 	join_path_components(backup_wal_file_path, instance->arclog_path, wal_file_name);
 
+	/*
+	 * Segment is staged into pg_wal by restore --stage-wal. Fail at once,
+	 * so the server reads it from pg_wal.
+	 */
+	if (IsXLogFileName(wal_file_name) &&
+		wal_segment_is_staged(pg_xlog_dir, wal_file_name))
+	{
+		elog(INFO, "PID [%d]: WAL segment %s is staged into \"%s\"",
+			 my_pid, wal_file_name, pg_xlog_dir);
+		exit(1);
+	}
+
 	INSTR_TIME_SET_CURRENT(start_time);
 	if (num_threads > batch_size)
 		n_actual_threads = batch_size;
 	elog(INFO, "PID [%d]: pg_probackup archive-get WAL file: %s, remote: %s, threads: %i/%i, batch: %i",
-		my_pid, wal_file_name, IsSshProtocol() ? "ssh" : "none", n_actual_threads, num_threads, batch_size);
+		my_pid, wal_file_name, IsRemoteProtocol() ? instance_config.remote.proto : "none", n_actual_threads, num_threads, batch_size);
 
 	num_threads = n_actual_threads;
 
 	elog(VERBOSE, "Obtaining XLOG_SEG_SIZE from pg_control file");
 	instance->xlog_seg_size = get_xlog_seg_size(current_dir);
 
+	if (prefetch_dir_arg)
+		/* use provided prefetch directory */
+		snprintf(prefetch_dir, sizeof(prefetch_dir), "%s", prefetch_dir_arg);
+	else
+		/* use default path */
+		join_path_components(prefetch_dir, pg_xlog_dir, "pbk_prefetch");
+
+	/* In async prefetch mode segments are copied and validated by background
+	 * worker, so we only have to rename prefetched segment, if it is
+	 * available, and tell the worker, which segment is requested.
+	 * Worker is started if it is not running yet.
+	 */
+	if (async_prefetch && IsXLogFileName(wal_file_name) && batch_size > 1)
+	{
+#ifndef WIN32
+		XLogSegNo segno;
+		TimeLineID tli;
+		bool	  worker_running;
+		bool	  hit;
+
+		GetXLogFromFileName(wal_file_name, &tli, &segno, instance->xlog_seg_size);
+
+		mkdir(prefetch_dir, DIR_PERMISSION); /* In case prefetch directory do not exists yet */
+
+		/* worker publishes only validated segments */
+		hit = wal_satisfy_from_prefetch(tli, segno, wal_file_name, prefetch_dir,
+										absolute_wal_file_path, instance->arclog_path,
+										instance->xlog_seg_size, false, 0);
+
+		worker_running = prefetch_worker_is_running(prefetch_dir);
+
+		/* New worker gets the request at start, it has no miss to adjust
+		 * to yet.
+		 */
+		if (!worker_running ||
+			!write_prefetch_request(prefetch_dir, wal_file_name, !hit))
+			start_prefetch_worker(instance, prefetch_dir, wal_file_name,
+								  batch_size, validate_wal);
+
+		if (hit)
+		{
+			elog(INFO, "PID [%d]: pg_probackup archive-get used WAL segment %s prefetched by background worker",
+					my_pid, wal_file_name);
+			goto get_done;
+		}
+#else
+		elog(WARNING, "PID [%d]: Option --async-prefetch is not supported on this platform",
+				my_pid);
+#endif
+	}
 	/* Prefetch optimization kicks in only if simple XLOG segments is requested
 	 * and batching is enabled.
 	 *
@@ -1059,20 +2549,13 @@ do_archive_get(InstanceConfig *instance, const char *prefetch_dir_arg,
 	 * rename to destination path.
 	 * If file do not exists, then we run prefetch and rename it.
 	 */
-	if (IsXLogFileName(wal_file_name) && batch_size > 1)
+	else if (IsXLogFileName(wal_file_name) && batch_size > 1)
 	{
 		XLogSegNo segno;
 		TimeLineID tli;
 
 		GetXLogFromFileName(wal_file_name, &tli, &segno, instance->xlog_seg_size);
 
-		if (prefetch_dir_arg)
-			/* use provided prefetch directory */
-			snprintf(prefetch_dir, sizeof(prefetch_dir), "%s", prefetch_dir_arg);
-		else
-			/* use default path */
-			join_path_components(prefetch_dir, pg_xlog_dir, "pbk_prefetch");
-
 		/* Construct path to WAL file in prefetch directory.
 		 * current_dir/pg_wal/pbk_prefech/000000010000000000000001
 		 */
@@ -1097,8 +2580,8 @@ do_archive_get(InstanceConfig *instance, const char *prefetch_dir_arg,
 			n_files_in_prefetch = maintain_prefetch(prefetch_dir, segno, instance->xlog_seg_size);
 
 			if (wal_satisfy_from_prefetch(tli, segno, wal_file_name, prefetch_dir,
-										  absolute_wal_file_path, instance->xlog_seg_size,
-										  validate_wal, 0))
+										  absolute_wal_file_path, instance->arclog_path,
+										  instance->xlog_seg_size, validate_wal, 0))
 			{
 				n_files_in_prefetch--;
 				elog(INFO, "PID [%d]: pg_probackup archive-get used prefetched WAL segment %s, prefetch state: %u/%u",
@@ -1136,7 +2619,8 @@ do_archive_get(InstanceConfig *instance, const char *prefetch_dir_arg,
 			n_files_in_prefetch = maintain_prefetch(prefetch_dir, segno, instance->xlog_seg_size);
 
 			if (wal_satisfy_from_prefetch(tli, segno, wal_file_name, prefetch_dir, absolute_wal_file_path,
-										  instance->xlog_seg_size, validate_wal, 0))
+										  instance->arclog_path, instance->xlog_seg_size,
+										  validate_wal, 0))
 			{
 				n_files_in_prefetch--;
 				elog(INFO, "PID [%d]: pg_probackup archive-get copied WAL file %s, prefetch state: %u/%u",
@@ -1208,6 +2692,60 @@ get_done:
 				my_pid, wal_file_name, pretty_time_str);
 }
 
+/*
+ * Check that WAL segment is listed in STAGED_WAL_LIST of pg_wal and is
+ * still there. Recycled segments are never listed.
+ *
+ * The list is ordered, so once a segment following the last listed one is
+ * requested, recovery has consumed all staged WAL and the list is removed.
+ * Timeline is ignored in comparison, since segment numbers only grow along
+ * timeline history.
+ */
+static bool
+wal_segment_is_staged(const char *pg_xlog_dir, const char *wal_file_name)
+{
+	char		path[MAXPGPATH];
+	char		buf[MAXFNAMELEN + 1];
+	char		last[MAXFNAMELEN + 1] = "";
+	FILE	   *fp;
+	bool		staged = false;
+
+	join_path_components(path, pg_xlog_dir, STAGED_WAL_LIST);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return false;
+
+	while (fgets(buf, sizeof(buf), fp))
+	{
+		buf[strcspn(buf, "\n")] = '\0';
+		if (strcmp(buf, wal_file_name) == 0)
+		{
+			staged = true;
+			break;
+		}
+		if (IsXLogFileName(buf))
+			strcpy(last, buf);
+	}
+	fclose(fp);
+
+	if (!staged)
+	{
+		/* compare log and segment numbers, skipping timeline */
+		if (last[0] == '\0' || strcmp(wal_file_name + 8, last + 8) > 0)
+		{
+			elog(LOG, "WAL segment %s follows staged WAL, remove \"%s\"",
+				 wal_file_name, path);
+			if (unlink(path) != 0 && errno != ENOENT)
+				elog(WARNING, "Cannot remove file \"%s\": %s",
+					 path, strerror(errno));
+		}
+		return false;
+	}
+
+	join_path_components(path, pg_xlog_dir, wal_file_name);
+	return access(path, F_OK) == 0;
+}
+
 /*
  * Copy batch_size of regular WAL segments into prefetch directory,
  * starting with first_file.
@@ -1218,10 +2756,9 @@ uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir,
 					 TimeLineID tli, XLogSegNo first_segno, int num_threads,
 					 bool inclusive, int batch_size, uint32 wal_seg_size)
 {
-	int         i;
 	XLogSegNo   segno;
 	parray     *batch_files = parray_new();
-	int 		n_total_fetched = 0;
+	uint32		n_total_fetched = 0;
 
 	if (!inclusive)
 		first_segno++;
@@ -1238,6 +2775,27 @@ uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir,
 
 	}
 
+	n_total_fetched = fetch_wal_files(batch_files, prefetch_dir, archive_dir, num_threads);
+
+	parray_walk(batch_files, pfree);
+	parray_free(batch_files);
+	return n_total_fetched;
+}
+
+/*
+ * Copy WAL segments listed in batch_files from archive into prefetch directory.
+ * Return number of copied segments.
+ */
+static uint32
+fetch_wal_files(parray *batch_files, const char *prefetch_dir,
+				const char *archive_dir, int num_threads)
+{
+	int         i;
+	uint32		n_total_fetched = 0;
+
+	/* previous batch may have been stopped by missing segment */
+	prefetch_stop = false;
+
 	/* copy segments */
 	if (num_threads == 1)
 	{
@@ -1281,6 +2839,7 @@ uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir,
 
 			arg->thread_num = i+1;
 			arg->files = batch_files;
+			arg->n_fetched = 0;
 		}
 
 		/* Run threads */
@@ -1296,8 +2855,11 @@ uint32 run_wal_prefetch(const char *prefetch_dir, const char *archive_dir,
 			pthread_join(threads[i], NULL);
 			n_total_fetched += threads_args[i].n_fetched;
 		}
+
+		pfree(threads);
+		pfree(threads_args);
 	}
-	/* TODO: free batch_files */
+
 	return n_total_fetched;
 }
 
@@ -1454,6 +3016,10 @@ get_wal_file(const char *filename, const char *from_fullpath,
 		}
 	}
 
+	/* Segment may be moved into pack file by archive-pack */
+	if (rc == FILE_MISSING && IsXLogFileName(filename))
+		rc = get_wal_file_from_pack(filename, from_fullpath, out, thread_num);
+
 	if (!prefetch_mode && (rc == FILE_MISSING))
 		elog(LOG, "Thread [%d]: Target WAL file is missing: %s",
 				thread_num, filename);
@@ -1504,6 +3070,54 @@ get_wal_file(const char *filename, const char *from_fullpath,
 	return true;
 }
 
+/*
+ * Copy WAL segment from pack file located in the same directory as
+ * from_fullpath. Return codes are the same as of get_wal_file_internal().
+ */
+static int
+get_wal_file_from_pack(const char *filename, const char *from_fullpath,
+					   FILE *out, int thread_num)
+{
+	char		archive_dir[MAXPGPATH];
+	char		pack_path[MAXPGPATH];
+	char		errmsg[256];
+	TimeLineID	tli;
+	XLogSegNo	segno;
+	char	   *buf;
+	int			rc = SEND_OK;
+
+	strncpy(archive_dir, from_fullpath, MAXPGPATH);
+	get_parent_directory(archive_dir);
+	GetXLogFromFileName(filename, &tli, &segno, xlog_seg_size);
+
+	buf = pgut_malloc(xlog_seg_size);
+
+	if (!get_wal_from_pack(archive_dir, tli, segno, xlog_seg_size, buf,
+						   pack_path, errmsg, sizeof(errmsg), FIO_BACKUP_HOST))
+	{
+		if (errmsg[0] != '\0')
+		{
+			elog(WARNING, "Thread [%d]: Cannot read WAL file '%s' from pack file '%s': %s",
+				 thread_num, filename, pack_path, errmsg);
+			rc = READ_FAILED;
+		}
+		else
+			rc = FILE_MISSING;
+	}
+	else if (fwrite(buf, 1, xlog_seg_size, out) != xlog_seg_size)
+	{
+		elog(WARNING, "Thread [%d]: Cannot write to file '%s': %s",
+			 thread_num, filename, strerror(errno));
+		rc = WRITE_FAILED;
+	}
+	else
+		elog(VERBOSE, "Thread [%d]: WAL file '%s' is read from pack file '%s'",
+			 thread_num, filename, pack_path);
+
+	pg_free(buf);
+	return rc;
+}
+
 /*
  * Copy WAL segment with possible decompression from local archive.
  * Return codes:
@@ -1653,16 +3267,33 @@ bool next_wal_segment_exists(TimeLineID tli, XLogSegNo segno, const char *prefet
  */
 bool wal_satisfy_from_prefetch(TimeLineID tli, XLogSegNo segno, const char *wal_file_name,
 							   const char *prefetch_dir, const char *absolute_wal_file_path,
-							   uint32 wal_seg_size, bool parse_wal, int thread_num)
+							   const char *archive_dir, uint32 wal_seg_size,
+							   bool parse_wal, int thread_num)
 {
 	char prefetched_file[MAXPGPATH];
+	struct stat st;
+	pg_crc32 wal_crc;
+	uint64 wal_size;
 
 	join_path_components(prefetched_file, prefetch_dir, wal_file_name);
 
 	/* If prefetched file do not exists, then nothing can be done */
-	if (access(prefetched_file, F_OK) != 0)
+	if (stat(prefetched_file, &st) != 0)
 		return false;
 
+	/* Prefetched segment matching checksum file of archived segment
+	 * is as good as archived one, there is no need to parse it.
+	 */
+	if (parse_wal &&
+		read_wal_checksum(archive_dir, wal_file_name, &wal_crc, &wal_size) &&
+		st.st_size == wal_size &&
+		EQ_CRC32C(pgFileGetCRC(prefetched_file, true, false), wal_crc))
+	{
+		elog(VERBOSE, "Thread [%d]: Prefetched WAL segment %s matches its checksum file",
+				thread_num, wal_file_name);
+		parse_wal = false;
+	}
+
 	/* If the next WAL segment do not exists in prefetch directory,
 	 * then current segment cannot be validated, therefore cannot be used
 	 * to satisfy recovery request.
@@ -1723,6 +3354,11 @@ uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32
 			strcmp(dir_ent->d_name, "..") == 0)
 			continue;
 
+		/* Skip files and directories of prefetch worker */
+		if (strcmp(dir_ent->d_name, PREFETCH_STAGING_DIR) == 0 ||
+			strncmp(dir_ent->d_name, PREFETCH_FILE_PREFIX, strlen(PREFETCH_FILE_PREFIX)) == 0)
+			continue;
+
 		if (IsXLogFileName(dir_ent->d_name))
 		{
 
@@ -1744,3 +3380,389 @@ uint32 maintain_prefetch(const char *prefetch_dir, XLogSegNo first_segno, uint32
 
 	return n_files;
 }
+
+#ifndef WIN32
+/*
+ * Check that prefetch worker for this prefetch directory is alive.
+ * Pid file left by dead worker is removed.
+ */
+static bool
+prefetch_worker_is_running(const char *prefetch_dir)
+{
+	char		pid_file[MAXPGPATH];
+	FILE	   *fp;
+	int			pid = 0;
+
+	join_path_components(pid_file, prefetch_dir, PREFETCH_PID_FILE);
+
+	fp = fopen(pid_file, "r");
+	if (fp == NULL)
+		return false;
+
+	if (fscanf(fp, "%d", &pid) != 1)
+		pid = 0;
+	fclose(fp);
+
+	if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM))
+		return true;
+
+	elog(LOG, "Remove stale prefetch worker pid file \"%s\"", pid_file);
+	unlink(pid_file);
+	return false;
+}
+
+/*
+ * Fork prefetch worker, detached from archive-get process.
+ * Return true if worker was started.
+ */
+static bool
+start_prefetch_worker(InstanceConfig *instance, const char *prefetch_dir,
+					  const char *wal_file_name, int batch_size,
+					  bool validate_wal)
+{
+	char		pid_file[MAXPGPATH];
+	char		buf[32];
+	int			fd;
+	pid_t		pid;
+
+	join_path_components(pid_file, prefetch_dir, PREFETCH_PID_FILE);
+
+	/* Only one archive-get process may start the worker */
+	fd = open(pid_file, O_WRONLY | O_CREAT | O_EXCL, FILE_PERMISSION);
+	if (fd < 0)
+	{
+		if (errno != EEXIST)
+			elog(WARNING, "Cannot create prefetch worker pid file \"%s\": %s",
+				 pid_file, strerror(errno));
+		return false;
+	}
+
+	/* Connection to remote host cannot be shared with child process */
+	fio_disconnect();
+
+	pid = fork();
+	if (pid < 0)
+	{
+		elog(WARNING, "Cannot start prefetch worker: %s", strerror(errno));
+		close(fd);
+		unlink(pid_file);
+		return false;
+	}
+
+	if (pid == 0)
+	{
+		close(fd);
+
+		/* Detach from recovery process */
+		setsid();
+
+		run_prefetch_worker(instance, prefetch_dir, wal_file_name, batch_size,
+							validate_wal);
+
+		unlink(pid_file);
+		fio_disconnect();
+		exit(0);
+	}
+
+	snprintf(buf, sizeof(buf), "%d\n", (int) pid);
+	if (write(fd, buf, strlen(buf)) != (ssize_t) strlen(buf))
+		elog(WARNING, "Cannot write prefetch worker pid file \"%s\": %s",
+			 pid_file, strerror(errno));
+	close(fd);
+
+	elog(LOG, "PID [%d]: Started prefetch worker with PID [%d]", getpid(), (int) pid);
+	return true;
+}
+
+/*
+ * Tell prefetch worker which WAL segment is requested by recovery.
+ * miss - requested segment was not found in prefetch directory.
+ * Returns false if the worker doesn't listen for requests.
+ */
+static bool
+write_prefetch_request(const char *prefetch_dir, const char *wal_file_name,
+					   bool miss)
+{
+	char		fifo_path[MAXPGPATH];
+	char		request[MAXFNAMELEN + 8];
+	int			len;
+	int			fd;
+
+	join_path_components(fifo_path, prefetch_dir, PREFETCH_REQUEST_FIFO);
+
+	/* Fails with ENXIO if nobody reads the FIFO */
+	fd = open(fifo_path, O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+	{
+		if (errno != ENOENT && errno != ENXIO)
+			elog(WARNING, "Cannot open prefetch request FIFO \"%s\": %s",
+				 fifo_path, strerror(errno));
+		return false;
+	}
+
+	/* Request is shorter than PIPE_BUF, so it is written atomically */
+	len = snprintf(request, sizeof(request), "%s %d\n", wal_file_name, miss ? 1 : 0);
+	if (write(fd, request, len) != len)
+	{
+		elog(WARNING, "Cannot write prefetch request into \"%s\": %s",
+			 fifo_path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+	return true;
+}
+
+/*
+ * Take the first complete request from buf, which holds buf_len bytes
+ * read from the FIFO. Returns false if there is no complete request.
+ */
+static bool
+take_prefetch_request(char *buf, int *buf_len, char *wal_file_name, bool *miss)
+{
+	char	   *eol;
+	int			is_miss = 0;
+	bool		result = false;
+
+	while (!result)
+	{
+		buf[*buf_len] = '\0';
+		eol = strchr(buf, '\n');
+		if (eol == NULL)
+		{
+			/* Line can't be that long, drop the garbage */
+			if (*buf_len >= MAXPGPATH)
+				*buf_len = 0;
+			return false;
+		}
+		*eol = '\0';
+
+		if (sscanf(buf, "%24s %d", wal_file_name, &is_miss) == 2 &&
+			IsXLogFileName(wal_file_name))
+		{
+			*miss = (is_miss != 0);
+			result = true;
+		}
+		else
+			elog(WARNING, "Prefetch request \"%s\" is corrupted, ignore it", buf);
+
+		*buf_len -= eol + 1 - buf;
+		memmove(buf, eol + 1, *buf_len);
+	}
+
+	return result;
+}
+
+/*
+ * Main loop of prefetch worker.
+ *
+ * Worker keeps a window of WAL segments following the last requested one.
+ * Segments are copied from archive into staging directory and moved into
+ * prefetch directory in ascending order, after they are validated, so
+ * archive-get can use them without any checks.
+ *
+ * Window starts at batch_size segments. Each miss reported by archive-get
+ * means that replay is faster than prefetch, so the window is doubled,
+ * up to PREFETCH_MAX_WINDOW batches. Long series of hits shrinks it back.
+ * Worker sleeps in select() on the request FIFO while there is nothing to
+ * fetch, and exits if there are no requests for PREFETCH_IDLE_TIMEOUT
+ * seconds. wal_file_name is the request of archive-get which started it.
+ */
+static void
+run_prefetch_worker(InstanceConfig *instance, const char *prefetch_dir,
+					const char *wal_file_name, int batch_size, bool validate_wal)
+{
+	char		staging_dir[MAXPGPATH];
+	char		fifo_path[MAXPGPATH];
+	char		req_buf[MAXPGPATH + 1];
+	int			req_len;
+	int			fifo_fd;
+	int			fifo_keep_fd;
+	char		last_request[MAXFNAMELEN] = "";
+	uint32		wal_seg_size = instance->xlog_seg_size;
+	int			window = batch_size;
+	int			max_window = batch_size * PREFETCH_MAX_WINDOW;
+	int			n_hits = 0;
+	time_t		last_request_time = time(NULL);
+	time_t		last_fetch_time = 0;
+	bool		need_fetch = false;
+	XLogSegNo	segno = 0;
+	TimeLineID	tli = 0;
+
+	join_path_components(staging_dir, prefetch_dir, PREFETCH_STAGING_DIR);
+	mkdir(staging_dir, DIR_PERMISSION);
+
+	/* Pid file is ours, so whatever is left at the FIFO path is stale */
+	join_path_components(fifo_path, prefetch_dir, PREFETCH_REQUEST_FIFO);
+	if (unlink(fifo_path) != 0 && errno != ENOENT)
+		elog(WARNING, "Cannot remove file \"%s\": %s", fifo_path, strerror(errno));
+	if (mkfifo(fifo_path, FILE_PERMISSION) != 0)
+	{
+		elog(WARNING, "PID [%d]: Cannot create prefetch request FIFO \"%s\": %s",
+			 getpid(), fifo_path, strerror(errno));
+		return;
+	}
+
+	/*
+	 * Keep the FIFO open for writing too, so it doesn't report end of file
+	 * when archive-get closes it.
+	 */
+	fifo_fd = open(fifo_path, O_RDONLY | O_NONBLOCK);
+	fifo_keep_fd = fifo_fd < 0 ? -1 : open(fifo_path, O_WRONLY | O_NONBLOCK);
+	if (fifo_fd < 0 || fifo_keep_fd < 0)
+	{
+		elog(WARNING, "PID [%d]: Cannot open prefetch request FIFO \"%s\": %s",
+			 getpid(), fifo_path, strerror(errno));
+		unlink(fifo_path);
+		return;
+	}
+
+	req_len = snprintf(req_buf, sizeof(req_buf), "%s 0\n", wal_file_name);
+
+	elog(LOG, "PID [%d]: Prefetch worker started, prefetch directory: \"%s\", window: %i",
+		 getpid(), prefetch_dir, window);
+
+	while (!interrupted)
+	{
+		char		request[MAXFNAMELEN];
+		bool		miss = false;
+		bool		got_request = false;
+		parray	   *batch_files;
+		XLogSegNo	s;
+		uint32		n_published = 0;
+		time_t		now = time(NULL);
+		struct timeval timeout;
+		fd_set		rfds;
+		int			rc;
+
+		/*
+		 * Wait for requests: forever if there is nothing to fetch, up to the
+		 * next retry otherwise, and not beyond the idle timeout.
+		 */
+		timeout.tv_sec = last_request_time + PREFETCH_IDLE_TIMEOUT - now;
+		if (need_fetch)
+			timeout.tv_sec = 0;
+		else if (last_request[0] != '\0')
+			timeout.tv_sec = Min(timeout.tv_sec,
+								 last_fetch_time + PREFETCH_RETRY_INTERVAL - now);
+		timeout.tv_sec = Max(timeout.tv_sec, 0);
+		timeout.tv_usec = 0;
+
+		FD_ZERO(&rfds);
+		FD_SET(fifo_fd, &rfds);
+		rc = select(fifo_fd + 1, &rfds, NULL, NULL, &timeout);
+		if (rc < 0 && errno != EINTR)
+			elog(ERROR, "select() failed: %s", strerror(errno));
+
+		if (rc > 0)
+		{
+			ssize_t		n = read(fifo_fd, req_buf + req_len,
+								 sizeof(req_buf) - 1 - req_len);
+
+			if (n > 0)
+				req_len += n;
+		}
+
+		while (take_prefetch_request(req_buf, &req_len, request, &miss))
+		{
+			got_request = true;
+
+			strncpy(last_request, request, MAXFNAMELEN);
+			GetXLogFromFileName(last_request, &tli, &segno, wal_seg_size);
+			last_request_time = time(NULL);
+			need_fetch = true;
+
+			if (miss)
+			{
+				n_hits = 0;
+				if (window < max_window)
+				{
+					window = Min(window * 2, max_window);
+					elog(LOG, "PID [%d]: WAL segment %s was not prefetched in time, window: %i",
+						 getpid(), last_request, window);
+				}
+			}
+			else if (++n_hits >= 2 * window && window > batch_size)
+			{
+				n_hits = 0;
+				window = Max(window - window / 4, batch_size);
+				elog(LOG, "PID [%d]: Prefetch window is reduced to %i", getpid(), window);
+			}
+		}
+
+		if (!got_request && time(NULL) - last_request_time >= PREFETCH_IDLE_TIMEOUT)
+			break;
+
+		/* Nothing is requested yet or it's too early to retry */
+		if (last_request[0] == '\0' ||
+			(!need_fetch && time(NULL) - last_fetch_time < PREFETCH_RETRY_INTERVAL))
+			continue;
+
+		need_fetch = false;
+		last_fetch_time = time(NULL);
+
+		/* Requested segment is already served, drop it and older ones */
+		maintain_prefetch(prefetch_dir, segno + 1, wal_seg_size);
+		maintain_prefetch(staging_dir, segno + 1, wal_seg_size);
+
+		batch_files = parray_new();
+
+		/* Copy missing segments of the window, no more than batch_size at a time */
+		for (s = segno + 1; s <= segno + window &&
+			 parray_num(batch_files) < (size_t) batch_size; s++)
+		{
+			char		name[MAXFNAMELEN];
+			char		path[MAXPGPATH];
+			WALSegno   *xlogfile;
+
+			GetXLogFileName(name, tli, s, wal_seg_size);
+
+			join_path_components(path, prefetch_dir, name);
+			if (access(path, F_OK) == 0)
+				continue;
+
+			join_path_components(path, staging_dir, name);
+			if (access(path, F_OK) == 0)
+				continue;
+
+			xlogfile = palloc(sizeof(WALSegno));
+			pg_atomic_init_flag(&xlogfile->lock);
+			strncpy(xlogfile->name, name, MAXFNAMELEN);
+			parray_append(batch_files, xlogfile);
+		}
+
+		if (parray_num(batch_files) > 0)
+			fetch_wal_files(batch_files, staging_dir, instance->arclog_path,
+							Min(num_threads, (int) parray_num(batch_files)));
+
+		parray_walk(batch_files, pfree);
+		parray_free(batch_files);
+
+		/* Publish validated segments in ascending order */
+		for (s = segno + 1; s <= segno + window; s++)
+		{
+			char		name[MAXFNAMELEN];
+			char		to_path[MAXPGPATH];
+
+			GetXLogFileName(name, tli, s, wal_seg_size);
+			join_path_components(to_path, prefetch_dir, name);
+
+			if (wal_satisfy_from_prefetch(tli, s, name, staging_dir, to_path,
+										  instance->arclog_path, wal_seg_size,
+										  validate_wal, 0))
+				n_published++;
+		}
+
+		/* Keep on filling the window while there is progress */
+		if (n_published > 0)
+			need_fetch = true;
+	}
+
+	unlink(fifo_path);
+	close(fifo_fd);
+	close(fifo_keep_fd);
+
+	elog(LOG, "PID [%d]: Prefetch worker is stopped", getpid());
+}
+#endif
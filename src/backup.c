@@ -25,6 +25,10 @@
 #include "utils/thread.h"
 #include "utils/file.h"
 
+#if defined(WIN32)
+#define __thread __declspec(thread)
+#endif
+
 static int	standby_message_timeout = 10 * 1000;	/* 10 sec = default */
 static XLogRecPtr stop_backup_lsn = InvalidXLogRecPtr;
 static XLogRecPtr stop_stream_lsn = InvalidXLogRecPtr;
@@ -42,7 +46,44 @@ const char *progname = "pg_probackup";
 /* list of files contained in backup */
 static parray *backup_files_list = NULL;
 
-/* We need critical section for datapagemap_add() in case of using threads */
+/*
+ * Index of data files from backup_files_list by relfilenode and segment
+ * number, used to find pgFile by block reference during WAL parsing
+ * without constructing its path. Open addressing, read-only once built,
+ * so WAL reader threads can use it without locking.
+ */
+typedef struct
+{
+	Oid			spcOid;
+	Oid			dbOid;
+	Oid			relOid;
+	ForkNumber	forknum;
+	int			segno;
+	pgFile	   *file;		/* NULL if slot is free */
+} PagemapIndexEntry;
+
+static PagemapIndexEntry *pagemap_index = NULL;
+static uint32 pagemap_index_mask = 0;
+
+/*
+ * Blocks found by WAL reader thread are accumulated in the thread private
+ * delta, deltas of all threads are merged into file pagemaps after
+ * WAL parsing is done. Delta is a hash table keyed by index slot number.
+ */
+typedef struct
+{
+	uint32		nslots;		/* power of two */
+	uint32		nused;
+	int32	   *entry;		/* pagemap_index slot or -1 */
+	pagemap_t  *maps;
+	int32		last_entry;	/* cache for consecutive references */
+	pagemap_t  *last_map;
+} PagemapDelta;
+
+static __thread PagemapDelta *thread_pagemap_delta = NULL;
+static parray *pagemap_deltas = NULL;
+
+/* We need critical section to register thread delta in pagemap_deltas */
 static pthread_mutex_t backup_pagemap_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
@@ -78,6 +119,11 @@ static bool pg_stop_backup_is_sent = false;
  */
 static void backup_cleanup(bool fatal, void *userdata);
 
+static void build_pagemap_index(parray *files);
+static void merge_pagemap_deltas(void);
+static PagemapDelta *pagemap_delta_new(void);
+static pagemap_t *pagemap_delta_get(PagemapDelta *delta, int32 entry);
+
 static void *backup_files(void *arg);
 
 static void do_backup_instance(PGconn *backup_conn, PGNodeInfo *nodeInfo, bool no_sync);
@@ -390,7 +436,7 @@ do_backup_instance(PGconn *backup_conn, PGNodeInfo *nodeInfo, bool no_sync)
 	 * 2 - create 'base/1'
 	 *
 	 * Sorted array is used at least in parse_filelist_filenames(),
-	 * extractPageMap(), make_pagemap_from_ptrack().
+	 * make_pagemap_from_ptrack().
 	 */
 	parray_qsort(backup_files_list, pgFileComparePath);
 
@@ -425,9 +471,13 @@ do_backup_instance(PGconn *backup_conn, PGNodeInfo *nodeInfo, bool no_sync)
 			 * reading WAL segments present in archives up to the point
 			 * where this backup has started.
 			 */
+			build_pagemap_index(backup_files_list);
+
 			pagemap_isok = extractPageMap(arclog_path, instance_config.xlog_seg_size,
 						   prev_backup->start_lsn, prev_backup->tli,
 						   current.start_lsn, current.tli, tli_list);
+
+			merge_pagemap_deltas();
 		}
 		else if (current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
 		{
@@ -840,7 +890,7 @@ do_backup(time_t start_time, bool no_validate,
 	elog(INFO, "Backup start, pg_probackup version: %s, instance: %s, backup ID: %s, backup mode: %s, "
 			"wal mode: %s, remote: %s, compress-algorithm: %s, compress-level: %i",
 			PROGRAM_VERSION, instance_name, base36enc(start_time), pgBackupGetBackupMode(&current),
-			current.stream ? "STREAM" : "ARCHIVE", IsSshProtocol()  ? "true" : "false",
+			current.stream ? "STREAM" : "ARCHIVE", IsRemoteProtocol() ? "true" : "false",
 			deparse_compress_alg(current.compress_alg), current.compress_level);
 
 	/* Create backup directory and BACKUP_CONTROL_FILE */
@@ -2322,55 +2372,226 @@ set_cfs_datafiles(parray *files, const char *root, char *relative, size_t i)
 	free(cfs_tblspc_path);
 }
 
+static inline uint32
+pagemap_index_hash(Oid spcOid, Oid dbOid, Oid relOid, ForkNumber forknum, int segno)
+{
+	uint64		h;
+
+	h = (((uint64) relOid << 32) | dbOid) * UINT64CONST(0x9E3779B97F4A7C15);
+	h ^= (((uint64) spcOid << 32) | ((uint32) segno << 4) | (uint32) forknum) *
+		UINT64CONST(0xC2B2AE3D27D4EB4F);
+	h ^= h >> 31;
+
+	return (uint32) h;
+}
+
 /*
- * Find pgfile by given rnode in the backup_files_list
- * and add given blkno to its pagemap.
+ * Build pagemap_index for data files of the list.
+ * Should be called before extractPageMap().
  */
-void
-process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
+static void
+build_pagemap_index(parray *files)
 {
-	char	   *path;
-	char	   *rel_path;
-	BlockNumber blkno_inseg;
-	int			segno;
-	pgFile	  **file_item;
-	pgFile		f;
+	uint32		nslots = 1024;
+	int			i;
 
-	segno = blkno / RELSEG_SIZE;
-	blkno_inseg = blkno % RELSEG_SIZE;
+	/* keep load factor below 0.5 */
+	while (nslots < parray_num(files) * 2)
+		nslots *= 2;
 
-	rel_path = relpathperm(rnode, forknum);
-	if (segno > 0)
-		path = psprintf("%s/%s.%u", instance_config.pgdata, rel_path, segno);
-	else
-		path = psprintf("%s/%s", instance_config.pgdata, rel_path);
+	pagemap_index = pgut_malloc(nslots * sizeof(PagemapIndexEntry));
+	MemSet(pagemap_index, 0, nslots * sizeof(PagemapIndexEntry));
+	pagemap_index_mask = nslots - 1;
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		uint32		slot;
+
+		/* Only main fork of relations from PGDATA is tracked */
+		if (!S_ISREG(file->mode) || !file->is_datafile ||
+			file->external_dir_num != 0)
+			continue;
 
-	pg_free(rel_path);
+		slot = pagemap_index_hash(file->tblspcOid, file->dbOid, file->relOid,
+								  MAIN_FORKNUM, file->segno) & pagemap_index_mask;
 
-	f.path = path;
-	/* backup_files_list should be sorted before */
-	file_item = (pgFile **) parray_bsearch(backup_files_list, &f,
-										   pgFileComparePath);
+		while (pagemap_index[slot].file != NULL)
+			slot = (slot + 1) & pagemap_index_mask;
 
-	/*
-	 * If we don't have any record of this file in the file map, it means
-	 * that it's a relation that did not have much activity since the last
-	 * backup. We can safely ignore it. If it is a new relation file, the
-	 * backup would simply copy it as-is.
-	 */
-	if (file_item)
+		pagemap_index[slot].spcOid = file->tblspcOid;
+		pagemap_index[slot].dbOid = file->dbOid;
+		pagemap_index[slot].relOid = file->relOid;
+		pagemap_index[slot].forknum = MAIN_FORKNUM;
+		pagemap_index[slot].segno = file->segno;
+		pagemap_index[slot].file = file;
+	}
+
+	pagemap_deltas = parray_new();
+}
+
+/*
+ * OR-merge pagemap deltas of WAL reader threads into file pagemaps
+ * and release pagemap_index.
+ */
+static void
+merge_pagemap_deltas(void)
+{
+	int			i;
+
+	for (i = 0; i < parray_num(pagemap_deltas); i++)
+	{
+		PagemapDelta *delta = (PagemapDelta *) parray_get(pagemap_deltas, i);
+		uint32		slot;
+
+		for (slot = 0; slot < delta->nslots; slot++)
+		{
+			if (delta->entry[slot] < 0)
+				continue;
+
+			pagemap_union(&pagemap_index[delta->entry[slot]].file->pagemap,
+						  &delta->maps[slot]);
+			pagemap_free(&delta->maps[slot]);
+		}
+
+		pg_free(delta->entry);
+		pg_free(delta->maps);
+		pg_free(delta);
+	}
+
+	parray_free(pagemap_deltas);
+	pagemap_deltas = NULL;
+	/* delta of the current thread is filled by block summaries */
+	thread_pagemap_delta = NULL;
+
+	pg_free(pagemap_index);
+	pagemap_index = NULL;
+	pagemap_index_mask = 0;
+}
+
+static PagemapDelta *
+pagemap_delta_new(void)
+{
+	PagemapDelta *delta = pgut_new(PagemapDelta);
+
+	delta->nslots = 256;
+	delta->nused = 0;
+	delta->entry = pgut_malloc(delta->nslots * sizeof(int32));
+	memset(delta->entry, -1, delta->nslots * sizeof(int32));
+	delta->maps = pgut_malloc(delta->nslots * sizeof(pagemap_t));
+	MemSet(delta->maps, 0, delta->nslots * sizeof(pagemap_t));
+	delta->last_entry = -1;
+	delta->last_map = NULL;
+
+	/* This happens once per thread, so locking is fine here */
+	pthread_lock(&backup_pagemap_mutex);
+	parray_append(pagemap_deltas, delta);
+	pthread_mutex_unlock(&backup_pagemap_mutex);
+
+	return delta;
+}
+
+/* Get pagemap of the thread delta for given pagemap_index slot */
+static pagemap_t *
+pagemap_delta_get(PagemapDelta *delta, int32 entry)
+{
+	uint32		slot;
+
+	if (entry == delta->last_entry)
+		return delta->last_map;
+
+	/* grow the table, keeping load factor below 0.5 */
+	if ((delta->nused + 1) * 2 > delta->nslots)
+	{
+		uint32		old_nslots = delta->nslots;
+		int32	   *old_entry = delta->entry;
+		pagemap_t  *old_maps = delta->maps;
+		uint32		i;
+
+		delta->nslots *= 2;
+		delta->entry = pgut_malloc(delta->nslots * sizeof(int32));
+		memset(delta->entry, -1, delta->nslots * sizeof(int32));
+		delta->maps = pgut_malloc(delta->nslots * sizeof(pagemap_t));
+		MemSet(delta->maps, 0, delta->nslots * sizeof(pagemap_t));
+
+		for (i = 0; i < old_nslots; i++)
+		{
+			if (old_entry[i] < 0)
+				continue;
+
+			slot = (uint32) old_entry[i] & (delta->nslots - 1);
+			while (delta->entry[slot] >= 0)
+				slot = (slot + 1) & (delta->nslots - 1);
+
+			delta->entry[slot] = old_entry[i];
+			delta->maps[slot] = old_maps[i];
+		}
+
+		pg_free(old_entry);
+		pg_free(old_maps);
+	}
+
+	slot = (uint32) entry & (delta->nslots - 1);
+	while (delta->entry[slot] >= 0 && delta->entry[slot] != entry)
+		slot = (slot + 1) & (delta->nslots - 1);
+
+	if (delta->entry[slot] < 0)
 	{
-		/* We need critical section only we use more than one threads */
-		if (num_threads > 1)
-			pthread_lock(&backup_pagemap_mutex);
+		delta->entry[slot] = entry;
+		delta->nused++;
+	}
+
+	delta->last_entry = entry;
+	delta->last_map = &delta->maps[slot];
 
-		datapagemap_add(&(*file_item)->pagemap, blkno_inseg);
+	return delta->last_map;
+}
 
-		if (num_threads > 1)
-			pthread_mutex_unlock(&backup_pagemap_mutex);
+/*
+ * Find pgfile by given rnode in the pagemap_index
+ * and add given blkno to its pagemap.
+ *
+ * Called by WAL reader threads for every block reference, so neither
+ * string formatting nor locking is allowed here: the index is read-only
+ * and blocks are collected in the thread private delta.
+ */
+void
+process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
+{
+	int			segno = blkno / RELSEG_SIZE;
+	uint32		slot;
+
+	slot = pagemap_index_hash(rnode.spcNode, rnode.dbNode, rnode.relNode,
+							  forknum, segno) & pagemap_index_mask;
+
+	for (;;)
+	{
+		PagemapIndexEntry *entry = &pagemap_index[slot];
+
+		/*
+		 * If we don't have any record of this file in the file map, it means
+		 * that it's a relation that did not have much activity since the last
+		 * backup. We can safely ignore it. If it is a new relation file, the
+		 * backup would simply copy it as-is.
+		 */
+		if (entry->file == NULL)
+			return;
+
+		if (entry->relOid == rnode.relNode &&
+			entry->dbOid == rnode.dbNode &&
+			entry->spcOid == rnode.spcNode &&
+			entry->segno == segno &&
+			entry->forknum == forknum)
+			break;
+
+		slot = (slot + 1) & pagemap_index_mask;
 	}
 
-	pg_free(path);
+	if (thread_pagemap_delta == NULL)
+		thread_pagemap_delta = pagemap_delta_new();
+
+	pagemap_add(pagemap_delta_get(thread_pagemap_delta, (int32) slot),
+				blkno % RELSEG_SIZE);
 }
 
 /*
@@ -872,8 +872,8 @@ catalog_get_timelines(InstanceConfig *instance)
 
 	/* read all xlog files that belong to this archive */
 	sprintf(arclog_path, "%s/%s/%s", backup_path, "wal", instance->name);
-	dir_list_file(xlog_files_list, arclog_path, false, false, false, 0, FIO_BACKUP_HOST);
-	parray_qsort(xlog_files_list, pgFileComparePath);
+	wal_state_list_archive(arclog_path, xlog_files_list,
+			       instance->archive_state_cache);
 
 	timelineinfos = parray_new();
 	tlinfo = NULL;
@@ -886,11 +886,71 @@ catalog_get_timelines(InstanceConfig *instance)
 		parray *timelines;
 		xlogFile *wal_file = NULL;
 
+		/*
+		 * Pack file of consecutive WAL segments, see walpack.c.
+		 * It must be checked before regular WAL files, because its name
+		 * starts with WAL file name too.
+		 */
+		if (IsWalPackFileName(file->name) || IsTempWalPackFileName(file->name))
+		{
+			XLogSegNo first_segno;
+			XLogSegNo last_segno;
+
+			if (!parse_wal_pack_name(file->name, instance->xlog_seg_size,
+									 &tli, &first_segno, &last_segno))
+			{
+				elog(WARNING, "unexpected WAL pack file name \"%s\"", file->name);
+				continue;
+			}
+
+			elog(VERBOSE, "WAL pack file \"%s\"", file->name);
+
+			if (!tlinfo || tlinfo->tli != tli)
+			{
+				tlinfo = timelineInfoNew(tli);
+				parray_append(timelineinfos, tlinfo);
+			}
+
+			/* append file to xlog file list */
+			wal_file = palloc(sizeof(xlogFile));
+			wal_file->file = *file;
+			wal_file->segno = last_segno;
+			wal_file->pack_first_segno = first_segno;
+			wal_file->type = WAL_PACK;
+			wal_file->keep = false;
+			parray_append(tlinfo->xlog_filelist, wal_file);
+
+			/* unfinished pack file doesn't hold any segments yet */
+			if (IsTempWalPackFileName(file->name))
+				continue;
+
+			if (tlinfo->n_xlog_files != 0 &&
+				first_segno > tlinfo->end_segno + 1)
+			{
+				xlogInterval *interval = palloc(sizeof(xlogInterval));
+				interval->begin_segno = tlinfo->end_segno + 1;
+				interval->end_segno = first_segno - 1;
+
+				if (tlinfo->lost_segments == NULL)
+					tlinfo->lost_segments = parray_new();
+
+				parray_append(tlinfo->lost_segments, interval);
+			}
+
+			if (tlinfo->begin_segno == 0)
+				tlinfo->begin_segno = first_segno;
+
+			if (last_segno > tlinfo->end_segno)
+				tlinfo->end_segno = last_segno;
+			/* update counters */
+			tlinfo->n_xlog_files += last_segno - first_segno + 1;
+			tlinfo->size += file->size;
+		}
 		/*
 		 * Regular WAL file.
 		 * IsXLogFileName() cannot be used here
 		 */
-		if (strspn(file->name, "0123456789ABCDEF") == XLOG_FNAME_LEN)
+		else if (strspn(file->name, "0123456789ABCDEF") == XLOG_FNAME_LEN)
 		{
 			int result = 0;
 			uint32 log, seg;
@@ -954,6 +1014,69 @@ catalog_get_timelines(InstanceConfig *instance)
 					parray_append(tlinfo->xlog_filelist, wal_file);
 					continue;
 				}
+				/* block summary of WAL segment */
+				else if (IsBlockSummaryFileName(file->name) ||
+						 IsTempBlockSummaryFileName(file->name))
+				{
+					elog(VERBOSE, "block summary file \"%s\"", file->name);
+
+					if (!tlinfo || tlinfo->tli != tli)
+					{
+						tlinfo = timelineInfoNew(tli);
+						parray_append(timelineinfos, tlinfo);
+					}
+
+					/* append file to xlog file list */
+					wal_file = palloc(sizeof(xlogFile));
+					wal_file->file = *file;
+					wal_file->segno = segno;
+					wal_file->type = BLOCK_SUMMARY;
+					wal_file->keep = false;
+					parray_append(tlinfo->xlog_filelist, wal_file);
+					continue;
+				}
+				/* recovery target index of WAL segment */
+				else if (IsRecoveryIndexFileName(file->name) ||
+						 IsTempRecoveryIndexFileName(file->name))
+				{
+					elog(VERBOSE, "recovery target index file \"%s\"", file->name);
+
+					if (!tlinfo || tlinfo->tli != tli)
+					{
+						tlinfo = timelineInfoNew(tli);
+						parray_append(timelineinfos, tlinfo);
+					}
+
+					/* append file to xlog file list */
+					wal_file = palloc(sizeof(xlogFile));
+					wal_file->file = *file;
+					wal_file->segno = segno;
+					wal_file->type = RECOVERY_INDEX;
+					wal_file->keep = false;
+					parray_append(tlinfo->xlog_filelist, wal_file);
+					continue;
+				}
+				/* checksum of WAL segment */
+				else if (IsWalChecksumFileName(file->name) ||
+						 IsTempWalChecksumFileName(file->name))
+				{
+					elog(VERBOSE, "WAL checksum file \"%s\"", file->name);
+
+					if (!tlinfo || tlinfo->tli != tli)
+					{
+						tlinfo = timelineInfoNew(tli);
+						parray_append(timelineinfos, tlinfo);
+					}
+
+					/* append file to xlog file list */
+					wal_file = palloc(sizeof(xlogFile));
+					wal_file->file = *file;
+					wal_file->segno = segno;
+					wal_file->type = WAL_CHECKSUM;
+					wal_file->keep = false;
+					parray_append(tlinfo->xlog_filelist, wal_file);
+					continue;
+				}
 				/* temp WAL segment */
 				else if (IsTempXLogFileName(file->name) ||
 						 IsTempCompressXLogFileName(file->name))
@@ -1004,9 +1127,10 @@ catalog_get_timelines(InstanceConfig *instance)
 				 * though it's legal to find two files with equal segno in case there
 				 * are both compressed and non-compessed versions. For example
 				 * 000000010000000000000002 and 000000010000000000000002.gz
-				 *
+				 * Segment may also be found both in pack file and loose,
+				 * if archive-pack was interrupted before unlinking it.
 				 */
-				if (segno != expected_segno && segno != tlinfo->end_segno)
+				if (segno > expected_segno)
 				{
 					xlogInterval *interval = palloc(sizeof(xlogInterval));;
 					interval->begin_segno = expected_segno;
@@ -1023,7 +1147,8 @@ catalog_get_timelines(InstanceConfig *instance)
 				tlinfo->begin_segno = segno;
 
 			/* this file is the last for this timeline so far */
-			tlinfo->end_segno = segno;
+			if (segno > tlinfo->end_segno)
+				tlinfo->end_segno = segno;
 			/* update counters */
 			tlinfo->n_xlog_files++;
 			tlinfo->size += file->size;
@@ -1071,6 +1196,9 @@ catalog_get_timelines(InstanceConfig *instance)
 			parray_walk(timelines, pfree);
 			parray_free(timelines);
 		}
+		/* listing cache of the archive itself */
+		else if (IsWalStateFileName(file->name))
+			continue;
 		else
 			elog(WARNING, "unexpected WAL file name \"%s\"", file->name);
 	}
@@ -1427,6 +1555,9 @@ catalog_get_timelines(InstanceConfig *instance)
 		for (j = 0; j < parray_num(tlinfo->xlog_filelist); j++)
 		{
 			xlogFile *wal_file = (xlogFile *) parray_get(tlinfo->xlog_filelist, j);
+			/* pack file is kept if any of its segments must be kept */
+			XLogSegNo first_segno = wal_file->type == WAL_PACK ?
+									wal_file->pack_first_segno : wal_file->segno;
 
 			if (wal_file->segno >= anchor_segno)
 			{
@@ -1444,7 +1575,7 @@ catalog_get_timelines(InstanceConfig *instance)
 				xlogInterval *keep_segments = (xlogInterval *) parray_get(tlinfo->keep_segments, k);
 
 				if ((wal_file->segno >= keep_segments->begin_segno) &&
-					wal_file->segno <= keep_segments->end_segno)
+					first_segno <= keep_segments->end_segno)
 				{
 					wal_file->keep = true;
 					break;
@@ -142,6 +142,11 @@ ConfigOption instance_options[] =
 		&instance_config.restore_command, SOURCE_CMD, SOURCE_DEFAULT,
 		OPTION_ARCHIVE_GROUP, 0, option_get_value
 	},
+	{
+		'b', 232, "archive-state-cache",
+		&instance_config.archive_state_cache, SOURCE_CMD, 0,
+		OPTION_ARCHIVE_GROUP, 0, option_get_value
+	},
 	/* Logging options */
 	{
 		'f', 212, "log-level-console",
@@ -241,6 +246,11 @@ ConfigOption instance_options[] =
 		&instance_config.remote.ssh_config, SOURCE_CMD, 0,
 		OPTION_REMOTE_GROUP, 0, option_get_value
 	},
+	{
+		'b', 231, "remote-compress",
+		&instance_config.remote.compress, SOURCE_CMD, 0,
+		OPTION_REMOTE_GROUP, 0, option_get_value
+	},
 	{ 0 }
 };
 
@@ -481,6 +491,11 @@ readInstanceConfigFile(const char *instance_name)
 			&instance->restore_command, SOURCE_CMD, 0,
 			OPTION_ARCHIVE_GROUP, 0, option_get_value
 		},
+		{
+			'b', 232, "archive-state-cache",
+			&instance->archive_state_cache, SOURCE_CMD, 0,
+			OPTION_ARCHIVE_GROUP, 0, option_get_value
+		},
 
 		/* Instance options */
 		{
@@ -588,6 +603,11 @@ readInstanceConfigFile(const char *instance_name)
 			&instance->remote.ssh_config, SOURCE_CMD, 0,
 			OPTION_REMOTE_GROUP, 0, option_get_value
 		},
+		{
+			'b', 231, "remote-compress",
+			&instance->remote.compress, SOURCE_CMD, 0,
+			OPTION_REMOTE_GROUP, 0, option_get_value
+		},
 		{ 0 }
 	};
 
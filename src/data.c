@@ -132,7 +132,7 @@ do_decompress(void* dst, size_t dst_size, void const* src, size_t src_size,
  * There is no 100% criteria to determine whether page is compressed or not.
  * But at least we will do this check only for pages which will no pass validation step.
  */
-static bool
+bool
 page_may_be_compressed(Page page, CompressAlg alg, uint32 backup_version)
 {
 	PageHeader	phdr;
@@ -255,6 +255,76 @@ get_checksum_errormsg(Page page, char **errormsg, BlockNumber absolute_blkno)
 			 pg_checksum_page(page, absolute_blkno));
 }
 
+/*
+ * Get page via ptrack interface from PostgreSQL shared buffer
+ * and write it into argument "page".
+ * Returns PageIsOk or PageIsTruncated if the block doesn't exist.
+ */
+static int32
+get_page_via_ptrack(ConnectionArgs *conn_arg, pgFile *file,
+					BlockNumber blknum, Page page, XLogRecPtr *page_lsn,
+					uint32 checksum_version, int ptrack_version_num,
+					const char *ptrack_schema, const char *from_fullpath)
+{
+	int rc = 0;
+	size_t page_size = 0;
+	Page ptrack_page = NULL;
+	BlockNumber absolute_blknum = file->segno * RELSEG_SIZE + blknum;
+
+	ptrack_page = (Page) pg_ptrack_get_block(conn_arg, file->dbOid, file->tblspcOid,
+									  file->relOid, absolute_blknum, &page_size,
+									  ptrack_version_num, ptrack_schema);
+
+	if (ptrack_page == NULL)
+		/* This block was truncated.*/
+		return PageIsTruncated;
+
+	if (page_size != BLCKSZ)
+		elog(ERROR, "File: \"%s\", block %u, expected block size %d, but read %zu",
+				   from_fullpath, blknum, BLCKSZ, page_size);
+
+	/*
+	 * We need to copy the page that was successfully
+	 * retrieved from ptrack into our output "page" parameter.
+	 */
+	memcpy(page, ptrack_page, BLCKSZ);
+	pg_free(ptrack_page);
+
+	/* UPD: It apprears that is possible to get zeroed page or page with invalid header
+	 * from shared buffer.
+	 * Note, that getting page with wrong checksumm from shared buffer is
+	 * acceptable.
+	 */
+	*page_lsn = 0;
+	rc = validate_one_page(page, absolute_blknum,
+							InvalidXLogRecPtr, page_lsn,
+							checksum_version);
+
+	/* It is ok to get zeroed page */
+	if (rc == PAGE_IS_ZEROED)
+	{
+		*page_lsn = 0;
+		return PageIsOk;
+	}
+
+	/* Getting page with invalid header from shared buffers is unacceptable */
+	if (rc == PAGE_HEADER_IS_INVALID)
+	{
+		char *errormsg = NULL;
+		get_header_errormsg(page, &errormsg);
+		elog(ERROR, "Corruption detected in file \"%s\", block %u: %s",
+							from_fullpath, blknum, errormsg);
+	}
+
+	/* We must set checksum here, because it is outdated
+	 * in the block recieved from shared buffers.
+	 */
+	if (checksum_version)
+		((PageHeader) page)->pd_checksum = pg_checksum_page(page, absolute_blknum);
+
+	return PageIsOk;
+}
+
 /*
  * Retrieves a page taking the backup mode into account
  * and writes it into argument "page". Argument "page"
@@ -418,55 +488,10 @@ prepare_page(ConnectionArgs *conn_arg,
 		&& (ptrack_version_num >= 15 && ptrack_version_num < 20))
 			|| !page_is_valid)
 	{
-		int rc = 0;
-		size_t page_size = 0;
-		Page ptrack_page = NULL;
-		ptrack_page = (Page) pg_ptrack_get_block(conn_arg, file->dbOid, file->tblspcOid,
-										  file->relOid, absolute_blknum, &page_size,
-										  ptrack_version_num, ptrack_schema);
-
-		if (ptrack_page == NULL)
-			/* This block was truncated.*/
+		if (get_page_via_ptrack(conn_arg, file, blknum, page, &page_lsn,
+								checksum_version, ptrack_version_num,
+								ptrack_schema, from_fullpath) == PageIsTruncated)
 			return PageIsTruncated;
-
-		if (page_size != BLCKSZ)
-			elog(ERROR, "File: \"%s\", block %u, expected block size %d, but read %zu",
-					   from_fullpath, blknum, BLCKSZ, page_size);
-
-		/*
-		 * We need to copy the page that was successfully
-		 * retrieved from ptrack into our output "page" parameter.
-		 */
-		memcpy(page, ptrack_page, BLCKSZ);
-		pg_free(ptrack_page);
-
-		/* UPD: It apprears that is possible to get zeroed page or page with invalid header
-		 * from shared buffer.
-		 * Note, that getting page with wrong checksumm from shared buffer is
-		 * acceptable.
-		 */
-		rc = validate_one_page(page, absolute_blknum,
-								InvalidXLogRecPtr, &page_lsn,
-								checksum_version);
-
-		/* It is ok to get zeroed page */
-		if (rc == PAGE_IS_ZEROED)
-			return PageIsOk;
-
-		/* Getting page with invalid header from shared buffers is unacceptable */
-		if (rc == PAGE_HEADER_IS_INVALID)
-		{
-			char *errormsg = NULL;
-			get_header_errormsg(page, &errormsg);
-			elog(ERROR, "Corruption detected in file \"%s\", block %u: %s",
-								from_fullpath, blknum, errormsg);
-		}
-
-		/* We must set checksum here, because it is outdated
-		 * in the block recieved from shared buffers.
-		 */
-		if (checksum_version)
-			((PageHeader) page)->pd_checksum = pg_checksum_page(page, absolute_blknum);
 	}
 
 	/*
@@ -540,6 +565,65 @@ compress_and_backup_page(pgFile *file, BlockNumber blknum,
 	file->uncompressed_size += BLCKSZ;
 }
 
+/* Arguments of backup_page_via_ptrack() */
+typedef struct
+{
+	ConnectionArgs *conn_arg;
+	pgFile	   *file;
+	FILE	   *out;
+	XLogRecPtr	prev_backup_start_lsn;
+	BackupMode	backup_mode;
+	CompressAlg	calg;
+	int			clevel;
+	uint32		checksum_version;
+	int			ptrack_version_num;
+	const char *ptrack_schema;
+	const char *from_fullpath;
+	const char *to_fullpath;
+} ptrack_page_arg;
+
+/*
+ * Called by fio_send_pages() for invalid page the remote agent gave up
+ * reading: get the page from shared buffer and back it up, like
+ * prepare_page() does for local file. Returns false if block is truncated.
+ */
+static bool
+backup_page_via_ptrack(BlockNumber blknum, char const *errormsg, void *arg)
+{
+	ptrack_page_arg *args = (ptrack_page_arg *) arg;
+	char		page[BLCKSZ];
+	XLogRecPtr	page_lsn = 0;
+
+	elog(WARNING, "File \"%s\", block %u, try to fetch via shared buffer",
+		 args->from_fullpath, blknum);
+	if (errormsg)
+		elog(WARNING, "Corruption detected in file \"%s\", block %u: %s",
+			 args->from_fullpath, blknum, errormsg);
+	else
+		elog(WARNING, "Corruption detected in file \"%s\", block %u",
+			 args->from_fullpath, blknum);
+
+	if (get_page_via_ptrack(args->conn_arg, args->file, blknum, page, &page_lsn,
+							args->checksum_version, args->ptrack_version_num,
+							args->ptrack_schema, args->from_fullpath) == PageIsTruncated)
+		return false;
+
+	/* Skip page as prepare_page() does */
+	if (args->backup_mode == BACKUP_MODE_DIFF_DELTA &&
+		args->file->exists_in_prev &&
+		page_lsn &&
+		page_lsn < args->prev_backup_start_lsn)
+	{
+		elog(VERBOSE, "Skipping blknum %u in file: \"%s\"", blknum, args->from_fullpath);
+		return true;
+	}
+
+	compress_and_backup_page(args->file, blknum, NULL, args->out, &(args->file->crc),
+							 PageIsOk, page, args->calg, args->clevel,
+							 args->from_fullpath, args->to_fullpath);
+	return true;
+}
+
 /*
  * Backup data file in the from_root directory to the to_root directory with
  * same relative path. If prev_backup_start_lsn is not NULL, only pages with
@@ -563,7 +647,7 @@ backup_data_file(ConnectionArgs* conn_arg, pgFile *file,
 	int         page_state;
 	char        curr_page[BLCKSZ];
 	bool        use_pagemap;
-	datapagemap_iterator_t *iter = NULL;
+	pagemap_iterator_t iter;
 
 	/* stdio buffers */
 	char *in_buf = NULL;
@@ -590,7 +674,7 @@ backup_data_file(ConnectionArgs* conn_arg, pgFile *file,
 	 */
 	if ((backup_mode == BACKUP_MODE_DIFF_PAGE ||
 		backup_mode == BACKUP_MODE_DIFF_PTRACK) &&
-		file->pagemap.bitmapsize == PageBitmapIsEmpty &&
+		pagemap_is_empty(&file->pagemap) &&
 		file->exists_in_prev && !file->pagemap_isabsent)
 	{
 		/*
@@ -655,9 +739,8 @@ backup_data_file(ConnectionArgs* conn_arg, pgFile *file,
 	 * Such files should be fully copied.
 	 */
 
-	if 	(file->pagemap.bitmapsize == PageBitmapIsEmpty ||
-		 file->pagemap_isabsent || !file->exists_in_prev ||
-		 !file->pagemap.bitmap)
+	if 	(pagemap_is_empty(&file->pagemap) ||
+		 file->pagemap_isabsent || !file->exists_in_prev)
 		use_pagemap = false;
 	else
 		use_pagemap = true;
@@ -686,15 +769,33 @@ backup_data_file(ConnectionArgs* conn_arg, pgFile *file,
 	{
 		char *errmsg = NULL;
 		BlockNumber	err_blknum = 0;
-
-		/* TODO: retrying via ptrack should be implemented on the agent */
-		int rc = fio_send_pages(in, out, file,
+		ptrack_page_arg fetch_arg;
+		int rc;
+
+		/* invalid pages are fetched via ptrack, as prepare_page() does */
+		fetch_arg.conn_arg = conn_arg;
+		fetch_arg.file = file;
+		fetch_arg.out = out;
+		fetch_arg.prev_backup_start_lsn = prev_backup_start_lsn;
+		fetch_arg.backup_mode = backup_mode;
+		fetch_arg.calg = calg;
+		fetch_arg.clevel = clevel;
+		fetch_arg.checksum_version = checksum_version;
+		fetch_arg.ptrack_version_num = ptrack_version_num;
+		fetch_arg.ptrack_schema = ptrack_schema;
+		fetch_arg.from_fullpath = from_fullpath;
+		fetch_arg.to_fullpath = to_fullpath;
+
+		rc = fio_send_pages(in, out, file,
 								/* send prev backup START_LSN */
 								backup_mode == BACKUP_MODE_DIFF_DELTA &&
 								file->exists_in_prev ? prev_backup_start_lsn : InvalidXLogRecPtr,
 								calg, clevel, checksum_version,
 								/* send pagemap if any */
 								use_pagemap ? &file->pagemap : NULL,
+								/* fetch invalid pages if ptrack is available */
+								ptrack_version_num > 0 ? backup_page_via_ptrack : NULL,
+								&fetch_arg,
 								/* variables for error reporting */
 								&err_blknum, &errmsg);
 
@@ -726,8 +827,8 @@ backup_data_file(ConnectionArgs* conn_arg, pgFile *file,
 	{
 		if (use_pagemap)
 		{
-			iter = datapagemap_iterate(&file->pagemap);
-			datapagemap_next(iter, &blknum); /* set first block */
+			pagemap_iterate(&file->pagemap, &iter);
+			pagemap_next(&iter, &blknum); /* set first block */
 		}
 
 		while (blknum < nblocks)
@@ -760,7 +861,7 @@ backup_data_file(ConnectionArgs* conn_arg, pgFile *file,
 			if (use_pagemap)
 			{
 				/* exit if pagemap is exhausted */
-				if (!datapagemap_next(iter, &blknum))
+				if (!pagemap_next(&iter, &blknum))
 					break;
 			}
 			else
@@ -768,8 +869,7 @@ backup_data_file(ConnectionArgs* conn_arg, pgFile *file,
 		}
 	}
 
-	pg_free(file->pagemap.bitmap);
-	pg_free(iter);
+	pagemap_free(&file->pagemap);
 
 	/* refresh n_blocks for FULL and DELTA */
 	if (backup_mode == BACKUP_MODE_FULL ||
@@ -852,9 +952,14 @@ backup_non_data_file(pgFile *file, pgFile *prev_file,
  * Iterate over parent backup chain and lookup given destination file in
  * filelist of every chain member starting with FULL backup.
  * Apply changed blocks to destination file from every backup in parent chain.
+ *
+ * If remote_apply is true, backup files are streamed to the remote agent
+ * as is, and the agent applies them to the destination file itself.
+ * Number of sent bytes is returned in this case.
  */
 size_t
-restore_data_file(parray *parent_chain, pgFile *dest_file, FILE *out, const char *to_fullpath)
+restore_data_file(parray *parent_chain, pgFile *dest_file, FILE *out,
+				  const char *to_fullpath, bool remote_apply)
 {
 	int    i;
 	size_t total_write_len = 0;
@@ -914,7 +1019,12 @@ restore_data_file(parray *parent_chain, pgFile *dest_file, FILE *out, const char
 		 * have BackupPageHeader with meta information, so we cannot just
 		 * copy the file from backup.
 		 */
-		total_write_len += restore_data_file_internal(in, out, tmp_file,
+		if (remote_apply)
+			total_write_len += fio_apply_data_file(out, in, tmp_file->compress_alg,
+					  parse_program_version(backup->program_version),
+					  dest_file->n_blocks, from_fullpath);
+		else
+			total_write_len += restore_data_file_internal(in, out, tmp_file,
 					  parse_program_version(backup->program_version),
 					  from_fullpath, to_fullpath, dest_file->n_blocks);
 
@@ -1057,6 +1167,19 @@ restore_data_file_internal(FILE *in, FILE *out, pgFile *file, uint32 backup_vers
 			is_compressed = true;
 		}
 
+		/*
+		 * Remote agent gets pages in batches and writes them to their
+		 * blocks itself, so neither seek nor decompression is needed here.
+		 */
+		if (fio_is_remote_file(out))
+		{
+			fio_fwrite_page(out, blknum, page.data,
+							is_compressed ? compressed_size : BLCKSZ,
+							is_compressed ? file->compress_alg : NONE_COMPRESS);
+			write_len += BLCKSZ;
+			continue;
+		}
+
 		/*
 		 * Seek and write the restored page.
 		 * When restoring file from FULL backup, pages are written sequentially,
@@ -11,9 +11,32 @@
 #include "pg_probackup.h"
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "utils/thread.h"
+
+/* Directory of instance backups, where deleted backups are moved to */
+#define TRASH_DIR	".trash"
+
+typedef struct
+{
+	parray	   *files;
+	int			thread_num;
+
+	/*
+	 * Return value from the thread.
+	 * 0 means there is no error, 1 - there is an error.
+	 */
+	int			ret;
+} delete_files_arg;
+
+static void delete_file_list(parray *files);
+static void *delete_files_worker(void *arg);
+static bool move_backup_to_trash(pgBackup *backup);
+static void purge_trash(const char *instance_name, bool background);
+static void *purge_trash_worker(void *arg);
 static void delete_walfiles_in_tli(XLogRecPtr keep_lsn, timelineInfo *tli,
 						uint32 xlog_seg_size, bool dry_run);
 static void do_retention_internal(parray *backup_list, parray *to_keep_list,
@@ -107,6 +130,9 @@ do_delete(time_t backup_id)
 	if (delete_wal)
 		do_retention_wal(dry_run);
 
+	if (!dry_run)
+		purge_trash(instance_name, delete_trash);
+
 	/* cleanup */
 	parray_free(delete_list);
 	parray_walk(backup_list, pgBackupFree);
@@ -191,6 +217,9 @@ void do_retention(void)
 	if (!wal_deleted)
 		elog(INFO, "There is no WAL to purge by retention policy");
 
+	if (!dry_run)
+		purge_trash(instance_name, delete_trash);
+
 	/* Cleanup */
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
@@ -721,11 +750,8 @@ do_retention_wal(bool dry_run)
 void
 delete_backup_files(pgBackup *backup)
 {
-	size_t		i;
 	char		timestamp[100];
 	parray		*files;
-	size_t		num_files;
-	char		full_path[MAXPGPATH];
 
 	/*
 	 * If the backup was deleted already, there is nothing to do.
@@ -742,6 +768,16 @@ delete_backup_files(pgBackup *backup)
 	elog(INFO, "Delete: %s %s",
 		 base36enc(backup->start_time), timestamp);
 
+	/*
+	 * Moving backup into trash directory takes a single rename, the files
+	 * are removed later by purge_trash().
+	 */
+	if (delete_trash && move_backup_to_trash(backup))
+	{
+		backup->status = BACKUP_STATUS_DELETED;
+		return;
+	}
+
 	/*
 	 * Update STATUS to BACKUP_STATUS_DELETING in preparation for the case which
 	 * the error occurs before deleting all backup files.
@@ -752,24 +788,7 @@ delete_backup_files(pgBackup *backup)
 	files = parray_new();
 	dir_list_file(files, backup->root_dir, false, true, true, 0, FIO_BACKUP_HOST);
 
-	/* delete leaf node first */
-	parray_qsort(files, pgFileComparePathDesc);
-	num_files = parray_num(files);
-	for (i = 0; i < num_files; i++)
-	{
-		pgFile	   *file = (pgFile *) parray_get(files, i);
-
-		join_path_components(full_path, backup->root_dir, file->rel_path);
-
-		if (interrupted)
-			elog(ERROR, "interrupted during delete backup");
-
-		if (progress)
-			elog(INFO, "Progress: (%zd/%zd). Delete file \"%s\"",
-				 i + 1, num_files, full_path);
-
-		pgFileDelete(file, full_path);
-	}
+	delete_file_list(files);
 
 	parray_walk(files, pgFileFree);
 	parray_free(files);
@@ -808,6 +827,8 @@ delete_walfiles_in_tli(XLogRecPtr keep_lsn, timelineInfo *tlinfo,
 	char 		first_to_del_str[MAXFNAMELEN];
 	char 		oldest_to_keep_str[MAXFNAMELEN];
 	int			i;
+	parray	   *to_delete;
+	parray	   *files;
 	size_t		wal_size_logical = 0;
 	size_t		wal_size_actual = 0;
 	char		wal_pretty_size[20];
@@ -911,13 +932,13 @@ delete_walfiles_in_tli(XLogRecPtr keep_lsn, timelineInfo *tlinfo,
 	if (dry_run)
 		return;
 
+	to_delete = parray_new();
+	files = parray_new();
+
 	for (i = 0; i < parray_num(tlinfo->xlog_filelist); i++)
 	{
 		xlogFile *wal_file = (xlogFile *) parray_get(tlinfo->xlog_filelist, i);
 
-		if (interrupted)
-			elog(ERROR, "interrupted during WAL archive purge");
-
 		/* Any segment equal or greater than EndSegNo must be kept
 		 * unless it`s a 'purge all' scenario.
 		 */
@@ -930,29 +951,41 @@ delete_walfiles_in_tli(XLogRecPtr keep_lsn, timelineInfo *tlinfo,
 				continue;
 			}
 
-			/* unlink segment */
-			if (fio_unlink(wal_file->file.path, FIO_BACKUP_HOST) < 0)
-			{
-				/* Missing file is not considered as error condition */
-				if (errno != ENOENT)
-					elog(ERROR, "Could not remove file \"%s\": %s",
-								 wal_file->file.path, strerror(errno));
-			}
-			else
-			{
-				if (wal_file->type == SEGMENT)
-					elog(VERBOSE, "Removed WAL segment \"%s\"", wal_file->file.path);
-				else if (wal_file->type == TEMP_SEGMENT)
-					elog(VERBOSE, "Removed temp WAL segment \"%s\"", wal_file->file.path);
-				else if (wal_file->type == PARTIAL_SEGMENT)
-					elog(VERBOSE, "Removed partial WAL segment \"%s\"", wal_file->file.path);
-				else if (wal_file->type == BACKUP_HISTORY_FILE)
-					elog(VERBOSE, "Removed backup history file \"%s\"", wal_file->file.path);
-			}
-
-			wal_deleted = true;
+			parray_append(to_delete, wal_file);
+			parray_append(files, &wal_file->file);
 		}
 	}
+
+	/* unlink segments, missing file is not considered as error condition */
+	delete_file_list(files);
+
+	for (i = 0; i < parray_num(to_delete); i++)
+	{
+		xlogFile *wal_file = (xlogFile *) parray_get(to_delete, i);
+
+		if (wal_file->type == SEGMENT)
+			elog(VERBOSE, "Removed WAL segment \"%s\"", wal_file->file.path);
+		else if (wal_file->type == TEMP_SEGMENT)
+			elog(VERBOSE, "Removed temp WAL segment \"%s\"", wal_file->file.path);
+		else if (wal_file->type == PARTIAL_SEGMENT)
+			elog(VERBOSE, "Removed partial WAL segment \"%s\"", wal_file->file.path);
+		else if (wal_file->type == BACKUP_HISTORY_FILE)
+			elog(VERBOSE, "Removed backup history file \"%s\"", wal_file->file.path);
+		else if (wal_file->type == BLOCK_SUMMARY)
+			elog(VERBOSE, "Removed block summary file \"%s\"", wal_file->file.path);
+		else if (wal_file->type == RECOVERY_INDEX)
+			elog(VERBOSE, "Removed recovery target index file \"%s\"", wal_file->file.path);
+		else if (wal_file->type == WAL_CHECKSUM)
+			elog(VERBOSE, "Removed WAL checksum file \"%s\"", wal_file->file.path);
+		else if (wal_file->type == WAL_PACK)
+			elog(VERBOSE, "Removed WAL pack file \"%s\"", wal_file->file.path);
+
+		wal_state_remove(wal_file->file.path);
+		wal_deleted = true;
+	}
+
+	parray_free(to_delete);
+	parray_free(files);
 }
 
 
@@ -965,6 +998,7 @@ do_delete_instance(void)
 	int 		i;
 	int 		rc;
 	char		instance_config_path[MAXPGPATH];
+	char		trash_dir[MAXPGPATH];
 
 
 	/* Delete all backups. */
@@ -982,6 +1016,12 @@ do_delete_instance(void)
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
 
+	/* Trash directory must be empty before instance directory is removed */
+	purge_trash(instance_name, false);
+	join_path_components(trash_dir, backup_instance_path, TRASH_DIR);
+	if (rmdir(trash_dir) != 0 && errno != ENOENT)
+		elog(ERROR, "Can't remove \"%s\": %s", trash_dir, strerror(errno));
+
 	/* Delete all wal files. */
 	xlog_files_list = parray_new();
 	dir_list_file(xlog_files_list, arclog_path, false, false, false, 0, FIO_BACKUP_HOST);
@@ -1121,8 +1161,264 @@ do_delete_status(InstanceConfig *instance_config, const char *status)
 	// we don`t do WAL purge here, because it is impossible to correctly handle
 	// dry-run case.
 
+	if (!dry_run)
+		purge_trash(instance_config->name, delete_trash);
+
 	/* Cleanup */
 	parray_free(delete_list);
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
 }
+
+/*
+ * Delete listed files of directory tree. Files are unlinked by num_threads
+ * threads, then directories are removed, leaf first.
+ */
+static void
+delete_file_list(parray *files)
+{
+	pthread_t  *threads;
+	delete_files_arg *threads_args;
+	bool		delete_isok = true;
+	int			i;
+
+	/* Files of the same directory go together */
+	parray_qsort(files, pgFileComparePath);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+
+		pg_atomic_clear_flag(&file->lock);
+	}
+
+	threads = (pthread_t *) palloc(sizeof(pthread_t) * num_threads);
+	threads_args = (delete_files_arg *)
+		palloc(sizeof(delete_files_arg) * num_threads);
+
+	thread_interrupted = false;
+	for (i = 0; i < num_threads; i++)
+	{
+		delete_files_arg *arg = &(threads_args[i]);
+
+		arg->files = files;
+		arg->thread_num = i + 1;
+		/* By default there are some error */
+		arg->ret = 1;
+
+		pthread_create(&threads[i], NULL, delete_files_worker, arg);
+	}
+
+	for (i = 0; i < num_threads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (threads_args[i].ret == 1)
+			delete_isok = false;
+	}
+
+	pfree(threads);
+	pfree(threads_args);
+
+	if (!delete_isok)
+		elog(ERROR, "Files deletion failed");
+
+	/* delete leaf node first */
+	parray_qsort(files, pgFileComparePathDesc);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+
+		if (S_ISDIR(file->mode))
+			pgFileDelete(file, file->path);
+	}
+}
+
+/*
+ * Unlink files, which are not directories, from the list shared
+ * between threads.
+ */
+static void *
+delete_files_worker(void *arg)
+{
+	delete_files_arg *arguments = (delete_files_arg *) arg;
+	int			n_files = parray_num(arguments->files);
+	char		dir_path[MAXPGPATH];
+	int			dir_fd = -1;
+	int			i;
+
+	dir_path[0] = '\0';
+
+	for (i = 0; i < n_files; i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(arguments->files, i);
+		int			rc;
+
+		if (S_ISDIR(file->mode))
+			continue;
+
+		if (!pg_atomic_test_set_flag(&file->lock))
+			continue;
+
+		if (interrupted || thread_interrupted)
+			elog(ERROR, "interrupted during delete");
+
+		if (progress)
+			elog(INFO, "Progress: (%d/%d). Delete file \"%s\"",
+				 i + 1, n_files, file->path);
+
+#ifndef WIN32
+		{
+			char		parent[MAXPGPATH];
+
+			/*
+			 * Unlink file relative to descriptor of its directory, so that
+			 * the whole path is not resolved for every file.
+			 */
+			strncpy(parent, file->path, MAXPGPATH);
+			get_parent_directory(parent);
+
+			if (strcmp(parent, dir_path) != 0)
+			{
+				if (dir_fd >= 0)
+					close(dir_fd);
+				dir_fd = open(parent, O_RDONLY);
+				strncpy(dir_path, parent, MAXPGPATH);
+			}
+
+			if (dir_fd >= 0)
+				rc = unlinkat(dir_fd, file->name, 0);
+			else
+				rc = unlink(file->path);
+		}
+#else
+		rc = remove(file->path);
+#endif
+
+		if (rc < 0 && errno != ENOENT)
+		{
+			int			save_errno = errno;
+
+			if (dir_fd >= 0)
+				close(dir_fd);
+			elog(ERROR, "Cannot remove file \"%s\": %s", file->path,
+				 strerror(save_errno));
+		}
+	}
+
+	if (dir_fd >= 0)
+		close(dir_fd);
+
+	/* Data files deletion is successful */
+	arguments->ret = 0;
+
+	return NULL;
+}
+
+/*
+ * Move backup directory into the trash directory of instance.
+ * Returns false if backup must be deleted in place.
+ */
+static bool
+move_backup_to_trash(pgBackup *backup)
+{
+	char		trash_dir[MAXPGPATH];
+	char		trash_path[MAXPGPATH];
+
+	strncpy(trash_dir, backup->root_dir, MAXPGPATH);
+	get_parent_directory(trash_dir);
+	join_path_components(trash_dir, trash_dir, TRASH_DIR);
+	join_path_components(trash_path, trash_dir, base36enc(backup->start_time));
+
+	if (fio_mkdir(trash_dir, DIR_PERMISSION, FIO_BACKUP_HOST) != 0 ||
+		fio_rename(backup->root_dir, trash_path, FIO_BACKUP_HOST) != 0)
+	{
+		elog(WARNING, "Cannot move backup %s into trash directory \"%s\": %s",
+			 base36enc(backup->start_time), trash_dir, strerror(errno));
+		return false;
+	}
+
+	elog(LOG, "Backup %s is moved into trash directory \"%s\"",
+		 base36enc(backup->start_time), trash_dir);
+	return true;
+}
+
+/*
+ * Remove backups left in the trash directory of instance. If background
+ * is true, they are removed by a detached process, so the command doesn't
+ * wait for it.
+ */
+static void
+purge_trash(const char *instance_name, bool background)
+{
+	static char	trash_dir[MAXPGPATH];
+
+	snprintf(trash_dir, MAXPGPATH, "%s/%s/%s/%s",
+			 backup_path, BACKUPS_DIR, instance_name, TRASH_DIR);
+
+	if (dir_is_empty(trash_dir, FIO_BACKUP_HOST))
+		return;
+
+#ifndef WIN32
+	if (background)
+	{
+		pid_t		pid;
+
+		/* Connection to remote host cannot be shared with child process */
+		fio_disconnect();
+
+		pid = fork();
+		if (pid == 0)
+		{
+			pthread_t	thread;
+			int			fd;
+
+			/* Detach from terminal of delete command */
+			setsid();
+			fd = open("/dev/null", O_RDWR);
+			if (fd >= 0)
+			{
+				dup2(fd, STDIN_FILENO);
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				close(fd);
+			}
+
+			/* Errors in thread don't call exit() */
+			pthread_create(&thread, NULL, purge_trash_worker, trash_dir);
+			pthread_join(thread, NULL);
+
+			/* Exit callbacks would release backup locks of the parent */
+			_exit(0);
+		}
+
+		if (pid > 0)
+		{
+			elog(INFO, "Trash directory \"%s\" is purged in background by process %d",
+				 trash_dir, (int) pid);
+			return;
+		}
+
+		elog(WARNING, "Cannot start trash purge process: %s", strerror(errno));
+	}
+#endif
+
+	purge_trash_worker(trash_dir);
+}
+
+static void *
+purge_trash_worker(void *arg)
+{
+	const char *trash_dir = (const char *) arg;
+	parray	   *files = parray_new();
+
+	dir_list_file(files, trash_dir, false, false, false, 0, FIO_BACKUP_HOST);
+	delete_file_list(files);
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+
+	elog(LOG, "Trash directory \"%s\" is purged", trash_dir);
+
+	return NULL;
+}
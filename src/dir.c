@@ -124,9 +124,10 @@ typedef struct TablespaceCreatedList
 static int pgCompareString(const void *str1, const void *str2);
 
 static char dir_check_file(pgFile *file);
-static void dir_list_file_internal(parray *files, pgFile *parent, bool exclude,
+static void dir_list_file_internal(const char *path, const char *rel_path,
 								   bool follow_symlink,
-								   int external_dir_num, fio_location location);
+								   int external_dir_num, fio_location location,
+								   dir_list_callback callback, void *arg);
 static void opt_path_map(ConfigOption *opt, const char *arg,
 						 TablespaceList *list, const char *type);
 
@@ -401,6 +402,8 @@ pgFileFree(void *file)
 	if (file_ptr->forkName)
 		free(file_ptr->forkName);
 
+	pagemap_free(&file_ptr->pagemap);
+
 	pfree(file_ptr->path);
 	pfree(file_ptr->rel_path);
 	pfree(file);
@@ -566,6 +569,163 @@ db_map_entry_free(void *entry)
 	free(entry);
 }
 
+#define CHECK_FALSE				0
+#define CHECK_TRUE				1
+#define CHECK_EXCLUDE_FALSE		2
+
+typedef struct
+{
+	parray	   *files;
+	const char *root;
+	bool		exclude;
+	int			external_dir_num;
+	/* used by the agent to pass entries to FIO_LIST_TREE */
+	dir_list_callback send;
+	void	   *send_arg;
+} dir_list_context;
+
+/*
+ * Add entry found by dir_list_file_internal() into context->files,
+ * skipping hidden and excluded files. Returns true if the directory
+ * content should be listed.
+ */
+static bool
+dir_list_add(pgFile *file, void *arg)
+{
+	dir_list_context *context = (dir_list_context *) arg;
+	char		check_res;
+
+	/* skip hidden files and directories */
+	if (file->name[0] == '.')
+	{
+		elog(WARNING, "Skip hidden file: '%s'", file->path);
+		pgFileFree(file);
+		return false;
+	}
+
+	/*
+	 * Add only files, directories and links. Skip sockets and other
+	 * unexpected file formats.
+	 */
+	if (!S_ISDIR(file->mode) && !S_ISREG(file->mode))
+	{
+		elog(WARNING, "Skip '%s': unexpected file format", file->path);
+		pgFileFree(file);
+		return false;
+	}
+
+	if (context->exclude)
+	{
+		check_res = dir_check_file(file);
+		if (check_res == CHECK_FALSE)
+		{
+			/* Skip */
+			pgFileFree(file);
+			return false;
+		}
+		else if (check_res == CHECK_EXCLUDE_FALSE)
+		{
+			/* We add the directory itself which content was excluded */
+			parray_append(context->files, file);
+			return false;
+		}
+	}
+
+	parray_append(context->files, file);
+	return true;
+}
+
+/* Add entry of remote tree received from the agent */
+static void
+dir_list_remote_entry(const char *rel_path, mode_t mode, int64 size,
+					  time_t mtime, void *arg)
+{
+	dir_list_context *context = (dir_list_context *) arg;
+	char		path[MAXPGPATH];
+	pgFile	   *file;
+
+	join_path_components(path, context->root, rel_path);
+
+	file = pgFileInit(path, rel_path);
+	file->size = size;
+	file->mode = mode;
+	file->mtime = mtime;
+	file->external_dir_num = context->external_dir_num;
+
+	/* Repeat the checks to report skipped files and fill in file flags */
+	dir_list_add(file, context);
+}
+
+/*
+ * Agent side of dir_list_add(). Excluded files are dropped right here,
+ * so they are not sent at all. Hidden files and files of unexpected format
+ * are sent, so that the client could report them, but are not descended into.
+ */
+static bool
+dir_list_send(pgFile *file, void *arg)
+{
+	dir_list_context *context = (dir_list_context *) arg;
+	bool		descend = true;
+
+	if (file->name[0] == '.' || (!S_ISDIR(file->mode) && !S_ISREG(file->mode)))
+		descend = false;
+	else if (context->exclude)
+	{
+		char		check_res = dir_check_file(file);
+
+		if (check_res == CHECK_FALSE)
+		{
+			pgFileFree(file);
+			return false;
+		}
+		else if (check_res == CHECK_EXCLUDE_FALSE)
+			descend = false;
+	}
+
+	context->send(file, context->send_arg);
+	pgFileFree(file);
+	return descend;
+}
+
+/*
+ * Walk directory tree "root" on behalf of the client of FIO_LIST_TREE,
+ * passing every entry to be listed to "send".
+ */
+void
+dir_list_tree(const char *root, bool exclude, bool follow_symlink,
+			  dir_list_callback send, void *send_arg)
+{
+	dir_list_context context;
+
+	context.files = NULL;
+	context.root = root;
+	context.exclude = exclude;
+	context.external_dir_num = 0;
+	context.send = send;
+	context.send_arg = send_arg;
+
+	dir_list_file_internal(root, "", follow_symlink, 0, FIO_LOCAL_HOST,
+						   dir_list_send, &context);
+}
+
+/*
+ * Add or remove PG_LOG_DIR in the last slot of pgdata_exclude_dir.
+ * The agent calls it for every FIO_LIST_TREE request, because it does not
+ * know about --backup-pg-log of the client.
+ */
+void
+set_pg_log_exclusion(bool exclude)
+{
+	int			i;
+
+	/* find first empty slot or pg_log set earlier */
+	for (i = 0; pgdata_exclude_dir[i]; i++)
+		if (strcmp(pgdata_exclude_dir[i], PG_LOG_DIR) == 0)
+			break;
+
+	pgdata_exclude_dir[i] = exclude ? PG_LOG_DIR : NULL;
+}
+
 /*
  * List files, symbolic links and directories in the directory "root" and add
  * pgFile objects to "files".  We add "root" to "files" if add_root is true.
@@ -578,6 +738,7 @@ dir_list_file(parray *files, const char *root, bool exclude, bool follow_symlink
 			  bool add_root, int external_dir_num, fio_location location)
 {
 	pgFile	   *file;
+	dir_list_context context;
 
 	file = pgFileNew(root, "", follow_symlink, external_dir_num, location);
 	if (file == NULL)
@@ -601,17 +762,24 @@ dir_list_file(parray *files, const char *root, bool exclude, bool follow_symlink
 	if (add_root)
 		parray_append(files, file);
 
-	dir_list_file_internal(files, file, exclude, follow_symlink,
-						   external_dir_num, location);
+	context.files = files;
+	context.root = file->path;
+	context.exclude = exclude;
+	context.external_dir_num = external_dir_num;
+
+	/* Remote tree is walked by the agent, which sends us only what we need */
+	if (fio_is_remote(location))
+		fio_list_tree(file->path, exclude, follow_symlink, exclusive_backup,
+					  backup_logs, dir_list_remote_entry, &context, location);
+	else
+		dir_list_file_internal(file->path, file->rel_path, follow_symlink,
+							   external_dir_num, location,
+							   dir_list_add, &context);
 
 	if (!add_root)
 		pgFileFree(file);
 }
 
-#define CHECK_FALSE				0
-#define CHECK_TRUE				1
-#define CHECK_EXCLUDE_FALSE		2
-
 /*
  * Check file or directory.
  *
@@ -815,23 +983,21 @@ dir_check_file(pgFile *file)
 }
 
 /*
- * List files in parent->path directory.  If "exclude" is true do not add into
- * "files" files from pgdata_exclude_files and directories from
- * pgdata_exclude_dir.
+ * List files in "path" directory. Every entry is passed to "callback", which
+ * takes ownership of it and returns true if the directory content should be
+ * listed too.
  */
 static void
-dir_list_file_internal(parray *files, pgFile *parent, bool exclude,
+dir_list_file_internal(const char *path, const char *rel_path,
 					   bool follow_symlink,
-					   int external_dir_num, fio_location location)
+					   int external_dir_num, fio_location location,
+					   dir_list_callback callback, void *arg)
 {
 	DIR			  *dir;
 	struct dirent *dent;
 
-	if (!S_ISDIR(parent->mode))
-		elog(ERROR, "\"%s\" is not a directory", parent->path);
-
 	/* Open directory and list contents */
-	dir = fio_opendir(parent->path, location);
+	dir = fio_opendir(path, location);
 	if (dir == NULL)
 	{
 		if (errno == ENOENT)
@@ -840,7 +1006,7 @@ dir_list_file_internal(parray *files, pgFile *parent, bool exclude,
 			return;
 		}
 		elog(ERROR, "Cannot open directory \"%s\": %s",
-			 parent->path, strerror(errno));
+			 path, strerror(errno));
 	}
 
 	errno = 0;
@@ -849,10 +1015,10 @@ dir_list_file_internal(parray *files, pgFile *parent, bool exclude,
 		pgFile	   *file;
 		char		child[MAXPGPATH];
 		char		rel_child[MAXPGPATH];
-		char		check_res;
+		bool		is_dir;
 
-		join_path_components(child, parent->path, dent->d_name);
-		join_path_components(rel_child, parent->rel_path, dent->d_name);
+		join_path_components(child, path, dent->d_name);
+		join_path_components(rel_child, rel_path, dent->d_name);
 
 		file = pgFileNew(child, rel_child, follow_symlink, external_dir_num,
 						 location);
@@ -867,51 +1033,15 @@ dir_list_file_internal(parray *files, pgFile *parent, bool exclude,
 			continue;
 		}
 
-		/* skip hidden files and directories */
-		if (file->name[0] == '.')
-		{
-			elog(WARNING, "Skip hidden file: '%s'", file->path);
-			pgFileFree(file);
-			continue;
-		}
-
-		/*
-		 * Add only files, directories and links. Skip sockets and other
-		 * unexpected file formats.
-		 */
-		if (!S_ISDIR(file->mode) && !S_ISREG(file->mode))
-		{
-			elog(WARNING, "Skip '%s': unexpected file format", file->path);
-			pgFileFree(file);
-			continue;
-		}
-
-		if (exclude)
-		{
-			check_res = dir_check_file(file);
-			if (check_res == CHECK_FALSE)
-			{
-				/* Skip */
-				pgFileFree(file);
-				continue;
-			}
-			else if (check_res == CHECK_EXCLUDE_FALSE)
-			{
-				/* We add the directory itself which content was excluded */
-				parray_append(files, file);
-				continue;
-			}
-		}
-
-		parray_append(files, file);
+		is_dir = S_ISDIR(file->mode);
 
 		/*
 		 * If the entry is a directory call dir_list_file_internal()
 		 * recursively.
 		 */
-		if (S_ISDIR(file->mode))
-			dir_list_file_internal(files, file, exclude, follow_symlink,
-								   external_dir_num, location);
+		if (callback(file, arg) && is_dir)
+			dir_list_file_internal(child, rel_child, follow_symlink,
+								   external_dir_num, location, callback, arg);
 	}
 
 	if (errno && errno != ENOENT)
@@ -919,7 +1049,7 @@ dir_list_file_internal(parray *files, pgFile *parent, bool exclude,
 		int			errno_tmp = errno;
 		fio_closedir(dir);
 		elog(ERROR, "Cannot read directory \"%s\": %s",
-			 parent->path, strerror(errno_tmp));
+			 path, strerror(errno_tmp));
 	}
 	fio_closedir(dir);
 }
@@ -1041,6 +1171,9 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 	parray		*links = NULL;
 	mode_t		pg_tablespace_mode = DIR_PERMISSION;
 	char		to_path[MAXPGPATH];
+	char	  **dir_paths;
+	int		   *dir_modes;
+	int			n_dirs = 0;
 
 	/* get tablespace map */
 	if (extract_tablespaces)
@@ -1094,6 +1227,10 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 
 	elog(LOG, "Restore directories and symlinks...");
 
+	/* Directories are created all at once after the loop */
+	dir_paths = pgut_newarray(char *, parray_num(dest_files));
+	dir_modes = pgut_newarray(int, parray_num(dest_files));
+
 	/* create directories */
 	for (i = 0; i < parray_num(dest_files); i++)
 	{
@@ -1136,6 +1273,14 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 					elog(VERBOSE, "Create directory \"%s\" and symbolic link \"%s\"",
 							 linked_path, to_path);
 
+					/*
+					 * pg_tblspc itself may be still waiting in the batch,
+					 * it must exist before the link is created in it.
+					 */
+					fio_mkdirs((char const* const*) dir_paths, dir_modes, n_dirs, location);
+					while (n_dirs > 0)
+						pfree(dir_paths[--n_dirs]);
+
 					/* create tablespace directory */
 					fio_mkdir(linked_path, pg_tablespace_mode, location);
 
@@ -1153,9 +1298,23 @@ create_data_directories(parray *dest_files, const char *data_dir, const char *ba
 		elog(VERBOSE, "Create directory \"%s\"", dir->rel_path);
 
 		join_path_components(to_path, data_dir, dir->rel_path);
-		fio_mkdir(to_path, dir->mode, location);
+		dir_paths[n_dirs] = pgut_strdup(to_path);
+		dir_modes[n_dirs] = dir->mode;
+		n_dirs++;
 	}
 
+	/*
+	 * Create the rest in a single round trip for remote location. Symbolic
+	 * links are already requested, so directories inside tablespaces will be
+	 * created in place.
+	 */
+	fio_mkdirs((char const* const*) dir_paths, dir_modes, n_dirs, location);
+
+	for (i = 0; i < n_dirs; i++)
+		pfree(dir_paths[i]);
+	pfree(dir_paths);
+	pfree(dir_modes);
+
 	if (extract_tablespaces)
 	{
 		parray_walk(links, pgFileFree);
@@ -1513,6 +1672,20 @@ bad_format:
 parray *
 dir_read_file_list(const char *root, const char *external_prefix,
 				   const char *file_txt, fio_location location)
+{
+	return dir_read_file_list_filtered(root, external_prefix, file_txt,
+									   location, NULL, NULL);
+}
+
+/*
+ * Same as dir_read_file_list(), but entries for which filter returns
+ * false are discarded as soon as they are parsed, so memory is only
+ * spent on entries the caller is interested in.
+ */
+parray *
+dir_read_file_list_filtered(const char *root, const char *external_prefix,
+							const char *file_txt, fio_location location,
+							pgFileFilter filter, void *filter_arg)
 {
 	FILE   *fp;
 	parray *files;
@@ -1595,6 +1768,12 @@ dir_read_file_list(const char *root, const char *external_prefix,
 		if (get_control_value(buf, "n_blocks", NULL, &n_blocks, false))
 			file->n_blocks = (int) n_blocks;
 
+		if (filter && !filter(file, filter_arg))
+		{
+			pgFileFree(file);
+			continue;
+		}
+
 		parray_append(files, file);
 	}
 
@@ -23,6 +23,7 @@ static void help_add_instance(void);
 static void help_del_instance(void);
 static void help_archive_push(void);
 static void help_archive_get(void);
+static void help_archive_pack(void);
 static void help_checkdb(void);
 
 void
@@ -56,6 +57,8 @@ help_command(char *command)
 		help_archive_push();
 	else if (strcmp(command, "archive-get") == 0)
 		help_archive_get();
+	else if (strcmp(command, "archive-pack") == 0)
+		help_archive_pack();
 	else if (strcmp(command, "checkdb") == 0)
 		help_checkdb();
 	else if (strcmp(command, "--help") == 0
@@ -96,11 +99,11 @@ help_pg_probackup(void)
 	printf(_("                 [--wal-depth=wal-depth]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
-	printf(_("                 [--archive-timeout=timeout]\n"));
+	printf(_("                 [--archive-timeout=timeout] [--archive-state-cache]\n"));
 	printf(_("                 [-d dbname] [-h host] [-p port] [-U username]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
 	printf(_("                 [--restore-command=cmdline] [--archive-host=destination]\n"));
 	printf(_("                 [--archive-port=port] [--archive-user=username]\n"));
 	printf(_("                 [--help]\n"));
@@ -140,7 +143,7 @@ help_pg_probackup(void)
 	printf(_("                 [-w --no-password] [-W --password]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
 	printf(_("                 [--ttl=interval] [--expire-time=timestamp] [--note=text]\n"));
 	printf(_("                 [--help]\n"));
 
@@ -160,11 +163,11 @@ help_pg_probackup(void)
 	printf(_("                 [-T OLDDIR=NEWDIR] [--progress]\n"));
 	printf(_("                 [--external-mapping=OLDDIR=NEWDIR]\n"));
 	printf(_("                 [--skip-external-dirs] [--restore-command=cmdline]\n"));
-	printf(_("                 [--no-sync]\n"));
+	printf(_("                 [--no-sync] [--stage-wal] [--remote-apply]\n"));
 	printf(_("                 [--db-include | --db-exclude]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
 	printf(_("                 [--archive-host=hostname]\n"));
 	printf(_("                 [--archive-port=port] [--archive-user=username]\n"));
 	printf(_("                 [--help]\n"));
@@ -195,7 +198,7 @@ help_pg_probackup(void)
 	printf(_("                 [--retention-window=retention-window]\n"));
 	printf(_("                 [--wal-depth=wal-depth]\n"));
 	printf(_("                 [-i backup-id | --delete-expired | --merge-expired | --status=backup_status]\n"));
-	printf(_("                 [--delete-wal]\n"));
+	printf(_("                 [--delete-wal] [--trash]\n"));
 	printf(_("                 [--dry-run]\n"));
 	printf(_("                 [--help]\n"));
 
@@ -208,7 +211,7 @@ help_pg_probackup(void)
 	printf(_("                 [--external-dirs=external-directories-paths]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
 	printf(_("                 [--help]\n"));
 
 	printf(_("\n  %s del-instance -B backup-path\n"), PROGRAM_NAME);
@@ -220,22 +223,27 @@ help_pg_probackup(void)
 	printf(_("                 [-j num-threads] [--batch-size=batch_size]\n"));
 	printf(_("                 [--archive-timeout=timeout]\n"));
 	printf(_("                 [--no-ready-rename] [--no-sync]\n"));
-	printf(_("                 [--overwrite] [--compress]\n"));
+	printf(_("                 [--overwrite] [--compress] [--block-summary]\n"));
+	printf(_("                 [--recovery-index] [--daemon] [--socket=path]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
 	printf(_("                 [--help]\n"));
 
 	printf(_("\n  %s archive-get -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 --wal-file-path=wal-file-path\n"));
 	printf(_("                 --wal-file-name=wal-file-name\n"));
 	printf(_("                 [-j num-threads] [--batch-size=batch_size]\n"));
-	printf(_("                 [--no-validate-wal]\n"));
+	printf(_("                 [--no-validate-wal] [--async-prefetch]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
+	printf(_("                 [--help]\n"));
+
+	printf(_("\n  %s archive-pack -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
+	printf(_("                 [--pack-size=pack_size] [--no-sync]\n"));
 	printf(_("                 [--help]\n"));
 
 	if ((PROGRAM_URL || PROGRAM_EMAIL))
@@ -285,7 +293,7 @@ help_backup(void)
 	printf(_("                 [-w --no-password] [-W --password]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
 	printf(_("                 [--ttl=interval] [--expire-time=timestamp] [--note=text]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
@@ -359,6 +367,8 @@ help_backup(void)
 
 	printf(_("\n  Archive options:\n"));
 	printf(_("      --archive-timeout=timeout    wait timeout for WAL segment archiving (default: 5min)\n"));
+	printf(_("      --archive-state-cache        cache listing of WAL archive, do not use if WAL is\n"));
+	printf(_("                                   delivered into archive by other tools\n"));
 
 	printf(_("\n  Connection options:\n"));
 	printf(_("  -U, --pguser=USERNAME            user name to connect as (default: current local user)\n"));
@@ -370,7 +380,7 @@ help_backup(void)
 
 	printf(_("\n  Remote options:\n"));
 	printf(_("      --remote-proto=protocol      remote protocol to use\n"));
-	printf(_("                                   available options: 'ssh', 'none' (default: ssh)\n"));
+	printf(_("                                   available options: 'ssh', 'tcp', 'none' (default: ssh)\n"));
 	printf(_("      --remote-host=destination    remote host address or hostname\n"));
 	printf(_("      --remote-port=port           remote host port (default: 22)\n"));
 	printf(_("      --remote-path=path           path to directory with pg_probackup binary on remote host\n"));
@@ -378,6 +388,7 @@ help_backup(void)
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
 	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress            compress data sent between pg_probackup and remote agent\n"));
 
 	printf(_("\n  Replica options:\n"));
 	printf(_("      --master-user=user_name      user name to connect to master (deprecated)\n"));
@@ -404,11 +415,11 @@ help_restore(void)
 	printf(_("                 [--recovery-target=immediate|latest]\n"));
 	printf(_("                 [--recovery-target-name=target-name]\n"));
 	printf(_("                 [--recovery-target-action=pause|promote|shutdown]\n"));
-	printf(_("                 [--restore-command=cmdline]\n"));
-	printf(_("                 [-R | --restore-as-replica]\n"));
+	printf(_("                 [--restore-command=cmdline] [--stage-wal]\n"));
+	printf(_("                 [-R | --restore-as-replica] [--remote-apply]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n"));
 	printf(_("                 [--archive-host=hostname] [--archive-port=port]\n"));
 	printf(_("                 [--archive-user=username]\n\n"));
 
@@ -451,6 +462,7 @@ help_restore(void)
 	printf(_("                                   action the server should take once the recovery target is reached\n"));
 	printf(_("                                   (default: pause)\n"));
 	printf(_("      --restore-command=cmdline    command to use as 'restore_command' in recovery.conf; 'none' disables\n"));
+	printf(_("      --stage-wal                  copy WAL required for recovery into restored pg_wal\n"));
 
 	printf(_("\n  Standby options:\n"));
 	printf(_("  -R, --restore-as-replica         write a minimal recovery.conf in the output directory\n"));
@@ -483,7 +495,7 @@ help_restore(void)
 
 	printf(_("\n  Remote options:\n"));
 	printf(_("      --remote-proto=protocol      remote protocol to use\n"));
-	printf(_("                                   available options: 'ssh', 'none' (default: ssh)\n"));
+	printf(_("                                   available options: 'ssh', 'tcp', 'none' (default: ssh)\n"));
 	printf(_("      --remote-host=destination    remote host address or hostname\n"));
 	printf(_("      --remote-port=port           remote host port (default: 22)\n"));
 	printf(_("      --remote-path=path           path to directory with pg_probackup binary on remote host\n"));
@@ -491,6 +503,9 @@ help_restore(void)
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
 	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress            compress data sent between pg_probackup and remote agent\n"));
+	printf(_("      --remote-apply               send backup data files as is and restore their pages\n"));
+	printf(_("                                   on remote host\n"));
 
 	printf(_("\n  Remote WAL archive options:\n"));
 	printf(_("      --archive-host=destination   address or hostname for ssh connection to archive host\n"));
@@ -619,7 +634,7 @@ help_delete(void)
 {
 	printf(_("\n%s delete -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
 	printf(_("                 [-i backup-id | --delete-expired | --merge-expired] [--delete-wal]\n"));
-	printf(_("                 [-j num-threads] [--progress]\n"));
+	printf(_("                 [-j num-threads] [--progress] [--trash]\n"));
 	printf(_("                 [--retention-redundancy=retention-redundancy]\n"));
 	printf(_("                 [--retention-window=retention-window]\n"));
 	printf(_("                 [--wal-depth=wal-depth]\n\n"));
@@ -629,6 +644,8 @@ help_delete(void)
 	printf(_("  -i, --backup-id=backup-id        backup to delete\n"));
 	printf(_("  -j, --threads=NUM                number of parallel threads\n"));
 	printf(_("      --progress                   show progress\n"));
+	printf(_("      --trash                      move deleted backups into trash directory\n"));
+	printf(_("                                   and remove their files in background\n"));
 
 	printf(_("\n  Retention options:\n"));
 	printf(_("      --delete-expired             delete backups expired according to current\n"));
@@ -744,11 +761,11 @@ help_set_config(void)
 	printf(_("                 [--wal-depth=wal-depth]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
-	printf(_("                 [--archive-timeout=timeout]\n"));
+	printf(_("                 [--archive-timeout=timeout] [--archive-state-cache]\n"));
 	printf(_("                 [-d dbname] [-h host] [-p port] [-U username]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
 	printf(_("      --instance=instance_name     name of the instance\n"));
@@ -805,7 +822,7 @@ help_set_config(void)
 
 	printf(_("\n  Remote options:\n"));
 	printf(_("      --remote-proto=protocol      remote protocol to use\n"));
-	printf(_("                                   available options: 'ssh', 'none' (default: ssh)\n"));
+	printf(_("                                   available options: 'ssh', 'tcp', 'none' (default: ssh)\n"));
 	printf(_("      --remote-host=destination    remote host address or hostname\n"));
 	printf(_("      --remote-port=port           remote host port (default: 22)\n"));
 	printf(_("      --remote-path=path           path to directory with pg_probackup binary on remote host\n"));
@@ -813,6 +830,7 @@ help_set_config(void)
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
 	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress            compress data sent between pg_probackup and remote agent\n"));
 
 	printf(_("\n  Remote WAL archive options:\n"));
 	printf(_("      --archive-host=destination   address or hostname for ssh connection to archive host\n"));
@@ -846,7 +864,7 @@ help_add_instance(void)
 	printf(_("                 [-E external-directory-path]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
 	printf(_("  -D, --pgdata=pgdata-path         location of the database storage area\n"));
@@ -857,14 +875,15 @@ help_add_instance(void)
 	printf(_("                                   (example: --external-dirs=/tmp/dir1:/tmp/dir2)\n"));
 	printf(_("\n  Remote options:\n"));
 	printf(_("      --remote-proto=protocol      remote protocol to use\n"));
-	printf(_("                                   available options: 'ssh', 'none' (default: ssh)\n"));
+	printf(_("                                   available options: 'ssh', 'tcp', 'none' (default: ssh)\n"));
 	printf(_("      --remote-host=destination    remote host address or hostname\n"));
 	printf(_("      --remote-port=port           remote host port (default: 22)\n"));
 	printf(_("      --remote-path=path           path to directory with pg_probackup binary on remote host\n"));
 	printf(_("                                   (default: current binary path)\n"));
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
-	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n\n"));
+	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress            compress data sent between pg_probackup and remote agent\n\n"));
 }
 
 static void
@@ -884,12 +903,13 @@ help_archive_push(void)
 	printf(_("                 [-j num-threads] [--batch-size=batch_size]\n"));
 	printf(_("                 [--archive-timeout=timeout]\n"));
 	printf(_("                 [--no-ready-rename] [--no-sync]\n"));
-	printf(_("                 [--overwrite] [--compress]\n"));
+	printf(_("                 [--overwrite] [--compress] [--block-summary]\n"));
+	printf(_("                 [--recovery-index] [--daemon] [--socket=path]\n"));
 	printf(_("                 [--compress-algorithm=compress-algorithm]\n"));
 	printf(_("                 [--compress-level=compress-level]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
 	printf(_("      --instance=instance_name     name of the instance to delete\n"));
@@ -901,6 +921,10 @@ help_archive_push(void)
 	printf(_("      --no-ready-rename            do not rename '.ready' files in 'archive_status' directory\n"));
 	printf(_("      --no-sync                    do not sync WAL file to disk\n"));
 	printf(_("      --overwrite                  overwrite archived WAL file\n"));
+	printf(_("      --block-summary              write summary of changed blocks to speed up PAGE backups\n"));
+	printf(_("      --recovery-index             write index of recovery targets to speed up validation\n"));
+	printf(_("      --daemon                     run as a daemon, pushing WAL files requested via --socket\n"));
+	printf(_("      --socket=path                UNIX socket of archive-push daemon\n"));
 
 	printf(_("\n  Compression options:\n"));
 	printf(_("      --compress                   alias for --compress-algorithm='zlib' and --compress-level=1\n"));
@@ -911,14 +935,15 @@ help_archive_push(void)
 
 	printf(_("\n  Remote options:\n"));
 	printf(_("      --remote-proto=protocol      remote protocol to use\n"));
-	printf(_("                                   available options: 'ssh', 'none' (default: ssh)\n"));
+	printf(_("                                   available options: 'ssh', 'tcp', 'none' (default: ssh)\n"));
 	printf(_("      --remote-host=hostname       remote host address or hostname\n"));
 	printf(_("      --remote-port=port           remote host port (default: 22)\n"));
 	printf(_("      --remote-path=path           path to directory with pg_probackup binary on remote host\n"));
 	printf(_("                                   (default: current binary path)\n"));
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
-	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n\n"));
+	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress            compress data sent between pg_probackup and remote agent\n\n"));
 }
 
 static void
@@ -928,10 +953,10 @@ help_archive_get(void)
 	printf(_("                 --wal-file-path=wal-file-path\n"));
 	printf(_("                 --wal-file-name=wal-file-name\n"));
 	printf(_("                 [-j num-threads] [--batch-size=batch_size]\n"));
-	printf(_("                 [--no-validate-wal]\n"));
+	printf(_("                 [--no-validate-wal] [--async-prefetch]\n"));
 	printf(_("                 [--remote-proto] [--remote-host]\n"));
 	printf(_("                 [--remote-port] [--remote-path] [--remote-user]\n"));
-	printf(_("                 [--ssh-options]\n\n"));
+	printf(_("                 [--ssh-options] [--remote-compress]\n\n"));
 
 	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
 	printf(_("      --instance=instance_name     name of the instance to delete\n"));
@@ -943,15 +968,29 @@ help_archive_get(void)
 	printf(_("      --batch-size=NUM             number of files to be prefetched\n"));
 	printf(_("      --prefetch-dir=path          location of the store area for prefetched WAL files\n"));
 	printf(_("      --no-validate-wal            skip validation of prefetched WAL file before using it\n"));
+	printf(_("      --async-prefetch             prefetch WAL files by background worker\n"));
 
 	printf(_("\n  Remote options:\n"));
 	printf(_("      --remote-proto=protocol      remote protocol to use\n"));
-	printf(_("                                   available options: 'ssh', 'none' (default: ssh)\n"));
+	printf(_("                                   available options: 'ssh', 'tcp', 'none' (default: ssh)\n"));
 	printf(_("      --remote-host=hostname       remote host address or hostname\n"));
 	printf(_("      --remote-port=port           remote host port (default: 22)\n"));
 	printf(_("      --remote-path=path           path to directory with pg_probackup binary on remote host\n"));
 	printf(_("                                   (default: current binary path)\n"));
 	printf(_("      --remote-user=username       user name for ssh connection (default: current user)\n"));
 	printf(_("      --ssh-options=ssh_options    additional ssh options (default: none)\n"));
-	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n\n"));
+	printf(_("                                   (example: --ssh-options='-c cipher_spec -F configfile')\n"));
+	printf(_("      --remote-compress            compress data sent between pg_probackup and remote agent\n\n"));
+}
+
+static void
+help_archive_pack(void)
+{
+	printf(_("\n%s archive-pack -B backup-path --instance=instance_name\n"), PROGRAM_NAME);
+	printf(_("                 [--pack-size=pack_size] [--no-sync]\n\n"));
+
+	printf(_("  -B, --backup-path=backup-path    location of the backup storage area\n"));
+	printf(_("      --instance=instance_name     name of the instance\n"));
+	printf(_("      --pack-size=NUM              number of WAL segments in pack file (default: 64)\n"));
+	printf(_("      --no-sync                    do not sync pack files to disk\n\n"));
 }
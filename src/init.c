@@ -119,6 +119,8 @@ do_add_instance(InstanceConfig *instance)
 				   SOURCE_DEFAULT);
 	config_set_opt(instance_options, &instance_config.remote.ssh_config,
 				   SOURCE_DEFAULT);
+	config_set_opt(instance_options, &instance_config.remote.compress,
+				   SOURCE_DEFAULT);
 
 	/* pgdata was set through command line */
 	do_set_config(true);
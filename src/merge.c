@@ -1156,7 +1156,7 @@ merge_data_file(parray *parent_chain, pgBackup *full_backup,
 	setvbuf(out, buffer, _IOFBF, STDIO_BUFSIZE);
 
 	/* restore file into temp file */
-	tmp_file->size = restore_data_file(parent_chain, dest_file, out, to_fullpath_tmp1);
+	tmp_file->size = restore_data_file(parent_chain, dest_file, out, to_fullpath_tmp1, false);
 	fclose(out);
 	pg_free(buffer);
 
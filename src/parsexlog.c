@@ -94,6 +94,57 @@ typedef struct XLogRecTarget
 	XLogRecPtr	rec_lsn;
 } XLogRecTarget;
 
+/* Result of WAL segment opening */
+typedef enum WalSegmentStatus
+{
+	WAL_SEGMENT_ABSENT = 0,
+	WAL_SEGMENT_OPEN_FAILED,
+	WAL_SEGMENT_OPENED
+} WalSegmentStatus;
+
+/* Segment data is read and inflated by chunks, multiple of XLOG_BLCKSZ */
+#define WAL_SEGMENT_CHUNK	(1024 * 1024)
+
+/*
+ * Opened WAL segment, either a file or a member of pack file.
+ * Segments taken from read-ahead are served from the ring of chunks filled
+ * by a loader thread. Otherwise segment data is read or inflated by
+ * WAL_SEGMENT_CHUNK bytes into a window, and inflating starts over if an
+ * earlier chunk is requested, so memory used by a segment doesn't depend
+ * on its size.
+ */
+typedef struct WalSegment
+{
+	XLogSegNo	segno;
+	WalSegmentStatus status;
+	bool		compressed;
+	char		path[MAXPGPATH];	/* path of the segment or pack file */
+
+	int			fd;
+	uint64		file_offset;	/* offset of segment data in the file */
+	uint64		file_size;		/* size of segment data in the file */
+	uint64		file_pos;		/* current position of fd */
+
+	char	   *buf;			/* window of segment data */
+	uint32		buf_start;		/* offset of the window in the segment */
+	uint32		buf_len;		/* number of bytes in the window */
+
+#ifdef HAVE_LIBZ
+	z_stream	z;
+	bool		z_active;		/* z is initialized */
+	bool		z_end;			/* end of compressed stream is reached */
+	uint64		in_off;			/* offset of next input chunk in segment data */
+	uint64		out_off;		/* offset of next inflated byte */
+	char	   *in_buf;
+#endif
+
+	/* read-ahead slot which holds segment data, if any */
+	struct WalReadAheadSlot *slot;
+
+	/* reason why segment cannot be opened or is shorter than expected */
+	char		errmsg[256];
+} WalSegment;
+
 typedef struct XLogReaderData
 {
 	int			thread_num;
@@ -103,20 +154,129 @@ typedef struct XLogReaderData
 	XLogSegNo	xlogsegno;
 	bool		xlogexists;
 
-	char		 page_buf[XLOG_BLCKSZ];
 	uint32		 prev_page_off;
 
 	bool		need_switch;
 
-	int			xlogfile;
+	/* currently opened segment */
+	WalSegment	seg;
 	char		xlogpath[MAXPGPATH];
-
-#ifdef HAVE_LIBZ
-	gzFile		 gz_xlogfile;
-	char		 gz_xlogpath[MAXPGPATH];
-#endif
 } XLogReaderData;
 
+/*
+ * Block-change summary of WAL segment.
+ *
+ * "archive-push --block-summary" writes it into the archive next to the
+ * segment as "<segment>.bsum". It contains blocks referenced by all WAL
+ * records starting in [start_lsn, end_lsn), so extractPageMap() can use it
+ * instead of parsing the segment. Record crossing the segment end belongs to
+ * the summary of the next segment, which starts reading at end_lsn of the
+ * previous summary if it exists, otherwise at the first record starting in
+ * the segment.
+ *
+ * The file consists of BlockSummaryHeader followed by nentries of
+ * BlockSummaryEntryHeader, each followed by serialized pagemap of blocks.
+ * The summary is used only if wal_crc matches the checksum file of the
+ * archived segment, see wal_sidecar_is_current().
+ */
+#define BLOCK_SUMMARY_MAGIC		0x4D555342	/* "BSUM" */
+#define BLOCK_SUMMARY_VERSION	2
+
+typedef struct BlockSummaryHeader
+{
+	uint32		magic;
+	uint32		version;
+	TimeLineID	tli;
+	uint32		nentries;
+	XLogRecPtr	start_lsn;
+	XLogRecPtr	end_lsn;
+	pg_crc32	wal_crc;	/* CRC-32C of the summarized segment */
+	uint32		size;		/* size of data following the header */
+	pg_crc32	crc;		/* CRC-32C of data following the header */
+} BlockSummaryHeader;
+
+typedef struct BlockSummaryEntryHeader
+{
+	Oid			spcNode;
+	Oid			dbNode;
+	Oid			relNode;
+	int32		forknum;
+	uint32		size;		/* size of serialized pagemap */
+} BlockSummaryEntryHeader;
+
+/* Blocks of relation fork collected while building summary */
+typedef struct BlockSummaryEntry
+{
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	pagemap_t	pagemap;
+} BlockSummaryEntry;
+
+/* Private data of XLogReaderState used to build summary */
+typedef struct BlockSummaryReader
+{
+	const char *pg_xlog_dir;
+	TimeLineID	tli;
+	uint32		seg_size;
+	XLogSegNo	segno;		/* segment to build summary for */
+	WalSegment	segs[2];	/* previous and summarized segments */
+	bool		loaded[2];
+	bool		crossed;	/* reader needed the next segment */
+} BlockSummaryReader;
+
+/*
+ * Recovery target index of WAL segment.
+ *
+ * It lists restore points created by WAL records starting in
+ * [start_lsn, end_lsn) along with ranges of timestamps and xids of these
+ * records. find_restore_point() uses it to translate recovery_target_name
+ * into LSN, and validate_wal() uses it to find the segment, where recovery
+ * target is reached, so only that segment is decoded instead of all WAL
+ * following the backup. Only "archive-push --recovery-index" writes it into
+ * the archive next to the segment as "<segment>.ridx", covering the same
+ * range as block summary does, and it is used only if wal_crc matches the
+ * checksum file of the archived segment, see wal_sidecar_is_current().
+ *
+ * The file consists of RecoveryIndexHeader followed by nrestore_points of
+ * RecoveryIndexRestorePoint.
+ */
+#define RECOVERY_INDEX_MAGIC	0x58444952	/* "RIDX" */
+#define RECOVERY_INDEX_VERSION	3
+
+typedef struct RecoveryIndexHeader
+{
+	uint32		magic;
+	uint32		version;
+	TimeLineID	tli;
+	uint32		nrestore_points;
+	XLogRecPtr	start_lsn;
+	XLogRecPtr	end_lsn;
+	TimestampTz	min_time;	/* timestamps of commit, abort and restore */
+	TimestampTz	max_time;	/* point records, 0 if there are none */
+	TransactionId min_xid;	/* xids of records, invalid if there are none */
+	TransactionId max_xid;
+	pg_crc32	wal_crc;	/* CRC-32C of the indexed segment */
+	pg_crc32	crc;		/* CRC-32C of the header up to crc and
+							 * restore points */
+} RecoveryIndexHeader;
+
+typedef struct RecoveryIndexRestorePoint
+{
+	XLogRecPtr	lsn;
+	TimestampTz	time;
+	char		name[MAXFNAMELEN];
+} RecoveryIndexRestorePoint;
+
+/* TransactionIdPrecedes() for normal xids, it isn't available in frontend */
+#define XidPrecedes(id1, id2)	((int32) ((id1) - (id2)) < 0)
+
+/* Recovery target index being collected */
+typedef struct RecoveryIndexBuild
+{
+	RecoveryIndexHeader header;
+	parray	   *restore_points;
+} RecoveryIndexBuild;
+
 /* Function to process a WAL record */
 typedef void (*xlog_record_function) (XLogReaderState *record,
 									  XLogReaderData *reader_data,
@@ -175,6 +335,48 @@ static void *XLogThreadWorker(void *arg);
 static void CleanupXLogPageRead(XLogReaderState *xlogreader);
 static void PrintXLogCorruptionMsg(XLogReaderData *reader_data, int elevel);
 
+static void wal_segment_open(WalSegment *seg, const char *dir, uint32 seg_size,
+							 XLogSegNo segno, TimeLineID tli, bool prefetch);
+static bool wal_segment_read_page(WalSegment *seg, uint32 page_off, char *page);
+static pg_crc32 wal_segment_crc(WalSegment *seg, uint32 seg_size);
+static void wal_segment_close(WalSegment *seg);
+static void wal_readahead_start(int nreaders, TimeLineID tli,
+								uint32 seg_size, XLogSegNo endSegNo);
+static void wal_readahead_stop(void);
+static bool wal_readahead_take(XLogSegNo segno, WalSegment *seg);
+static bool wal_readahead_page(WalSegment *seg, uint32 page_off, char **data);
+static void wal_readahead_release(struct WalReadAheadSlot *slot);
+static void *wal_readahead_worker(void *arg);
+
+static bool extractPageMapInterval(const char *archivedir, uint32 wal_seg_size,
+								   TimeLineID tli, XLogRecPtr startpoint,
+								   XLogRecPtr endpoint, bool inclusive_endpoint);
+static bool read_block_summary(const char *archive_dir, TimeLineID tli,
+							   XLogSegNo segno, uint32 seg_size,
+							   BlockSummaryHeader *header, char **data);
+static bool apply_block_summary(BlockSummaryHeader *header, char *data);
+
+static bool wal_sidecar_is_current(const char *archive_dir,
+								   const char *wal_file_name,
+								   pg_crc32 wal_crc, const char *path);
+
+static void recovery_index_build_begin(RecoveryIndexBuild *build,
+									   TimeLineID tli, XLogRecPtr start_lsn);
+static void recovery_index_build_add(RecoveryIndexBuild *build,
+									 XLogReaderState *record);
+static void recovery_index_build_free(RecoveryIndexBuild *build);
+static bool write_recovery_index(const char *path, RecoveryIndexBuild *build,
+								 bool no_sync, int elevel, int thread_num);
+static bool read_recovery_index(const char *archive_dir, TimeLineID tli,
+								XLogSegNo segno, uint32 seg_size,
+								RecoveryIndexHeader *header,
+								parray *restore_points);
+static XLogRecPtr find_indexed_target(const char *archivedir, TimeLineID tli,
+									  uint32 seg_size, XLogRecPtr startpoint,
+									  time_t target_time, TransactionId target_xid,
+									  XLogRecPtr target_lsn);
+
+static bool recordIsTrackable(XLogReaderState *record);
 static void extractPageInfo(XLogReaderState *record,
 							XLogReaderData *reader_data, bool *stop_reading);
 static void validateXLogRecord(XLogReaderState *record,
@@ -191,6 +393,73 @@ static uint32 segnum_read = 0;
 /* Number of detected corrupted or absent segments */
 static uint32 segnum_corrupted = 0;
 static pthread_mutex_t wal_segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_readahead_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * WAL segments read-ahead.
+ *
+ * Reader threads take segments one by one from segno_next, so segments
+ * starting from segno_next are going to be read next. Loader threads find
+ * them in advance and read or inflate their data into a ring of
+ * WAL_SEGMENT_CHUNK buffers of a slot, so reader threads don't wait for
+ * lookups in archive, for disk and for decompression, and copy pages from
+ * memory. A loader doesn't overwrite the chunk a reader is at and chunks
+ * after it, so the ring bounds memory used by a slot and the loader of a
+ * segment which is larger than the ring keeps going while it is read.
+ * There are two slots per reader: the segment being read and the next one.
+ *
+ * Slots are protected by wal_segment_mutex, the same lock which is used to
+ * take segno_next, so a loader never starts to load a segment which is
+ * already taken by a reader. Changes of slots and of segno_next are
+ * signalled by wal_readahead_cond.
+ */
+
+/* Number of slots per reader thread */
+#define WAL_READAHEAD_DEPTH		2
+/* Maximum number of chunks in the ring of a slot, 16MB */
+#define WAL_READAHEAD_CHUNKS	16
+
+typedef enum
+{
+	WAL_SLOT_EMPTY = 0,
+	WAL_SLOT_OPENING,			/* loader looks for the segment */
+	WAL_SLOT_LOADING,			/* loader fills the ring */
+	WAL_SLOT_LOADED				/* loader is done with the slot */
+} WalSlotState;
+
+typedef struct WalReadAheadSlot
+{
+	WalSlotState state;
+	WalSegment	seg;			/* segment as opened by the loader, without
+								 * the file, which is read by the loader */
+	bool		taken;			/* a reader uses the segment */
+	bool		released;		/* the reader is done with the segment */
+
+	char	  **chunks;			/* ring of wal_readahead.nchunks buffers */
+	uint32		first_chunk;	/* first chunk number kept in the ring */
+	uint32		nchunks;		/* number of chunks loaded */
+	uint32		read_chunk;		/* chunk number the reader is at */
+	uint32		data_len;		/* number of bytes loaded */
+
+	/* reason why the segment isn't loaded completely */
+	char		errmsg[256];
+} WalReadAheadSlot;
+
+static struct
+{
+	bool		active;
+	bool		stop;
+	TimeLineID	tli;
+	uint32		seg_size;
+	XLogSegNo	endSegNo;
+
+	int			nslots;
+	WalReadAheadSlot *slots;
+	uint32		nchunks;		/* size of the ring of a slot */
+
+	int			nloaders;
+	pthread_t  *loaders;
+} wal_readahead;
 
 /* copied from timestamp.c */
 static pg_time_t
@@ -245,10 +514,8 @@ extractPageMap(const char *archivedir, uint32 wal_seg_size,
 
 	if (start_tli == end_tli)
 		/* easy case */
-		extract_isok = RunXLogThreads(archivedir, 0, InvalidTransactionId,
-									  InvalidXLogRecPtr, end_tli, wal_seg_size,
-									  startpoint, endpoint, false, extractPageInfo,
-									  NULL, true);
+		extract_isok = extractPageMapInterval(archivedir, wal_seg_size, end_tli,
+											  startpoint, endpoint, true);
 	else
 	{
 		/* We have to process WAL located on several different xlog intervals,
@@ -337,10 +604,11 @@ extractPageMap(const char *archivedir, uint32 wal_seg_size,
 			if (wal_interval->tli == end_tli)
 				inclusive_endpoint = true;
 
-			extract_isok = RunXLogThreads(archivedir, 0, InvalidTransactionId,
-									  InvalidXLogRecPtr, wal_interval->tli, wal_seg_size,
-									  wal_interval->begin_lsn, wal_interval->end_lsn,
-									  false, extractPageInfo, NULL, inclusive_endpoint);
+			extract_isok = extractPageMapInterval(archivedir, wal_seg_size,
+												  wal_interval->tli,
+												  wal_interval->begin_lsn,
+												  wal_interval->end_lsn,
+												  inclusive_endpoint);
 			if (!extract_isok)
 				break;
 
@@ -352,6 +620,81 @@ extractPageMap(const char *archivedir, uint32 wal_seg_size,
 	return extract_isok;
 }
 
+/*
+ * Collect data blocks touched by WAL records from 'startpoint' to 'endpoint'
+ * on the timeline tli into a page map.
+ *
+ * Block summaries written by archive-push are used where they exist, only
+ * the rest of the interval is parsed.
+ */
+static bool
+extractPageMapInterval(const char *archivedir, uint32 wal_seg_size,
+					   TimeLineID tli, XLogRecPtr startpoint,
+					   XLogRecPtr endpoint, bool inclusive_endpoint)
+{
+	XLogSegNo	start_segno;
+	XLogSegNo	end_segno;
+	XLogSegNo	segno;
+	/* Records starting before this position are already processed */
+	XLogRecPtr	processed_lsn = startpoint;
+	int			n_summaries = 0;
+
+	GetXLogSegNo(startpoint, start_segno, wal_seg_size);
+	GetXLogSegNo(endpoint, end_segno, wal_seg_size);
+
+	for (segno = start_segno; segno <= end_segno; segno++)
+	{
+		BlockSummaryHeader header;
+		char	   *data = NULL;
+
+		if (!read_block_summary(archivedir, tli, segno, wal_seg_size,
+								&header, &data))
+			continue;
+
+		if (header.end_lsn <= processed_lsn)
+		{
+			pg_free(data);
+			continue;
+		}
+
+		/* Parse the gap before the summary */
+		if (header.start_lsn > processed_lsn)
+		{
+			if (!RunXLogThreads(archivedir, 0, InvalidTransactionId,
+								InvalidXLogRecPtr, tli, wal_seg_size,
+								processed_lsn, header.start_lsn, false,
+								extractPageInfo, NULL, true))
+			{
+				pg_free(data);
+				return false;
+			}
+			processed_lsn = header.start_lsn;
+		}
+
+		if (apply_block_summary(&header, data))
+		{
+			processed_lsn = header.end_lsn;
+			n_summaries++;
+		}
+
+		pg_free(data);
+	}
+
+	if (n_summaries > 0)
+		elog(LOG, "Used %i block summaries for timeline %i, processed LSN %X/%X",
+			 n_summaries, tli,
+			 (uint32) (processed_lsn >> 32), (uint32) (processed_lsn));
+
+	if (processed_lsn < endpoint ||
+		(processed_lsn == endpoint && inclusive_endpoint))
+		return RunXLogThreads(archivedir, 0, InvalidTransactionId,
+							  InvalidXLogRecPtr, tli, wal_seg_size,
+							  processed_lsn, endpoint, false, extractPageInfo,
+							  NULL, inclusive_endpoint);
+
+	return true;
+}
+
 /*
  * Ensure that the backup has all wal files needed for recovery to consistent
  * state.
@@ -393,8 +736,11 @@ validate_backup_wal_from_start_to_stop(pgBackup *backup,
  * Ensure that the backup has all wal files needed for recovery to consistent
  * state. And check if we have in archive all files needed to restore the backup
  * up to the given recovery target.
+ *
+ * Returns LSN of the record the recovery target is reached at, or
+ * InvalidXLogRecPtr if no target is given.
  */
-void
+XLogRecPtr
 validate_wal(pgBackup *backup, const char *archivedir,
 			 time_t target_time, TransactionId target_xid,
 			 XLogRecPtr target_lsn, TimeLineID tli, uint32 wal_seg_size)
@@ -440,7 +786,7 @@ validate_wal(pgBackup *backup, const char *archivedir,
 	if (backup->status == BACKUP_STATUS_CORRUPT)
 	{
 		elog(WARNING, "Backup %s WAL segments are corrupted", backup_id);
-		return;
+		return InvalidXLogRecPtr;
 	}
 	/*
 	 * If recovery target is provided check that we can restore backup to a
@@ -451,7 +797,7 @@ validate_wal(pgBackup *backup, const char *archivedir,
 	{
 		/* Recovery target is not given so exit */
 		elog(INFO, "Backup %s WAL segments are valid", backup_id);
-		return;
+		return InvalidXLogRecPtr;
 	}
 
 	/*
@@ -479,10 +825,23 @@ validate_wal(pgBackup *backup, const char *archivedir,
 		|| (XRecOffIsValid(target_lsn) && last_rec.rec_lsn >= target_lsn))
 		all_wal = true;
 
-	all_wal = all_wal ||
-		RunXLogThreads(archivedir, target_time, target_xid, target_lsn,
-					   tli, wal_seg_size, backup->stop_lsn,
-					   InvalidXLogRecPtr, true, validateXLogRecord, &last_rec, true);
+	if (!all_wal)
+	{
+		/* Skip WAL, which is known not to reach the target */
+		XLogRecPtr	decode_from = find_indexed_target(archivedir, tli, wal_seg_size,
+													  backup->stop_lsn, target_time,
+													  target_xid, target_lsn);
+
+		if (decode_from != backup->stop_lsn)
+			elog(LOG, "WAL from %X/%X to %X/%X is skipped according to recovery target indexes",
+				 (uint32) (backup->stop_lsn >> 32), (uint32) (backup->stop_lsn),
+				 (uint32) (decode_from >> 32), (uint32) (decode_from));
+
+		all_wal = RunXLogThreads(archivedir, target_time, target_xid, target_lsn,
+								 tli, wal_seg_size, decode_from,
+								 InvalidXLogRecPtr, true, validateXLogRecord,
+								 &last_rec, true);
+	}
 	if (last_rec.rec_time > 0)
 		time2iso(last_timestamp, lengthof(last_timestamp),
 				 timestamptz_to_time_t(last_rec.rec_time));
@@ -514,6 +873,8 @@ validate_wal(pgBackup *backup, const char *archivedir,
 			elog(ERROR, "Not enough WAL records to lsn %X/%X",
 					(uint32) (target_lsn >> 32), (uint32) (target_lsn));
 	}
+
+	return last_rec.rec_lsn;
 }
 
 /*
@@ -871,124 +1232,51 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 	/* Try to switch to the next WAL segment */
 	if (!reader_data->xlogexists)
 	{
-		char		xlogfname[MAXFNAMELEN];
-		char		partial_file[MAXPGPATH];
-
-		GetXLogFileName(xlogfname, reader_data->tli, reader_data->xlogsegno, wal_seg_size);
+		WalSegment *seg = &reader_data->seg;
 
-		snprintf(reader_data->xlogpath, MAXPGPATH, "%s/%s", wal_archivedir, xlogfname);
-		snprintf(reader_data->gz_xlogpath, MAXPGPATH, "%s.gz", reader_data->xlogpath);
+		/* Take the segment from read-ahead or open it by ourselves */
+		if (!wal_readahead_take(reader_data->xlogsegno, seg))
+			wal_segment_open(seg, wal_archivedir, wal_seg_size,
+							 reader_data->xlogsegno, reader_data->tli, false);
 
-		/* We fall back to using .partial segment in case if we are running
-		 * multi-timeline incremental backup right after standby promotion.
-		 * TODO: it should be explicitly enabled.
-		 */
-		snprintf(partial_file, MAXPGPATH, "%s.partial", reader_data->xlogpath);
+		snprintf(reader_data->xlogpath, MAXPGPATH, "%s", seg->path);
 
-		/* If segment do not exists, but the same
-		 * segment with '.partial' suffix does, use it instead */
-		if (!fileExists(reader_data->xlogpath, FIO_LOCAL_HOST) &&
-			fileExists(partial_file, FIO_LOCAL_HOST))
-		{
-			snprintf(reader_data->xlogpath, MAXPGPATH, "%s", partial_file);
-		}
+		/* Exit without error if WAL segment doesn't exist */
+		if (seg->status == WAL_SEGMENT_ABSENT)
+			return -1;
 
-		if (fileExists(reader_data->xlogpath, FIO_LOCAL_HOST))
-		{
-			elog(LOG, "Thread [%d]: Opening WAL segment \"%s\"",
-				 reader_data->thread_num, reader_data->xlogpath);
+		elog(LOG, "Thread [%d]: Opening %sWAL segment \"%s\"",
+			 reader_data->thread_num, seg->compressed ? "compressed " : "",
+			 seg->path);
 
-			reader_data->xlogexists = true;
-			reader_data->xlogfile = fio_open(reader_data->xlogpath,
-											 O_RDONLY | PG_BINARY, FIO_LOCAL_HOST);
+		reader_data->xlogexists = true;
 
-			if (reader_data->xlogfile < 0)
-			{
-				elog(WARNING, "Thread [%d]: Could not open WAL segment \"%s\": %s",
-					 reader_data->thread_num, reader_data->xlogpath,
-					 strerror(errno));
-				return -1;
-			}
-		}
-#ifdef HAVE_LIBZ
-		/* Try to open compressed WAL segment */
-		else if (fileExists(reader_data->gz_xlogpath, FIO_LOCAL_HOST))
+		if (seg->status == WAL_SEGMENT_OPEN_FAILED)
 		{
-			elog(LOG, "Thread [%d]: Opening compressed WAL segment \"%s\"",
-				 reader_data->thread_num, reader_data->gz_xlogpath);
-
-			reader_data->xlogexists = true;
-			reader_data->gz_xlogfile = fio_gzopen(reader_data->gz_xlogpath,
-													  "rb", -1, FIO_LOCAL_HOST);
-			if (reader_data->gz_xlogfile == NULL)
-			{
-				elog(WARNING, "Thread [%d]: Could not open compressed WAL segment \"%s\": %s",
-					 reader_data->thread_num, reader_data->gz_xlogpath,
-					 strerror(errno));
-				return -1;
-			}
-		}
-#endif
-		/* Exit without error if WAL segment doesn't exist */
-		if (!reader_data->xlogexists)
+			elog(WARNING, "Thread [%d]: Could not open %sWAL segment \"%s\": %s",
+				 reader_data->thread_num, seg->compressed ? "compressed " : "",
+				 seg->path, seg->errmsg);
 			return -1;
+		}
 	}
 
 	/*
-	 * At this point, we have the right segment open.
+	 * At this point, we have the right segment opened.
 	 */
 	Assert(reader_data->xlogexists);
 
-	/*
-	 * Do not read same page read earlier from the file, read it from the buffer
-	 */
-	if (reader_data->prev_page_off != 0 &&
-		reader_data->prev_page_off == targetPageOff)
-	{
-		memcpy(readBuf, reader_data->page_buf, XLOG_BLCKSZ);
-		*pageTLI = reader_data->tli;
-		return XLOG_BLCKSZ;
-	}
-
 	/* Read the requested page */
-	if (reader_data->xlogfile != -1)
-	{
-		if (fio_seek(reader_data->xlogfile, (off_t) targetPageOff) < 0)
-		{
-			elog(WARNING, "Thread [%d]: Could not seek in WAL segment \"%s\": %s",
-				 reader_data->thread_num, reader_data->xlogpath, strerror(errno));
-			return -1;
-		}
-
-		if (fio_read(reader_data->xlogfile, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
-		{
-			elog(WARNING, "Thread [%d]: Could not read from WAL segment \"%s\": %s",
-				 reader_data->thread_num, reader_data->xlogpath, strerror(errno));
-			return -1;
-		}
-	}
-#ifdef HAVE_LIBZ
-	else
+	if (!wal_segment_read_page(&reader_data->seg, targetPageOff, readBuf))
 	{
-		if (fio_gzseek(reader_data->gz_xlogfile, (z_off_t) targetPageOff, SEEK_SET) == -1)
-		{
-			elog(WARNING, "Thread [%d]: Could not seek in compressed WAL segment \"%s\": %s",
-				reader_data->thread_num, reader_data->gz_xlogpath,
-				get_gz_error(reader_data->gz_xlogfile));
-			return -1;
-		}
-
-		if (fio_gzread(reader_data->gz_xlogfile, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
-		{
-			elog(WARNING, "Thread [%d]: Could not read from compressed WAL segment \"%s\": %s",
-				reader_data->thread_num, reader_data->gz_xlogpath,
-				get_gz_error(reader_data->gz_xlogfile));
-			return -1;
-		}
+		elog(WARNING, "Thread [%d]: Could not read from %sWAL segment \"%s\": %s",
+			 reader_data->thread_num,
+			 reader_data->seg.compressed ? "compressed " : "",
+			 reader_data->seg.path,
+			 reader_data->seg.errmsg[0] ? reader_data->seg.errmsg :
+			 "unexpected end of file");
+		return -1;
 	}
-#endif
 
-	memcpy(reader_data->page_buf, readBuf, XLOG_BLCKSZ);
 	reader_data->prev_page_off = targetPageOff;
 	*pageTLI = reader_data->tli;
 	return XLOG_BLCKSZ;
@@ -1011,7 +1299,6 @@ InitXLogPageRead(XLogReaderData *reader_data, const char *archivedir,
 
 	MemSet(reader_data, 0, sizeof(XLogReaderData));
 	reader_data->tli = tli;
-	reader_data->xlogfile = -1;
 
 	if (allocate_reader)
 	{
@@ -1131,6 +1418,7 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 
 	/* Run threads */
 	thread_interrupted = false;
+	wal_readahead_start(threads_need, tli, segment_size, endSegNo);
 	for (i = 0; i < threads_need; i++)
 	{
 		elog(VERBOSE, "Start WAL reader thread: %d", i + 1);
@@ -1144,6 +1432,7 @@ RunXLogThreads(const char *archivedir, time_t target_time,
 		if (thread_args[i].ret == 1)
 			result = false;
 	}
+	wal_readahead_stop();
 
 	/* Release threads here, use thread_args only below */
 	pfree(threads);
@@ -1364,6 +1653,7 @@ XLogThreadWorker(void *arg)
 			/* We should store least target segment number */
 			if (segno_target == 0 || segno_target > reader_data->xlogsegno)
 				segno_target = reader_data->xlogsegno;
+			pthread_cond_broadcast(&wal_readahead_cond);
 			pthread_mutex_unlock(&wal_segment_mutex);
 
 			break;
@@ -1431,6 +1721,7 @@ SwitchThreadToNextWal(XLogReaderState *xlogreader, xlog_thread_arg *arg)
 	reader_data->xlogsegno = segno_next;
 	segnum_read++;
 	segno_next++;
+	pthread_cond_broadcast(&wal_readahead_cond);
 	pthread_mutex_unlock(&wal_segment_mutex);
 
 	/* We've reached the end */
@@ -1555,18 +1846,7 @@ CleanupXLogPageRead(XLogReaderState *xlogreader)
 	XLogReaderData *reader_data;
 
 	reader_data = (XLogReaderData *) xlogreader->private_data;
-	if (reader_data->xlogfile >= 0)
-	{
-		fio_close(reader_data->xlogfile);
-		reader_data->xlogfile = -1;
-	}
-#ifdef HAVE_LIBZ
-	else if (reader_data->gz_xlogfile != NULL)
-	{
-		fio_gzclose(reader_data->gz_xlogfile);
-		reader_data->gz_xlogfile = NULL;
-	}
-#endif
+	wal_segment_close(&reader_data->seg);
 	reader_data->prev_page_off = 0;
 	reader_data->xlogexists = false;
 }
@@ -1583,16 +1863,10 @@ PrintXLogCorruptionMsg(XLogReaderData *reader_data, int elevel)
 		if (!reader_data->xlogexists)
 			elog(elevel, "Thread [%d]: WAL segment \"%s\" is absent",
 				 reader_data->thread_num, reader_data->xlogpath);
-		else if (reader_data->xlogfile != -1)
+		else
 			elog(elevel, "Thread [%d]: Possible WAL corruption. "
 						 "Error has occured during reading WAL segment \"%s\"",
 				 reader_data->thread_num, reader_data->xlogpath);
-#ifdef HAVE_LIBZ
-		else if (reader_data->gz_xlogfile != NULL)
-			elog(elevel, "Thread [%d]: Possible WAL corruption. "
-						 "Error has occured during reading WAL segment \"%s\"",
-				 reader_data->thread_num, reader_data->gz_xlogpath);
-#endif
 	}
 	else
 	{
@@ -1603,157 +1877,1784 @@ PrintXLogCorruptionMsg(XLogReaderData *reader_data, int elevel)
 }
 
 /*
- * Extract information about blocks modified in this record.
+ * Open WAL segment segno of timeline tli from directory dir.
+ * Partial and compressed segments are used if plain one doesn't exist.
+ * Errors are not reported here, they are stored in seg and reported by
+ * reader thread which uses the segment.
+ *
+ * If prefetch is true, ask the kernel to read segment data in advance.
  */
 static void
-extractPageInfo(XLogReaderState *record, XLogReaderData *reader_data,
-				bool *stop_reading)
+wal_segment_open(WalSegment *seg, const char *dir, uint32 seg_size,
+				 XLogSegNo segno, TimeLineID tli, bool prefetch)
 {
-	uint8		block_id;
-	RmgrId		rmid = XLogRecGetRmid(record);
-	uint8		info = XLogRecGetInfo(record);
-	uint8		rminfo = info & ~XLR_INFO_MASK;
+	char		xlogfname[MAXFNAMELEN];
+	char		partial_file[MAXPGPATH];
+#ifdef HAVE_LIBZ
+	char		gz_file[MAXPGPATH];
+#endif
+	struct stat	st;
 
-	/* Is this a special record type that I recognize? */
+	MemSet(seg, 0, sizeof(WalSegment));
+	seg->segno = segno;
+	seg->fd = -1;
 
-	if (rmid == RM_DBASE_ID && rminfo == XLOG_DBASE_CREATE)
+	GetXLogFileName(xlogfname, tli, segno, seg_size);
+	snprintf(seg->path, MAXPGPATH, "%s/%s", dir, xlogfname);
+
+	/* We fall back to using .partial segment in case if we are running
+	 * multi-timeline incremental backup right after standby promotion.
+	 * TODO: it should be explicitly enabled.
+	 */
+	snprintf(partial_file, MAXPGPATH, "%s.partial", seg->path);
+
+	/* If segment do not exists, but the same
+	 * segment with '.partial' suffix does, use it instead */
+	if (!fileExists(seg->path, FIO_LOCAL_HOST) &&
+		fileExists(partial_file, FIO_LOCAL_HOST))
 	{
-		/*
-		 * New databases can be safely ignored. They would be completely
-		 * copied if found.
-		 */
+		snprintf(seg->path, MAXPGPATH, "%s", partial_file);
 	}
-	else if (rmid == RM_DBASE_ID && rminfo == XLOG_DBASE_DROP)
+
+#ifdef HAVE_LIBZ
+	/* Try to use compressed WAL segment */
+	snprintf(gz_file, MAXPGPATH, "%s/%s.gz", dir, xlogfname);
+	if (!fileExists(seg->path, FIO_LOCAL_HOST) &&
+		fileExists(gz_file, FIO_LOCAL_HOST))
 	{
-		/*
-		 * An existing database was dropped. It is fine to ignore that
-		 * they will be removed appropriately.
-		 */
+		snprintf(seg->path, MAXPGPATH, "%s", gz_file);
+		seg->compressed = true;
 	}
-	else if (rmid == RM_SMGR_ID && rminfo == XLOG_SMGR_CREATE)
+#endif
+
+	if (fileExists(seg->path, FIO_LOCAL_HOST))
 	{
-		/*
-		 * We can safely ignore these. The file will be removed when
-		 * combining the backups in the case of differential on.
-		 */
+		seg->fd = fio_open(seg->path, O_RDONLY | PG_BINARY, FIO_LOCAL_HOST);
+		if (seg->fd < 0 || fio_fstat(seg->fd, &st) < 0)
+		{
+			seg->status = WAL_SEGMENT_OPEN_FAILED;
+			snprintf(seg->errmsg, sizeof(seg->errmsg), "%s", strerror(errno));
+			if (seg->fd >= 0)
+				fio_close(seg->fd);
+			seg->fd = -1;
+			return;
+		}
+		seg->file_size = st.st_size;
 	}
-	else if (rmid == RM_SMGR_ID && rminfo == XLOG_SMGR_TRUNCATE)
+	/* Segment may be moved into pack file by archive-pack */
+	else if (!locate_wal_in_pack(dir, tli, segno, seg_size, seg->path,
+								 &seg->file_offset, &seg->file_size,
+								 &seg->compressed, seg->errmsg,
+								 sizeof(seg->errmsg), FIO_LOCAL_HOST))
 	{
-		/*
-		 * We can safely ignore these. When we compare the sizes later on,
-		 * we'll notice that they differ, and copy the missing tail from
-		 * source system.
-		 */
+		seg->status = seg->errmsg[0] != '\0' ?
+			WAL_SEGMENT_OPEN_FAILED : WAL_SEGMENT_ABSENT;
+		return;
 	}
-	else if (info & XLR_SPECIAL_REL_UPDATE)
+	else
 	{
-		/*
-		 * This record type modifies a relation file in some special way, but
-		 * we don't recognize the type. That's bad - we don't know how to
-		 * track that change.
-		 */
-		elog(ERROR, "WAL record modifies a relation, but record type is not recognized\n"
-			 "lsn: %X/%X, rmgr: %s, info: %02X",
-		  (uint32) (record->ReadRecPtr >> 32), (uint32) (record->ReadRecPtr),
-				 RmgrNames[rmid], info);
+		seg->fd = fio_open(seg->path, O_RDONLY | PG_BINARY, FIO_LOCAL_HOST);
+		if (seg->fd < 0)
+		{
+			seg->status = WAL_SEGMENT_OPEN_FAILED;
+			snprintf(seg->errmsg, sizeof(seg->errmsg), "%s", strerror(errno));
+			return;
+		}
 	}
 
-	for (block_id = 0; block_id <= record->max_block_id; block_id++)
+#ifndef HAVE_LIBZ
+	if (seg->compressed)
 	{
-		RelFileNode rnode;
-		ForkNumber	forknum;
-		BlockNumber blkno;
-
-		if (!XLogRecGetBlockTag(record, block_id, &rnode, &forknum, &blkno))
-			continue;
+		seg->status = WAL_SEGMENT_OPEN_FAILED;
+		snprintf(seg->errmsg, sizeof(seg->errmsg), "zlib support is disabled");
+		fio_close(seg->fd);
+		seg->fd = -1;
+		return;
+	}
+#endif
 
-		/* We only care about the main fork; others are copied as is */
-		if (forknum != MAIN_FORKNUM)
-			continue;
+	seg->status = WAL_SEGMENT_OPENED;
 
-		process_block_change(forknum, rnode, blkno);
-	}
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	/* WAL is read sequentially, tell the kernel to read it ahead */
+	if (prefetch)
+		(void) posix_fadvise(seg->fd, seg->file_offset, seg->file_size,
+							 POSIX_FADV_WILLNEED);
+#endif
 }
 
 /*
- * Check the current read WAL record during validation.
+ * Read up to size bytes of segment file data at offset off.
+ * The file is read sequentially most of the time, so seek only if needed.
  */
-static void
-validateXLogRecord(XLogReaderState *record, XLogReaderData *reader_data,
-				   bool *stop_reading)
+static ssize_t
+wal_segment_read_file(WalSegment *seg, char *buf, size_t size, uint64 off)
 {
-	/* Check target xid */
-	if (TransactionIdIsValid(wal_target_xid) &&
-		wal_target_xid == reader_data->cur_rec.rec_xid)
-		*stop_reading = true;
-	/* Check target time */
-	else if (wal_target_time != 0 &&
-			 timestamptz_to_time_t(reader_data->cur_rec.rec_time) >= wal_target_time)
-		*stop_reading = true;
-	/* Check target lsn */
-	else if (XRecOffIsValid(wal_target_lsn) &&
-			 reader_data->cur_rec.rec_lsn >= wal_target_lsn)
-		*stop_reading = true;
+	size_t		done = 0;
+
+	if (off >= seg->file_size)
+		return 0;
+	size = Min(size, seg->file_size - off);
+
+	if (seg->file_pos != seg->file_offset + off)
+	{
+		if (fio_seek(seg->fd, seg->file_offset + off) < 0)
+			return -1;
+		seg->file_pos = seg->file_offset + off;
+	}
+
+	while (done < size)
+	{
+		ssize_t		rc = fio_read(seg->fd, buf + done, size - done);
+
+		if (rc < 0)
+			return -1;
+		if (rc == 0)
+			break;
+		done += rc;
+		seg->file_pos += rc;
+	}
+	return done;
 }
 
+#ifdef HAVE_LIBZ
 /*
- * Extract timestamp from WAL record.
- *
- * If the record contains a timestamp, returns true, and saves the timestamp
+ * Inflate WAL_SEGMENT_CHUNK bytes of compressed segment data at offset off,
+ * which is a multiple of WAL_SEGMENT_CHUNK, into buf.
+ */
+static ssize_t
+wal_segment_inflate(WalSegment *seg, char *buf, uint64 off)
+{
+	/* Compressed stream cannot be read backwards, start over */
+	if (seg->z_active && off < seg->out_off)
+	{
+		inflateEnd(&seg->z);
+		seg->z_active = false;
+	}
+
+	if (!seg->z_active)
+	{
+		if (seg->in_buf == NULL)
+			seg->in_buf = pgut_malloc(WAL_SEGMENT_CHUNK);
+
+		MemSet(&seg->z, 0, sizeof(seg->z));
+		/* 16 is added to windowBits to accept gzip header */
+		if (inflateInit2(&seg->z, MAX_WBITS + 16) != Z_OK)
+		{
+			snprintf(seg->errmsg, sizeof(seg->errmsg),
+					 "cannot initialize decompression");
+			return -1;
+		}
+		seg->z_active = true;
+		seg->z_end = false;
+		seg->in_off = 0;
+		seg->out_off = 0;
+	}
+
+	/* Chunks before off are inflated into buf too and thrown away */
+	for (;;)
+	{
+		size_t		len = 0;
+
+		while (len < WAL_SEGMENT_CHUNK && !seg->z_end)
+		{
+			int			rc;
+
+			if (seg->z.avail_in == 0)
+			{
+				ssize_t		read_len;
+
+				read_len = wal_segment_read_file(seg, seg->in_buf,
+												 WAL_SEGMENT_CHUNK, seg->in_off);
+				if (read_len <= 0)
+				{
+					snprintf(seg->errmsg, sizeof(seg->errmsg), "%s",
+							 read_len < 0 ? strerror(errno) :
+							 "unexpected end of compressed data");
+					return -1;
+				}
+				seg->in_off += read_len;
+				seg->z.next_in = (Bytef *) seg->in_buf;
+				seg->z.avail_in = read_len;
+			}
+
+			seg->z.next_out = (Bytef *) buf + len;
+			seg->z.avail_out = WAL_SEGMENT_CHUNK - len;
+
+			rc = inflate(&seg->z, Z_NO_FLUSH);
+			len = WAL_SEGMENT_CHUNK - seg->z.avail_out;
+
+			if (rc == Z_STREAM_END)
+				seg->z_end = true;
+			else if (rc != Z_OK && rc != Z_BUF_ERROR)
+			{
+				snprintf(seg->errmsg, sizeof(seg->errmsg), "%s",
+						 seg->z.msg ? seg->z.msg : "cannot decompress data");
+				return -1;
+			}
+		}
+
+		seg->out_off += len;
+		if (seg->out_off - len == off)
+			return len;
+		if (seg->z_end)
+			return 0;
+	}
+}
+#endif
+
+/*
+ * Read or inflate WAL_SEGMENT_CHUNK bytes of segment data at offset off,
+ * which is a multiple of WAL_SEGMENT_CHUNK, into buf.
+ *
+ * Returns number of bytes, which is less than WAL_SEGMENT_CHUNK at the end
+ * of the segment, or -1 with seg->errmsg set.
+ */
+static ssize_t
+wal_segment_read_chunk(WalSegment *seg, char *buf, uint64 off)
+{
+	ssize_t		len;
+
+	Assert(off % WAL_SEGMENT_CHUNK == 0);
+
+#ifdef HAVE_LIBZ
+	if (seg->compressed)
+		return wal_segment_inflate(seg, buf, off);
+#endif
+
+	len = wal_segment_read_file(seg, buf, WAL_SEGMENT_CHUNK, off);
+	if (len < 0)
+		snprintf(seg->errmsg, sizeof(seg->errmsg), "%s", strerror(errno));
+	return len;
+}
+
+/*
+ * Read WAL page at page_off of opened segment into page.
+ *
+ * Returns false if the page cannot be read, seg->errmsg is empty if
+ * the segment is just shorter than that.
+ */
+static bool
+wal_segment_read_page(WalSegment *seg, uint32 page_off, char *page)
+{
+	uint32		chunk_off = page_off - page_off % WAL_SEGMENT_CHUNK;
+
+	Assert(page_off % XLOG_BLCKSZ == 0);
+
+	if (seg->slot != NULL)
+	{
+		XLogSegNo	segno = seg->segno;
+		char	   *data;
+
+		if (wal_readahead_page(seg, page_off, &data))
+		{
+			if (data == NULL)
+				return false;
+			memcpy(page, data, XLOG_BLCKSZ);
+			return true;
+		}
+
+		/* The chunk is gone from the ring, read the segment by ourselves */
+		wal_readahead_release(seg->slot);
+		seg->slot = NULL;
+		wal_segment_open(seg, wal_archivedir, wal_readahead.seg_size, segno,
+						 wal_readahead.tli, false);
+		if (seg->status != WAL_SEGMENT_OPENED)
+		{
+			if (seg->errmsg[0] == '\0')
+				snprintf(seg->errmsg, sizeof(seg->errmsg), "file is removed");
+			return false;
+		}
+	}
+
+	if (seg->buf_len == 0 || seg->buf_start != chunk_off)
+	{
+		ssize_t		len;
+
+		if (seg->buf == NULL)
+			seg->buf = pgut_malloc(WAL_SEGMENT_CHUNK);
+
+		seg->buf_len = 0;
+		len = wal_segment_read_chunk(seg, seg->buf, chunk_off);
+		if (len < 0)
+			return false;
+		seg->buf_start = chunk_off;
+		seg->buf_len = len;
+	}
+
+	if (page_off + XLOG_BLCKSZ > seg->buf_start + seg->buf_len)
+		return false;
+
+	memcpy(page, seg->buf + (page_off - seg->buf_start), XLOG_BLCKSZ);
+	return true;
+}
+
+/*
+ * CRC32C of data of opened segment, up to seg_size bytes.
+ */
+static pg_crc32
+wal_segment_crc(WalSegment *seg, uint32 seg_size)
+{
+	char		page[XLOG_BLCKSZ];
+	pg_crc32	crc;
+	uint32		page_off;
+
+	INIT_FILE_CRC32(true, crc);
+	for (page_off = 0; page_off < seg_size; page_off += XLOG_BLCKSZ)
+	{
+		if (!wal_segment_read_page(seg, page_off, page))
+			break;
+		COMP_FILE_CRC32(true, crc, page, XLOG_BLCKSZ);
+	}
+	FIN_FILE_CRC32(true, crc);
+
+	return crc;
+}
+
+/*
+ * Close WAL segment and release its memory. Does nothing if the segment
+ * isn't opened.
+ */
+static void
+wal_segment_close(WalSegment *seg)
+{
+	if (seg->status != WAL_SEGMENT_OPENED)
+		return;
+
+	if (seg->slot != NULL)
+		wal_readahead_release(seg->slot);
+	seg->slot = NULL;
+
+#ifdef HAVE_LIBZ
+	if (seg->z_active)
+		inflateEnd(&seg->z);
+	seg->z_active = false;
+	pg_free(seg->in_buf);
+	seg->in_buf = NULL;
+#endif
+
+	pg_free(seg->buf);
+	seg->buf = NULL;
+	seg->buf_len = 0;
+
+	if (seg->fd >= 0)
+		fio_close(seg->fd);
+	seg->fd = -1;
+	seg->status = WAL_SEGMENT_ABSENT;
+}
+
+/*
+ * Start loader threads for RunXLogThreads(). Memory used by read-ahead is
+ * limited by WAL_READAHEAD_DEPTH slots per reader, WAL_READAHEAD_CHUNKS
+ * chunks per slot.
+ */
+static void
+wal_readahead_start(int nreaders, TimeLineID tli, uint32 seg_size,
+					XLogSegNo endSegNo)
+{
+	int			i;
+
+	MemSet(&wal_readahead, 0, sizeof(wal_readahead));
+
+	wal_readahead.tli = tli;
+	wal_readahead.seg_size = seg_size;
+	wal_readahead.endSegNo = endSegNo;
+	wal_readahead.nchunks = Min(WAL_READAHEAD_CHUNKS,
+								(seg_size + WAL_SEGMENT_CHUNK - 1) / WAL_SEGMENT_CHUNK);
+	wal_readahead.nslots = nreaders * WAL_READAHEAD_DEPTH;
+	wal_readahead.slots = pgut_malloc(sizeof(WalReadAheadSlot) * wal_readahead.nslots);
+	MemSet(wal_readahead.slots, 0, sizeof(WalReadAheadSlot) * wal_readahead.nslots);
+
+	/* Chunk buffers are allocated by loaders when they are needed */
+	for (i = 0; i < wal_readahead.nslots; i++)
+	{
+		wal_readahead.slots[i].chunks = pgut_malloc(sizeof(char *) * wal_readahead.nchunks);
+		MemSet(wal_readahead.slots[i].chunks, 0, sizeof(char *) * wal_readahead.nchunks);
+	}
+
+	wal_readahead.nloaders = nreaders;
+	wal_readahead.loaders = pgut_malloc(sizeof(pthread_t) * wal_readahead.nloaders);
+
+	wal_readahead.active = true;
+
+	for (i = 0; i < wal_readahead.nloaders; i++)
+		pthread_create(&wal_readahead.loaders[i], NULL, wal_readahead_worker,
+					   NULL);
+
+	elog(VERBOSE, "Started %d WAL loader threads, %d segments read-ahead by %u chunks",
+		 wal_readahead.nloaders, wal_readahead.nslots, wal_readahead.nchunks);
+}
+
+/*
+ * Stop loader threads and release memory of slots.
+ */
+static void
+wal_readahead_stop(void)
+{
+	int			i;
+	uint32		j;
+
+	if (!wal_readahead.active)
+		return;
+
+	pthread_lock(&wal_segment_mutex);
+	wal_readahead.stop = true;
+	pthread_cond_broadcast(&wal_readahead_cond);
+	pthread_mutex_unlock(&wal_segment_mutex);
+
+	for (i = 0; i < wal_readahead.nloaders; i++)
+		pthread_join(wal_readahead.loaders[i], NULL);
+
+	for (i = 0; i < wal_readahead.nslots; i++)
+	{
+		for (j = 0; j < wal_readahead.nchunks; j++)
+			pg_free(wal_readahead.slots[i].chunks[j]);
+		pg_free(wal_readahead.slots[i].chunks);
+	}
+
+	pg_free(wal_readahead.slots);
+	pg_free(wal_readahead.loaders);
+	MemSet(&wal_readahead, 0, sizeof(wal_readahead));
+}
+
+/*
+ * Make slot empty, keeping its chunk buffers for reuse.
+ * Should be called under wal_segment_mutex.
+ */
+static void
+wal_readahead_clear(WalReadAheadSlot *slot)
+{
+	char	  **chunks = slot->chunks;
+
+	MemSet(slot, 0, sizeof(WalReadAheadSlot));
+	slot->chunks = chunks;
+}
+
+/*
+ * Take segment segno from read-ahead, waiting if it is being opened.
+ * Its data is served by wal_readahead_page() then.
+ *
+ * Returns false if the segment wasn't taken in advance or it couldn't be
+ * found or opened by the loader. The caller should open it by itself then,
+ * because the segment might have appeared in the archive since.
+ */
+static bool
+wal_readahead_take(XLogSegNo segno, WalSegment *seg)
+{
+	WalReadAheadSlot *slot = NULL;
+	bool		opened;
+	int			i;
+
+	if (!wal_readahead.active)
+		return false;
+
+	pthread_lock(&wal_segment_mutex);
+	for (;;)
+	{
+		if (interrupted || thread_interrupted)
+		{
+			pthread_mutex_unlock(&wal_segment_mutex);
+			elog(ERROR, "Interrupted during WAL reading");
+		}
+
+		slot = NULL;
+		for (i = 0; i < wal_readahead.nslots; i++)
+		{
+			if (wal_readahead.slots[i].state != WAL_SLOT_EMPTY &&
+				!wal_readahead.slots[i].taken &&
+				wal_readahead.slots[i].seg.segno == segno)
+			{
+				slot = &wal_readahead.slots[i];
+				break;
+			}
+		}
+
+		if (slot == NULL)
+		{
+			pthread_mutex_unlock(&wal_segment_mutex);
+			return false;
+		}
+
+		if (slot->state != WAL_SLOT_OPENING)
+			break;
+
+		/* Loader is opening the segment, it takes a moment */
+		pthread_cond_wait(&wal_readahead_cond, &wal_segment_mutex);
+	}
+
+	opened = slot->seg.status == WAL_SEGMENT_OPENED;
+	if (opened)
+	{
+		*seg = slot->seg;
+		seg->slot = slot;
+		slot->taken = true;
+	}
+	else
+		wal_readahead_clear(slot);
+
+	pthread_cond_broadcast(&wal_readahead_cond);
+	pthread_mutex_unlock(&wal_segment_mutex);
+
+	return opened;
+}
+
+/*
+ * Find WAL page at page_off of segment taken from read-ahead in the ring
+ * of its slot, waiting for the loader if it isn't loaded yet. *data points
+ * to the page in the ring then, or it is NULL if the segment is shorter or
+ * cannot be read, seg->errmsg tells which one.
+ *
+ * Returns false if the page is not kept in the ring anymore.
+ */
+static bool
+wal_readahead_page(WalSegment *seg, uint32 page_off, char **data)
+{
+	WalReadAheadSlot *slot = seg->slot;
+	uint32		chunkno = page_off / WAL_SEGMENT_CHUNK;
+
+	*data = NULL;
+
+	pthread_lock(&wal_segment_mutex);
+	if (chunkno < slot->first_chunk)
+	{
+		pthread_mutex_unlock(&wal_segment_mutex);
+		return false;
+	}
+
+	/* Let the loader replace chunks before this one */
+	if (slot->read_chunk != chunkno)
+	{
+		slot->read_chunk = chunkno;
+		pthread_cond_broadcast(&wal_readahead_cond);
+	}
+
+	while (chunkno >= slot->nchunks && slot->state != WAL_SLOT_LOADED)
+	{
+		if (interrupted || thread_interrupted)
+		{
+			pthread_mutex_unlock(&wal_segment_mutex);
+			elog(ERROR, "Interrupted during WAL reading");
+		}
+		pthread_cond_wait(&wal_readahead_cond, &wal_segment_mutex);
+	}
+
+	/*
+	 * The loader doesn't replace the chunk the reader is at, so the page can
+	 * be copied without the lock.
+	 */
+	if (chunkno < slot->nchunks && page_off + XLOG_BLCKSZ <= slot->data_len)
+		*data = slot->chunks[chunkno % wal_readahead.nchunks] +
+			page_off % WAL_SEGMENT_CHUNK;
+	else
+		snprintf(seg->errmsg, sizeof(seg->errmsg), "%s", slot->errmsg);
+	pthread_mutex_unlock(&wal_segment_mutex);
+
+	return true;
+}
+
+/*
+ * Give back the slot of a segment taken from read-ahead. If the loader is
+ * still loading it, the loader stops and makes the slot empty.
+ */
+static void
+wal_readahead_release(WalReadAheadSlot *slot)
+{
+	pthread_lock(&wal_segment_mutex);
+	if (slot->state == WAL_SLOT_LOADED)
+		wal_readahead_clear(slot);
+	else
+		slot->released = true;
+	pthread_cond_broadcast(&wal_readahead_cond);
+	pthread_mutex_unlock(&wal_segment_mutex);
+}
+
+/*
+ * Choose next segment to load and a free slot for it.
+ * Should be called under wal_segment_mutex.
+ */
+static WalReadAheadSlot *
+wal_readahead_next(XLogSegNo *segno_load)
+{
+	WalReadAheadSlot *free_slot = NULL;
+	XLogSegNo	segno;
+	int			i;
+
+	for (i = 0; i < wal_readahead.nslots; i++)
+	{
+		WalReadAheadSlot *slot = &wal_readahead.slots[i];
+
+		/*
+		 * Forget segments which were left behind, e.g. if a reader opened
+		 * the segment by itself while it was being opened by a loader.
+		 */
+		if (slot->state == WAL_SLOT_LOADED && !slot->taken &&
+			slot->seg.segno + wal_readahead.nslots < segno_next)
+			wal_readahead_clear(slot);
+
+		if (slot->state == WAL_SLOT_EMPTY && free_slot == NULL)
+			free_slot = slot;
+	}
+
+	if (free_slot == NULL)
+		return NULL;
+
+	for (segno = segno_next; segno < segno_next + wal_readahead.nslots; segno++)
+	{
+		bool		found = false;
+
+		/* Do not read beyond the end or the found recovery target */
+		if (wal_readahead.endSegNo != 0 && segno > wal_readahead.endSegNo)
+			return NULL;
+		if (segno_target != 0 && segno > segno_target)
+			return NULL;
+
+		for (i = 0; i < wal_readahead.nslots; i++)
+		{
+			if (wal_readahead.slots[i].state != WAL_SLOT_EMPTY &&
+				wal_readahead.slots[i].seg.segno == segno)
+			{
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+		{
+			*segno_load = segno;
+			return free_slot;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Whether the loader of slot should stop: the reader is done with the
+ * segment, readers moved on without taking it, or read-ahead is stopped.
+ * Should be called under wal_segment_mutex.
+ */
+static bool
+wal_readahead_cancelled(WalReadAheadSlot *slot)
+{
+	return slot->released || wal_readahead.stop ||
+		interrupted || thread_interrupted ||
+		(!slot->taken && slot->seg.segno + wal_readahead.nslots < segno_next);
+}
+
+/*
+ * Read or inflate data of opened segment seg into the ring of slot.
+ * Should be called under wal_segment_mutex, it is released while reading.
+ *
+ * Returns false if loading is cancelled before the whole segment is loaded.
+ */
+static bool
+wal_readahead_load(WalReadAheadSlot *slot, WalSegment *seg)
+{
+	while (slot->data_len < wal_readahead.seg_size)
+	{
+		uint32		chunkno = slot->nchunks;
+		char	  **chunk;
+		ssize_t		len;
+
+		/* Wait until the reader moves past the chunk to replace */
+		while (chunkno >= wal_readahead.nchunks &&
+			   chunkno - wal_readahead.nchunks >= slot->read_chunk &&
+			   !wal_readahead_cancelled(slot))
+			pthread_cond_wait(&wal_readahead_cond, &wal_segment_mutex);
+
+		if (wal_readahead_cancelled(slot))
+			return false;
+
+		if (chunkno >= wal_readahead.nchunks)
+			slot->first_chunk = chunkno - wal_readahead.nchunks + 1;
+		chunk = &slot->chunks[chunkno % wal_readahead.nchunks];
+		pthread_mutex_unlock(&wal_segment_mutex);
+
+		if (*chunk == NULL)
+			*chunk = pgut_malloc(WAL_SEGMENT_CHUNK);
+		len = wal_segment_read_chunk(seg, *chunk,
+									 (uint64) chunkno * WAL_SEGMENT_CHUNK);
+
+		pthread_lock(&wal_segment_mutex);
+		if (len < 0)
+		{
+			snprintf(slot->errmsg, sizeof(slot->errmsg), "%s", seg->errmsg);
+			break;
+		}
+		if (len > 0)
+		{
+			slot->nchunks++;
+			slot->data_len += len;
+			pthread_cond_broadcast(&wal_readahead_cond);
+		}
+		if (len < WAL_SEGMENT_CHUNK)
+			break;
+	}
+
+	return true;
+}
+
+/*
+ * WAL loader thread. It sleeps until a slot is freed or readers move on.
+ */
+static void *
+wal_readahead_worker(void *arg)
+{
+	pthread_lock(&wal_segment_mutex);
+	for (;;)
+	{
+		WalReadAheadSlot *slot;
+		WalSegment	seg;
+		XLogSegNo	segno = 0;
+		bool		loaded = true;
+
+		if (wal_readahead.stop || interrupted || thread_interrupted)
+			break;
+
+		slot = wal_readahead_next(&segno);
+		if (slot == NULL)
+		{
+			pthread_cond_wait(&wal_readahead_cond, &wal_segment_mutex);
+			continue;
+		}
+
+		slot->state = WAL_SLOT_OPENING;
+		slot->seg.segno = segno;
+		pthread_mutex_unlock(&wal_segment_mutex);
+
+		/* Slot's segno is read by other threads, so open into local copy */
+		wal_segment_open(&seg, wal_archivedir, wal_readahead.seg_size, segno,
+						 wal_readahead.tli, true);
+
+		pthread_lock(&wal_segment_mutex);
+		slot->seg = seg;
+		/* The file is read by the loader only */
+		slot->seg.fd = -1;
+		if (seg.status == WAL_SEGMENT_OPENED)
+		{
+			slot->state = WAL_SLOT_LOADING;
+			pthread_cond_broadcast(&wal_readahead_cond);
+			loaded = wal_readahead_load(slot, &seg);
+			wal_segment_close(&seg);
+		}
+
+		slot->state = WAL_SLOT_LOADED;
+		if (slot->released || (!loaded && !slot->taken))
+			wal_readahead_clear(slot);
+		else if (!loaded)
+			snprintf(slot->errmsg, sizeof(slot->errmsg), "reading is cancelled");
+		pthread_cond_broadcast(&wal_readahead_cond);
+	}
+	pthread_mutex_unlock(&wal_segment_mutex);
+
+	return NULL;
+}
+
+/*
+ * Check that the record doesn't modify relation files in a way which
+ * cannot be tracked by its block references.
+ */
+static bool
+recordIsTrackable(XLogReaderState *record)
+{
+	RmgrId		rmid = XLogRecGetRmid(record);
+	uint8		info = XLogRecGetInfo(record);
+	uint8		rminfo = info & ~XLR_INFO_MASK;
+
+	/* Is this a special record type that I recognize? */
+
+	if (rmid == RM_DBASE_ID && rminfo == XLOG_DBASE_CREATE)
+	{
+		/*
+		 * New databases can be safely ignored. They would be completely
+		 * copied if found.
+		 */
+	}
+	else if (rmid == RM_DBASE_ID && rminfo == XLOG_DBASE_DROP)
+	{
+		/*
+		 * An existing database was dropped. It is fine to ignore that
+		 * they will be removed appropriately.
+		 */
+	}
+	else if (rmid == RM_SMGR_ID && rminfo == XLOG_SMGR_CREATE)
+	{
+		/*
+		 * We can safely ignore these. The file will be removed when
+		 * combining the backups in the case of differential on.
+		 */
+	}
+	else if (rmid == RM_SMGR_ID && rminfo == XLOG_SMGR_TRUNCATE)
+	{
+		/*
+		 * We can safely ignore these. When we compare the sizes later on,
+		 * we'll notice that they differ, and copy the missing tail from
+		 * source system.
+		 */
+	}
+	else if (info & XLR_SPECIAL_REL_UPDATE)
+	{
+		/*
+		 * This record type modifies a relation file in some special way, but
+		 * we don't recognize the type. That's bad - we don't know how to
+		 * track that change.
+		 */
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Extract information about blocks modified in this record.
+ */
+static void
+extractPageInfo(XLogReaderState *record, XLogReaderData *reader_data,
+				bool *stop_reading)
+{
+	uint8		block_id;
+
+	if (!recordIsTrackable(record))
+		elog(ERROR, "WAL record modifies a relation, but record type is not recognized\n"
+			 "lsn: %X/%X, rmgr: %s, info: %02X",
+		  (uint32) (record->ReadRecPtr >> 32), (uint32) (record->ReadRecPtr),
+				 RmgrNames[XLogRecGetRmid(record)], XLogRecGetInfo(record));
+
+	for (block_id = 0; block_id <= record->max_block_id; block_id++)
+	{
+		RelFileNode rnode;
+		ForkNumber	forknum;
+		BlockNumber blkno;
+
+		if (!XLogRecGetBlockTag(record, block_id, &rnode, &forknum, &blkno))
+			continue;
+
+		/* We only care about the main fork; others are copied as is */
+		if (forknum != MAIN_FORKNUM)
+			continue;
+
+		process_block_change(forknum, rnode, blkno);
+	}
+}
+
+/*
+ * Check the current read WAL record during validation.
+ */
+static void
+validateXLogRecord(XLogReaderState *record, XLogReaderData *reader_data,
+				   bool *stop_reading)
+{
+	/* Check target xid */
+	if (TransactionIdIsValid(wal_target_xid) &&
+		wal_target_xid == reader_data->cur_rec.rec_xid)
+		*stop_reading = true;
+	/* Check target time */
+	else if (wal_target_time != 0 &&
+			 timestamptz_to_time_t(reader_data->cur_rec.rec_time) >= wal_target_time)
+		*stop_reading = true;
+	/* Check target lsn */
+	else if (XRecOffIsValid(wal_target_lsn) &&
+			 reader_data->cur_rec.rec_lsn >= wal_target_lsn)
+		*stop_reading = true;
+}
+
+/*
+ * Extract timestamp from WAL record.
+ *
+ * If the record contains a timestamp, returns true, and saves the timestamp
  * in *recordXtime. If the record type has no timestamp, returns false.
  * Currently, only transaction commit/abort records and restore points contain
  * timestamps.
  */
 static bool
-getRecordTimestamp(XLogReaderState *record, TimestampTz *recordXtime)
+getRecordTimestamp(XLogReaderState *record, TimestampTz *recordXtime)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	uint8		xact_info = info & XLOG_XACT_OPMASK;
+	uint8		rmid = XLogRecGetRmid(record);
+
+	if (rmid == RM_XLOG_ID && info == XLOG_RESTORE_POINT)
+	{
+		*recordXtime = ((xl_restore_point *) XLogRecGetData(record))->rp_time;
+		return true;
+	}
+	else if (rmid == RM_XACT_ID && (xact_info == XLOG_XACT_COMMIT ||
+							   xact_info == XLOG_XACT_COMMIT_PREPARED))
+	{
+		*recordXtime = ((xl_xact_commit *) XLogRecGetData(record))->xact_time;
+		return true;
+	}
+	else if (rmid == RM_XACT_ID && (xact_info == XLOG_XACT_ABORT ||
+							   xact_info == XLOG_XACT_ABORT_PREPARED))
+	{
+		*recordXtime = ((xl_xact_abort *) XLogRecGetData(record))->xact_time;
+		return true;
+	}
+
+	return false;
+}
+
+bool validate_wal_segment(TimeLineID tli, XLogSegNo segno, const char *prefetch_dir, uint32 wal_seg_size)
+{
+	XLogRecPtr startpoint;
+	XLogRecPtr endpoint;
+
+	bool rc;
+	int tmp_num_threads = num_threads;
+	num_threads = 1;
+
+	/* calculate startpoint and endpoint */
+	GetXLogRecPtr(segno, 0, wal_seg_size, startpoint);
+	GetXLogRecPtr(segno+1, 0, wal_seg_size, endpoint);
+
+	/* disable multi-threading */
+	num_threads = 1;
+
+	rc = RunXLogThreads(prefetch_dir, 0, InvalidTransactionId,
+						InvalidXLogRecPtr, tli, wal_seg_size,
+						startpoint, endpoint, false, NULL, NULL, true);
+
+	num_threads = tmp_num_threads;
+
+	return rc;
+}
+
+
+/*
+ * XLogreader callback function to read a WAL page while building block
+ * summary. Only the summarized segment and the previous one are available,
+ * both are taken from pg_wal.
+ */
+static int
+BlockSummaryPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
+					 int reqLen, XLogRecPtr targetRecPtr, char *readBuf,
+					 TimeLineID *pageTLI)
+{
+	BlockSummaryReader *reader = (BlockSummaryReader *) xlogreader->private_data;
+	uint32		targetPageOff = targetPagePtr % reader->seg_size;
+	XLogSegNo	segno;
+	int			i;
+
+	if (interrupted)
+		elog(ERROR, "Interrupted during WAL reading");
+
+	GetXLogSegNo(targetPagePtr, segno, reader->seg_size);
+
+	if (segno > reader->segno)
+	{
+		reader->crossed = true;
+		return -1;
+	}
+	if (segno + 1 < reader->segno)
+		return -1;
+
+	i = (segno == reader->segno) ? 1 : 0;
+	if (!reader->loaded[i])
+	{
+		wal_segment_open(&reader->segs[i], reader->pg_xlog_dir,
+						 reader->seg_size, segno, reader->tli, false);
+		reader->loaded[i] = true;
+	}
+
+	if (reader->segs[i].status != WAL_SEGMENT_OPENED ||
+		!wal_segment_read_page(&reader->segs[i], targetPageOff, readBuf))
+		return -1;
+
+	*pageTLI = reader->tli;
+	return XLOG_BLCKSZ;
+}
+
+static int
+block_summary_entry_cmp(const void *a1, const void *a2)
+{
+	const BlockSummaryEntry *e1 = *(BlockSummaryEntry * const *) a1;
+	const BlockSummaryEntry *e2 = *(BlockSummaryEntry * const *) a2;
+
+	if (e1->rnode.spcNode != e2->rnode.spcNode)
+		return e1->rnode.spcNode < e2->rnode.spcNode ? -1 : 1;
+	if (e1->rnode.dbNode != e2->rnode.dbNode)
+		return e1->rnode.dbNode < e2->rnode.dbNode ? -1 : 1;
+	if (e1->rnode.relNode != e2->rnode.relNode)
+		return e1->rnode.relNode < e2->rnode.relNode ? -1 : 1;
+	if (e1->forknum != e2->forknum)
+		return e1->forknum < e2->forknum ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Find entry of the relation fork in sorted entries array, create it
+ * if it doesn't exist.
+ */
+static BlockSummaryEntry *
+block_summary_get_entry(parray *entries, RelFileNode rnode, ForkNumber forknum)
+{
+	BlockSummaryEntry key;
+	BlockSummaryEntry *key_ptr = &key;
+	BlockSummaryEntry **found;
+	BlockSummaryEntry *entry;
+
+	key.rnode = rnode;
+	key.forknum = forknum;
+
+	found = (BlockSummaryEntry **) parray_bsearch(entries, &key_ptr,
+												  block_summary_entry_cmp);
+	if (found)
+		return *found;
+
+	/* New relations are rare, so resorting is fine */
+	entry = pgut_new(BlockSummaryEntry);
+	entry->rnode = rnode;
+	entry->forknum = forknum;
+	MemSet(&entry->pagemap, 0, sizeof(pagemap_t));
+
+	parray_append(entries, entry);
+	parray_qsort(entries, block_summary_entry_cmp);
+
+	return entry;
+}
+
+static void
+block_summary_entry_free(void *entry)
+{
+	pagemap_free(&((BlockSummaryEntry *) entry)->pagemap);
+	pg_free(entry);
+}
+
+/*
+ * Write sidecar file of WAL segment into the archive: write it as a
+ * temporary ".part" file first and rename it then.
+ */
+bool
+write_wal_sidecar(const char *path, const char *buf, size_t size,
+				  bool no_sync, int elevel, int thread_num)
+{
+	char		to_fullpath_part[MAXPGPATH];
+	int			out;
+
+	snprintf(to_fullpath_part, sizeof(to_fullpath_part), "%s.part", path);
+
+	out = fio_open(to_fullpath_part, O_RDWR | O_CREAT | O_TRUNC | PG_BINARY,
+				   FIO_BACKUP_HOST);
+	if (out < 0)
+	{
+		elog(elevel, "Thread [%d]: Cannot open file \"%s\": %s",
+			 thread_num, to_fullpath_part, strerror(errno));
+		return false;
+	}
+
+	if (fio_write(out, buf, size) != size)
+	{
+		elog(elevel, "Thread [%d]: Cannot write file \"%s\": %s",
+			 thread_num, to_fullpath_part, strerror(errno));
+		fio_close(out);
+		fio_unlink(to_fullpath_part, FIO_BACKUP_HOST);
+		return false;
+	}
+
+	if (fio_close(out) != 0 ||
+		(!no_sync && fio_sync(to_fullpath_part, FIO_BACKUP_HOST) != 0) ||
+		fio_rename(to_fullpath_part, path, FIO_BACKUP_HOST) < 0)
+	{
+		elog(elevel, "Thread [%d]: Cannot write file \"%s\": %s",
+			 thread_num, path, strerror(errno));
+		fio_unlink(to_fullpath_part, FIO_BACKUP_HOST);
+		return false;
+	}
+
+	wal_state_add(path, size);
+
+	return true;
+}
+
+/*
+ * Write block summary file of collected entries into archive_dir.
+ */
+static bool
+write_block_summary_file(const char *path, BlockSummaryHeader *header,
+						 parray *entries, bool no_sync, int thread_num)
+{
+	char	   *buf;
+	char	   *ptr;
+	size_t		size = 0;
+	bool		success;
+	int			i;
+
+	for (i = 0; i < parray_num(entries); i++)
+	{
+		BlockSummaryEntry *entry = (BlockSummaryEntry *) parray_get(entries, i);
+
+		pagemap_optimize(&entry->pagemap);
+		size += sizeof(BlockSummaryEntryHeader) +
+			pagemap_serialized_size(&entry->pagemap);
+	}
+
+	buf = pgut_malloc(sizeof(BlockSummaryHeader) + size);
+	ptr = buf + sizeof(BlockSummaryHeader);
+
+	for (i = 0; i < parray_num(entries); i++)
+	{
+		BlockSummaryEntry *entry = (BlockSummaryEntry *) parray_get(entries, i);
+		BlockSummaryEntryHeader entry_header;
+
+		entry_header.spcNode = entry->rnode.spcNode;
+		entry_header.dbNode = entry->rnode.dbNode;
+		entry_header.relNode = entry->rnode.relNode;
+		entry_header.forknum = entry->forknum;
+		entry_header.size = pagemap_serialized_size(&entry->pagemap);
+
+		memcpy(ptr, &entry_header, sizeof(entry_header));
+		ptr += sizeof(entry_header);
+		pagemap_serialize(&entry->pagemap, ptr);
+		ptr += entry_header.size;
+	}
+
+	header->nentries = parray_num(entries);
+	header->size = size;
+	INIT_FILE_CRC32(true, header->crc);
+	COMP_FILE_CRC32(true, header->crc, buf + sizeof(BlockSummaryHeader), size);
+	FIN_FILE_CRC32(true, header->crc);
+	memcpy(buf, header, sizeof(BlockSummaryHeader));
+
+	success = write_wal_sidecar(path, buf, sizeof(BlockSummaryHeader) + size,
+								no_sync, WARNING, thread_num);
+	pg_free(buf);
+
+	return success;
+}
+
+/*
+ * Summarize WAL segment wal_file_name located in pg_xlog_dir: write its block
+ * summary and/or recovery target index into archive_dir.
+ *
+ * Both are optional, so problems are reported as WARNING and false is
+ * returned, extractPageMap() and validate_wal() will parse the segment in
+ * this case.
+ */
+bool
+summarize_wal_segment(const char *wal_file_name, const char *pg_xlog_dir,
+					  const char *archive_dir, uint32 seg_size,
+					  bool block_summary, bool recovery_index,
+					  bool no_sync, int thread_num)
+{
+	BlockSummaryReader reader;
+	BlockSummaryHeader header;
+	BlockSummaryHeader prev_header;
+	RecoveryIndexHeader prev_index;
+	RecoveryIndexBuild ridx;
+	XLogReaderState *xlogreader;
+	XLogRecPtr	seg_start;
+	XLogRecPtr	next_lsn;
+	XLogRecPtr	read_from;
+	char		path[MAXPGPATH];
+	parray	   *entries = parray_new();
+	bool		success = false;
+	bool		summary_failed = false;
+
+	MemSet(&reader, 0, sizeof(reader));
+	reader.pg_xlog_dir = pg_xlog_dir;
+	reader.seg_size = seg_size;
+	GetXLogFromFileName(wal_file_name, &reader.tli, &reader.segno, seg_size);
+	GetXLogRecPtr(reader.segno, 0, seg_size, seg_start);
+
+	ridx.restore_points = NULL;
+
+#if PG_VERSION_NUM >= 110000
+	xlogreader = XLogReaderAllocate(seg_size, &BlockSummaryPageRead, &reader);
+#else
+	xlogreader = XLogReaderAllocate(&BlockSummaryPageRead, &reader);
+#endif
+	if (xlogreader == NULL)
+		elog(ERROR, "Thread [%d]: out of memory", thread_num);
+
+	/*
+	 * Start with the record crossing into this segment, if summary or index
+	 * of the previous segment tells where it begins.
+	 */
+	next_lsn = seg_start;
+	if (reader.segno > 0)
+	{
+		XLogRecPtr	prev_end_lsn = InvalidXLogRecPtr;
+
+		if (block_summary &&
+			read_block_summary(archive_dir, reader.tli, reader.segno - 1,
+							   seg_size, &prev_header, NULL))
+			prev_end_lsn = prev_header.end_lsn;
+		else if (recovery_index &&
+				 read_recovery_index(archive_dir, reader.tli, reader.segno - 1,
+									 seg_size, &prev_index, NULL))
+			prev_end_lsn = prev_index.end_lsn;
+
+		if (prev_end_lsn < seg_start && prev_end_lsn + seg_size > seg_start)
+			next_lsn = prev_end_lsn;
+	}
+
+	MemSet(&header, 0, sizeof(header));
+	header.magic = BLOCK_SUMMARY_MAGIC;
+	header.version = BLOCK_SUMMARY_VERSION;
+	header.tli = reader.tli;
+	header.start_lsn = next_lsn;
+
+	if (recovery_index)
+		recovery_index_build_begin(&ridx, reader.tli, next_lsn);
+
+	if (next_lsn == seg_start)
+		read_from = XLogFindNextRecord(xlogreader, seg_start);
+	else
+		read_from = next_lsn;
+
+	if (XLogRecPtrIsInvalid(read_from))
+	{
+		elog(WARNING, "Thread [%d]: Cannot summarize WAL segment \"%s\": "
+			 "could not find a valid record",
+			 thread_num, wal_file_name);
+		goto cleanup;
+	}
+
+	for (;;)
+	{
+		XLogRecord *record;
+		char	   *errormsg;
+		uint8		block_id;
+
+		record = XLogReadRecord(xlogreader, read_from, &errormsg);
+		read_from = InvalidXLogRecPtr;
+
+		if (record == NULL)
+		{
+			/* The rest belongs to the summary of the next segment */
+			if (reader.crossed)
+				break;
+
+			elog(WARNING, "Thread [%d]: Cannot summarize WAL segment \"%s\": "
+				 "could not read WAL record at %X/%X%s%s",
+				 thread_num, wal_file_name,
+				 (uint32) (next_lsn >> 32), (uint32) (next_lsn),
+				 errormsg ? ": " : "", errormsg ? errormsg : "");
+			goto cleanup;
+		}
+
+		if (recovery_index)
+			recovery_index_build_add(&ridx, xlogreader);
+
+		if (block_summary && !recordIsTrackable(xlogreader))
+		{
+			elog(WARNING, "Thread [%d]: Cannot build block summary for WAL segment \"%s\": "
+				 "WAL record at %X/%X modifies a relation, but record type is not recognized",
+				 thread_num, wal_file_name,
+				 (uint32) (xlogreader->ReadRecPtr >> 32),
+				 (uint32) (xlogreader->ReadRecPtr));
+			block_summary = false;
+			summary_failed = true;
+			if (!recovery_index)
+				goto cleanup;
+		}
+
+		for (block_id = 0; block_summary && block_id <= xlogreader->max_block_id;
+			 block_id++)
+		{
+			RelFileNode rnode;
+			ForkNumber	forknum;
+			BlockNumber blkno;
+			BlockSummaryEntry *entry;
+
+			if (!XLogRecGetBlockTag(xlogreader, block_id, &rnode, &forknum, &blkno))
+				continue;
+
+			entry = block_summary_get_entry(entries, rnode, forknum);
+			pagemap_add(&entry->pagemap, blkno);
+		}
+
+		next_lsn = xlogreader->EndRecPtr;
+	}
+
+	/*
+	 * Record following the page end starts after the page header. Use its
+	 * position, so end_lsn can be used as a startpoint of WAL parsing.
+	 */
+	if (next_lsn % XLOG_BLCKSZ == 0 && next_lsn % seg_size != 0)
+		next_lsn += SizeOfXLogShortPHD;
+	header.end_lsn = next_lsn;
+	success = true;
+
+	/* Key both files on the segment contents, see wal_sidecar_is_current() */
+	if (!reader.loaded[1])
+	{
+		wal_segment_open(&reader.segs[1], pg_xlog_dir, seg_size, reader.segno,
+						 reader.tli, false);
+		reader.loaded[1] = true;
+	}
+	header.wal_crc = wal_segment_crc(&reader.segs[1], seg_size);
+
+	if (block_summary)
+	{
+		snprintf(path, MAXPGPATH, "%s/%s.bsum", archive_dir, wal_file_name);
+		if (write_block_summary_file(path, &header, entries, no_sync, thread_num))
+			elog(LOG, "Thread [%d]: Block summary for WAL segment \"%s\" is written, "
+				 "relations: %lu, LSN range: %X/%X - %X/%X",
+				 thread_num, wal_file_name, parray_num(entries),
+				 (uint32) (header.start_lsn >> 32), (uint32) (header.start_lsn),
+				 (uint32) (header.end_lsn >> 32), (uint32) (header.end_lsn));
+		else
+			success = false;
+	}
+
+	if (recovery_index)
+	{
+		ridx.header.end_lsn = next_lsn;
+		ridx.header.wal_crc = header.wal_crc;
+		snprintf(path, MAXPGPATH, "%s/%s.ridx", archive_dir, wal_file_name);
+		if (write_recovery_index(path, &ridx, no_sync, WARNING, thread_num))
+			elog(LOG, "Thread [%d]: Recovery target index for WAL segment \"%s\" is written, "
+				 "LSN range: %X/%X - %X/%X",
+				 thread_num, wal_file_name,
+				 (uint32) (ridx.header.start_lsn >> 32), (uint32) (ridx.header.start_lsn),
+				 (uint32) (ridx.header.end_lsn >> 32), (uint32) (ridx.header.end_lsn));
+		else
+			success = false;
+	}
+
+cleanup:
+	wal_segment_close(&reader.segs[0]);
+	wal_segment_close(&reader.segs[1]);
+	XLogReaderFree(xlogreader);
+	parray_walk(entries, block_summary_entry_free);
+	parray_free(entries);
+	recovery_index_build_free(&ridx);
+
+	return success && !summary_failed;
+}
+
+/*
+ * Read block summary of WAL segment segno from archive_dir. If data is not
+ * NULL, entries are read and checked as well, caller should free them.
+ *
+ * Returns false if summary doesn't exist or cannot be used.
+ */
+static bool
+read_block_summary(const char *archive_dir, TimeLineID tli, XLogSegNo segno,
+				   uint32 seg_size, BlockSummaryHeader *header, char **data)
 {
-	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
-	uint8		xact_info = info & XLOG_XACT_OPMASK;
-	uint8		rmid = XLogRecGetRmid(record);
+	char		xlogfname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+	char	   *buf = NULL;
+	pg_crc32	crc;
+	int			fd;
 
-	if (rmid == RM_XLOG_ID && info == XLOG_RESTORE_POINT)
+	GetXLogFileName(xlogfname, tli, segno, seg_size);
+	snprintf(path, MAXPGPATH, "%s/%s.bsum", archive_dir, xlogfname);
+
+	fd = fio_open(path, O_RDONLY | PG_BINARY, FIO_BACKUP_HOST);
+	if (fd < 0)
 	{
-		*recordXtime = ((xl_restore_point *) XLogRecGetData(record))->rp_time;
-		return true;
+		if (errno != ENOENT)
+			elog(WARNING, "Cannot open block summary file \"%s\": %s",
+				 path, strerror(errno));
+		return false;
 	}
-	else if (rmid == RM_XACT_ID && (xact_info == XLOG_XACT_COMMIT ||
-							   xact_info == XLOG_XACT_COMMIT_PREPARED))
+
+	if (fio_read(fd, header, sizeof(BlockSummaryHeader)) != sizeof(BlockSummaryHeader) ||
+		header->magic != BLOCK_SUMMARY_MAGIC)
+		goto corrupted;
+
+	if (header->version != BLOCK_SUMMARY_VERSION || header->tli != tli)
+		goto corrupted;
+
+	if (data != NULL)
 	{
-		*recordXtime = ((xl_xact_commit *) XLogRecGetData(record))->xact_time;
-		return true;
+		buf = pgut_malloc(header->size);
+
+		if (fio_read(fd, buf, header->size) != (ssize_t) header->size)
+			goto corrupted;
+
+		INIT_FILE_CRC32(true, crc);
+		COMP_FILE_CRC32(true, crc, buf, header->size);
+		FIN_FILE_CRC32(true, crc);
+
+		if (!EQ_CRC32C(crc, header->crc))
+			goto corrupted;
 	}
-	else if (rmid == RM_XACT_ID && (xact_info == XLOG_XACT_ABORT ||
-							   xact_info == XLOG_XACT_ABORT_PREPARED))
+
+	fio_close(fd);
+
+	if (!wal_sidecar_is_current(archive_dir, xlogfname, header->wal_crc, path))
 	{
-		*recordXtime = ((xl_xact_abort *) XLogRecGetData(record))->xact_time;
+		pg_free(buf);
+		return false;
+	}
+
+	if (data != NULL)
+		*data = buf;
+	return true;
+
+corrupted:
+	elog(WARNING, "Block summary file \"%s\" is corrupted, WAL segment will be parsed",
+		 path);
+	pg_free(buf);
+	fio_close(fd);
+	return false;
+}
+
+/*
+ * Add blocks of the main fork listed in block summary to the page map.
+ */
+static bool
+apply_block_summary(BlockSummaryHeader *header, char *data)
+{
+	char	   *ptr = data;
+	char	   *end = data + header->size;
+	uint32		i;
+
+	for (i = 0; i < header->nentries; i++)
+	{
+		BlockSummaryEntryHeader entry_header;
+		RelFileNode rnode;
+		pagemap_t	map;
+		pagemap_iterator_t iter;
+		BlockNumber start;
+		BlockNumber count;
+
+		if ((size_t) (end - ptr) < sizeof(entry_header))
+			return false;
+		memcpy(&entry_header, ptr, sizeof(entry_header));
+		ptr += sizeof(entry_header);
+
+		if ((size_t) (end - ptr) < entry_header.size)
+			return false;
+
+		/* We only care about the main fork; others are copied as is */
+		if (entry_header.forknum != MAIN_FORKNUM)
+		{
+			ptr += entry_header.size;
+			continue;
+		}
+
+		if (!pagemap_deserialize(&map, ptr, entry_header.size))
+			return false;
+		ptr += entry_header.size;
+
+		rnode.spcNode = entry_header.spcNode;
+		rnode.dbNode = entry_header.dbNode;
+		rnode.relNode = entry_header.relNode;
+
+		pagemap_iterate(&map, &iter);
+		while (pagemap_next_range(&iter, &start, &count))
+		{
+			BlockNumber blkno;
+
+			for (blkno = start; blkno - start < count; blkno++)
+				process_block_change(MAIN_FORKNUM, rnode, blkno);
+		}
+		pagemap_free(&map);
+	}
+
+	return true;
+}
+
+/*
+ * Check that WAL sidecar file at path describes the archived segment:
+ * CRC of the segment it was built for must match the checksum file written
+ * by archive-push. A sidecar of the overwritten segment isn't used then.
+ */
+static bool
+wal_sidecar_is_current(const char *archive_dir, const char *wal_file_name,
+					   pg_crc32 wal_crc, const char *path)
+{
+	pg_crc32	archived_crc;
+	uint64		archived_size;
+
+	if (read_wal_checksum(archive_dir, wal_file_name, &archived_crc, &archived_size) &&
+		EQ_CRC32C(archived_crc, wal_crc))
 		return true;
+
+	elog(LOG, "File \"%s\" does not match archived WAL segment, ignore it", path);
+	return false;
+}
+
+/*
+ * Start collecting recovery target index of WAL records starting at
+ * start_lsn.
+ */
+static void
+recovery_index_build_begin(RecoveryIndexBuild *build, TimeLineID tli,
+						   XLogRecPtr start_lsn)
+{
+	recovery_index_build_free(build);
+	build->restore_points = parray_new();
+
+	MemSet(&build->header, 0, sizeof(RecoveryIndexHeader));
+	build->header.magic = RECOVERY_INDEX_MAGIC;
+	build->header.version = RECOVERY_INDEX_VERSION;
+	build->header.tli = tli;
+	build->header.start_lsn = start_lsn;
+}
+
+/*
+ * Account WAL record in recovery target index.
+ */
+static void
+recovery_index_build_add(RecoveryIndexBuild *build, XLogReaderState *record)
+{
+	RecoveryIndexHeader *header = &build->header;
+	TransactionId xid = XLogRecGetXid(record);
+	TimestampTz	rec_time;
+
+	/* the same values validateXLogRecord() checks the targets against */
+	if (getRecordTimestamp(record, &rec_time))
+	{
+		if (header->min_time == 0 || rec_time < header->min_time)
+			header->min_time = rec_time;
+		if (header->max_time == 0 || rec_time > header->max_time)
+			header->max_time = rec_time;
+	}
+
+	if (TransactionIdIsValid(xid))
+	{
+		if (!TransactionIdIsValid(header->min_xid) ||
+			XidPrecedes(xid, header->min_xid))
+			header->min_xid = xid;
+		if (!TransactionIdIsValid(header->max_xid) ||
+			XidPrecedes(header->max_xid, xid))
+			header->max_xid = xid;
+	}
+
+	if (XLogRecGetRmid(record) == RM_XLOG_ID &&
+		(XLogRecGetInfo(record) & ~XLR_INFO_MASK) == XLOG_RESTORE_POINT)
+	{
+		xl_restore_point *xlrec = (xl_restore_point *) XLogRecGetData(record);
+		RecoveryIndexRestorePoint *point = pgut_new(RecoveryIndexRestorePoint);
+
+		MemSet(point, 0, sizeof(RecoveryIndexRestorePoint));
+		point->lsn = record->ReadRecPtr;
+		point->time = xlrec->rp_time;
+		strncpy(point->name, xlrec->rp_name, MAXFNAMELEN - 1);
+		parray_append(build->restore_points, point);
+	}
+}
+
+static void
+recovery_index_build_free(RecoveryIndexBuild *build)
+{
+	if (build->restore_points)
+	{
+		parray_walk(build->restore_points, pfree);
+		parray_free(build->restore_points);
+		build->restore_points = NULL;
+	}
+}
+
+/*
+ * Write collected recovery target index into path.
+ */
+static bool
+write_recovery_index(const char *path, RecoveryIndexBuild *build,
+					 bool no_sync, int elevel, int thread_num)
+{
+	RecoveryIndexHeader *header = &build->header;
+	size_t		size;
+	char	   *buf;
+	char	   *ptr;
+	bool		success;
+	int			i;
+
+	header->nrestore_points = parray_num(build->restore_points);
+	size = sizeof(RecoveryIndexHeader) +
+		header->nrestore_points * sizeof(RecoveryIndexRestorePoint);
+
+	buf = pgut_malloc(size);
+	ptr = buf + sizeof(RecoveryIndexHeader);
+	for (i = 0; i < parray_num(build->restore_points); i++)
+	{
+		memcpy(ptr, parray_get(build->restore_points, i),
+			   sizeof(RecoveryIndexRestorePoint));
+		ptr += sizeof(RecoveryIndexRestorePoint);
+	}
+
+	INIT_FILE_CRC32(true, header->crc);
+	COMP_FILE_CRC32(true, header->crc, header, offsetof(RecoveryIndexHeader, crc));
+	COMP_FILE_CRC32(true, header->crc, buf + sizeof(RecoveryIndexHeader),
+					size - sizeof(RecoveryIndexHeader));
+	FIN_FILE_CRC32(true, header->crc);
+	memcpy(buf, header, sizeof(RecoveryIndexHeader));
+
+	success = write_wal_sidecar(path, buf, size, no_sync, elevel, thread_num);
+	pg_free(buf);
+
+	return success;
+}
+
+/*
+ * Read recovery target index of WAL segment segno from archive_dir. If
+ * restore_points is not NULL, restore points of the index are appended
+ * to it, caller should free them.
+ *
+ * Returns false if index doesn't exist or cannot be used.
+ */
+static bool
+read_recovery_index(const char *archive_dir, TimeLineID tli, XLogSegNo segno,
+					uint32 seg_size, RecoveryIndexHeader *header,
+					parray *restore_points)
+{
+	char		xlogfname[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+	char	   *buf = NULL;
+	size_t		size;
+	pg_crc32	crc;
+	uint32		i;
+	int			fd;
+
+	GetXLogFileName(xlogfname, tli, segno, seg_size);
+	snprintf(path, MAXPGPATH, "%s/%s.ridx", archive_dir, xlogfname);
+
+	fd = fio_open(path, O_RDONLY | PG_BINARY, FIO_BACKUP_HOST);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, "Cannot open recovery target index file \"%s\": %s",
+				 path, strerror(errno));
+		return false;
+	}
+
+	if (fio_read(fd, header, sizeof(RecoveryIndexHeader)) != sizeof(RecoveryIndexHeader) ||
+		header->magic != RECOVERY_INDEX_MAGIC ||
+		header->version != RECOVERY_INDEX_VERSION || header->tli != tli ||
+		header->nrestore_points > seg_size / sizeof(RecoveryIndexRestorePoint))
+		goto corrupted;
+
+	size = header->nrestore_points * sizeof(RecoveryIndexRestorePoint);
+	buf = pgut_malloc(size + 1);
+	if (fio_read(fd, buf, size) != (ssize_t) size)
+		goto corrupted;
+
+	INIT_FILE_CRC32(true, crc);
+	COMP_FILE_CRC32(true, crc, header, offsetof(RecoveryIndexHeader, crc));
+	COMP_FILE_CRC32(true, crc, buf, size);
+	FIN_FILE_CRC32(true, crc);
+
+	if (!EQ_CRC32C(crc, header->crc))
+		goto corrupted;
+
+	fio_close(fd);
+
+	if (!wal_sidecar_is_current(archive_dir, xlogfname, header->wal_crc, path))
+	{
+		pg_free(buf);
+		return false;
+	}
+
+	for (i = 0; restore_points && i < header->nrestore_points; i++)
+	{
+		RecoveryIndexRestorePoint *point = pgut_new(RecoveryIndexRestorePoint);
+
+		memcpy(point, buf + i * sizeof(RecoveryIndexRestorePoint),
+			   sizeof(RecoveryIndexRestorePoint));
+		point->name[MAXFNAMELEN - 1] = '\0';
+		parray_append(restore_points, point);
 	}
 
+	pg_free(buf);
+	return true;
+
+corrupted:
+	elog(WARNING, "Recovery target index file \"%s\" is corrupted, WAL segment will be parsed",
+		 path);
+	pg_free(buf);
+	fio_close(fd);
 	return false;
 }
 
-bool validate_wal_segment(TimeLineID tli, XLogSegNo segno, const char *prefetch_dir, uint32 wal_seg_size)
+/*
+ * Find the first restore point named name created after startpoint on
+ * timeline tli using recovery target indexes of consecutive archived
+ * segments, like recovery does with recovery_target_name.
+ *
+ * Returns InvalidXLogRecPtr if it isn't found before the first segment
+ * without usable index.
+ */
+XLogRecPtr
+find_restore_point(const char *archivedir, const char *name, TimeLineID tli,
+				   XLogRecPtr startpoint, uint32 seg_size)
 {
-	XLogRecPtr startpoint;
-	XLogRecPtr endpoint;
+	XLogSegNo	segno;
+	XLogRecPtr	found = InvalidXLogRecPtr;
 
-	bool rc;
-	int tmp_num_threads = num_threads;
-	num_threads = 1;
+	GetXLogSegNo(startpoint, segno, seg_size);
 
-	/* calculate startpoint and endpoint */
-	GetXLogRecPtr(segno, 0, wal_seg_size, startpoint);
-	GetXLogRecPtr(segno+1, 0, wal_seg_size, endpoint);
+	while (XLogRecPtrIsInvalid(found))
+	{
+		RecoveryIndexHeader header;
+		parray	   *restore_points = parray_new();
+		bool		indexed;
+		int			i;
 
-	/* disable multi-threading */
-	num_threads = 1;
+		indexed = read_recovery_index(archivedir, tli, segno++, seg_size,
+									  &header, restore_points);
 
-	rc = RunXLogThreads(prefetch_dir, 0, InvalidTransactionId,
-						InvalidXLogRecPtr, tli, wal_seg_size,
-						startpoint, endpoint, false, NULL, NULL, true);
+		for (i = 0; i < parray_num(restore_points); i++)
+		{
+			RecoveryIndexRestorePoint *point = parray_get(restore_points, i);
 
-	num_threads = tmp_num_threads;
+			if (point->lsn >= startpoint && strcmp(point->name, name) == 0)
+			{
+				found = point->lsn;
+				break;
+			}
+		}
 
-	return rc;
+		parray_walk(restore_points, pfree);
+		parray_free(restore_points);
+
+		if (!indexed)
+			break;
+	}
+
+	return found;
 }
 
+/*
+ * Find where decoding of WAL following startpoint on timeline tli should
+ * begin to reach the recovery target, using recovery target indexes of
+ * consecutive archived segments. Segments, which index shows that the target
+ * is not reached there, are skipped: the index matches the archived segment,
+ * so their WAL is present and intact.
+ *
+ * Returns the beginning of the first segment, where the target may be
+ * reached, or of the last indexed segment before the first segment without
+ * usable index, so WAL is decoded from there as without indexes. Returns
+ * startpoint itself if its segment is not indexed.
+ */
+static XLogRecPtr
+find_indexed_target(const char *archivedir, TimeLineID tli, uint32 seg_size,
+					XLogRecPtr startpoint, time_t target_time,
+					TransactionId target_xid, XLogRecPtr target_lsn)
+{
+	XLogSegNo	segno;
+	XLogRecPtr	decode_from = startpoint;
+
+	GetXLogSegNo(startpoint, segno, seg_size);
+
+	for (;; segno++)
+	{
+		RecoveryIndexHeader header;
+
+		if (!read_recovery_index(archivedir, tli, segno, seg_size, &header, NULL))
+			break;
+
+		/* decoding from the segment start skips the record crossing into it */
+		decode_from = Max(startpoint, header.start_lsn);
+
+		if (XRecOffIsValid(target_lsn) && target_lsn < header.end_lsn)
+			break;
+
+		if (target_time != 0 && header.max_time != 0 &&
+			timestamptz_to_time_t(header.max_time) >= target_time)
+			break;
+
+		if (TransactionIdIsValid(target_xid) &&
+			TransactionIdIsValid(header.min_xid) &&
+			!XidPrecedes(target_xid, header.min_xid) &&
+			!XidPrecedes(header.max_xid, target_xid))
+			break;
+	}
+
+	return decode_from;
+}
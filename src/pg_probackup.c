@@ -35,6 +35,7 @@ typedef enum ProbackupSubcmd
 	DELETE_INSTANCE_CMD,
 	ARCHIVE_PUSH_CMD,
 	ARCHIVE_GET_CMD,
+	ARCHIVE_PACK_CMD,
 	BACKUP_CMD,
 	RESTORE_CMD,
 	VALIDATE_CMD,
@@ -101,6 +102,8 @@ bool no_validate = false;
 
 bool skip_block_validation = false;
 bool skip_external_dirs = false;
+static bool stage_wal = false;
+static bool remote_apply = false;
 
 /* array for datnames, provided via db-include and db-exclude */
 static parray *datname_exclude_list = NULL;
@@ -117,6 +120,7 @@ bool		delete_expired = false;
 bool		merge_expired = false;
 bool		force = false;
 bool		dry_run = false;
+bool		delete_trash = false;
 static char *delete_status = NULL;
 /* compression options */
 bool 		compress_shortcut = false;
@@ -130,10 +134,18 @@ static char *wal_file_path;
 static char *wal_file_name;
 static bool file_overwrite = false;
 static bool no_ready_rename = false;
+static bool block_summary = false;
+static bool recovery_index = false;
+static bool push_daemon = false;
+static char *push_socket = NULL;
 
 /* archive get options */
 static char *prefetch_dir;
 bool no_validate_wal = false;
+static bool async_prefetch = false;
+
+/* archive pack options */
+static int	pack_size = 64;
 
 /* show options */
 ShowFormat show_format = SHOW_PLAIN;
@@ -198,6 +210,8 @@ static ConfigOption cmd_options[] =
 	{ 'b', 143, "no-validate",		&no_validate,		SOURCE_CMD_STRICT },
 	{ 'b', 154, "skip-block-validation", &skip_block_validation,	SOURCE_CMD_STRICT },
 	{ 'b', 156, "skip-external-dirs", &skip_external_dirs,	SOURCE_CMD_STRICT },
+	{ 'b', 174, "stage-wal",		&stage_wal,			SOURCE_CMD_STRICT },
+	{ 'b', 177, "remote-apply",		&remote_apply,		SOURCE_CMD_STRICT },
 	{ 'f', 158, "db-include", 		opt_datname_include_list, SOURCE_CMD_STRICT },
 	{ 'f', 159, "db-exclude", 		opt_datname_exclude_list, SOURCE_CMD_STRICT },
 	{ 'b', 'R', "restore-as-replica", &restore_as_replica,	SOURCE_CMD_STRICT },
@@ -211,6 +225,7 @@ static ConfigOption cmd_options[] =
 	{ 'b', 145, "wal",				&delete_wal,		SOURCE_CMD_STRICT },
 	{ 'b', 146, "expired",			&delete_expired,	SOURCE_CMD_STRICT },
 	{ 's', 172, "status",			&delete_status,		SOURCE_CMD_STRICT },
+	{ 'b', 176, "trash",			&delete_trash,		SOURCE_CMD_STRICT },
 
 	/* TODO not implemented yet */
 	{ 'b', 147, "force",			&force,				SOURCE_CMD_STRICT },
@@ -227,9 +242,16 @@ static ConfigOption cmd_options[] =
 	{ 'b', 152, "overwrite",		&file_overwrite,	SOURCE_CMD_STRICT },
 	{ 'b', 153, "no-ready-rename",	&no_ready_rename,	SOURCE_CMD_STRICT },
 	{ 'i', 162, "batch-size",		&batch_size,		SOURCE_CMD_STRICT },
+	{ 'b', 161, "block-summary",	&block_summary,		SOURCE_CMD_STRICT },
+	{ 'b', 167, "recovery-index",	&recovery_index,	SOURCE_CMD_STRICT },
+	{ 'b', 168, "daemon",			&push_daemon,		SOURCE_CMD_STRICT },
+	{ 's', 169, "socket",			&push_socket,		SOURCE_CMD_STRICT },
 	/* archive-get options */
 	{ 's', 163, "prefetch-dir",		&prefetch_dir,		SOURCE_CMD_STRICT },
 	{ 'b', 164, "no-validate-wal",	&no_validate_wal,	SOURCE_CMD_STRICT },
+	{ 'b', 173, "async-prefetch",	&async_prefetch,	SOURCE_CMD_STRICT },
+	/* archive-pack options */
+	{ 'i', 175, "pack-size",		&pack_size,			SOURCE_CMD_STRICT },
 	/* show options */
 	{ 'f', 165, "format",			opt_show_format,	SOURCE_CMD_STRICT },
 	{ 'b', 166, "archive",			&show_archive,		SOURCE_CMD_STRICT },
@@ -255,11 +277,11 @@ setMyLocation(void)
 {
 
 #ifdef WIN32
-	if (IsSshProtocol())
+	if (IsRemoteProtocol())
 		elog(ERROR, "Currently remote operations on Windows are not supported");
 #endif
 
-	MyLocation = IsSshProtocol()
+	MyLocation = IsRemoteProtocol()
 		? (backup_subcmd == ARCHIVE_PUSH_CMD || backup_subcmd == ARCHIVE_GET_CMD)
 		   ? FIO_DB_HOST
 		   : (backup_subcmd == BACKUP_CMD || backup_subcmd == RESTORE_CMD || backup_subcmd == ADD_INSTANCE_CMD)
@@ -313,6 +335,8 @@ main(int argc, char *argv[])
 			backup_subcmd = ARCHIVE_PUSH_CMD;
 		else if (strcmp(argv[1], "archive-get") == 0)
 			backup_subcmd = ARCHIVE_GET_CMD;
+		else if (strcmp(argv[1], "archive-pack") == 0)
+			backup_subcmd = ARCHIVE_PACK_CMD;
 		else if (strcmp(argv[1], "add-instance") == 0)
 			backup_subcmd = ADD_INSTANCE_CMD;
 		else if (strcmp(argv[1], "del-instance") == 0)
@@ -345,6 +369,21 @@ main(int argc, char *argv[])
 #endif
 		else if (strcmp(argv[1], "agent") == 0 && argc > 2)
 		{
+#ifndef WIN32
+			/* standalone agent serving direct connections, see fio_agent_listen() */
+			if (strncmp(argv[2], "--listen=", strlen("--listen=")) == 0)
+			{
+				bool allow_external = false;
+
+				remote_agent = PROGRAM_VERSION;
+				if (argc > 3 && strcmp(argv[3], "--allow-external") == 0)
+					allow_external = true;
+				else if (argc > 3)
+					elog(ERROR, "Invalid agent option \"%s\"", argv[3]);
+				fio_agent_listen(argv[2] + strlen("--listen="), allow_external);
+				return 0;
+			}
+#endif
 			remote_agent = argv[2];
 			if (strcmp(remote_agent, PROGRAM_VERSION) != 0)
 			{
@@ -353,7 +392,13 @@ main(int argc, char *argv[])
 					 "Agent version %s doesn't match master pg_probackup version %s",
 					 PROGRAM_VERSION, remote_agent);
 			}
-			fio_communicate(STDIN_FILENO, STDOUT_FILENO);
+#ifndef WIN32
+			if (argc > 3 && strcmp(argv[3], "mux") == 0)
+				fio_mux_serve(STDIN_FILENO, STDOUT_FILENO,
+							  argc > 4 && strcmp(argv[4], "zlib") == 0, NULL);
+			else
+#endif
+				fio_communicate(STDIN_FILENO, STDOUT_FILENO);
 			return 0;
 		}
 		else if (strcmp(argv[1], "--help") == 0 ||
@@ -434,6 +479,20 @@ main(int argc, char *argv[])
 	if (help_opt)
 		help_command(command_name);
 
+	/*
+	 * archive-push client just hands WAL file over to the daemon, it
+	 * doesn't need the catalog. Push the file as usual if the daemon has
+	 * failed.
+	 */
+	if (backup_subcmd == ARCHIVE_PUSH_CMD && push_socket && !push_daemon &&
+		archive_push_client(push_socket, wal_file_name,
+							backup_path ? backup_path : getenv("BACKUP_PATH"),
+							instance_name, file_overwrite, no_sync,
+							no_ready_rename, block_summary, recovery_index,
+							compress_shortcut ? ZLIB_COMPRESS : instance_config.compress_alg,
+							instance_config.compress_level))
+		return 0;
+
 	/* backup_path is required for all pg_probackup commands except help and checkdb */
 	if (backup_path == NULL)
 	{
@@ -667,15 +726,7 @@ main(int argc, char *argv[])
 		dbuser = pstrdup(instance_config.conn_opt.pguser);
 
 	/* setup exclusion list for file search */
-	if (!backup_logs)
-	{
-		int			i;
-
-		for (i = 0; pgdata_exclude_dir[i]; i++);		/* find first empty slot */
-
-		/* Set 'pg_log' in first empty slot */
-		pgdata_exclude_dir[i] = PG_LOG_DIR;
-	}
+	set_pg_log_exclusion(!backup_logs);
 
 	if (backup_subcmd == VALIDATE_CMD || backup_subcmd == RESTORE_CMD)
 	{
@@ -709,6 +760,8 @@ main(int argc, char *argv[])
 		restore_params->primary_slot_name = replication_slot;
 		restore_params->skip_block_validation = skip_block_validation;
 		restore_params->skip_external_dirs = skip_external_dirs;
+		restore_params->stage_wal = stage_wal;
+		restore_params->remote_apply = remote_apply;
 		restore_params->partial_db_list = NULL;
 		restore_params->partial_restore_type = NONE;
 		restore_params->primary_conninfo = primary_conninfo;
@@ -776,12 +829,22 @@ main(int argc, char *argv[])
 	switch (backup_subcmd)
 	{
 		case ARCHIVE_PUSH_CMD:
-			do_archive_push(&instance_config, wal_file_path, wal_file_name,
-							batch_size, file_overwrite, no_sync, no_ready_rename);
+			if (push_daemon)
+				do_archive_push_daemon(&instance_config, push_socket, batch_size,
+									   file_overwrite, no_sync, no_ready_rename,
+									   block_summary, recovery_index);
+			else
+				do_archive_push(&instance_config, wal_file_path, wal_file_name,
+								batch_size, file_overwrite, no_sync, no_ready_rename,
+								block_summary, recovery_index);
 			break;
 		case ARCHIVE_GET_CMD:
 			do_archive_get(&instance_config, prefetch_dir,
-						   wal_file_path, wal_file_name, batch_size, !no_validate_wal);
+						   wal_file_path, wal_file_name, batch_size, !no_validate_wal,
+						   async_prefetch);
+			break;
+		case ARCHIVE_PACK_CMD:
+			do_archive_pack(&instance_config, pack_size, no_sync);
 			break;
 		case ADD_INSTANCE_CMD:
 			return do_add_instance(&instance_config);
@@ -35,8 +35,7 @@
 #include "utils/parray.h"
 #include "utils/pgut.h"
 #include "utils/file.h"
-
-#include "datapagemap.h"
+#include "utils/pagemap.h"
 
 /* pgut client variables and full path */
 extern const char  *PROGRAM_NAME;
@@ -65,6 +64,7 @@ extern const char  *PROGRAM_EMAIL;
 #define PG_TABLESPACE_MAP_FILE "tablespace_map"
 #define EXTERNAL_DIR			"external_directories/externaldir"
 #define DATABASE_MAP			"database_map"
+#define STAGED_WAL_LIST			"pbk_staged"
 
 /* Timeout defaults */
 #define ARCHIVE_TIMEOUT_DEFAULT		300
@@ -175,12 +175,14 @@ typedef struct pgFile
 	bool	exists_in_prev;		/* Mark files, both data and regular, that exists in previous backup */
 	CompressAlg		compress_alg;		/* compression algorithm applied to the file */
 	volatile 		pg_atomic_flag lock;/* lock for synchronization of parallel threads  */
-	datapagemap_t	pagemap;			/* bitmap of pages updated since previous backup
-										   may take up to 16kB per file */
+	pagemap_t		pagemap;			/* set of pages updated since previous backup */
 	bool			pagemap_isabsent;	/* Used to mark files with unknown state of pagemap,
 										 * i.e. datafiles without _ptrack */
 } pgFile;
 
+/* Callback to discard entries while reading backup content list */
+typedef bool (*pgFileFilter) (pgFile *file, void *arg);
+
 typedef struct page_map_entry
 {
 	const char	*path;		/* file or directory name */
@@ -188,9 +190,6 @@ typedef struct page_map_entry
 	size_t		 pagemapsize;
 } page_map_entry;
 
-/* Special values of datapagemap_t bitmapsize */
-#define PageBitmapIsEmpty 0		/* Used to mark unchanged datafiles */
-
 /* Current state of backup */
 typedef enum BackupStatus
 {
@@ -229,8 +228,8 @@ typedef enum ShowFormat
 #define BYTES_INVALID		(-1) /* file didn`t changed since previous backup, DELTA backup do not rely on it */
 #define FILE_NOT_FOUND		(-2) /* file disappeared during backup */
 #define BLOCKNUM_INVALID	(-1)
-#define PROGRAM_VERSION	"2.3.0"
-#define AGENT_PROTOCOL_VERSION 20300
+#define PROGRAM_VERSION	"2.3.1"
+#define AGENT_PROTOCOL_VERSION 20301
 
 
 typedef struct ConnectionOptions
@@ -282,6 +281,9 @@ typedef struct InstanceConfig
 	/* cmdline to be used as restore_command */
 	char	   *restore_command;
 
+	/* Cache listing of WAL archive in archive.state, see walstate.c */
+	bool		archive_state_cache;
+
 	/* Logger parameters */
 	LoggerConfig logger;
 
@@ -427,6 +429,8 @@ typedef struct pgRestoreParams
 	bool	skip_block_validation; //Start using it
 	const char *restore_command;
 	const char *primary_slot_name;
+	bool	stage_wal;
+	bool	remote_apply;
 
 	/* options for partial restore */
 	PartialRestoreType partial_restore_type;
@@ -517,13 +521,18 @@ typedef enum xlogFileType
 	SEGMENT,
 	TEMP_SEGMENT,
 	PARTIAL_SEGMENT,
-	BACKUP_HISTORY_FILE
+	BACKUP_HISTORY_FILE,
+	BLOCK_SUMMARY,
+	RECOVERY_INDEX,
+	WAL_CHECKSUM,
+	WAL_PACK
 } xlogFileType;
 
 typedef struct xlogFile
 {
 	pgFile       file;
-	XLogSegNo    segno;
+	XLogSegNo    segno;		/* for WAL_PACK it is the last segment in pack */
+	XLogSegNo    pack_first_segno;	/* used only by WAL_PACK */
 	xlogFileType type;
 	bool         keep; /* Used to prevent removal of WAL segments
                         * required by ARCHIVE backups. */
@@ -623,7 +632,57 @@ typedef struct BackupPageHeader
 	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
 	 strcmp((fname) + XLOG_FNAME_LEN, ".gz.part") == 0)
 
+#define IsBlockSummaryFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN + strlen(".bsum") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 strcmp((fname) + XLOG_FNAME_LEN, ".bsum") == 0)
+
+#define IsTempBlockSummaryFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN + strlen(".bsum.part") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 strcmp((fname) + XLOG_FNAME_LEN, ".bsum.part") == 0)
+
+#define IsRecoveryIndexFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN + strlen(".ridx") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 strcmp((fname) + XLOG_FNAME_LEN, ".ridx") == 0)
+
+#define IsTempRecoveryIndexFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN + strlen(".ridx.part") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 strcmp((fname) + XLOG_FNAME_LEN, ".ridx.part") == 0)
+
+#define IsWalChecksumFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN + strlen(".crc") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 strcmp((fname) + XLOG_FNAME_LEN, ".crc") == 0)
+
+#define IsTempWalChecksumFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN + strlen(".crc.part") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 strcmp((fname) + XLOG_FNAME_LEN, ".crc.part") == 0)
+
+#define IsWalPackFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN * 2 + 1 + strlen(".pack") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 (fname)[XLOG_FNAME_LEN] == '-' &&		\
+	 strspn((fname) + XLOG_FNAME_LEN + 1, "0123456789ABCDEF") == XLOG_FNAME_LEN && \
+	 strcmp((fname) + XLOG_FNAME_LEN * 2 + 1, ".pack") == 0)
+
+#define IsTempWalPackFileName(fname)	\
+	(strlen(fname) == XLOG_FNAME_LEN * 2 + 1 + strlen(".pack.part") &&	\
+	 strspn(fname, "0123456789ABCDEF") == XLOG_FNAME_LEN &&		\
+	 (fname)[XLOG_FNAME_LEN] == '-' &&		\
+	 strspn((fname) + XLOG_FNAME_LEN + 1, "0123456789ABCDEF") == XLOG_FNAME_LEN && \
+	 strcmp((fname) + XLOG_FNAME_LEN * 2 + 1, ".pack.part") == 0)
+
+/* archive listing cache, see walstate.c */
+#define IsWalStateFileName(fname)	\
+	(strncmp(fname, "archive.", strlen("archive.")) == 0)
+
 #define IsSshProtocol() (instance_config.remote.host && strcmp(instance_config.remote.proto, "ssh") == 0)
+#define IsTcpProtocol() (instance_config.remote.host && strcmp(instance_config.remote.proto, "tcp") == 0)
+#define IsRemoteProtocol() (IsSshProtocol() || IsTcpProtocol())
 
 /* directory options */
 extern char	   *backup_path;
@@ -642,6 +701,7 @@ extern bool 	temp_slot;
 
 /* backup options */
 extern bool		smooth_checkpoint;
+extern bool		backup_logs;
 
 /* remote probackup options */
 extern char* remote_agent;
@@ -653,6 +713,7 @@ extern bool		delete_wal;
 extern bool		delete_expired;
 extern bool		merge_expired;
 extern bool		dry_run;
+extern bool		delete_trash;
 
 /* compression options */
 extern bool		compress_shortcut;
@@ -726,9 +787,45 @@ extern int do_add_instance(InstanceConfig *instance);
 /* in archive.c */
 extern void do_archive_push(InstanceConfig *instance, char *wal_file_path,
 						   char *wal_file_name, int batch_size, bool overwrite,
-						   bool no_sync, bool no_ready_rename);
+						   bool no_sync, bool no_ready_rename, bool block_summary,
+						   bool recovery_index);
+extern void do_archive_push_daemon(InstanceConfig *instance, const char *socket_path,
+								   int batch_size, bool overwrite, bool no_sync,
+								   bool no_ready_rename, bool block_summary,
+								   bool recovery_index);
+extern bool archive_push_client(const char *socket_path, const char *wal_file_name,
+								const char *backup_dir, const char *instance,
+								bool overwrite, bool no_sync, bool no_ready_rename,
+								bool block_summary, bool recovery_index,
+								CompressAlg compress_alg, int compress_level);
 extern void do_archive_get(InstanceConfig *instance, const char *prefetch_dir_arg, char *wal_file_path,
-						   char *wal_file_name, int batch_size, bool validate_wal);
+						   char *wal_file_name, int batch_size, bool validate_wal,
+						   bool async_prefetch);
+extern bool read_wal_checksum(const char *archive_dir, const char *wal_file_name,
+							  pg_crc32 *wal_crc, uint64 *wal_size);
+
+/* in walstate.c */
+extern void wal_state_list_archive(const char *archive_dir, parray *files,
+				   bool use_cache);
+extern void wal_state_add(const char *path, int64 size);
+extern void wal_state_remove(const char *path);
+
+/* in walpack.c */
+extern void do_archive_pack(InstanceConfig *instance, int pack_size, bool no_sync);
+extern bool parse_wal_pack_name(const char *name, uint32 seg_size, TimeLineID *tli,
+								XLogSegNo *first_segno, XLogSegNo *last_segno);
+extern bool find_wal_pack(const char *archive_dir, TimeLineID tli,
+						  XLogSegNo segno, uint32 seg_size, char *pack_path,
+						  fio_location location);
+extern bool get_wal_from_pack(const char *archive_dir, TimeLineID tli,
+							  XLogSegNo segno, uint32 seg_size, char *buf,
+							  char *pack_path, char *errmsg, size_t errmsg_len,
+							  fio_location location);
+extern bool locate_wal_in_pack(const char *archive_dir, TimeLineID tli,
+							   XLogSegNo segno, uint32 seg_size, char *pack_path,
+							   uint64 *offset, uint64 *size, bool *compressed,
+							   char *errmsg, size_t errmsg_len,
+							   fio_location location);
 
 /* in configure.c */
 extern void do_show_config(void);
@@ -834,6 +931,10 @@ extern void append_children(parray *backup_list, pgBackup *target_backup, parray
 extern bool launch_agent(void);
 extern void launch_ssh(char* argv[]);
 extern void wait_ssh(void);
+#ifndef WIN32
+extern void fio_mux_serve(int in, int out, bool compress, uint8 const* keys);
+extern void fio_agent_listen(char const* address, bool allow_external);
+#endif
 
 #define COMPRESS_ALG_DEFAULT NOT_DEFINED_COMPRESS
 #define COMPRESS_LEVEL_DEFAULT 1
@@ -842,9 +943,14 @@ extern CompressAlg parse_compress_alg(const char *arg);
 extern const char* deparse_compress_alg(int alg);
 
 /* in dir.c */
+typedef bool (*dir_list_callback)(pgFile *file, void *arg);
+
+extern void set_pg_log_exclusion(bool exclude);
 extern void dir_list_file(parray *files, const char *root, bool exclude,
 						  bool follow_symlink, bool add_root,
 						  int external_dir_num, fio_location location);
+extern void dir_list_tree(const char *root, bool exclude, bool follow_symlink,
+						  dir_list_callback send, void *send_arg);
 
 extern void create_data_directories(parray *dest_files,
 										const char *data_dir,
@@ -868,6 +974,9 @@ extern void print_file_list(FILE *out, const parray *files, const char *root,
 							const char *external_prefix, parray *external_list);
 extern parray *dir_read_file_list(const char *root, const char *external_prefix,
 								  const char *file_txt, fio_location location);
+extern parray *dir_read_file_list_filtered(const char *root, const char *external_prefix,
+										   const char *file_txt, fio_location location,
+										   pgFileFilter filter, void *filter_arg);
 extern parray *make_external_directory_list(const char *colon_separated_dirs,
 											bool remap);
 extern void free_dir_list(parray *list);
@@ -923,9 +1032,10 @@ extern void backup_non_data_file_internal(const char *from_fullpath,
 										  bool missing_ok);
 
 extern size_t restore_data_file(parray *parent_chain, pgFile *dest_file,
-								  FILE *out, const char *to_fullpath);
+								  FILE *out, const char *to_fullpath, bool remote_apply);
 extern size_t restore_data_file_internal(FILE *in, FILE *out, pgFile *file, uint32 backup_version,
 								  const char *from_fullpath, const char *to_fullpath, int nblocks);
+extern bool page_may_be_compressed(Page page, CompressAlg alg, uint32 backup_version);
 extern size_t restore_non_data_file(parray *parent_chain, pgBackup *dest_backup,
 								  pgFile *dest_file, FILE *out, const char *to_fullpath);
 extern void restore_non_data_file_internal(FILE *in, FILE *out, pgFile *file,
@@ -940,10 +1050,10 @@ extern bool extractPageMap(const char *archivedir, uint32 wal_seg_size,
 						   XLogRecPtr startpoint, TimeLineID start_tli,
 						   XLogRecPtr endpoint, TimeLineID end_tli,
 						   parray *tli_list);
-extern void validate_wal(pgBackup *backup, const char *archivedir,
-						 time_t target_time, TransactionId target_xid,
-						 XLogRecPtr target_lsn, TimeLineID tli,
-						 uint32 seg_size);
+extern XLogRecPtr validate_wal(pgBackup *backup, const char *archivedir,
+							   time_t target_time, TransactionId target_xid,
+							   XLogRecPtr target_lsn, TimeLineID tli,
+							   uint32 seg_size);
 extern bool validate_wal_segment(TimeLineID tli, XLogSegNo segno,
 								 const char *prefetch_dir, uint32 wal_seg_size);
 extern bool read_recovery_info(const char *archivedir, TimeLineID tli,
@@ -958,6 +1068,15 @@ extern XLogRecPtr get_prior_record_lsn(const char *archivedir, XLogRecPtr start_
 
 extern XLogRecPtr get_first_record_lsn(const char *archivedir, XLogRecPtr start_lsn,
 									   TimeLineID tli, uint32 wal_seg_size, int timeout);
+extern bool summarize_wal_segment(const char *wal_file_name, const char *pg_xlog_dir,
+								  const char *archive_dir, uint32 seg_size,
+								  bool block_summary, bool recovery_index,
+								  bool no_sync, int thread_num);
+extern XLogRecPtr find_restore_point(const char *archivedir, const char *name,
+									 TimeLineID tli, XLogRecPtr startpoint,
+									 uint32 seg_size);
+extern bool write_wal_sidecar(const char *path, const char *buf, size_t size,
+							  bool no_sync, int elevel, int thread_num);
 
 /* in util.c */
 extern TimeLineID get_current_timeline(PGconn *conn);
@@ -1014,7 +1133,8 @@ extern parray * pg_ptrack_get_pagemapset(PGconn *backup_conn, const char *ptrack
 /* FIO */
 extern int fio_send_pages(FILE* in, FILE* out, pgFile *file, XLogRecPtr horizonLsn,
 						   int calg, int clevel, uint32 checksum_version,
-						   datapagemap_t *pagemap, BlockNumber* err_blknum, char **errormsg);
+						   pagemap_t *pagemap, fio_page_callback fetch_page, void *fetch_arg,
+						   BlockNumber* err_blknum, char **errormsg);
 /* return codes for fio_send_pages */
 #define OUT_BUF_SIZE (512 * 1024)
 extern int fio_send_file_gz(const char *from_fullpath, const char *to_fullpath, FILE* out, int thread_num);
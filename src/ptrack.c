@@ -111,20 +111,17 @@ make_pagemap_from_ptrack_1(parray *files, PGconn *backup_conn)
 				}
 				else
 				{
+					size_t		bitmapsize;
 
 					if (start_addr + RELSEG_SIZE/HEAPBLOCKS_PER_BYTE > ptrack_nonparsed_size)
-					{
-						file->pagemap.bitmapsize = ptrack_nonparsed_size - start_addr;
-						elog(VERBOSE, "pagemap size: %i", file->pagemap.bitmapsize);
-					}
+						bitmapsize = ptrack_nonparsed_size - start_addr;
 					else
-					{
-						file->pagemap.bitmapsize = RELSEG_SIZE/HEAPBLOCKS_PER_BYTE;
-						elog(VERBOSE, "pagemap size: %i", file->pagemap.bitmapsize);
-					}
+						bitmapsize = RELSEG_SIZE/HEAPBLOCKS_PER_BYTE;
 
-					file->pagemap.bitmap = pg_malloc(file->pagemap.bitmapsize);
-					memcpy(file->pagemap.bitmap, ptrack_nonparsed+start_addr, file->pagemap.bitmapsize);
+					pagemap_from_bitmap(&file->pagemap, ptrack_nonparsed + start_addr,
+										bitmapsize);
+					elog(VERBOSE, "pagemap size: %zu, changed blocks: %u",
+						 bitmapsize, pagemap_count(&file->pagemap));
 				}
 			}
 			else
@@ -693,8 +690,10 @@ make_pagemap_from_ptrack_2(parray *files,
 		if (map)
 		{
 			elog(VERBOSE, "Using ptrack pagemap for file \"%s\"", file->rel_path);
-			file->pagemap.bitmapsize = map->pagemapsize;
-			file->pagemap.bitmap = map->pagemap;
+			pagemap_from_bitmap(&file->pagemap, map->pagemap, map->pagemapsize);
+			PQfreemem(map->pagemap);
+			map->pagemap = NULL;
+			map->pagemapsize = 0;
 		}
 	}
 
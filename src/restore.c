@@ -25,6 +25,7 @@ typedef struct
 	parray	   *parent_chain;
 	parray	   *dbOid_exclude_list;
 	bool		skip_external_dirs;
+	bool		remote_apply;
 	const char *to_root;
 	size_t		restored_bytes;
 
@@ -35,6 +36,29 @@ typedef struct
 	int			ret;
 } restore_files_arg;
 
+/* WAL segment or history file to be staged into restored pg_wal */
+typedef struct
+{
+	char		name[MAXFNAMELEN];
+	bool		is_segment;
+	volatile pg_atomic_flag lock;
+} StageWalFile;
+
+typedef struct
+{
+	parray	   *files;
+	const char *wal_dir;
+	bool		no_sync;
+	int			thread_num;
+	size_t		staged_bytes;
+
+	/*
+	 * Return value from the thread.
+	 * 0 means there is no error, 1 - there is an error.
+	 */
+	int			ret;
+} stage_wal_arg;
+
 static void create_recovery_conf(time_t backup_id,
 								 pgRecoveryTarget *rt,
 								 pgBackup *backup,
@@ -46,6 +70,18 @@ static void pg12_recovery_config(pgBackup *backup, bool add_include);
 static void restore_chain(pgBackup *dest_backup, parray *parent_chain,
 						  parray *dbOid_exclude_list, pgRestoreParams *params,
 						  const char *pgdata_path, bool no_sync);
+static parray *read_chain_filelist(pgBackup *backup, parray *dest_files,
+								   bool *resolved);
+static void stage_wal(pgBackup *dest_backup, pgRecoveryTarget *rt,
+					  XLogRecPtr target_lsn, const char *pgdata_path,
+					  bool no_sync);
+static void *stage_wal_files(void *arg);
+static size_t stage_wal_file(const char *wal_dir, StageWalFile *file,
+							 bool no_sync, int thread_num);
+static char *stage_wal_read_pack(const char *wal_file_name, char *from_fullpath,
+								 int thread_num);
+static bool chain_file_is_needed(pgFile *file, void *arg);
+static XLogRecPtr restore_point_lsn(pgBackup *backup, const char *name);
 
 /*
  * Iterate over backup list to find all ancestors of the broken parent_backup
@@ -90,6 +126,38 @@ set_orphan_status(parray *backups, pgBackup *parent_backup)
 	pg_free(parent_backup_id);
 }
 
+/*
+ * Find LSN of restore point recovery would stop at using recovery target
+ * indexes of archived WAL written by "archive-push --recovery-index".
+ * Recovery cannot stop before the end of backup, so it is an error.
+ *
+ * Returns InvalidXLogRecPtr if the restore point isn't indexed, WAL is
+ * validated without recovery target then.
+ */
+static XLogRecPtr
+restore_point_lsn(pgBackup *backup, const char *name)
+{
+	XLogRecPtr	lsn;
+
+	lsn = find_restore_point(arclog_path, name, backup->tli, backup->start_lsn,
+							 instance_config.xlog_seg_size);
+
+	if (XLogRecPtrIsInvalid(lsn))
+	{
+		elog(LOG, "Restore point \"%s\" is not found in recovery target indexes", name);
+		return InvalidXLogRecPtr;
+	}
+
+	if (lsn < backup->stop_lsn)
+		elog(ERROR, "Restore point \"%s\" at %X/%X precedes the end of backup %s at %X/%X",
+			 name, (uint32) (lsn >> 32), (uint32) lsn, base36enc(backup->start_time),
+			 (uint32) (backup->stop_lsn >> 32), (uint32) backup->stop_lsn);
+
+	elog(INFO, "Restore point \"%s\" is found at %X/%X",
+		 name, (uint32) (lsn >> 32), (uint32) lsn);
+	return lsn;
+}
+
 /*
  * Entry point of pg_probackup RESTORE and VALIDATE subcommands.
  */
@@ -108,6 +176,7 @@ do_restore_or_validate(time_t target_backup_id, pgRecoveryTarget *rt,
 	char	   *action = params->is_restore ? "Restore":"Validate";
 	parray	   *parent_chain = NULL;
 	parray	   *dbOid_exclude_list = NULL;
+	XLogRecPtr	target_lsn = InvalidXLogRecPtr;
 
 	if (params->is_restore)
 	{
@@ -396,14 +465,21 @@ do_restore_or_validate(time_t target_backup_id, pgRecoveryTarget *rt,
 		// TODO: there should be a way for a user to request only(!) WAL validation
 		if (!corrupted_backup)
 		{
+			target_lsn = rt->target_lsn;
+
+			/* Validate WAL up to the restore point, if it is indexed */
+			if (rt->target_name)
+				target_lsn = restore_point_lsn(dest_backup, rt->target_name);
+
 			/*
 			 * Validate corresponding WAL files.
 			 * We pass base_full_backup timeline as last argument to this function,
 			 * because it's needed to form the name of xlog file.
+			 * Remember where the target is reached to bound staged WAL.
 			 */
-			validate_wal(dest_backup, arclog_path, rt->target_time,
-						 rt->target_xid, rt->target_lsn,
-						 dest_backup->tli, instance_config.xlog_seg_size);
+			target_lsn = validate_wal(dest_backup, arclog_path, rt->target_time,
+									  rt->target_xid, target_lsn,
+									  dest_backup->tli, instance_config.xlog_seg_size);
 		}
 		/* Orphanize every OK descendant of corrupted backup */
 		else
@@ -468,6 +544,20 @@ do_restore_or_validate(time_t target_backup_id, pgRecoveryTarget *rt,
 		restore_chain(dest_backup, parent_chain, dbOid_exclude_list,
 							params, instance_config.pgdata, no_sync);
 
+		/* Place WAL needed for recovery into restored pg_wal */
+		if (params->stage_wal)
+		{
+			if (rt->target_stop && strcmp(rt->target_stop, "immediate") == 0)
+				target_lsn = dest_backup->stop_lsn;
+			else if (XLogRecPtrIsInvalid(target_lsn) && rt->lsn_string)
+				target_lsn = rt->target_lsn;
+			else if (XLogRecPtrIsInvalid(target_lsn) && rt->target_name)
+				target_lsn = restore_point_lsn(dest_backup, rt->target_name);
+
+			stage_wal(dest_backup, rt, target_lsn, instance_config.pgdata,
+					  no_sync);
+		}
+
 		/* Create recovery.conf with given recovery target parameters */
 		create_recovery_conf(target_backup_id, rt, dest_backup, params);
 	}
@@ -498,6 +588,10 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 	char		timestamp[100];
 	parray		*dest_files = NULL;
 	parray		*external_dirs = NULL;
+	bool		*resolved;
+	char	   **dir_paths;
+	int		   *dir_modes;
+	int			n_dirs = 0;
 	/* arrays with meta info for multi threaded backup */
 	pthread_t  *threads;
 	restore_files_arg *threads_args;
@@ -518,6 +612,13 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 	join_path_components(control_file, dest_backup->root_dir, DATABASE_FILE_LIST);
 	dest_files = dir_read_file_list(NULL, NULL, control_file, FIO_BACKUP_HOST);
 
+	/*
+	 * this sorting is important, because we rely on it to find
+	 * destination file in intermediate backups file lists
+	 * using bsearch and to merge-join these lists with destination list.
+	 */
+	parray_qsort(dest_files, pgFileCompareRelPathWithExternal);
+
 	/* Lock backup chain and make sanity checks */
 	for (i = parray_num(parent_chain) - 1; i >= 0; i--)
 	{
@@ -547,23 +648,29 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 			elog(ERROR,
 				"XLOG_BLCKSZ(%d) is not compatible(%d expected)",
 				backup->wal_block_size, XLOG_BLCKSZ);
+	}
 
-		/* populate backup filelist */
-		if (backup->start_time != dest_backup->start_time)
-		{
-			join_path_components(control_file, backup->root_dir, DATABASE_FILE_LIST);
-			backup->files = dir_read_file_list(NULL, NULL, control_file, FIO_BACKUP_HOST);
-		}
-		else
-			backup->files = dest_files;
+	/*
+	 * Populate file lists of the chain from the direct parent of destination
+	 * backup to the oldest backup, so that copies of non-data files hidden
+	 * by newer full copies are not kept, see read_chain_filelist().
+	 */
+	resolved = palloc0(parray_num(dest_files) * sizeof(bool));
+	for (i = 0; i < parray_num(dest_files); i++)
+	{
+		pgFile	   *dest_file = (pgFile *) parray_get(dest_files, i);
 
-		/*
-		 * this sorting is important, because we rely on it to find
-		 * destination file in intermediate backups file lists
-		 * using bsearch.
-		 */
-		parray_qsort(backup->files, pgFileCompareRelPathWithExternal);
+		resolved[i] = dest_file->write_size >= 0;
+	}
+
+	dest_backup->files = dest_files;
+	for (i = 1; i < parray_num(parent_chain); i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(parent_chain, i);
+
+		backup->files = read_chain_filelist(backup, dest_files, resolved);
 	}
+	pfree(resolved);
 
 	/*
 	 * Restore dest_backup internal directories.
@@ -583,10 +690,19 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 
 		if (parray_num(external_dirs) > 0)
 			elog(LOG, "Restore external directories");
+	}
+
+	/* Directories are created all at once after the loop below, roots first */
+	dir_paths = pgut_newarray(char *, parray_num(dest_files) +
+							  (external_dirs ? parray_num(external_dirs) : 0));
+	dir_modes = pgut_newarray(int, parray_num(dest_files) +
+							  (external_dirs ? parray_num(external_dirs) : 0));
 
-		for (i = 0; i < parray_num(external_dirs); i++)
-			fio_mkdir(parray_get(external_dirs, i),
-					  DIR_PERMISSION, FIO_DB_HOST);
+	for (i = 0; external_dirs && i < parray_num(external_dirs); i++)
+	{
+		dir_paths[n_dirs] = pgut_strdup(parray_get(external_dirs, i));
+		dir_modes[n_dirs] = DIR_PERMISSION;
+		n_dirs++;
 	}
 
 	/*
@@ -612,13 +728,23 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 			join_path_components(dirpath, external_path, file->rel_path);
 
 			elog(VERBOSE, "Create external directory \"%s\"", dirpath);
-			fio_mkdir(dirpath, file->mode, FIO_DB_HOST);
+			dir_paths[n_dirs] = pgut_strdup(dirpath);
+			dir_modes[n_dirs] = file->mode;
+			n_dirs++;
 		}
 
 		/* setup threads */
 		pg_atomic_clear_flag(&file->lock);
 	}
 
+	/* Single round trip for remote location, see create_data_directories() */
+	fio_mkdirs((char const* const*) dir_paths, dir_modes, n_dirs, FIO_DB_HOST);
+
+	for (i = 0; i < n_dirs; i++)
+		pfree(dir_paths[i]);
+	pfree(dir_paths);
+	pfree(dir_modes);
+
 	/*
 	 * Close ssh connection belonging to the main thread
 	 * to avoid the possibility of been killed for idleness
@@ -649,6 +775,7 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 		arg->parent_chain = parent_chain;
 		arg->dbOid_exclude_list = dbOid_exclude_list;
 		arg->skip_external_dirs = params->skip_external_dirs;
+		arg->remote_apply = params->remote_apply;
 		arg->to_root = pgdata_path;
 		threads_args[i].restored_bytes = 0;
 		/* By default there are some error */
@@ -750,6 +877,121 @@ restore_chain(pgBackup *dest_backup, parray *parent_chain,
 	}
 }
 
+/*
+ * Read file list of intermediate backup of the chain, keeping only
+ * the entries that restore_data_file() and restore_non_data_file()
+ * can actually consult.
+ *
+ * Keeping the full list of every chain member in memory makes memory
+ * consumption grow as number of files times length of the chain.
+ * Instead, data files without backed up blocks and directories are thrown
+ * away while the list is being read, and the rest is merge-joined with
+ * sorted list of destination backup:
+ *  - files which are not going to be restored are thrown away;
+ *  - non-data file is kept only until its full copy is met. Lists are read
+ *    from the newest parent to the oldest one, and resolved[] marks
+ *    destination files whose full copy is found in newer backup, so
+ *    restore_non_data_file() never looks further.
+ * Lists in the catalog are ordered by size, so each of them has to be
+ * sorted before the merge, but only one unpruned list is in memory at once.
+ * The result is sorted by pgFileCompareRelPathWithExternal.
+ */
+static parray *
+read_chain_filelist(pgBackup *backup, parray *dest_files, bool *resolved)
+{
+	int			i = 0;
+	int			j;
+	char		control_file[MAXPGPATH];
+	size_t		n_entries = 0;
+	parray	   *files;
+	parray	   *result;
+
+	join_path_components(control_file, backup->root_dir, DATABASE_FILE_LIST);
+	files = dir_read_file_list_filtered(NULL, NULL, control_file, FIO_BACKUP_HOST,
+										chain_file_is_needed, &n_entries);
+
+	parray_qsort(files, pgFileCompareRelPathWithExternal);
+
+	result = parray_new();
+
+	/* both lists are sorted, so a single pass is enough */
+	for (j = 0; j < parray_num(dest_files); j++)
+	{
+		pgFile	   *dest_file = (pgFile *) parray_get(dest_files, j);
+		pgFile	   *file = NULL;
+
+		/* Skip files absent in destination backup */
+		for (; i < parray_num(files); i++)
+		{
+			int			cmp;
+
+			file = (pgFile *) parray_get(files, i);
+			cmp = pgFileCompareRelPathWithExternal(&file, &dest_file);
+
+			if (cmp == 0)
+			{
+				i++;
+				break;
+			}
+			if (cmp > 0)
+			{
+				file = NULL;
+				break;
+			}
+			pgFileFree(file);
+			file = NULL;
+		}
+
+		if (file == NULL)
+			continue;
+
+		if (S_ISDIR(dest_file->mode) ||
+			((!dest_file->is_datafile || dest_file->is_cfs) && resolved[j]))
+		{
+			pgFileFree(file);
+			continue;
+		}
+
+		if (!dest_file->is_datafile || dest_file->is_cfs)
+			resolved[j] = file->write_size >= 0;
+
+		parray_append(result, file);
+	}
+
+	for (; i < parray_num(files); i++)
+		pgFileFree(parray_get(files, i));
+	parray_free(files);
+
+	elog(LOG, "Backup %s: %lu of %lu file list entries are used for restore",
+		 base36enc(backup->start_time), (unsigned long) parray_num(result),
+		 (unsigned long) n_entries);
+
+	return result;
+}
+
+/*
+ * Filter for read_chain_filelist().
+ * Data file which has no blocks in intermediate backup is skipped by
+ * restore_data_file() anyway. Non-data files must be kept even if
+ * unchanged, because restore_non_data_file() treats absence of the file
+ * in intermediate backup as an error.
+ */
+static bool
+chain_file_is_needed(pgFile *file, void *arg)
+{
+	size_t	   *n_entries = (size_t *) arg;
+
+	(*n_entries)++;
+
+	if (S_ISDIR(file->mode))
+		return false;
+
+	if (file->is_datafile && !file->is_cfs && file->write_size <= 0)
+		return false;
+
+	return true;
+}
+
 /*
  * Restore files into $PGDATA.
  */
@@ -833,8 +1075,11 @@ restore_files(void *arg)
 			join_path_components(to_fullpath, external_path, dest_file->rel_path);
 		}
 
-		/* open destination file */
-		out = fio_fopen(to_fullpath, PG_BINARY_W, FIO_DB_HOST);
+		/*
+		 * open destination file, remote open errors are reported
+		 * by fio_disconnect() at the end of the thread
+		 */
+		out = fio_fopen_async(to_fullpath, PG_BINARY_W, FIO_DB_HOST);
 		if (out == NULL)
 		{
 			int errno_tmp = errno;
@@ -864,7 +1109,9 @@ restore_files(void *arg)
 				setvbuf(out, out_buf, _IOFBF, STDIO_BUFSIZE);
 			/* Destination file is data file */
 			arguments->restored_bytes += restore_data_file(arguments->parent_chain,
-															dest_file, out, to_fullpath);
+															dest_file, out, to_fullpath,
+															arguments->remote_apply &&
+															fio_is_remote_file(out));
 		}
 		else
 		{
@@ -894,6 +1141,479 @@ done:
 	return NULL;
 }
 
+/*
+ * Return timeline, which WAL segment belongs to, according to the history
+ * of the target timeline. Segment containing a switchpoint is taken from
+ * the new timeline, as the server does.
+ */
+static TimeLineID
+stage_wal_tli(parray *timelines, XLogSegNo segno, uint32 seg_size)
+{
+	int			i;
+
+	/* timelines are sorted from newest to oldest */
+	for (i = 0; i < parray_num(timelines); i++)
+	{
+		TimeLineHistoryEntry *tln = (TimeLineHistoryEntry *) parray_get(timelines, i);
+		XLogSegNo	begin_segno = 0;
+
+		/* timeline begins, where its parent ends */
+		if (i + 1 < parray_num(timelines))
+		{
+			TimeLineHistoryEntry *parent = (TimeLineHistoryEntry *) parray_get(timelines, i + 1);
+
+			GetXLogSegNo(parent->end, begin_segno, seg_size);
+		}
+
+		if (segno >= begin_segno)
+			return tln->tli;
+	}
+
+	return ((TimeLineHistoryEntry *) parray_get(timelines, parray_num(timelines) - 1))->tli;
+}
+
+/*
+ * Check if WAL file, compressed, plain or packed, exists in the archive.
+ */
+static bool
+wal_file_in_archive(const char *wal_file_name)
+{
+	char		path[MAXPGPATH];
+	TimeLineID	tli;
+	XLogSegNo	segno;
+
+	snprintf(path, MAXPGPATH, "%s/%s.gz", arclog_path, wal_file_name);
+	if (fio_access(path, F_OK, FIO_BACKUP_HOST) == 0)
+		return true;
+
+	join_path_components(path, arclog_path, wal_file_name);
+	if (fio_access(path, F_OK, FIO_BACKUP_HOST) == 0)
+		return true;
+
+	if (!IsXLogFileName(wal_file_name))
+		return false;
+
+	GetXLogFromFileName(wal_file_name, &tli, &segno, instance_config.xlog_seg_size);
+	return find_wal_pack(arclog_path, tli, segno, instance_config.xlog_seg_size,
+						 path, FIO_BACKUP_HOST);
+}
+
+static void
+stage_wal_add_file(parray *files, const char *name, bool is_segment)
+{
+	StageWalFile *file = pgut_new(StageWalFile);
+
+	strncpy(file->name, name, MAXFNAMELEN);
+	file->is_segment = is_segment;
+	pg_atomic_clear_flag(&file->lock);
+
+	parray_append(files, file);
+}
+
+/*
+ * Copy WAL required for recovery from the archive into restored pg_wal,
+ * so the server does not have to run restore_command for every segment.
+ *
+ * Segments are staged starting with the one containing start_lsn of the
+ * backup and follow the history of the target timeline. If target_lsn, the
+ * LSN recovery target is reached at, is known, all segments up to it must be
+ * present in the archive. Otherwise all consecutive segments available in
+ * the archive are staged.
+ */
+static void
+stage_wal(pgBackup *dest_backup, pgRecoveryTarget *rt, XLogRecPtr target_lsn,
+		  const char *pgdata_path, bool no_sync)
+{
+	int			i;
+	char		wal_dir[MAXPGPATH];
+	char		path[MAXPGPATH];
+	char		name[MAXFNAMELEN];
+	FILE	   *fp;
+	parray	   *timelines;
+	parray	   *files = parray_new();
+	TimeLineID	target_tli;
+	XLogSegNo	segno;
+	XLogSegNo	end_segno = 0;
+	uint64		n_segments = 0;
+	uint32		seg_size = instance_config.xlog_seg_size;
+	int			n_threads;
+	pthread_t  *threads;
+	stage_wal_arg *threads_args;
+	bool		stage_isok = true;
+
+	/* fancy reporting */
+	char		pretty_total_bytes[20];
+	char		pretty_time[20];
+	size_t		total_bytes = 0;
+	time_t		start_time, end_time;
+
+	if (parse_server_version(dest_backup->server_version) >= 100000)
+		join_path_components(wal_dir, pgdata_path, "pg_wal");
+	else
+		join_path_components(wal_dir, pgdata_path, "pg_xlog");
+
+	target_tli = rt->target_tli ? rt->target_tli : dest_backup->tli;
+	timelines = read_timeline_history(arclog_path, target_tli);
+
+	if (!XLogRecPtrIsInvalid(target_lsn))
+		GetXLogSegNo(target_lsn, end_segno, seg_size);
+
+	/* history files of target timeline and its ancestors */
+	for (i = 0; i < parray_num(timelines); i++)
+	{
+		TimeLineHistoryEntry *tln = (TimeLineHistoryEntry *) parray_get(timelines, i);
+
+		if (tln->tli == 1)
+			continue;
+
+		snprintf(name, MAXFNAMELEN, "%08X.history", tln->tli);
+		stage_wal_add_file(files, name, false);
+	}
+
+	GetXLogSegNo(dest_backup->start_lsn, segno, seg_size);
+	for (;; segno++)
+	{
+		GetXLogFileName(name, stage_wal_tli(timelines, segno, seg_size),
+						segno, seg_size);
+
+		if (!XLogRecPtrIsInvalid(target_lsn) && segno > end_segno)
+		{
+			/* record at the target may continue in the next segment */
+			if (segno == end_segno + 1 && wal_file_in_archive(name))
+			{
+				stage_wal_add_file(files, name, true);
+				n_segments++;
+			}
+			break;
+		}
+
+		/* segment restored from STREAM backup */
+		if (dest_backup->stream)
+		{
+			join_path_components(path, wal_dir, name);
+			if (fio_access(path, F_OK, FIO_DB_HOST) == 0)
+				continue;
+		}
+
+		if (!wal_file_in_archive(name))
+		{
+			if (!XLogRecPtrIsInvalid(target_lsn))
+				elog(ERROR, "WAL segment \"%s\" required to reach recovery target is absent in archive",
+					 name);
+			break;
+		}
+
+		stage_wal_add_file(files, name, true);
+		n_segments++;
+	}
+
+	if (XLogRecPtrIsInvalid(target_lsn))
+	{
+		pretty_size((int64) n_segments * seg_size, pretty_total_bytes,
+					lengthof(pretty_total_bytes));
+		elog(WARNING, "Recovery target is not resolved to LSN, all %lu consecutive "
+			 "WAL segments from archive will be staged, %s",
+			 (unsigned long) n_segments, pretty_total_bytes);
+	}
+
+	/* main thread does not need remote connection */
+	fio_disconnect();
+
+	n_threads = Max(1, Min(num_threads, (int) parray_num(files)));
+	threads = (pthread_t *) palloc(sizeof(pthread_t) * n_threads);
+	threads_args = (stage_wal_arg *) palloc(sizeof(stage_wal_arg) * n_threads);
+
+	elog(INFO, "Start staging WAL files into \"%s\", files: %lu",
+		 wal_dir, (unsigned long) parray_num(files));
+	time(&start_time);
+	thread_interrupted = false;
+
+	for (i = 0; i < n_threads; i++)
+	{
+		stage_wal_arg *arg = &(threads_args[i]);
+
+		arg->files = files;
+		arg->wal_dir = wal_dir;
+		arg->no_sync = no_sync;
+		arg->thread_num = i + 1;
+		arg->staged_bytes = 0;
+		/* By default there are some error */
+		arg->ret = 1;
+
+		pthread_create(&threads[i], NULL, stage_wal_files, arg);
+	}
+
+	/* Wait theads */
+	for (i = 0; i < n_threads; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (threads_args[i].ret == 1)
+			stage_isok = false;
+
+		total_bytes += threads_args[i].staged_bytes;
+	}
+
+	time(&end_time);
+	pretty_time_interval(difftime(end_time, start_time),
+						 pretty_time, lengthof(pretty_time));
+	pretty_size(total_bytes, pretty_total_bytes, lengthof(pretty_total_bytes));
+
+	if (!stage_isok)
+		elog(ERROR, "WAL staging failed. Transfered bytes: %s, time elapsed: %s",
+			 pretty_total_bytes, pretty_time);
+
+	/*
+	 * Tell archive-get which segments are staged, so it lets the server
+	 * read them from pg_wal. Segments of other names found there may be
+	 * recycled files, which must not be used instead of archived ones.
+	 */
+	join_path_components(path, wal_dir, STAGED_WAL_LIST);
+	fp = fio_fopen(path, PG_BINARY_W, FIO_DB_HOST);
+	if (fp == NULL)
+		elog(ERROR, "Cannot open file \"%s\": %s", path, strerror(errno));
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		StageWalFile *file = (StageWalFile *) parray_get(files, i);
+
+		if (file->is_segment)
+			fio_fprintf(fp, "%s\n", file->name);
+	}
+
+	if (fio_fflush(fp) != 0 || fio_fclose(fp))
+		elog(ERROR, "Cannot write file \"%s\": %s", path, strerror(errno));
+
+	/* make renames of staged files durable */
+	if (!no_sync && fio_sync(wal_dir, FIO_DB_HOST) != 0)
+		elog(ERROR, "Failed to sync directory \"%s\": %s", wal_dir, strerror(errno));
+
+	elog(INFO, "WAL files are staged. Transfered bytes: %s, time elapsed: %s",
+		 pretty_total_bytes, pretty_time);
+
+	pfree(threads);
+	pfree(threads_args);
+	parray_walk(files, pfree);
+	parray_free(files);
+	parray_walk(timelines, pfree);
+	parray_free(timelines);
+}
+
+/*
+ * Copy WAL files from the archive into restored pg_wal.
+ */
+static void *
+stage_wal_files(void *arg)
+{
+	int			i;
+	stage_wal_arg *arguments = (stage_wal_arg *) arg;
+
+	for (i = 0; i < parray_num(arguments->files); i++)
+	{
+		StageWalFile *file = (StageWalFile *) parray_get(arguments->files, i);
+
+		if (!pg_atomic_test_set_flag(&file->lock))
+			continue;
+
+		/* check for interrupt */
+		if (interrupted || thread_interrupted)
+			elog(ERROR, "Interrupted during WAL staging");
+
+		if (progress)
+			elog(INFO, "Progress: (%d/%lu). Stage WAL file \"%s\"",
+				 i + 1, (unsigned long) parray_num(arguments->files),
+				 file->name);
+
+		arguments->staged_bytes += stage_wal_file(arguments->wal_dir, file,
+												  arguments->no_sync,
+												  arguments->thread_num);
+	}
+
+	/* ssh connection to longer needed */
+	fio_disconnect();
+
+	arguments->ret = 0;
+
+	return NULL;
+}
+
+/*
+ * Read WAL segment from pack file as a whole. from_fullpath is set to the
+ * path of pack file.
+ */
+static char *
+stage_wal_read_pack(const char *wal_file_name, char *from_fullpath,
+					int thread_num)
+{
+	TimeLineID	tli;
+	XLogSegNo	segno;
+	char		errmsg[256];
+	char	   *data;
+	uint32		seg_size = instance_config.xlog_seg_size;
+
+	GetXLogFromFileName(wal_file_name, &tli, &segno, seg_size);
+	data = pgut_malloc(seg_size);
+
+	if (!get_wal_from_pack(arclog_path, tli, segno, seg_size, data,
+						   from_fullpath, errmsg, sizeof(errmsg),
+						   FIO_BACKUP_HOST))
+	{
+		if (errmsg[0] != '\0')
+			elog(ERROR, "Thread [%d]: Cannot read WAL file \"%s\" from pack file \"%s\": %s",
+				 thread_num, wal_file_name, from_fullpath, errmsg);
+
+		elog(ERROR, "Thread [%d]: Cannot open WAL file \"%s\": %s",
+			 thread_num, from_fullpath, strerror(ENOENT));
+	}
+
+	return data;
+}
+
+/*
+ * Copy single WAL file from the archive into restored pg_wal with possible
+ * decompression. Segment is checked against its checksum file, if there is
+ * one, and becomes visible under its own name only when completely written.
+ * Return number of bytes written.
+ */
+static size_t
+stage_wal_file(const char *wal_dir, StageWalFile *file, bool no_sync,
+			   int thread_num)
+{
+	char		from_fullpath[MAXPGPATH];
+	char		to_fullpath[MAXPGPATH];
+	char		to_fullpath_part[MAXPGPATH];
+	char	   *buf;
+	FILE	   *in = NULL;
+#ifdef HAVE_LIBZ
+	gzFile		gz_in = NULL;
+#endif
+	char	   *pack_data = NULL;
+	FILE	   *out;
+	pg_crc32	crc;
+	pg_crc32	archived_crc = 0;
+	uint64		archived_size = 0;
+	bool		has_checksum;
+	size_t		size = 0;
+
+	join_path_components(to_fullpath, wal_dir, file->name);
+	snprintf(to_fullpath_part, MAXPGPATH, "%s.part", to_fullpath);
+
+#ifdef HAVE_LIBZ
+	snprintf(from_fullpath, MAXPGPATH, "%s/%s.gz", arclog_path, file->name);
+	if (fio_access(from_fullpath, F_OK, FIO_BACKUP_HOST) == 0)
+	{
+		gz_in = gzopen(from_fullpath, PG_BINARY_R);
+		if (gz_in == NULL)
+			elog(ERROR, "Thread [%d]: Cannot open compressed WAL file \"%s\": %s",
+				 thread_num, from_fullpath, strerror(errno));
+	}
+	else
+#endif
+	{
+		join_path_components(from_fullpath, arclog_path, file->name);
+		in = fopen(from_fullpath, PG_BINARY_R);
+		if (in == NULL)
+		{
+			/* history file of ancestor timeline may be gone */
+			if (errno == ENOENT && !file->is_segment)
+				return 0;
+
+			/* Segment may be moved into pack file by archive-pack */
+			if (errno == ENOENT)
+				pack_data = stage_wal_read_pack(file->name, from_fullpath,
+												thread_num);
+			else
+				elog(ERROR, "Thread [%d]: Cannot open WAL file \"%s\": %s",
+					 thread_num, from_fullpath, strerror(errno));
+		}
+	}
+
+	has_checksum = file->is_segment &&
+		read_wal_checksum(arclog_path, file->name, &archived_crc, &archived_size);
+
+	out = fio_fopen(to_fullpath_part, PG_BINARY_W, FIO_DB_HOST);
+	if (out == NULL)
+		elog(ERROR, "Thread [%d]: Cannot open destination file \"%s\": %s",
+			 thread_num, to_fullpath_part, strerror(errno));
+
+	buf = pgut_malloc(STDIO_BUFSIZE);
+	INIT_FILE_CRC32(true, crc);
+
+	for (;;)
+	{
+		ssize_t		read_len;
+
+		if (pack_data)
+		{
+			/* segment is already read from pack file as a whole */
+			read_len = Min(STDIO_BUFSIZE, instance_config.xlog_seg_size - size);
+			memcpy(buf, pack_data + size, read_len);
+		}
+#ifdef HAVE_LIBZ
+		else if (gz_in)
+		{
+			read_len = gzread(gz_in, buf, STDIO_BUFSIZE);
+			if (read_len < 0)
+				elog(ERROR, "Thread [%d]: Cannot read compressed WAL file \"%s\"",
+					 thread_num, from_fullpath);
+		}
+#endif
+		else
+		{
+			read_len = fread(buf, 1, STDIO_BUFSIZE, in);
+			if (ferror(in))
+				elog(ERROR, "Thread [%d]: Cannot read WAL file \"%s\": %s",
+					 thread_num, from_fullpath, strerror(errno));
+		}
+
+		if (read_len == 0)
+			break;
+
+		COMP_FILE_CRC32(true, crc, buf, read_len);
+
+		if (fio_fwrite(out, buf, read_len) != read_len)
+			elog(ERROR, "Thread [%d]: Cannot write to file \"%s\": %s",
+				 thread_num, to_fullpath_part, strerror(errno));
+
+		size += read_len;
+	}
+
+	FIN_FILE_CRC32(true, crc);
+	pg_free(buf);
+
+	if (pack_data)
+		pg_free(pack_data);
+#ifdef HAVE_LIBZ
+	else if (gz_in)
+		gzclose(gz_in);
+#endif
+	else
+		fclose(in);
+
+	if (fio_fclose(out) != 0)
+		elog(ERROR, "Thread [%d]: Cannot close file \"%s\": %s",
+			 thread_num, to_fullpath_part, strerror(errno));
+
+	if (file->is_segment && size != instance_config.xlog_seg_size)
+		elog(ERROR, "Thread [%d]: WAL segment \"%s\" has invalid size %lu",
+			 thread_num, from_fullpath, (unsigned long) size);
+
+	if (has_checksum && (size != archived_size || !EQ_CRC32C(crc, archived_crc)))
+		elog(ERROR, "Thread [%d]: WAL segment \"%s\" does not match its checksum file",
+			 thread_num, from_fullpath);
+
+	if (!no_sync && fio_sync(to_fullpath_part, FIO_DB_HOST) != 0)
+		elog(ERROR, "Thread [%d]: Failed to sync file \"%s\": %s",
+			 thread_num, to_fullpath_part, strerror(errno));
+
+	if (fio_rename(to_fullpath_part, to_fullpath, FIO_DB_HOST) < 0)
+		elog(ERROR, "Thread [%d]: Cannot rename file \"%s\" to \"%s\": %s",
+			 thread_num, to_fullpath_part, to_fullpath, strerror(errno));
+
+	elog(VERBOSE, "Thread [%d]: WAL file \"%s\" is staged", thread_num, file->name);
+
+	return size;
+}
+
 /*
  * Create recovery.conf (probackup_recovery.conf in case of PG12)
  * with given recovery target parameters
@@ -995,7 +1715,11 @@ create_recovery_conf(time_t backup_id,
 			sprintf(restore_command_guc, "%s", instance_config.restore_command);
 		else
 		{
-			/* default cmdline, ok for local restore */
+			/*
+			 * default cmdline, ok for local restore. It is kept with staged
+			 * WAL too: the server still needs it for history files of newer
+			 * timelines and for segments, which were not staged.
+			 */
 			sprintf(restore_command_guc, "%s archive-get -B %s --instance %s "
 					"--wal-file-path=%%p --wal-file-name=%%f",
 					PROGRAM_FULL_PATH ? PROGRAM_FULL_PATH : PROGRAM_NAME,
@@ -15,6 +15,8 @@
 #define PRINTF_BUF_SIZE  1024
 #define FILE_PERMISSIONS 0600
 #define CHUNK_SIZE 1024 * 128
+#define FIO_READ_BUFFER_SIZE  (64*1024)
+#define FIO_WRITE_BUFFER_SIZE (256*1024)
 
 static __thread unsigned long fio_fdset = 0;
 static __thread void* fio_stdin_buffer;
@@ -22,6 +24,82 @@ static __thread int fio_stdout = 0;
 static __thread int fio_stdin = 0;
 static __thread int fio_stderr = 0;
 
+/* Directory entries received from the agent but not yet returned by fio_readdir() */
+typedef struct
+{
+	struct dirent* entries;
+	int n_entries;
+	int pos;
+} fio_dir_batch;
+
+static __thread fio_dir_batch fio_dir_batches[FIO_FDMAX];
+
+/* Pages written by fio_fwrite_page() but not yet sent to the agent */
+typedef struct
+{
+	char* buf;
+	size_t size;
+} fio_page_batch;
+
+static __thread fio_page_batch fio_page_batches[FIO_FDMAX];
+
+/*
+ * Read buffer of the channel: fio_stdin at master side or input
+ * of fio_communicate() at agent side. Replies of the agent and pipelined
+ * requests of the master mostly consist of small messages, so reading
+ * them ahead saves a lot of syscalls.
+ */
+typedef struct
+{
+	int fd;      /* -1 if there is no channel */
+	char* data;
+	size_t pos;
+	size_t len;
+} fio_read_buffer;
+
+static __thread fio_read_buffer fio_channel_in = {-1, NULL, 0, 0};
+
+/* Replies of the agent collected for single write */
+typedef struct
+{
+	int fd;
+	size_t len;
+	char* data;
+} fio_write_buffer;
+
+/* Page entry of FIO_WRITE_PAGES message, followed by page payload */
+typedef struct
+{
+	BlockNumber blknum;
+	uint32      size;         /* size of payload */
+	int32       compress_alg; /* NONE_COMPRESS if payload is a raw page */
+} fio_page_entry;
+
+static void fio_flush_pages(int handle);
+
+/* Parameters of backup data file applied by the agent */
+typedef struct
+{
+	int         nblocks;
+	int         compress_alg;
+	uint32      backup_version;
+} fio_apply_request;
+
+/* State of backup data file being applied by the agent */
+typedef struct
+{
+	fio_apply_request req;
+	char*       from_fullpath; /* for error messages */
+	BlockNumber blknum;        /* block number of the last page */
+	bool        done;          /* the rest of backup file is to be skipped */
+	bool        has_header;    /* BackupPageHeader of current page is received */
+	size_t      filled;        /* bytes of current page received */
+	char        page[sizeof(BackupPageHeader) + BLCKSZ];
+	char*       run;           /* restored pages of adjacent blocks */
+	BlockNumber run_start;
+	uint32      run_len;
+} fio_apply_state;
+
 fio_location MyLocation;
 
 typedef struct
@@ -44,12 +122,22 @@ typedef struct
 #undef fopen(a, b)
 #endif
 
+/* Attach read buffer to the channel, -1 detaches it */
+static void fio_set_channel(int fd)
+{
+	pg_free(fio_channel_in.data);
+	fio_channel_in.fd = fd;
+	fio_channel_in.data = NULL;
+	fio_channel_in.pos = fio_channel_in.len = 0;
+}
+
 /* Use specified file descriptors as stdin/stdout for FIO functions */
 void fio_redirect(int in, int out, int err)
 {
 	fio_stdin = in;
 	fio_stdout = out;
 	fio_stderr = err;
+	fio_set_channel(in ? in : -1);
 }
 
 void fio_error(int rc, int size, char const* file, int line)
@@ -151,6 +239,46 @@ bool fio_is_remote(fio_location location)
 static ssize_t fio_read_all(int fd, void* buf, size_t size)
 {
 	size_t offs = 0;
+
+	/* Channel is read through the buffer, except large payloads */
+	if (fd == fio_channel_in.fd)
+	{
+		fio_read_buffer* rb = &fio_channel_in;
+
+		while (offs < size)
+		{
+			ssize_t rc;
+
+			if (rb->pos < rb->len)
+			{
+				size_t n = Min(rb->len - rb->pos, size - offs);
+
+				memcpy((char*)buf + offs, rb->data + rb->pos, n);
+				rb->pos += n;
+				offs += n;
+				continue;
+			}
+
+			if (size - offs >= FIO_READ_BUFFER_SIZE)
+				break;
+
+			if (rb->data == NULL)
+				rb->data = pgut_malloc(FIO_READ_BUFFER_SIZE);
+
+			rc = read(fd, rb->data, FIO_READ_BUFFER_SIZE);
+			if (rc < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return rc;
+			} else if (rc == 0) {
+				return offs;
+			}
+			rb->pos = 0;
+			rb->len = rc;
+		}
+	}
+
 	while (offs < size)
 	{
 		ssize_t rc = read(fd, (char*)buf + offs, size - offs);
@@ -255,6 +383,8 @@ DIR* fio_opendir(char const* path, fio_location location)
 		hdr.handle = i;
 		hdr.size = strlen(path) + 1;
 		fio_fdset |= 1 << i;
+		fio_dir_batches[i].n_entries = 0;
+		fio_dir_batches[i].pos = 0;
 
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
 		IO_CHECK(fio_write_all(fio_stdout, path, hdr.size), hdr.size);
@@ -280,22 +410,34 @@ struct dirent* fio_readdir(DIR *dir)
 {
 	if (fio_is_remote_file((FILE*)dir))
 	{
-		fio_header hdr;
-		static __thread struct dirent entry;
+		fio_dir_batch* batch = &fio_dir_batches[(size_t)dir - 1];
 
-		hdr.cop = FIO_READDIR;
-		hdr.handle = (size_t)dir - 1;
-		hdr.size = 0;
-		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		/* Agent sends entries in batches to save round trips */
+		if (batch->pos == batch->n_entries)
+		{
+			fio_header hdr;
 
-		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
-		Assert(hdr.cop == FIO_SEND);
-		if (hdr.size) {
-			Assert(hdr.size == sizeof(entry));
-			IO_CHECK(fio_read_all(fio_stdin, &entry, sizeof(entry)), sizeof(entry));
-		}
+			hdr.cop = FIO_READDIR;
+			hdr.handle = (size_t)dir - 1;
+			hdr.size = 0;
+			IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+
+			IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+			Assert(hdr.cop == FIO_SEND);
+			Assert(hdr.size % sizeof(struct dirent) == 0 &&
+				   hdr.size <= FIO_READDIR_BATCH*sizeof(struct dirent));
 
-		return hdr.size ? &entry : NULL;
+			if (batch->entries == NULL)
+				batch->entries = pgut_malloc(FIO_READDIR_BATCH*sizeof(struct dirent));
+			if (hdr.size)
+				IO_CHECK(fio_read_all(fio_stdin, batch->entries, hdr.size), hdr.size);
+
+			batch->n_entries = hdr.size / sizeof(struct dirent);
+			batch->pos = 0;
+			if (batch->n_entries == 0)
+				return NULL;
+		}
+		return &batch->entries[batch->pos++];
 	}
 	else
 	{
@@ -313,6 +455,8 @@ int fio_closedir(DIR *dir)
 		hdr.handle = (size_t)dir - 1;
 		hdr.size = 0;
 		fio_fdset &= ~(1 << hdr.handle);
+		fio_dir_batches[hdr.handle].n_entries = 0;
+		fio_dir_batches[hdr.handle].pos = 0;
 
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
 		return 0;
@@ -323,8 +467,11 @@ int fio_closedir(DIR *dir)
 	}
 }
 
-/* Open file */
-int fio_open(char const* path, int mode, fio_location location)
+/*
+ * Open file. If async is true, remote file is opened without waiting for
+ * confirmation and open error is reported as deferred error.
+ */
+static int fio_open_impl(char const* path, int mode, fio_location location, bool async)
 {
 	int fd;
 	if (fio_is_remote(location))
@@ -338,7 +485,7 @@ int fio_open(char const* path, int mode, fio_location location)
 		if (i == FIO_FDMAX) {
 			return -1;
 		}
-		hdr.cop = FIO_OPEN;
+		hdr.cop = async ? FIO_OPEN_ASYNC : FIO_OPEN;
 		hdr.handle = i;
 		hdr.size = strlen(path) + 1;
 		hdr.arg = mode;
@@ -350,12 +497,16 @@ int fio_open(char const* path, int mode, fio_location location)
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
 		IO_CHECK(fio_write_all(fio_stdout, path, hdr.size), hdr.size);
 
-		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
-
-		if (hdr.arg != 0)
+		if (!async)
 		{
-			errno = hdr.arg;
-			return -1;
+			IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+
+			if (hdr.arg != 0)
+			{
+				fio_fdset &= ~(1 << i);
+				errno = hdr.arg;
+				return -1;
+			}
 		}
 		fd = i | FIO_PIPE_MARKER;
 	}
@@ -366,6 +517,55 @@ int fio_open(char const* path, int mode, fio_location location)
 	return fd;
 }
 
+/* Open file */
+int fio_open(char const* path, int mode, fio_location location)
+{
+	return fio_open_impl(path, mode, location, false);
+}
+
+/*
+ * Read error message of requests, which are not confirmed by the agent
+ * (close, write, rename, chmod, ...). Agent keeps the first such error
+ * and attaches it to the reply of FIO_GET_ASYNC_ERROR, FIO_SYNC,
+ * FIO_SYNC_FILES and FIO_DISCONNECT requests.
+ */
+static char* fio_read_async_error(fio_header* hdr)
+{
+	char* errormsg;
+
+	if (hdr->size == 0)
+		return NULL;
+
+	errormsg = pgut_malloc(hdr->size);
+	IO_CHECK(fio_read_all(fio_stdin, errormsg, hdr->size), hdr->size);
+	errormsg[hdr->size-1] = '\0';
+	return errormsg;
+}
+
+/*
+ * Throw error if some of requests sent by this thread without waiting for
+ * confirmation has failed at the agent.
+ */
+void fio_check_async_error(fio_location location)
+{
+	/* Nothing could fail if we have not connected yet */
+	if (fio_stdin && fio_is_remote(location))
+	{
+		fio_header hdr;
+		char* errormsg;
+
+		hdr.cop = FIO_GET_ASYNC_ERROR;
+		hdr.handle = -1;
+		hdr.size = 0;
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+		Assert(hdr.cop == FIO_GET_ASYNC_ERROR);
+
+		errormsg = fio_read_async_error(&hdr);
+		if (errormsg)
+			elog(ERROR, "%s", errormsg);
+	}
+}
 
 /* Close ssh session */
 void
@@ -374,21 +574,28 @@ fio_disconnect(void)
 	if (fio_stdin)
 	{
 		fio_header hdr;
+		char* errormsg;
+
 		hdr.cop = FIO_DISCONNECT;
 		hdr.size = 0;
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
 		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
 		Assert(hdr.cop == FIO_DISCONNECTED);
+		errormsg = fio_read_async_error(&hdr);
 		SYS_CHECK(close(fio_stdin));
 		SYS_CHECK(close(fio_stdout));
 		fio_stdin = 0;
 		fio_stdout = 0;
+		fio_set_channel(-1);
 		wait_ssh();
+
+		if (errormsg)
+			elog(ERROR, "%s", errormsg);
 	}
 }
 
 /* Open stdio file */
-FILE* fio_fopen(char const* path, char const* mode, fio_location location)
+static FILE* fio_fopen_impl(char const* path, char const* mode, fio_location location, bool async)
 {
 	FILE	   *f = NULL;
 
@@ -419,7 +626,7 @@ FILE* fio_fopen(char const* path, char const* mode, fio_location location)
 		} else {
 			Assert(false);
 		}
-		fd = fio_open(path, flags, location);
+		fd = fio_open_impl(path, flags, location, async);
 		if (fd >= 0)
 			f = (FILE*)(size_t)((fd + 1) & ~FIO_PIPE_MARKER);
 	}
@@ -432,6 +639,23 @@ FILE* fio_fopen(char const* path, char const* mode, fio_location location)
 	return f;
 }
 
+FILE* fio_fopen(char const* path, char const* mode, fio_location location)
+{
+	return fio_fopen_impl(path, mode, location, false);
+}
+
+/*
+ * Open stdio file for writing without waiting for the agent to open it.
+ * This saves a round trip per file when lots of files are created.
+ * Failure to open remote file is reported by the next fio_sync(),
+ * fio_sync_files(), fio_check_async_error() or fio_disconnect() call of
+ * this thread, so the file must not be read through the returned handle.
+ */
+FILE* fio_fopen_async(char const* path, char const* mode, fio_location location)
+{
+	return fio_fopen_impl(path, mode, location, true);
+}
+
 /* Format output to file stream */
 int fio_fprintf(FILE* f, char const* format, ...)
 {
@@ -458,11 +682,13 @@ int fio_fprintf(FILE* f, char const* format, ...)
 	return rc;
 }
 
-/* Flush stream data (does nothing for remote file) */
+/* Flush stream data (for remote file only sends batched pages) */
 int fio_fflush(FILE* f)
 {
 	int rc = 0;
-	if (!fio_is_remote_file(f))
+	if (fio_is_remote_file(f))
+		fio_flush_pages(fio_fileno(f) & ~FIO_PIPE_MARKER);
+	else
 		rc = fflush(f);
 	return rc;
 }
@@ -493,6 +719,10 @@ int fio_close(int fd)
 		hdr.size = 0;
 		fio_fdset &= ~(1 << hdr.handle);
 
+		fio_flush_pages(hdr.handle);
+		pg_free(fio_page_batches[hdr.handle].buf);
+		fio_page_batches[hdr.handle].buf = NULL;
+
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
 		/* Note, that file is closed without waiting for confirmation */
 
@@ -519,6 +749,8 @@ int fio_truncate(int fd, off_t size)
 	{
 		fio_header hdr;
 
+		fio_flush_pages(fd & ~FIO_PIPE_MARKER);
+
 		hdr.cop = FIO_TRUNCATE;
 		hdr.handle = fd & ~FIO_PIPE_MARKER;
 		hdr.size = 0;
@@ -545,6 +777,8 @@ int fio_pread(FILE* f, void* buf, off_t offs)
 		int fd = fio_fileno(f);
 		fio_header hdr;
 
+		fio_flush_pages(fd & ~FIO_PIPE_MARKER);
+
 		hdr.cop = FIO_PREAD;
 		hdr.handle = fd & ~FIO_PIPE_MARKER;
 		hdr.size = 0;
@@ -588,6 +822,8 @@ int fio_seek(int fd, off_t offs)
 	{
 		fio_header hdr;
 
+		fio_flush_pages(fd & ~FIO_PIPE_MARKER);
+
 		hdr.cop = FIO_SEEK;
 		hdr.handle = fd & ~FIO_PIPE_MARKER;
 		hdr.size = 0;
@@ -618,6 +854,8 @@ ssize_t fio_write(int fd, void const* buf, size_t size)
 	{
 		fio_header hdr;
 
+		fio_flush_pages(fd & ~FIO_PIPE_MARKER);
+
 		hdr.cop = FIO_WRITE;
 		hdr.handle = fd & ~FIO_PIPE_MARKER;
 		hdr.size = size;
@@ -663,6 +901,8 @@ ssize_t fio_fwrite_compressed(FILE* f, void const* buf, size_t size, int compres
 	{
 		fio_header hdr;
 
+		fio_flush_pages(fio_fileno(f) & ~FIO_PIPE_MARKER);
+
 		hdr.cop = FIO_WRITE_COMPRESSED;
 		hdr.handle = fio_fileno(f) & ~FIO_PIPE_MARKER;
 		hdr.size = size;
@@ -692,6 +932,144 @@ fio_write_compressed_impl(int fd, void const* buf, size_t size, int compress_alg
 	return fio_write_all(fd, uncompressed_buf, uncompressed_size);
 }
 
+/* Send pages collected by fio_fwrite_page() to the agent */
+static void fio_flush_pages(int handle)
+{
+	fio_page_batch* batch = &fio_page_batches[handle];
+	fio_header hdr;
+
+	if (batch->size == 0)
+		return;
+
+	hdr.cop = FIO_WRITE_PAGES;
+	hdr.handle = handle;
+	hdr.size = batch->size;
+	hdr.arg = 0;
+
+	IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_write_all(fio_stdout, batch->buf, batch->size), batch->size);
+
+	batch->size = 0;
+}
+
+/*
+ * Write page to the specified block of stdio file.
+ * Page is compressed with compress_alg, or it is a raw page of BLCKSZ bytes
+ * if compress_alg is NONE_COMPRESS.
+ *
+ * For remote file pages are collected in a batch and sent to the agent by
+ * single FIO_WRITE_PAGES message, the agent decompresses them and writes
+ * runs of adjacent blocks by single pwrite. Errors are reported by the agent
+ * later, like for other requests without confirmation. The batch is sent
+ * when it is full and before any other request for the same file.
+ *
+ * Position of local file is left after the written page.
+ */
+ssize_t fio_fwrite_page(FILE* f, BlockNumber blknum, void const* buf, size_t size, int compress_alg)
+{
+	if (fio_is_remote_file(f))
+	{
+		int handle = fio_fileno(f) & ~FIO_PIPE_MARKER;
+		fio_page_batch* batch = &fio_page_batches[handle];
+		fio_page_entry entry;
+
+		Assert(size <= BLCKSZ);
+
+		if (batch->size + sizeof(entry) + size > FIO_WRITE_PAGES_BATCH)
+			fio_flush_pages(handle);
+
+		if (batch->buf == NULL)
+			batch->buf = pgut_malloc(FIO_WRITE_PAGES_BATCH);
+
+		entry.blknum = blknum;
+		entry.size = size;
+		entry.compress_alg = compress_alg;
+
+		memcpy(batch->buf + batch->size, &entry, sizeof(entry));
+		memcpy(batch->buf + batch->size + sizeof(entry), buf, size);
+		batch->size += sizeof(entry) + size;
+
+		return BLCKSZ;
+	}
+	else
+	{
+		if (fseek(f, (off_t) blknum * BLCKSZ, SEEK_SET) < 0)
+			return -1;
+
+		return compress_alg == NONE_COMPRESS
+			? fwrite(buf, 1, size, f)
+			: fio_fwrite_compressed(f, buf, size, compress_alg);
+	}
+}
+
+/*
+ * Send backup data file to the agent, which restores its pages into
+ * the destination file like restore_data_file_internal() does. So the file
+ * is transferred as a plain sequential stream, and decompression and
+ * writes are done by the database host.
+ * Errors are reported by the agent later, like for other requests without
+ * confirmation. Returns number of sent bytes.
+ */
+size_t fio_apply_data_file(FILE* out, FILE* in, int compress_alg, uint32 backup_version,
+						   int nblocks, char const* from_fullpath)
+{
+	int handle = fio_fileno(out) & ~FIO_PIPE_MARKER;
+	size_t path_len = strlen(from_fullpath) + 1;
+	size_t total_len = 0;
+	fio_apply_request req;
+	fio_header hdr;
+	char* buf;
+
+	Assert(fio_is_remote_file(out));
+
+	fio_flush_pages(handle);
+
+	req.nblocks = nblocks;
+	req.compress_alg = compress_alg;
+	req.backup_version = backup_version;
+
+	hdr.cop = FIO_APPLY_FILE;
+	hdr.handle = handle;
+	hdr.size = sizeof(req) + path_len;
+	hdr.arg = 0;
+
+	IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_write_all(fio_stdout, &req, sizeof(req)), sizeof(req));
+	IO_CHECK(fio_write_all(fio_stdout, from_fullpath, path_len), path_len);
+
+	buf = pgut_malloc(CHUNK_SIZE);
+	hdr.cop = FIO_APPLY_DATA;
+
+	for (;;)
+	{
+		size_t read_len;
+
+		if (interrupted)
+			elog(ERROR, "Interrupted during data file restore");
+
+		read_len = fread(buf, 1, CHUNK_SIZE, in);
+
+		if (ferror(in))
+			elog(ERROR, "Cannot read backup file \"%s\": %s",
+				 from_fullpath, strerror(errno));
+
+		if (read_len == 0)
+			break;
+
+		hdr.size = read_len;
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, buf, read_len), read_len);
+		total_len += read_len;
+	}
+
+	/* empty chunk marks the end of backup file */
+	hdr.size = 0;
+	IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+
+	pg_free(buf);
+	return total_len;
+}
+
 /* Read data from stdio file */
 ssize_t fio_fread(FILE* f, void* buf, size_t size)
 {
@@ -709,6 +1087,8 @@ ssize_t fio_read(int fd, void* buf, size_t size)
 	{
 		fio_header hdr;
 
+		fio_flush_pages(fd & ~FIO_PIPE_MARKER);
+
 		hdr.cop = FIO_READ;
 		hdr.handle = fd & ~FIO_PIPE_MARKER;
 		hdr.size = 0;
@@ -743,6 +1123,8 @@ int fio_fstat(int fd, struct stat* st)
 	{
 		fio_header hdr;
 
+		fio_flush_pages(fd & ~FIO_PIPE_MARKER);
+
 		hdr.cop = FIO_FSTAT;
 		hdr.handle = fd & ~FIO_PIPE_MARKER;
 		hdr.size = 0;
@@ -880,12 +1262,28 @@ int fio_rename(char const* old_path, char const* new_path, fio_location location
 	}
 }
 
+/*
+ * Open file or directory for fsync.
+ */
+static int
+fio_open_for_sync(char const* path)
+{
+	int fd = open(path, O_WRONLY | PG_BINARY, FILE_PERMISSIONS);
+
+	/* directories cannot be opened for write */
+	if (fd < 0 && errno == EISDIR)
+		fd = open(path, O_RDONLY | PG_BINARY, 0);
+
+	return fd;
+}
+
 /* Sync file to disk */
 int fio_sync(char const* path, fio_location location)
 {
 	if (fio_is_remote(location))
 	{
 		fio_header hdr;
+		char* errormsg;
 		size_t path_len = strlen(path) + 1;
 		hdr.cop = FIO_SYNC;
 		hdr.handle = -1;
@@ -895,6 +1293,10 @@ int fio_sync(char const* path, fio_location location)
 		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
 		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
 
+		errormsg = fio_read_async_error(&hdr);
+		if (errormsg)
+			elog(ERROR, "%s", errormsg);
+
 		if (hdr.arg != 0)
 		{
 			errno = hdr.arg;
@@ -907,7 +1309,7 @@ int fio_sync(char const* path, fio_location location)
 	{
 		int fd;
 
-		fd = open(path, O_WRONLY | PG_BINARY, FILE_PERMISSIONS);
+		fd = fio_open_for_sync(path);
 		if (fd < 0)
 			return -1;
 
@@ -922,50 +1324,151 @@ int fio_sync(char const* path, fio_location location)
 	}
 }
 
-/* Get crc32 of file */
-pg_crc32 fio_get_crc32(const char *file_path, fio_location location, bool decompress)
+/*
+ * Sync files packed into buffer as a sequence of zero-terminated paths.
+ * Writeback is initiated for all files first, so the storage can
+ * service them together, and only then every file is fsync'ed.
+ * Returns 0 on success, errno otherwise.
+ */
+static int
+fio_sync_files_impl(char const* paths, int n_paths)
 {
-	if (fio_is_remote(location))
-	{
-		fio_header hdr;
-		size_t path_len = strlen(file_path) + 1;
-		pg_crc32 crc = 0;
-		hdr.cop = FIO_GET_CRC32;
-		hdr.handle = -1;
-		hdr.size = path_len;
-		hdr.arg = 0;
-
-		if (decompress)
-			hdr.arg = 1;
+	char const* path;
+	int         fd;
+	int         i;
 
-		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
-		IO_CHECK(fio_write_all(fio_stdout, file_path, path_len), path_len);
-		IO_CHECK(fio_read_all(fio_stdin, &crc, sizeof(crc)), sizeof(crc));
+#ifdef HAVE_SYNC_FILE_RANGE
+	for (i = 0, path = paths; i < n_paths; i++, path += strlen(path) + 1)
+	{
+		fd = fio_open_for_sync(path);
+		if (fd < 0)
+			return errno;
 
-		return crc;
+		/* ignore errors, this is just a hint */
+		(void) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+		close(fd);
 	}
-	else
+#endif
+
+	for (i = 0, path = paths; i < n_paths; i++, path += strlen(path) + 1)
 	{
-		if (decompress)
-			return pgFileGetCRCgz(file_path, true, true);
-		else
-			return pgFileGetCRC(file_path, true, true);
+		fd = fio_open_for_sync(path);
+		if (fd < 0)
+			return errno;
+
+		if (fsync(fd) < 0)
+		{
+			int save_errno = errno;
+
+			close(fd);
+			return save_errno;
+		}
+		close(fd);
 	}
+
+	return 0;
 }
 
-/* Remove file */
-int fio_unlink(char const* path, fio_location location)
+/*
+ * Sync several files at once. Remote files are synced
+ * in a single round trip.
+ */
+int fio_sync_files(char const* const* paths, int n_paths, fio_location location)
 {
+	size_t size = 0;
+	char  *buf;
+	char  *ptr;
+	int    rc;
+	int    i;
+
+	for (i = 0; i < n_paths; i++)
+		size += strlen(paths[i]) + 1;
+
+	buf = pgut_malloc(size);
+	for (i = 0, ptr = buf; i < n_paths; i++)
+	{
+		strcpy(ptr, paths[i]);
+		ptr += strlen(paths[i]) + 1;
+	}
+
 	if (fio_is_remote(location))
 	{
 		fio_header hdr;
-		size_t path_len = strlen(path) + 1;
-		hdr.cop = FIO_UNLINK;
+		char* errormsg;
+
+		hdr.cop = FIO_SYNC_FILES;
 		hdr.handle = -1;
-		hdr.size = path_len;
+		hdr.size = size;
+		hdr.arg = n_paths;
 
 		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
-		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
+		IO_CHECK(fio_write_all(fio_stdout, buf, size), size);
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+
+		errormsg = fio_read_async_error(&hdr);
+		if (errormsg)
+			elog(ERROR, "%s", errormsg);
+
+		rc = hdr.arg;
+	}
+	else
+		rc = fio_sync_files_impl(buf, n_paths);
+
+	pg_free(buf);
+
+	if (rc != 0)
+	{
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Get crc32 of file */
+pg_crc32 fio_get_crc32(const char *file_path, fio_location location, bool decompress)
+{
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t path_len = strlen(file_path) + 1;
+		pg_crc32 crc = 0;
+		hdr.cop = FIO_GET_CRC32;
+		hdr.handle = -1;
+		hdr.size = path_len;
+		hdr.arg = 0;
+
+		if (decompress)
+			hdr.arg = 1;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, file_path, path_len), path_len);
+		IO_CHECK(fio_read_all(fio_stdin, &crc, sizeof(crc)), sizeof(crc));
+
+		return crc;
+	}
+	else
+	{
+		if (decompress)
+			return pgFileGetCRCgz(file_path, true, true);
+		else
+			return pgFileGetCRC(file_path, true, true);
+	}
+}
+
+/* Remove file */
+int fio_unlink(char const* path, fio_location location)
+{
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t path_len = strlen(path) + 1;
+		hdr.cop = FIO_UNLINK;
+		hdr.handle = -1;
+		hdr.size = path_len;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, path, path_len), path_len);
 
 		// TODO: error is swallowed ?
 		return 0;
@@ -1002,6 +1505,197 @@ int fio_mkdir(char const* path, int mode, fio_location location)
 	}
 }
 
+/*
+ * Create several directories at once, parents first. Remote directories
+ * are created in a single round trip.
+ */
+int fio_mkdirs(char const* const* paths, int const* modes, int n_paths, fio_location location)
+{
+	int i;
+
+	if (n_paths == 0)
+		return 0;
+
+	if (fio_is_remote(location))
+	{
+		fio_header hdr;
+		size_t size = 0;
+		char* buf;
+		char* ptr;
+
+		for (i = 0; i < n_paths; i++)
+			size += sizeof(uint32) + strlen(paths[i]) + 1;
+
+		buf = pgut_malloc(size);
+		for (i = 0, ptr = buf; i < n_paths; i++)
+		{
+			uint32 mode = modes[i];
+
+			memcpy(ptr, &mode, sizeof(mode));
+			ptr += sizeof(mode);
+			strcpy(ptr, paths[i]);
+			ptr += strlen(paths[i]) + 1;
+		}
+
+		hdr.cop = FIO_MKDIRS;
+		hdr.handle = -1;
+		hdr.size = size;
+		hdr.arg = n_paths;
+
+		IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+		IO_CHECK(fio_write_all(fio_stdout, buf, size), size);
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+		Assert(hdr.cop == FIO_MKDIRS);
+
+		pg_free(buf);
+		return hdr.arg;
+	}
+	else
+	{
+		for (i = 0; i < n_paths; i++)
+			dir_create_dir(paths[i], modes[i]);
+		return 0;
+	}
+}
+
+static int fio_mkdirs_impl(char const* buf, int n_paths)
+{
+	int i;
+
+	for (i = 0; i < n_paths; i++)
+	{
+		uint32 mode;
+
+		memcpy(&mode, buf, sizeof(mode));
+		buf += sizeof(mode);
+		dir_create_dir(buf, mode);
+		buf += strlen(buf) + 1;
+	}
+	return 0;
+}
+
+/*
+ * List remote directory tree. Instead of a round trip per directory entry
+ * the agent walks the whole tree itself, applying exclusion rules of
+ * dir_list_file(), and streams compact entries, which are passed to callback.
+ */
+void fio_list_tree(char const* root, bool exclude, bool follow_symlink, bool exclusive,
+				   bool with_logs, fio_tree_callback callback, void* arg, fio_location location)
+{
+	fio_header hdr;
+	char* buf = NULL;
+	size_t buf_size = 0;
+
+	if (!fio_is_remote(location))
+		elog(ERROR, "Remote directory listing is requested for local directory \"%s\"", root);
+
+	hdr.cop = FIO_LIST_TREE;
+	hdr.handle = -1;
+	hdr.size = strlen(root) + 1;
+	hdr.arg = (exclude ? FIO_LIST_EXCLUDE : 0)
+		| (follow_symlink ? FIO_LIST_FOLLOW_SYMLINK : 0)
+		| (exclusive ? FIO_LIST_EXCLUSIVE : 0)
+		| (with_logs ? FIO_LIST_WITH_LOGS : 0);
+
+	IO_CHECK(fio_write_all(fio_stdout, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_write_all(fio_stdout, root, hdr.size), hdr.size);
+
+	while (true)
+	{
+		char* ptr;
+
+		IO_CHECK(fio_read_all(fio_stdin, &hdr, sizeof(hdr)), sizeof(hdr));
+		if (hdr.cop == FIO_SEND_FILE_EOF)
+			break;
+		Assert(hdr.cop == FIO_SEND);
+
+		if (hdr.size > buf_size)
+		{
+			buf_size = hdr.size;
+			buf = pgut_realloc(buf, buf_size);
+		}
+		IO_CHECK(fio_read_all(fio_stdin, buf, hdr.size), hdr.size);
+
+		for (ptr = buf; ptr < buf + hdr.size; )
+		{
+			fio_tree_entry entry;
+
+			memcpy(&entry, ptr, sizeof(entry));
+			ptr += sizeof(entry);
+			callback(ptr, entry.mode, entry.size, (time_t) entry.mtime, arg);
+			ptr += entry.path_len;
+		}
+	}
+	pg_free(buf);
+}
+
+/* Entries of FIO_LIST_TREE reply are packed into chunks of this size */
+#define FIO_TREE_CHUNK (64*1024)
+
+typedef struct
+{
+	int    out;
+	char*  buf;
+	size_t size;
+} fio_tree_writer;
+
+static void fio_tree_flush(fio_tree_writer* writer)
+{
+	fio_header hdr;
+
+	hdr.cop = FIO_SEND;
+	hdr.handle = -1;
+	hdr.size = writer->size;
+	IO_CHECK(fio_write_all(writer->out, &hdr, sizeof(hdr)), sizeof(hdr));
+	IO_CHECK(fio_write_all(writer->out, writer->buf, writer->size), writer->size);
+	writer->size = 0;
+}
+
+static bool fio_tree_send_entry(pgFile* file, void* arg)
+{
+	fio_tree_writer* writer = (fio_tree_writer*)arg;
+	fio_tree_entry entry;
+
+	entry.mode = file->mode;
+	entry.path_len = strlen(file->rel_path) + 1;
+	entry.size = file->size;
+	entry.mtime = file->mtime;
+
+	if (writer->size + sizeof(entry) + entry.path_len > FIO_TREE_CHUNK)
+		fio_tree_flush(writer);
+
+	memcpy(writer->buf + writer->size, &entry, sizeof(entry));
+	memcpy(writer->buf + writer->size + sizeof(entry), file->rel_path, entry.path_len);
+	writer->size += sizeof(entry) + entry.path_len;
+	return true;
+}
+
+static void fio_list_tree_impl(int out, char const* root, int flags)
+{
+	fio_tree_writer writer;
+	fio_header hdr;
+
+	writer.out = out;
+	writer.buf = pgut_malloc(FIO_TREE_CHUNK);
+	writer.size = 0;
+
+	/* dir_check_file() looks at them */
+	exclusive_backup = (flags & FIO_LIST_EXCLUSIVE) != 0;
+	set_pg_log_exclusion((flags & FIO_LIST_WITH_LOGS) == 0);
+
+	dir_list_tree(root, (flags & FIO_LIST_EXCLUDE) != 0,
+				  (flags & FIO_LIST_FOLLOW_SYMLINK) != 0,
+				  fio_tree_send_entry, &writer);
+	if (writer.size > 0)
+		fio_tree_flush(&writer);
+
+	hdr.cop = FIO_SEND_FILE_EOF;
+	hdr.handle = -1;
+	hdr.size = 0;
+	IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+	pg_free(writer.buf);
+}
+
 /* Change file mode */
 int fio_chmod(char const* path, int mode, fio_location location)
 {
@@ -1346,10 +2040,15 @@ static void fio_load_file(int out, char const* path)
  *
  * In case of DELTA mode horizonLsn must be a valid lsn,
  * otherwise it should be set to InvalidXLogRecPtr.
+ *
+ * If fetch_page is specified, agent doesn't report invalid pages as
+ * corruption, but asks to get them from other source, e.g. via ptrack.
+ * fetch_page writes the page into out itself.
  */
 int fio_send_pages(FILE* in, FILE* out, pgFile *file, XLogRecPtr horizonLsn,
 						   int calg, int clevel, uint32 checksum_version,
-						   datapagemap_t *pagemap, BlockNumber* err_blknum,
+						   pagemap_t *pagemap, fio_page_callback fetch_page,
+						   void *fetch_arg, BlockNumber* err_blknum,
 						   char **errormsg)
 {
 	struct {
@@ -1357,7 +2056,9 @@ int fio_send_pages(FILE* in, FILE* out, pgFile *file, XLogRecPtr horizonLsn,
 		fio_send_request arg;
 	} req;
 	BlockNumber	n_blocks_read = 0;
+	BlockNumber	n_blocks_fetched = 0;
 	BlockNumber blknum = 0;
+	char	   *bitmap = NULL;
 
 	Assert(fio_is_remote_file(in));
 
@@ -1365,22 +2066,26 @@ int fio_send_pages(FILE* in, FILE* out, pgFile *file, XLogRecPtr horizonLsn,
 
 	  8bytes       20bytes              var
 	------------------------------------------------------
-	| fio_header | fio_send_request |    BITMAP(if any)  |
+	| fio_header | fio_send_request |    PAGEMAP(if any) |
 	------------------------------------------------------
+
+	Pagemap is sent in compact encoding produced by pagemap_serialize(),
+	so a handful of blocks with big serial numbers costs only a few bytes.
 	*/
 
 	req.hdr.handle = fio_fileno(in) & ~FIO_PIPE_MARKER;
+	req.hdr.arg = fetch_page ? FIO_SEND_PAGES_FETCH : 0;
 
 	if (pagemap)
 	{
+		pagemap_optimize(pagemap);
+
 		req.hdr.cop = FIO_SEND_PAGES_PAGEMAP;
-		req.hdr.size = sizeof(fio_send_request) + pagemap->bitmapsize;
-		req.arg.bitmapsize = pagemap->bitmapsize;
+		req.arg.bitmapsize = pagemap_serialized_size(pagemap);
+		req.hdr.size = sizeof(fio_send_request) + req.arg.bitmapsize;
 
-		/* TODO: add optimization for the case of pagemap
-		 * containing small number of blocks with big serial numbers:
-		 * https://github.com/postgrespro/pg_probackup/blob/remote_page_backup/src/utils/file.c#L1211
-		 */
+		bitmap = pgut_malloc(req.arg.bitmapsize);
+		pagemap_serialize(pagemap, bitmap);
 	}
 	else
 	{
@@ -1397,20 +2102,14 @@ int fio_send_pages(FILE* in, FILE* out, pgFile *file, XLogRecPtr horizonLsn,
 
 	file->compress_alg = calg; /* TODO: wtf? why here? */
 
-//<-----
-//	datapagemap_iterator_t *iter;
-//	BlockNumber blkno;
-//	iter = datapagemap_iterate(pagemap);
-//	while (datapagemap_next(iter, &blkno))
-//		elog(INFO, "block %u", blkno);
-//	pg_free(iter);
-//<-----
-
 	IO_CHECK(fio_write_all(fio_stdout, &req, sizeof(req)), sizeof(req));
 
 	if (pagemap)
+	{
 		/* now send pagemap itself */
-		IO_CHECK(fio_write_all(fio_stdout, pagemap->bitmap, pagemap->bitmapsize), pagemap->bitmapsize);
+		IO_CHECK(fio_write_all(fio_stdout, bitmap, req.arg.bitmapsize), req.arg.bitmapsize);
+		pg_free(bitmap);
+	}
 
 	while (true)
 	{
@@ -1439,10 +2138,22 @@ int fio_send_pages(FILE* in, FILE* out, pgFile *file, XLogRecPtr horizonLsn,
 			}
 			return PAGE_CORRUPTION;
 		}
+		else if (hdr.cop == FIO_FETCH_PAGE)
+		{
+			blknum = hdr.arg;
+
+			Assert(fetch_page != NULL && hdr.size <= sizeof(buf));
+			if (hdr.size > 0)
+				IO_CHECK(fio_read_all(fio_stdin, buf, hdr.size), hdr.size);
+
+			/* pages are sent in order, so the page is written at its place */
+			if (fetch_page(blknum, hdr.size > 0 ? buf : NULL, fetch_arg))
+				n_blocks_fetched++;
+		}
 		else if (hdr.cop == FIO_SEND_FILE_EOF)
 		{
-			/* n_blocks_read reported by EOF */
-			n_blocks_read = hdr.size;
+			/* n_blocks_read reported by EOF doesn't include fetched pages */
+			n_blocks_read = hdr.size + n_blocks_fetched;
 			break;
 		}
 		else if (hdr.cop == FIO_PAGE)
@@ -1470,153 +2181,273 @@ int fio_send_pages(FILE* in, FILE* out, pgFile *file, XLogRecPtr horizonLsn,
 	return n_blocks_read;
 }
 
-/* TODO: read file using large buffer */
-static void fio_send_pages_impl(int fd, int out, char* buf, bool with_pagemap)
+/* Append message to the write buffer, flushing it if needed */
+static void fio_buffer_write(fio_write_buffer* wb, void const* buf, size_t size)
 {
-	BlockNumber blknum = 0;
+	if (wb->len + size > FIO_WRITE_BUFFER_SIZE && wb->len > 0)
+	{
+		IO_CHECK(fio_write_all(wb->fd, wb->data, wb->len), wb->len);
+		wb->len = 0;
+	}
+
+	if (size >= FIO_WRITE_BUFFER_SIZE)
+		IO_CHECK(fio_write_all(wb->fd, buf, size), size);
+	else
+	{
+		memcpy(wb->data + wb->len, buf, size);
+		wb->len += size;
+	}
+}
+
+static void fio_buffer_flush(fio_write_buffer* wb)
+{
+	if (wb->len > 0)
+		IO_CHECK(fio_write_all(wb->fd, wb->data, wb->len), wb->len);
+	wb->len = 0;
+}
+
+/* Number of blocks read from data file by single pread in fio_send_pages_impl */
+#define FIO_SEND_PAGES_READ_BLOCKS 64
+
+/*
+ * Read single page and validate it, retrying if the page is torn or its
+ * checksum doesn't match. Used when page read as part of a larger chunk
+ * doesn't pass validation. If client can fetch invalid pages itself,
+ * don't retry, but ask it to fetch the page, like prepare_page() does.
+ * Returns 1 if the page is read, 0 on EOF, 2 if the client is asked to
+ * fetch the page and -1 if error or corruption was reported to the client.
+ */
+static int
+fio_send_pages_read_page(int fd, fio_write_buffer* out, char *page, BlockNumber blknum,
+						 fio_send_request *req, bool fetch, XLogRecPtr *page_lsn)
+{
+	int			rc = 0;
+	int			retry_attempts = PAGE_READ_ATTEMPTS;
+	fio_header	hdr;
+
+	for (;;)
+	{
+		ssize_t read_len = pread(fd, page, BLCKSZ, blknum*BLCKSZ);
+		*page_lsn = InvalidXLogRecPtr;
+
+		/* report eof */
+		if (read_len == 0)
+			return 0;
+		/* report error */
+		else if (read_len < 0)
+		{
+			/* TODO: better to report exact error message, not errno */
+			hdr.cop = FIO_ERROR;
+			hdr.arg = errno;
+			hdr.size = blknum;
+			fio_buffer_write(out, &hdr, sizeof(hdr));
+			return -1;
+		}
+		else if (read_len == BLCKSZ)
+		{
+			rc = validate_one_page(page, req->segmentno + blknum,
+								   InvalidXLogRecPtr, page_lsn, req->checksumVersion);
+
+			/* TODO: optimize copy of zeroed page */
+			if (rc == PAGE_IS_ZEROED || rc == PAGE_IS_VALID)
+				return 1;
+		}
+//		else /* readed less than BLKSZ bytes, retry */
+
+		/* File is either has insane header or invalid checksum,
+		 * retry. If retry attempts are exhausted, report corruption,
+		 * or ask the client to fetch the page right away.
+		 */
+		if (--retry_attempts == 0 || fetch)
+		{
+			char *errormsg = NULL;
+			hdr.cop = fetch ? FIO_FETCH_PAGE : FIO_SEND_FILE_CORRUPTION;
+			hdr.arg = blknum;
+
+			/* Construct the error message */
+			if (rc == PAGE_HEADER_IS_INVALID)
+				get_header_errormsg(page, &errormsg);
+			else if (rc == PAGE_CHECKSUM_MISMATCH)
+				get_checksum_errormsg(page, &errormsg,
+									  req->segmentno + blknum);
+
+			/* if error message is not empty, set payload size to its length */
+			hdr.size = errormsg ? strlen(errormsg) + 1 : 0;
+
+			/* send header */
+			fio_buffer_write(out, &hdr, sizeof(hdr));
+
+			/* send error message if any */
+			if (errormsg)
+				fio_buffer_write(out, errormsg, hdr.size);
+
+			pg_free(errormsg);
+			return fetch ? 2 : -1;
+		}
+	}
+}
+
+/*
+ * Send pages of data file to the client.
+ *
+ * Blocks are read by ranges of contiguous blocks: either ranges taken from
+ * the pagemap, or the whole file. Every range is read with preads of up to
+ * FIO_SEND_PAGES_READ_BLOCKS blocks, and only pages that fail validation
+ * are reread one by one. Messages are collected in the write buffer,
+ * so many pages are sent by single write.
+ */
+static void fio_send_pages_impl(int fd, int out, char* buf, bool with_pagemap, bool fetch)
+{
+	BlockNumber range_start = 0;
+	BlockNumber range_count = 0;
 	BlockNumber n_blocks_read = 0;
 	XLogRecPtr	page_lsn = 0;
-	char read_buffer[BLCKSZ+1];
+	char	   *read_buffer;
+	fio_write_buffer wb;
 	fio_header hdr;
 	fio_send_request *req = (fio_send_request*) buf;
 
 	/* parse buffer */
-	datapagemap_t *map = NULL;
-	datapagemap_iterator_t *iter = NULL;
+	pagemap_t	map;
+	pagemap_iterator_t iter;
+
+	MemSet(&map, 0, sizeof(map));
 
 	if (with_pagemap)
 	{
-		map = pgut_malloc(sizeof(datapagemap_t));
-		map->bitmapsize = req->bitmapsize;
-		map->bitmap = (char*) buf + sizeof(fio_send_request);
-
-		/* get first block */
-		iter = datapagemap_iterate(map);
-		datapagemap_next(iter, &blknum);
+		if (!pagemap_deserialize(&map, buf + sizeof(fio_send_request), req->bitmapsize))
+		{
+			hdr.cop = FIO_ERROR;
+			hdr.arg = EINVAL;
+			hdr.size = 0;
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			return;
+		}
+		pagemap_iterate(&map, &iter);
 	}
 
-	hdr.cop = FIO_PAGE;
-	read_buffer[BLCKSZ] = 1; /* barrier */
+	read_buffer = pgut_malloc(FIO_SEND_PAGES_READ_BLOCKS * BLCKSZ);
+	wb.fd = out;
+	wb.len = 0;
+	wb.data = pgut_malloc(FIO_WRITE_BUFFER_SIZE);
 
-	while (blknum < req->nblocks)
+	for (;;)
 	{
-		int rc = 0;
-		int retry_attempts = PAGE_READ_ATTEMPTS;
+		BlockNumber range_end;
+		BlockNumber chunk_start;
 
-		/* TODO: handle signals on the agent */
-		if (interrupted)
-			elog(ERROR, "Interrupted during remote page reading");
+		/* get next range of blocks to read */
+		if (with_pagemap)
+		{
+			if (!pagemap_next_range(&iter, &range_start, &range_count))
+				break;
+		}
+		else
+		{
+			/* whole file is a single range */
+			if (range_count > 0)
+				break;
+			range_count = req->nblocks;
+		}
 
-		/* read page, check header and validate checksumms */
-		/* TODO: libpq connection on the agent, so we can do ptrack
-		 * magic right here.
-		 */
-		for (;;)
+		if (range_start >= req->nblocks)
+			break;
+
+		range_end = Min(range_start + range_count, req->nblocks);
+
+		for (chunk_start = range_start; chunk_start < range_end;
+			 chunk_start += FIO_SEND_PAGES_READ_BLOCKS)
 		{
-			ssize_t read_len = pread(fd, read_buffer, BLCKSZ, blknum*BLCKSZ);
-			page_lsn = InvalidXLogRecPtr;
-
-			/* report eof */
-			if (read_len == 0)
-				goto eof;
-			/* report error */
-			else if (read_len < 0)
+			BlockNumber chunk_blocks = Min(range_end - chunk_start,
+										   FIO_SEND_PAGES_READ_BLOCKS);
+			BlockNumber n_full_blocks;
+			BlockNumber i;
+			ssize_t		read_len;
+
+			/* TODO: handle signals on the agent */
+			if (interrupted)
+				elog(ERROR, "Interrupted during remote page reading");
+
+			read_len = pread(fd, read_buffer, chunk_blocks * BLCKSZ,
+							 (off_t) chunk_start * BLCKSZ);
+
+			if (read_len < 0)
 			{
-				/* TODO: better to report exact error message, not errno */
 				hdr.cop = FIO_ERROR;
 				hdr.arg = errno;
-				hdr.size = blknum;
-				IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+				hdr.size = chunk_start;
+				fio_buffer_write(&wb, &hdr, sizeof(hdr));
 				goto cleanup;
 			}
-			else if (read_len == BLCKSZ)
-			{
-				rc = validate_one_page(read_buffer, req->segmentno + blknum,
-										   InvalidXLogRecPtr, &page_lsn, req->checksumVersion);
 
-				/* TODO: optimize copy of zeroed page */
-				if (rc == PAGE_IS_ZEROED)
-					break;
-				else if (rc == PAGE_IS_VALID)
-					break;
-			}
-//		  	else /* readed less than BLKSZ bytes, retry */
+			/* the last page of short read is reread below */
+			n_full_blocks = read_len / BLCKSZ;
 
-			/* File is either has insane header or invalid checksum,
-			 * retry. If retry attempts are exhausted, report corruption.
-			 */
-			if (--retry_attempts == 0)
+			for (i = 0; i < chunk_blocks; i++)
 			{
-				char *errormsg = NULL;
-				hdr.cop = FIO_SEND_FILE_CORRUPTION;
-				hdr.arg = blknum;
-
-				/* Construct the error message */
-				if (rc == PAGE_HEADER_IS_INVALID)
-					get_header_errormsg(read_buffer, &errormsg);
-				else if (rc == PAGE_CHECKSUM_MISMATCH)
-					get_checksum_errormsg(read_buffer, &errormsg,
-										  req->segmentno + blknum);
-
-				/* if error message is not empty, set payload size to its length */
-				hdr.size = errormsg ? strlen(errormsg) + 1 : 0;
-
-				/* send header */
-				IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
-
-				/* send error message if any */
-				if (errormsg)
-					IO_CHECK(fio_write_all(out, errormsg, hdr.size), hdr.size);
+				BlockNumber blknum = chunk_start + i;
+				char	   *page = read_buffer + i * BLCKSZ;
+				int			rc = PAGE_HEADER_IS_INVALID;
+
+				/* read page, check header and validate checksumms */
+				page_lsn = InvalidXLogRecPtr;
+				if (i < n_full_blocks)
+					rc = validate_one_page(page, req->segmentno + blknum,
+										   InvalidXLogRecPtr, &page_lsn,
+										   req->checksumVersion);
+
+				if (rc != PAGE_IS_VALID && rc != PAGE_IS_ZEROED)
+				{
+					switch (fio_send_pages_read_page(fd, &wb, page, blknum,
+													 req, fetch, &page_lsn))
+					{
+						case 0:
+							goto eof;
+						case -1:
+							goto cleanup;
+						case 2:
+							/* client fetches and counts the page itself */
+							continue;
+					}
+				}
 
-				pg_free(errormsg);
-				goto cleanup;
-			}
-		}
+				n_blocks_read++;
 
-		n_blocks_read++;
+				/*
+				 * horizonLsn is not 0 only in case of delta backup.
+				 * As far as unsigned number are always greater or equal than zero,
+				 * there is no sense to add more checks.
+				 */
+				if ((req->horizonLsn == InvalidXLogRecPtr) ||
+					(page_lsn == InvalidXLogRecPtr) ||                     /* zeroed page */
+					(req->horizonLsn > 0 && page_lsn >= req->horizonLsn))  /* delta */
+				{
+					char write_buffer[BLCKSZ*2];
+					BackupPageHeader* bph = (BackupPageHeader*)write_buffer;
 
-		/*
-		 * horizonLsn is not 0 only in case of delta backup.
-		 * As far as unsigned number are always greater or equal than zero,
-		 * there is no sense to add more checks.
-		 */
-		if ((req->horizonLsn == InvalidXLogRecPtr) ||
-			(page_lsn == InvalidXLogRecPtr) ||                     /* zeroed page */
-			(req->horizonLsn > 0 && page_lsn >= req->horizonLsn))  /* delta */
-		{
-			char write_buffer[BLCKSZ*2];
-			BackupPageHeader* bph = (BackupPageHeader*)write_buffer;
+					/* compress page */
+					hdr.cop = FIO_PAGE;
+					hdr.arg = bph->block = blknum;
+					hdr.size = sizeof(BackupPageHeader);
 
-			/* compress page */
-			hdr.arg = bph->block = blknum;
-			hdr.size = sizeof(BackupPageHeader);
+					bph->compressed_size = do_compress(write_buffer + sizeof(BackupPageHeader),
+													   sizeof(write_buffer) - sizeof(BackupPageHeader),
+													   page, BLCKSZ, req->calg, req->clevel,
+													   NULL);
 
-			bph->compressed_size = do_compress(write_buffer + sizeof(BackupPageHeader),
-											   sizeof(write_buffer) - sizeof(BackupPageHeader),
-											   read_buffer, BLCKSZ, req->calg, req->clevel,
-											   NULL);
+					if (bph->compressed_size <= 0 || bph->compressed_size >= BLCKSZ)
+					{
+						/* Do not compress page */
+						memcpy(write_buffer + sizeof(BackupPageHeader), page, BLCKSZ);
+						bph->compressed_size = BLCKSZ;
+					}
+					hdr.size += MAXALIGN(bph->compressed_size);
 
-			if (bph->compressed_size <= 0 || bph->compressed_size >= BLCKSZ)
-			{
-				/* Do not compress page */
-				memcpy(write_buffer + sizeof(BackupPageHeader), read_buffer, BLCKSZ);
-				bph->compressed_size = BLCKSZ;
+					fio_buffer_write(&wb, &hdr, sizeof(hdr));
+					fio_buffer_write(&wb, write_buffer, hdr.size);
+				}
 			}
-			hdr.size += MAXALIGN(bph->compressed_size);
-
-			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
-			IO_CHECK(fio_write_all(out, write_buffer, hdr.size), hdr.size);
 		}
-
-		/* next block */
-		if (with_pagemap)
-		{
-			/* exit if pagemap is exhausted */
-			if (!datapagemap_next(iter, &blknum))
-				break;
-		}
-		else
-			blknum++;
 	}
 
 eof:
@@ -1624,11 +2455,13 @@ eof:
 	hdr.cop = FIO_SEND_FILE_EOF;
 	hdr.arg = 0;
 	hdr.size = n_blocks_read; /* TODO: report number of backed up blocks */
-	IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+	fio_buffer_write(&wb, &hdr, sizeof(hdr));
 
 cleanup:
-	pg_free(map);
-	pg_free(iter);
+	fio_buffer_flush(&wb);
+	pg_free(wb.data);
+	pg_free(read_buffer);
+	pagemap_free(&map);
 	return;
 }
 
@@ -1881,7 +2714,8 @@ static void fio_send_file_impl(int out, char const* path)
 {
 	FILE      *fp;
 	fio_header hdr;
-	char      *buf = pgut_malloc(CHUNK_SIZE);
+	/* chunk is sent together with its header by single write */
+	char      *buf = pgut_malloc(sizeof(fio_header) + CHUNK_SIZE);
 	size_t	   read_len = 0;
 	char      *errormsg = NULL;
 
@@ -1924,7 +2758,7 @@ static void fio_send_file_impl(int out, char const* path)
 	/* copy content */
 	for (;;)
 	{
-		read_len = fread(buf, 1, CHUNK_SIZE, fp);
+		read_len = fread(buf + sizeof(hdr), 1, CHUNK_SIZE, fp);
 
 		/* report error */
 		if (ferror(fp))
@@ -1947,8 +2781,8 @@ static void fio_send_file_impl(int out, char const* path)
 			/* send chunk */
 			hdr.cop = FIO_PAGE;
 			hdr.size = read_len;
-			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
-			IO_CHECK(fio_write_all(out, buf, read_len), read_len);
+			memcpy(buf, &hdr, sizeof(hdr));
+			IO_CHECK(fio_write_all(out, buf, sizeof(hdr) + read_len), sizeof(hdr) + read_len);
 		}
 
 		if (feof(fp))
@@ -1967,6 +2801,320 @@ cleanup:
 	return;
 }
 
+/*
+ * Remember failure of request, which is not confirmed to the client.
+ * Only the first error is kept until the client asks for it.
+ */
+static void pg_attribute_printf(2, 3)
+fio_set_async_error(char** errormsg, char const* fmt, ...)
+{
+	char buf[PRINTF_BUF_SIZE];
+	va_list args;
+
+	if (*errormsg != NULL)
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	*errormsg = pgut_strdup(buf);
+}
+
+/* Send reply with the pending deferred error attached */
+static void fio_send_async_error(int out, fio_header* hdr, char** errormsg)
+{
+	hdr->size = *errormsg ? strlen(*errormsg) + 1 : 0;
+	IO_CHECK(fio_write_all(out, hdr, sizeof(*hdr)), sizeof(*hdr));
+	if (*errormsg)
+	{
+		IO_CHECK(fio_write_all(out, *errormsg, hdr->size), hdr->size);
+		pg_free(*errormsg);
+		*errormsg = NULL;
+	}
+}
+
+/* Write range of adjacent pages restored by fio_write_pages_impl() */
+static bool
+fio_write_pages_run(int fd, char const* pages, BlockNumber start, uint32 n_blocks)
+{
+	size_t size = (size_t) n_blocks * BLCKSZ;
+	off_t  offs = (off_t) start * BLCKSZ;
+
+	while (size > 0)
+	{
+		ssize_t rc = pwrite(fd, pages, size, offs);
+
+		if (rc <= 0)
+		{
+			if (rc == 0)
+				errno = ENOSPC;
+			return false;
+		}
+		pages += rc;
+		offs += rc;
+		size -= rc;
+	}
+	return true;
+}
+
+/*
+ * Write pages sent by fio_flush_pages(). Pages are decompressed
+ * into the buffer of adjacent blocks, which is written by single pwrite
+ * when the run of blocks is interrupted or the buffer is full.
+ */
+static void
+fio_write_pages_impl(int fd, char const* buf, size_t size, char const* path, char** errormsg)
+{
+	char const* end = buf + size;
+	char* pages = pgut_malloc(FIO_WRITE_PAGES_RUN * BLCKSZ);
+	BlockNumber run_start = 0;
+	uint32 run_len = 0;
+
+	while (buf < end)
+	{
+		fio_page_entry entry;
+		char* page;
+
+		memcpy(&entry, buf, sizeof(entry));
+		buf += sizeof(entry);
+
+		if (entry.size > BLCKSZ || buf + entry.size > end)
+		{
+			fio_set_async_error(errormsg, "Malformed page batch for file \"%s\"", path);
+			break;
+		}
+
+		/* write out collected run if the page doesn't continue it */
+		if (run_len > 0 &&
+			(entry.blknum != run_start + run_len || run_len == FIO_WRITE_PAGES_RUN))
+		{
+			if (!fio_write_pages_run(fd, pages, run_start, run_len))
+			{
+				fio_set_async_error(errormsg, "Cannot write block %u of \"%s\": %s",
+									run_start, path, strerror(errno));
+				run_len = 0;
+				break;
+			}
+			run_len = 0;
+		}
+
+		if (run_len == 0)
+			run_start = entry.blknum;
+		page = pages + run_len * BLCKSZ;
+
+		if (entry.compress_alg == NONE_COMPRESS)
+		{
+			if (entry.size != BLCKSZ)
+			{
+				fio_set_async_error(errormsg, "Malformed page batch for file \"%s\"", path);
+				break;
+			}
+			memcpy(page, buf, BLCKSZ);
+		}
+		else
+		{
+			const char *decompress_errormsg = NULL;
+			int32 uncompressed_size = do_decompress(page, BLCKSZ, buf, entry.size,
+													entry.compress_alg, &decompress_errormsg);
+
+			if (uncompressed_size != BLCKSZ)
+			{
+				fio_set_async_error(errormsg, "Cannot decompress block %u of \"%s\": %s",
+									entry.blknum, path,
+									decompress_errormsg ? decompress_errormsg : "wrong page size");
+				break;
+			}
+		}
+
+		run_len++;
+		buf += entry.size;
+	}
+
+	if (run_len > 0 && !fio_write_pages_run(fd, pages, run_start, run_len))
+		fio_set_async_error(errormsg, "Cannot write block %u of \"%s\": %s",
+							run_start, path, strerror(errno));
+
+	pg_free(pages);
+}
+
+/* Write out pages of the current run of FIO_APPLY_FILE request */
+static void
+fio_apply_flush_run(int fd, fio_apply_state* state, char const* to_fullpath, char** errormsg)
+{
+	if (state->run_len > 0 &&
+		!fio_write_pages_run(fd, state->run, state->run_start, state->run_len))
+	{
+		fio_set_async_error(errormsg, "Cannot write block %u of \"%s\": %s",
+							state->run_start, to_fullpath, strerror(errno));
+		state->done = true;
+	}
+	state->run_len = 0;
+}
+
+/*
+ * Check BackupPageHeader of the received page, the same way as
+ * restore_data_file_internal() does. Returns false if the rest of
+ * backup file should be skipped.
+ */
+static bool
+fio_apply_header(int fd, fio_apply_state* state, char const* to_fullpath, char** errormsg)
+{
+	BackupPageHeader* header = (BackupPageHeader*) state->page;
+
+	if (header->block < state->blknum)
+	{
+		fio_set_async_error(errormsg, "Backup is broken at block %u of \"%s\"",
+							state->blknum, state->from_fullpath);
+		return false;
+	}
+
+	state->blknum = header->block;
+
+	/* Backward compatibility kludge, see restore_data_file_internal() */
+	if (header->compressed_size == PageIsTruncated)
+	{
+		fio_apply_flush_run(fd, state, to_fullpath, errormsg);
+		if (ftruncate(fd, (off_t) header->block * BLCKSZ) < 0)
+			fio_set_async_error(errormsg, "Cannot truncate file \"%s\": %s",
+								to_fullpath, strerror(errno));
+		return false;
+	}
+
+	/* no point in writing redundant data */
+	if (state->req.nblocks > 0 && state->blknum >= state->req.nblocks)
+		return false;
+
+	if (header->compressed_size > BLCKSZ || header->compressed_size < 0)
+	{
+		fio_set_async_error(errormsg, "Size of block %u of \"%s\" is invalid: %d",
+							state->blknum, state->from_fullpath, header->compressed_size);
+		return false;
+	}
+
+	return true;
+}
+
+/* Decompress received page and add it to the run of adjacent blocks */
+static void
+fio_apply_page(int fd, fio_apply_state* state, char const* to_fullpath, char** errormsg)
+{
+	BackupPageHeader* header = (BackupPageHeader*) state->page;
+	char* data = state->page + sizeof(BackupPageHeader);
+	char* page;
+
+	if (state->run_len > 0 &&
+		(state->blknum != state->run_start + state->run_len ||
+		 state->run_len == FIO_WRITE_PAGES_RUN))
+	{
+		fio_apply_flush_run(fd, state, to_fullpath, errormsg);
+		if (state->done)
+			return;
+	}
+
+	if (state->run_len == 0)
+		state->run_start = state->blknum;
+	page = state->run + state->run_len * BLCKSZ;
+
+	if (header->compressed_size != BLCKSZ
+		|| page_may_be_compressed(data, state->req.compress_alg,
+								  state->req.backup_version))
+	{
+		const char *decompress_errormsg = NULL;
+		int32 uncompressed_size = do_decompress(page, BLCKSZ, data, header->compressed_size,
+												state->req.compress_alg, &decompress_errormsg);
+
+		if (uncompressed_size != BLCKSZ)
+		{
+			fio_set_async_error(errormsg, "Cannot decompress block %u of \"%s\": %s",
+								state->blknum, state->from_fullpath,
+								decompress_errormsg ? decompress_errormsg : "wrong page size");
+			state->done = true;
+			return;
+		}
+	}
+	else
+		memcpy(page, data, BLCKSZ);
+
+	state->run_len++;
+}
+
+/*
+ * Apply chunk of backup data file sent by fio_apply_data_file().
+ * Pages may be split between chunks, so the current page is collected
+ * in the state until it is complete.
+ */
+static void
+fio_apply_data_impl(int fd, fio_apply_state* state, char const* buf, size_t size,
+					char const* to_fullpath, char** errormsg)
+{
+	BackupPageHeader* header = (BackupPageHeader*) state->page;
+
+	while (size > 0 && !state->done)
+	{
+		size_t need = sizeof(BackupPageHeader);
+		size_t len;
+
+		if (state->has_header)
+			need += MAXALIGN(header->compressed_size);
+
+		len = Min(need - state->filled, size);
+		memcpy(state->page + state->filled, buf, len);
+		state->filled += len;
+		buf += len;
+		size -= len;
+
+		if (state->filled < need)
+			break;
+
+		if (!state->has_header)
+		{
+			/* skip empty block */
+			if (header->block == 0 && header->compressed_size == 0)
+			{
+				state->filled = 0;
+				continue;
+			}
+
+			if (!fio_apply_header(fd, state, to_fullpath, errormsg))
+			{
+				state->done = true;
+				break;
+			}
+
+			state->has_header = true;
+			if (header->compressed_size > 0)
+				continue;
+		}
+
+		fio_apply_page(fd, state, to_fullpath, errormsg);
+		state->has_header = false;
+		state->filled = 0;
+	}
+}
+
+/* Finish backup data file sent by fio_apply_data_file() */
+static void
+fio_apply_end_impl(int fd, fio_apply_state* state, char const* to_fullpath, char** errormsg)
+{
+	if (!state->done && state->filled > 0)
+		fio_set_async_error(errormsg, "Odd size page found at block %u of \"%s\"",
+							state->blknum, state->from_fullpath);
+
+	/* pages collected before the rest of file was skipped are written too */
+	fio_apply_flush_run(fd, state, to_fullpath, errormsg);
+}
+
+static void
+fio_apply_free(fio_apply_state** state)
+{
+	if (*state == NULL)
+		return;
+	pg_free((*state)->from_fullpath);
+	pg_free((*state)->run);
+	pg_free(*state);
+	*state = NULL;
+}
+
 /* Execute commands at remote host */
 void fio_communicate(int in, int out)
 {
@@ -1977,12 +3125,16 @@ void fio_communicate(int in, int out)
 	 */
 	int fd[FIO_FDMAX];
 	DIR* dir[FIO_FDMAX];
+	char* fd_path[FIO_FDMAX];  /* for error messages of unconfirmed requests */
+	fio_apply_state* apply[FIO_FDMAX]; /* backup data files applied to opened files */
+	char* async_errormsg = NULL;
 	struct dirent* entry;
 	size_t buf_size = 128*1024;
 	char* buf = (char*)pgut_malloc(buf_size);
 	fio_header hdr;
 	struct stat st;
 	int rc;
+	int i;
 	int tmp_fd;
 	pg_crc32 crc;
 
@@ -1991,6 +3143,10 @@ void fio_communicate(int in, int out)
     SYS_CHECK(setmode(out, _O_BINARY));
 #endif
 
+	memset(fd_path, 0, sizeof(fd_path));
+	memset(apply, 0, sizeof(apply));
+	fio_set_channel(in);
+
     /* Main loop until end of processing all master commands */
 	while ((rc = fio_read_all(in, &hdr, sizeof hdr)) == sizeof(hdr)) {
 		if (hdr.size != 0) {
@@ -2011,38 +3167,80 @@ void fio_communicate(int in, int out)
 			hdr.size = 0;
 			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 			break;
-		  case FIO_READDIR: /* Get next directory entry */
+		  case FIO_READDIR: /* Get next batch of directory entries */
 			hdr.cop = FIO_SEND;
-			entry = readdir(dir[hdr.handle]);
-			if (entry != NULL)
-			{
-				hdr.size = sizeof(*entry);
-				IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
-				IO_CHECK(fio_write_all(out, entry, hdr.size), hdr.size);
-			}
-			else
+			hdr.size = 0;
+			Assert(buf_size >= FIO_READDIR_BATCH*sizeof(*entry));
+			while (hdr.size < FIO_READDIR_BATCH*sizeof(*entry)
+				   && (entry = readdir(dir[hdr.handle])) != NULL)
 			{
-				hdr.size = 0;
-				IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+				memcpy(buf + hdr.size, entry, sizeof(*entry));
+				hdr.size += sizeof(*entry);
 			}
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			if (hdr.size != 0)
+				IO_CHECK(fio_write_all(out, buf, hdr.size), hdr.size);
 			break;
 		  case FIO_CLOSEDIR: /* Finish directory traversal */
-			SYS_CHECK(closedir(dir[hdr.handle]));
+			if (closedir(dir[hdr.handle]) < 0)
+				fio_set_async_error(&async_errormsg, "Cannot close directory: %s", strerror(errno));
 			break;
 		  case FIO_OPEN: /* Open file */
 			fd[hdr.handle] = open(buf, hdr.arg, FILE_PERMISSIONS);
 			hdr.arg = fd[hdr.handle] < 0 ? errno : 0;
 			hdr.size = 0;
 			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			pg_free(fd_path[hdr.handle]);
+			fd_path[hdr.handle] = pgut_strdup(buf);
+			break;
+		  case FIO_OPEN_ASYNC: /* Open file without confirmation */
+			fd[hdr.handle] = open(buf, hdr.arg, FILE_PERMISSIONS);
+			if (fd[hdr.handle] < 0)
+				fio_set_async_error(&async_errormsg, "Cannot open file \"%s\": %s", buf, strerror(errno));
+			pg_free(fd_path[hdr.handle]);
+			fd_path[hdr.handle] = pgut_strdup(buf);
 			break;
 		  case FIO_CLOSE: /* Close file */
-			SYS_CHECK(close(fd[hdr.handle]));
+			fio_apply_free(&apply[hdr.handle]);
+			/* file which failed to open is already reported */
+			if (fd[hdr.handle] >= 0 && close(fd[hdr.handle]) < 0)
+				fio_set_async_error(&async_errormsg, "Cannot close file \"%s\": %s",
+									fd_path[hdr.handle], strerror(errno));
 			break;
 		  case FIO_WRITE: /* Write to the current position in file */
-			IO_CHECK(fio_write_all(fd[hdr.handle], buf, hdr.size), hdr.size);
+			if (fio_write_all(fd[hdr.handle], buf, hdr.size) != hdr.size)
+				fio_set_async_error(&async_errormsg, "Cannot write to file \"%s\": %s",
+									fd_path[hdr.handle], strerror(errno));
 			break;
 		  case FIO_WRITE_COMPRESSED: /* Write to the current position in file */
-			IO_CHECK(fio_write_compressed_impl(fd[hdr.handle], buf, hdr.size, hdr.arg), BLCKSZ);
+			if (fio_write_compressed_impl(fd[hdr.handle], buf, hdr.size, hdr.arg) != BLCKSZ)
+				fio_set_async_error(&async_errormsg, "Cannot write to file \"%s\": %s",
+									fd_path[hdr.handle], strerror(errno));
+			break;
+		  case FIO_WRITE_PAGES: /* Write batch of pages to their blocks */
+			fio_write_pages_impl(fd[hdr.handle], buf, hdr.size, fd_path[hdr.handle], &async_errormsg);
+			break;
+		  case FIO_APPLY_FILE: /* Start applying backup data file */
+			fio_apply_free(&apply[hdr.handle]);
+			apply[hdr.handle] = pgut_new(fio_apply_state);
+			MemSet(apply[hdr.handle], 0, sizeof(fio_apply_state));
+			memcpy(&apply[hdr.handle]->req, buf, sizeof(fio_apply_request));
+			apply[hdr.handle]->from_fullpath = pgut_strdup(buf + sizeof(fio_apply_request));
+			apply[hdr.handle]->run = pgut_malloc(FIO_WRITE_PAGES_RUN * BLCKSZ);
+			/* file which failed to open is already reported */
+			apply[hdr.handle]->done = fd[hdr.handle] < 0;
+			break;
+		  case FIO_APPLY_DATA: /* Chunk of backup data file, empty at the end of file */
+			Assert(apply[hdr.handle] != NULL);
+			if (hdr.size > 0)
+				fio_apply_data_impl(fd[hdr.handle], apply[hdr.handle], buf, hdr.size,
+									fd_path[hdr.handle], &async_errormsg);
+			else
+			{
+				fio_apply_end_impl(fd[hdr.handle], apply[hdr.handle],
+								   fd_path[hdr.handle], &async_errormsg);
+				fio_apply_free(&apply[hdr.handle]);
+			}
 			break;
 		  case FIO_READ: /* Read from the current position in file */
 			if ((size_t)hdr.arg > buf_size) {
@@ -2084,13 +3282,19 @@ void fio_communicate(int in, int out)
 			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 			break;
 		  case FIO_RENAME: /* Rename file */
-			SYS_CHECK(rename(buf, buf + strlen(buf) + 1));
+			if (rename(buf, buf + strlen(buf) + 1) < 0)
+				fio_set_async_error(&async_errormsg, "Cannot rename file \"%s\" to \"%s\": %s",
+									buf, buf + strlen(buf) + 1, strerror(errno));
 			break;
 		  case FIO_SYMLINK: /* Create symbolic link */
-			SYS_CHECK(symlink(buf, buf + strlen(buf) + 1));
+			if (symlink(buf, buf + strlen(buf) + 1) < 0)
+				fio_set_async_error(&async_errormsg, "Cannot create symlink \"%s\": %s",
+									buf + strlen(buf) + 1, strerror(errno));
 			break;
 		  case FIO_UNLINK: /* Remove file or directory (TODO: Win32) */
-			SYS_CHECK(remove_file_or_dir(buf));
+			/* caller doesn't wait, so missing file is not an error */
+			if (remove_file_or_dir(buf) < 0 && errno != ENOENT)
+				fio_set_async_error(&async_errormsg, "Cannot remove \"%s\": %s", buf, strerror(errno));
 			break;
 		  case FIO_MKDIR:  /* Create directory */
 			hdr.size = 0;
@@ -2098,28 +3302,39 @@ void fio_communicate(int in, int out)
 			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
 			break;
 		  case FIO_CHMOD:  /* Change file mode */
-			SYS_CHECK(chmod(buf, hdr.arg));
+			if (chmod(buf, hdr.arg) < 0)
+				fio_set_async_error(&async_errormsg, "Cannot change mode of \"%s\": %s", buf, strerror(errno));
 			break;
 		  case FIO_SEEK:   /* Set current position in file */
-			SYS_CHECK(lseek(fd[hdr.handle], hdr.arg, SEEK_SET));
+			if (lseek(fd[hdr.handle], hdr.arg, SEEK_SET) < 0)
+				fio_set_async_error(&async_errormsg, "Cannot seek in file \"%s\": %s",
+									fd_path[hdr.handle], strerror(errno));
 			break;
 		  case FIO_TRUNCATE: /* Truncate file */
-			SYS_CHECK(ftruncate(fd[hdr.handle], hdr.arg));
+			if (ftruncate(fd[hdr.handle], hdr.arg) < 0)
+				fio_set_async_error(&async_errormsg, "Cannot truncate file \"%s\": %s",
+									fd_path[hdr.handle], strerror(errno));
 			break;
 		  case FIO_SEND_PAGES:
 			Assert(hdr.size == sizeof(fio_send_request));
-			fio_send_pages_impl(fd[hdr.handle], out, buf, false);
+			fio_send_pages_impl(fd[hdr.handle], out, buf, false,
+								(hdr.arg & FIO_SEND_PAGES_FETCH) != 0);
 			break;
 		  case FIO_SEND_PAGES_PAGEMAP:
 			// buf contain fio_send_request header and bitmap.
-			fio_send_pages_impl(fd[hdr.handle], out, buf, true);
+			fio_send_pages_impl(fd[hdr.handle], out, buf, true,
+								(hdr.arg & FIO_SEND_PAGES_FETCH) != 0);
 			break;
 		  case FIO_SEND_FILE:
 			fio_send_file_impl(out, buf);
 			break;
+		  case FIO_SYNC_FILES:
+			hdr.arg = fio_sync_files_impl(buf, hdr.arg);
+			fio_send_async_error(out, &hdr, &async_errormsg);
+			break;
 		  case FIO_SYNC:
 			/* open file and fsync it */
-			tmp_fd = open(buf, O_WRONLY | PG_BINARY, FILE_PERMISSIONS);
+			tmp_fd = fio_open_for_sync(buf);
 			if (tmp_fd < 0)
 				hdr.arg = errno;
 			else
@@ -2131,7 +3346,7 @@ void fio_communicate(int in, int out)
 			}
 			close(tmp_fd);
 
-			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			fio_send_async_error(out, &hdr, &async_errormsg);
 			break;
 		  case FIO_GET_CRC32:
 			/* calculate crc32 for a file */
@@ -2141,15 +3356,33 @@ void fio_communicate(int in, int out)
 				crc = pgFileGetCRC(buf, true, true);
 			IO_CHECK(fio_write_all(out, &crc, sizeof(crc)), sizeof(crc));
 			break;
+		  case FIO_LIST_TREE:
+			fio_list_tree_impl(out, buf, hdr.arg);
+			break;
+		  case FIO_MKDIRS:
+			hdr.size = 0;
+			hdr.arg = fio_mkdirs_impl(buf, hdr.arg);
+			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			break;
+		  case FIO_GET_ASYNC_ERROR:
+			fio_send_async_error(out, &hdr, &async_errormsg);
+			break;
 		  case FIO_DISCONNECT:
 			hdr.cop = FIO_DISCONNECTED;
-			IO_CHECK(fio_write_all(out, &hdr, sizeof(hdr)), sizeof(hdr));
+			fio_send_async_error(out, &hdr, &async_errormsg);
 			break;
 		  default:
 			Assert(false);
 		}
 	}
 	free(buf);
+	for (i = 0; i < FIO_FDMAX; i++)
+	{
+		pg_free(fd_path[i]);
+		fio_apply_free(&apply[i]);
+	}
+	pg_free(async_errormsg);
+	fio_set_channel(-1);
 	if (rc != 0) { /* Not end of stream: normal pipe close */
 		perror("read");
 		exit(EXIT_FAILURE);
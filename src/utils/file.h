@@ -44,6 +44,15 @@ typedef enum
 //	FIO_CHUNK,
 	FIO_SEND_FILE_EOF,
 	FIO_SEND_FILE_CORRUPTION,
+	FIO_SYNC_FILES,
+	FIO_OPEN_ASYNC,
+	FIO_GET_ASYNC_ERROR,
+	FIO_LIST_TREE,
+	FIO_MKDIRS,
+	FIO_WRITE_PAGES,
+	FIO_APPLY_FILE,
+	FIO_APPLY_DATA,
+	FIO_FETCH_PAGE,
 	/* messages for closing connection */
 	FIO_DISCONNECT,
 	FIO_DISCONNECTED,
@@ -58,19 +67,61 @@ typedef enum
 } fio_location;
 
 #define FIO_FDMAX 64
+#define FIO_READDIR_BATCH 128 /* directory entries sent per FIO_READDIR request */
+#define FIO_WRITE_PAGES_BATCH (256*1024) /* max size of FIO_WRITE_PAGES message */
+#define FIO_WRITE_PAGES_RUN 32 /* max number of blocks written by single pwrite */
 #define FIO_PIPE_MARKER 0x40000000
 
 #define SYS_CHECK(cmd) do if ((cmd) < 0) { fprintf(stderr, "%s:%d: (%s) %s\n", __FILE__, __LINE__, #cmd, strerror(errno)); exit(EXIT_FAILURE); } while (0)
 #define IO_CHECK(cmd, size) do { int _rc = (cmd); if (_rc != (size)) fio_error(_rc, size, __FILE__, __LINE__); } while (0)
 
+/* FIO_SEND_PAGES flags */
+#define FIO_SEND_PAGES_FETCH    1 /* ask client to fetch invalid pages, see FIO_FETCH_PAGE */
+
+/* FIO_LIST_TREE flags */
+#define FIO_LIST_EXCLUDE        1
+#define FIO_LIST_FOLLOW_SYMLINK 2
+#define FIO_LIST_EXCLUSIVE      4
+#define FIO_LIST_WITH_LOGS      8
+
+/*
+ * Header of request and reply messages of the agent protocol.
+ *
+ * Messages carry no request id: the agent serves requests of a stream
+ * strictly in order, so replies are matched with requests by order.
+ * Concurrency comes from separate streams of threads multiplexed over
+ * one connection, not from many requests in flight on one stream.
+ * Round trips are avoided by requests which are not confirmed at all
+ * (write, close, seek, truncate, rename, symlink, unlink, chmod, closedir,
+ * FIO_OPEN_ASYNC), whose first error is kept by the agent and reported
+ * by fio_check_async_error(), fio_sync(), fio_sync_files() and
+ * fio_disconnect(), and by batched requests (FIO_MKDIRS, FIO_READDIR,
+ * FIO_SYNC_FILES, FIO_WRITE_PAGES, FIO_LIST_TREE). Requests whose result
+ * is needed by the caller right away (open for reading, stat, access,
+ * pread) remain round trips.
+ */
 typedef struct
 {
-	unsigned cop    : 5;
-	unsigned handle : 7;
-	unsigned size   : 20;
+	unsigned cop    : 16;
+	unsigned handle : 16;
+	unsigned size;
 	unsigned arg;
 } fio_header;
 
+/* Directory tree entry sent by FIO_LIST_TREE, followed by relative path */
+typedef struct
+{
+	uint32 mode;
+	uint32 path_len; /* including terminating zero */
+	int64  size;
+	int64  mtime;
+} fio_tree_entry;
+
+typedef void (*fio_tree_callback)(char const* rel_path, mode_t mode, int64 size, time_t mtime, void* arg);
+
+/* Called by fio_send_pages() for block the agent failed to read, returns false if block is truncated */
+typedef bool (*fio_page_callback)(BlockNumber blknum, char const* errormsg, void* arg);
+
 extern fio_location MyLocation;
 
 /* Check if FILE handle is local or remote (created by FIO) */
@@ -80,8 +131,12 @@ extern void    fio_redirect(int in, int out, int err);
 extern void    fio_communicate(int in, int out);
 
 extern FILE*   fio_fopen(char const* name, char const* mode, fio_location location);
+extern FILE*   fio_fopen_async(char const* name, char const* mode, fio_location location);
 extern size_t  fio_fwrite(FILE* f, void const* buf, size_t size);
 extern ssize_t fio_fwrite_compressed(FILE* f, void const* buf, size_t size, int compress_alg);
+extern ssize_t fio_fwrite_page(FILE* f, BlockNumber blknum, void const* buf, size_t size, int compress_alg);
+extern size_t  fio_apply_data_file(FILE* out, FILE* in, int compress_alg, uint32 backup_version,
+								   int nblocks, char const* from_fullpath);
 extern ssize_t fio_fread(FILE* f, void* buf, size_t size);
 extern int     fio_pread(FILE* f, void* buf, off_t offs);
 extern int     fio_fprintf(FILE* f, char const* arg, ...) pg_attribute_printf(2, 3);
@@ -101,13 +156,18 @@ extern int     fio_fstat(int fd, struct stat* st);
 extern int     fio_truncate(int fd, off_t size);
 extern int     fio_close(int fd);
 extern void    fio_disconnect(void);
+extern void    fio_check_async_error(fio_location location);
 extern int     fio_sync(char const* path, fio_location location);
+extern int     fio_sync_files(char const* const* paths, int n_paths, fio_location location);
 extern pg_crc32 fio_get_crc32(const char *file_path, fio_location location, bool decompress);
 
 extern int     fio_rename(char const* old_path, char const* new_path, fio_location location);
 extern int     fio_symlink(char const* target, char const* link_path, fio_location location);
 extern int     fio_unlink(char const* path, fio_location location);
 extern int     fio_mkdir(char const* path, int mode, fio_location location);
+extern int     fio_mkdirs(char const* const* paths, int const* modes, int n_paths, fio_location location);
+extern void    fio_list_tree(char const* root, bool exclude, bool follow_symlink, bool exclusive,
+							 bool with_logs, fio_tree_callback callback, void* arg, fio_location location);
 extern int     fio_chmod(char const* path, int mode, fio_location location);
 extern int     fio_access(char const* path, int mode, fio_location location);
 extern int     fio_stat(char const* path, struct stat* st, bool follow_symlinks, fio_location location);
@@ -0,0 +1,928 @@
+/*-------------------------------------------------------------------------
+ *
+ * pagemap.c: compressed bitmap of changed blocks.
+ *
+ * Copyright (c) 2020, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres_fe.h"
+
+#include "pagemap.h"
+#include "pgut.h"
+
+/* Number of low parts in a container */
+#define PAGEMAP_CONTAINER_BITS	65536
+#define PAGEMAP_BITMAP_WORDS	(PAGEMAP_CONTAINER_BITS / 64)
+#define PAGEMAP_BITMAP_SIZE		(PAGEMAP_BITMAP_WORDS * sizeof(uint64))
+
+/* Array container larger than this takes more space than bitmap */
+#define PAGEMAP_ARRAY_MAX		4096
+
+#define BLKNO_KEY(blkno)		((uint16) ((blkno) >> 16))
+#define BLKNO_LOW(blkno)		((uint16) ((blkno) & 0xFFFF))
+#define MAKE_BLKNO(key, low)	(((BlockNumber) (key) << 16) | (BlockNumber) (low))
+
+/*
+ * Serialized container header. Payload follows the header:
+ * n uint16 values for array, n pairs of uint16 for run,
+ * PAGEMAP_BITMAP_WORDS uint64 words for bitmap.
+ */
+typedef struct PageMapContainerHeader
+{
+	uint16		key;
+	uint16		type;
+	uint32		n;
+} PageMapContainerHeader;
+
+static PageMapContainer *get_container(pagemap_t *map, uint16 key, bool create);
+static void container_to_bitmap(PageMapContainer *c);
+static void container_add(PageMapContainer *c, uint16 low);
+static bool container_contains(const PageMapContainer *c, uint16 low);
+static uint32 container_count(const PageMapContainer *c);
+static uint32 container_count_runs(const PageMapContainer *c);
+static bool container_next_range(pagemap_iterator_t *iter, uint32 *start, uint32 *end);
+static void container_free(PageMapContainer *c);
+
+static inline int
+rightmost_one_pos64(uint64 word)
+{
+#ifdef HAVE__BUILTIN_CTZ
+	return __builtin_ctzll(word);
+#else
+	int			pos = 0;
+
+	while ((word & 1) == 0)
+	{
+		word >>= 1;
+		pos++;
+	}
+	return pos;
+#endif
+}
+
+static inline int
+popcount64(uint64 word)
+{
+#ifdef HAVE__BUILTIN_POPCOUNT
+	return __builtin_popcountll(word);
+#else
+	int			count = 0;
+
+	while (word)
+	{
+		word &= word - 1;
+		count++;
+	}
+	return count;
+#endif
+}
+
+/*
+ * Find container with given key. If there is no such container and
+ * create is true, insert empty array container at the right place,
+ * otherwise return NULL.
+ */
+static PageMapContainer *
+get_container(pagemap_t *map, uint16 key, bool create)
+{
+	int			low = 0;
+	int			high = map->ncontainers;
+	PageMapContainer *c;
+
+	/* Fast path: blocks are mostly added in ascending order */
+	if (map->ncontainers > 0 &&
+		map->containers[map->ncontainers - 1].key == key)
+		return &map->containers[map->ncontainers - 1];
+
+	while (low < high)
+	{
+		int			middle = (low + high) / 2;
+
+		if (map->containers[middle].key == key)
+			return &map->containers[middle];
+		else if (map->containers[middle].key < key)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (map->ncontainers == map->capacity)
+	{
+		map->capacity = map->capacity ? map->capacity * 2 : 2;
+		map->containers = pgut_realloc(map->containers,
+									   map->capacity * sizeof(PageMapContainer));
+	}
+
+	memmove(&map->containers[low + 1], &map->containers[low],
+			(map->ncontainers - low) * sizeof(PageMapContainer));
+	map->ncontainers++;
+
+	c = &map->containers[low];
+	MemSet(c, 0, sizeof(PageMapContainer));
+	c->key = key;
+	c->type = PAGEMAP_ARRAY;
+
+	return c;
+}
+
+/* Convert container of any type into bitmap container */
+static void
+container_to_bitmap(PageMapContainer *c)
+{
+	uint64	   *words;
+	uint32		i;
+
+	if (c->type == PAGEMAP_BITMAP)
+		return;
+
+	words = pgut_malloc(PAGEMAP_BITMAP_SIZE);
+	MemSet(words, 0, PAGEMAP_BITMAP_SIZE);
+
+	if (c->type == PAGEMAP_ARRAY)
+	{
+		for (i = 0; i < c->n; i++)
+			words[c->values[i] >> 6] |= UINT64CONST(1) << (c->values[i] & 63);
+	}
+	else
+	{
+		for (i = 0; i < c->n; i++)
+		{
+			uint32		start = c->values[2 * i];
+			uint32		end = start + c->values[2 * i + 1];
+			uint32		bit;
+
+			for (bit = start; bit <= end; bit++)
+				words[bit >> 6] |= UINT64CONST(1) << (bit & 63);
+		}
+	}
+
+	pg_free(c->values);
+	c->values = NULL;
+	c->words = words;
+	c->type = PAGEMAP_BITMAP;
+	c->n = 0;
+	c->capacity = 0;
+}
+
+static void
+container_add(PageMapContainer *c, uint16 low)
+{
+	switch (c->type)
+	{
+		case PAGEMAP_ARRAY:
+			{
+				uint32		lo = 0;
+				uint32		hi = c->n;
+
+				/* Fast path for appending in ascending order */
+				if (c->n > 0 && c->values[c->n - 1] < low)
+					lo = c->n;
+				else
+				{
+					while (lo < hi)
+					{
+						uint32		middle = (lo + hi) / 2;
+
+						if (c->values[middle] == low)
+							return;
+						else if (c->values[middle] < low)
+							lo = middle + 1;
+						else
+							hi = middle;
+					}
+				}
+
+				if (c->n == PAGEMAP_ARRAY_MAX)
+				{
+					container_to_bitmap(c);
+					c->words[low >> 6] |= UINT64CONST(1) << (low & 63);
+					return;
+				}
+
+				if (c->n == c->capacity)
+				{
+					c->capacity = c->capacity ? c->capacity * 2 : 4;
+					c->values = pgut_realloc(c->values, c->capacity * sizeof(uint16));
+				}
+
+				memmove(&c->values[lo + 1], &c->values[lo],
+						(c->n - lo) * sizeof(uint16));
+				c->values[lo] = low;
+				c->n++;
+				break;
+			}
+		case PAGEMAP_RUN:
+			if (container_contains(c, low))
+				return;
+			/* Runs are rebuilt by pagemap_optimize() */
+			container_to_bitmap(c);
+			/* fallthrough */
+		case PAGEMAP_BITMAP:
+			c->words[low >> 6] |= UINT64CONST(1) << (low & 63);
+			break;
+	}
+}
+
+static bool
+container_contains(const PageMapContainer *c, uint16 low)
+{
+	uint32		lo = 0;
+	uint32		hi = c->n;
+
+	switch (c->type)
+	{
+		case PAGEMAP_ARRAY:
+			while (lo < hi)
+			{
+				uint32		middle = (lo + hi) / 2;
+
+				if (c->values[middle] == low)
+					return true;
+				else if (c->values[middle] < low)
+					lo = middle + 1;
+				else
+					hi = middle;
+			}
+			return false;
+		case PAGEMAP_BITMAP:
+			return (c->words[low >> 6] & (UINT64CONST(1) << (low & 63))) != 0;
+		case PAGEMAP_RUN:
+			/* find the last run starting at or before low */
+			while (lo < hi)
+			{
+				uint32		middle = (lo + hi) / 2;
+
+				if (c->values[2 * middle] <= low)
+					lo = middle + 1;
+				else
+					hi = middle;
+			}
+			if (lo == 0)
+				return false;
+			lo--;
+			return low <= (uint32) c->values[2 * lo] + c->values[2 * lo + 1];
+	}
+
+	return false;
+}
+
+static uint32
+container_count(const PageMapContainer *c)
+{
+	uint32		count = 0;
+	uint32		i;
+
+	switch (c->type)
+	{
+		case PAGEMAP_ARRAY:
+			return c->n;
+		case PAGEMAP_BITMAP:
+			for (i = 0; i < PAGEMAP_BITMAP_WORDS; i++)
+				count += popcount64(c->words[i]);
+			return count;
+		case PAGEMAP_RUN:
+			for (i = 0; i < c->n; i++)
+				count += (uint32) c->values[2 * i + 1] + 1;
+			return count;
+	}
+
+	return 0;
+}
+
+/* Number of contiguous ranges in container */
+static uint32
+container_count_runs(const PageMapContainer *c)
+{
+	uint32		count = 0;
+	uint32		i;
+
+	switch (c->type)
+	{
+		case PAGEMAP_ARRAY:
+			for (i = 0; i < c->n; i++)
+				if (i == 0 || c->values[i] != c->values[i - 1] + 1)
+					count++;
+			return count;
+		case PAGEMAP_BITMAP:
+			/* count words where a run starts: bit is set, previous one is not */
+			for (i = 0; i < PAGEMAP_BITMAP_WORDS; i++)
+			{
+				uint64		word = c->words[i];
+				uint64		prev = (word << 1) |
+					(i > 0 ? c->words[i - 1] >> 63 : 0);
+
+				count += popcount64(word & ~prev);
+			}
+			return count;
+		case PAGEMAP_RUN:
+			return c->n;
+	}
+
+	return 0;
+}
+
+static void
+container_free(PageMapContainer *c)
+{
+	pg_free(c->values);
+	pg_free(c->words);
+	c->values = NULL;
+	c->words = NULL;
+}
+
+/*
+ * Add block number to the map.
+ */
+void
+pagemap_add(pagemap_t *map, BlockNumber blkno)
+{
+	container_add(get_container(map, BLKNO_KEY(blkno), true), BLKNO_LOW(blkno));
+}
+
+bool
+pagemap_contains(const pagemap_t *map, BlockNumber blkno)
+{
+	PageMapContainer *c = get_container((pagemap_t *) map, BLKNO_KEY(blkno), false);
+
+	return c != NULL && container_contains(c, BLKNO_LOW(blkno));
+}
+
+bool
+pagemap_is_empty(const pagemap_t *map)
+{
+	int			i;
+
+	for (i = 0; i < map->ncontainers; i++)
+	{
+		if (map->containers[i].type != PAGEMAP_BITMAP)
+		{
+			if (map->containers[i].n > 0)
+				return false;
+		}
+		else if (container_count(&map->containers[i]) > 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* Number of blocks in the map */
+uint32
+pagemap_count(const pagemap_t *map)
+{
+	uint32		count = 0;
+	int			i;
+
+	for (i = 0; i < map->ncontainers; i++)
+		count += container_count(&map->containers[i]);
+
+	return count;
+}
+
+/*
+ * Add all blocks of src to dst.
+ */
+void
+pagemap_union(pagemap_t *dst, const pagemap_t *src)
+{
+	int			i;
+	uint32		j;
+
+	for (i = 0; i < src->ncontainers; i++)
+	{
+		const PageMapContainer *s = &src->containers[i];
+		PageMapContainer *d = get_container(dst, s->key, true);
+
+		switch (s->type)
+		{
+			case PAGEMAP_ARRAY:
+				for (j = 0; j < s->n; j++)
+					container_add(d, s->values[j]);
+				break;
+			case PAGEMAP_BITMAP:
+				container_to_bitmap(d);
+				for (j = 0; j < PAGEMAP_BITMAP_WORDS; j++)
+					d->words[j] |= s->words[j];
+				break;
+			case PAGEMAP_RUN:
+				for (j = 0; j < s->n; j++)
+				{
+					uint32		low = s->values[2 * j];
+					uint32		end = low + s->values[2 * j + 1];
+
+					for (; low <= end; low++)
+						container_add(d, (uint16) low);
+				}
+				break;
+		}
+	}
+}
+
+/*
+ * Build map from flat bitmap, as used by ptrack and datapagemap_t:
+ * bit N of byte M stands for block M * 8 + N.
+ */
+void
+pagemap_from_bitmap(pagemap_t *map, const char *bitmap, size_t bitmapsize)
+{
+	size_t		offset;
+
+	for (offset = 0; offset < bitmapsize; offset++)
+	{
+		unsigned char byte = (unsigned char) bitmap[offset];
+		int			bitno;
+
+		if (byte == 0)
+			continue;
+
+		for (bitno = 0; bitno < 8; bitno++)
+			if (byte & (1 << bitno))
+				pagemap_add(map, (BlockNumber) (offset * 8 + bitno));
+	}
+
+	pagemap_optimize(map);
+}
+
+/*
+ * Convert every container into its most compact representation and
+ * drop empty containers. Should be called when the map is complete,
+ * e.g. before sending it to remote agent.
+ */
+void
+pagemap_optimize(pagemap_t *map)
+{
+	int			i;
+	int			n_kept = 0;
+
+	for (i = 0; i < map->ncontainers; i++)
+	{
+		PageMapContainer *c = &map->containers[i];
+		uint32		count = container_count(c);
+		uint32		nruns = container_count_runs(c);
+		size_t		array_size = count * sizeof(uint16);
+		size_t		run_size = nruns * 2 * sizeof(uint16);
+		uint16	   *values;
+		uint32		n = 0;
+		uint32		bit;
+
+		if (count == 0)
+		{
+			container_free(c);
+			continue;
+		}
+
+		if (run_size < array_size && run_size < PAGEMAP_BITMAP_SIZE)
+		{
+			if (c->type != PAGEMAP_RUN)
+			{
+				container_to_bitmap(c);
+				values = pgut_malloc(run_size);
+
+				for (bit = 0; bit < PAGEMAP_CONTAINER_BITS; bit++)
+				{
+					if (!(c->words[bit >> 6] & (UINT64CONST(1) << (bit & 63))))
+						continue;
+
+					if (n > 0 && (uint32) values[2 * (n - 1)] +
+						values[2 * (n - 1) + 1] + 1 == bit)
+						values[2 * (n - 1) + 1]++;
+					else
+					{
+						values[2 * n] = (uint16) bit;
+						values[2 * n + 1] = 0;
+						n++;
+					}
+				}
+
+				container_free(c);
+				c->values = values;
+				c->type = PAGEMAP_RUN;
+				c->n = c->capacity = n;
+			}
+		}
+		else if (count <= PAGEMAP_ARRAY_MAX)
+		{
+			if (c->type != PAGEMAP_ARRAY)
+			{
+				container_to_bitmap(c);
+				values = pgut_malloc(array_size);
+
+				for (bit = 0; bit < PAGEMAP_CONTAINER_BITS; bit++)
+					if (c->words[bit >> 6] & (UINT64CONST(1) << (bit & 63)))
+						values[n++] = (uint16) bit;
+
+				container_free(c);
+				c->values = values;
+				c->type = PAGEMAP_ARRAY;
+				c->n = c->capacity = n;
+			}
+		}
+		else
+			container_to_bitmap(c);
+
+		map->containers[n_kept++] = *c;
+	}
+
+	map->ncontainers = n_kept;
+}
+
+void
+pagemap_free(pagemap_t *map)
+{
+	int			i;
+
+	for (i = 0; i < map->ncontainers; i++)
+		container_free(&map->containers[i]);
+
+	pg_free(map->containers);
+	MemSet(map, 0, sizeof(pagemap_t));
+}
+
+void
+pagemap_iterate(const pagemap_t *map, pagemap_iterator_t *iter)
+{
+	iter->map = map;
+	iter->container = 0;
+	iter->pos = 0;
+	iter->runpos = 0;
+}
+
+/*
+ * Get next block from the map. Returns false if the map is exhausted.
+ * Blocks are returned in ascending order.
+ */
+bool
+pagemap_next(pagemap_iterator_t *iter, BlockNumber *blkno)
+{
+	const pagemap_t *map = iter->map;
+
+	while (iter->container < map->ncontainers)
+	{
+		const PageMapContainer *c = &map->containers[iter->container];
+
+		switch (c->type)
+		{
+			case PAGEMAP_ARRAY:
+				if (iter->pos < c->n)
+				{
+					*blkno = MAKE_BLKNO(c->key, c->values[iter->pos]);
+					iter->pos++;
+					return true;
+				}
+				break;
+			case PAGEMAP_BITMAP:
+				while (iter->pos < PAGEMAP_CONTAINER_BITS)
+				{
+					uint32		word_no = iter->pos >> 6;
+					uint64		word = c->words[word_no] &
+						(~UINT64CONST(0) << (iter->pos & 63));
+
+					if (word)
+					{
+						uint32		bit = word_no * 64 + rightmost_one_pos64(word);
+
+						*blkno = MAKE_BLKNO(c->key, bit);
+						iter->pos = bit + 1;
+						return true;
+					}
+					iter->pos = (word_no + 1) * 64;
+				}
+				break;
+			case PAGEMAP_RUN:
+				if (iter->pos < c->n)
+				{
+					uint32		start = c->values[2 * iter->pos];
+					uint32		length = (uint32) c->values[2 * iter->pos + 1] + 1;
+
+					*blkno = MAKE_BLKNO(c->key, start + iter->runpos);
+					if (++iter->runpos == length)
+					{
+						iter->pos++;
+						iter->runpos = 0;
+					}
+					return true;
+				}
+				break;
+		}
+
+		iter->container++;
+		iter->pos = 0;
+		iter->runpos = 0;
+	}
+
+	return false;
+}
+
+/*
+ * Get next maximal range of low parts [start, end) from the current
+ * container, moving to the next containers if needed.
+ */
+static bool
+container_next_range(pagemap_iterator_t *iter, uint32 *start, uint32 *end)
+{
+	const pagemap_t *map = iter->map;
+
+	while (iter->container < map->ncontainers)
+	{
+		const PageMapContainer *c = &map->containers[iter->container];
+
+		switch (c->type)
+		{
+			case PAGEMAP_ARRAY:
+				if (iter->pos < c->n)
+				{
+					*start = c->values[iter->pos];
+					*end = *start + 1;
+					iter->pos++;
+
+					while (iter->pos < c->n && c->values[iter->pos] == *end)
+					{
+						(*end)++;
+						iter->pos++;
+					}
+					return true;
+				}
+				break;
+			case PAGEMAP_BITMAP:
+				while (iter->pos < PAGEMAP_CONTAINER_BITS)
+				{
+					uint32		word_no = iter->pos >> 6;
+					uint64		word = c->words[word_no] &
+						(~UINT64CONST(0) << (iter->pos & 63));
+
+					if (!word)
+					{
+						iter->pos = (word_no + 1) * 64;
+						continue;
+					}
+
+					*start = word_no * 64 + rightmost_one_pos64(word);
+
+					/* now look for the first zero bit after start */
+					*end = PAGEMAP_CONTAINER_BITS;
+					iter->pos = *start;
+					while (iter->pos < PAGEMAP_CONTAINER_BITS)
+					{
+						word_no = iter->pos >> 6;
+						word = ~c->words[word_no] &
+							(~UINT64CONST(0) << (iter->pos & 63));
+
+						if (word)
+						{
+							*end = word_no * 64 + rightmost_one_pos64(word);
+							break;
+						}
+						iter->pos = (word_no + 1) * 64;
+					}
+					iter->pos = *end;
+					return true;
+				}
+				break;
+			case PAGEMAP_RUN:
+				if (iter->pos < c->n)
+				{
+					*start = (uint32) c->values[2 * iter->pos] + iter->runpos;
+					*end = (uint32) c->values[2 * iter->pos] +
+						c->values[2 * iter->pos + 1] + 1;
+					iter->pos++;
+					iter->runpos = 0;
+
+					/* glue adjacent runs */
+					while (iter->pos < c->n && c->values[2 * iter->pos] == *end)
+					{
+						*end += (uint32) c->values[2 * iter->pos + 1] + 1;
+						iter->pos++;
+					}
+					return true;
+				}
+				break;
+		}
+
+		iter->container++;
+		iter->pos = 0;
+		iter->runpos = 0;
+	}
+
+	return false;
+}
+
+/*
+ * Get next range of contiguous blocks from the map: blocks from start
+ * to start + count - 1. Returns false if the map is exhausted.
+ * Useful to read changed blocks with large sequential reads.
+ */
+bool
+pagemap_next_range(pagemap_iterator_t *iter, BlockNumber *start, BlockNumber *count)
+{
+	uint32		low_start;
+	uint32		low_end;
+	BlockNumber end;
+
+	if (!container_next_range(iter, &low_start, &low_end))
+		return false;
+
+	*start = MAKE_BLKNO(iter->map->containers[iter->container].key, low_start);
+	end = *start + (low_end - low_start);
+
+	/* range may continue in the next container */
+	while (low_end == PAGEMAP_CONTAINER_BITS)
+	{
+		pagemap_iterator_t saved = *iter;
+		BlockNumber next_start;
+
+		if (!container_next_range(iter, &low_start, &low_end))
+		{
+			*iter = saved;
+			break;
+		}
+
+		next_start = MAKE_BLKNO(iter->map->containers[iter->container].key, low_start);
+		if (next_start != end)
+		{
+			*iter = saved;
+			break;
+		}
+
+		end += low_end - low_start;
+	}
+
+	*count = end - *start;
+	return true;
+}
+
+/*
+ * Size of serialized map. Call pagemap_optimize() before serialization
+ * to get the most compact encoding.
+ */
+size_t
+pagemap_serialized_size(const pagemap_t *map)
+{
+	size_t		size = sizeof(uint32);
+	int			i;
+
+	for (i = 0; i < map->ncontainers; i++)
+	{
+		const PageMapContainer *c = &map->containers[i];
+
+		size += sizeof(PageMapContainerHeader);
+
+		if (c->type == PAGEMAP_ARRAY)
+			size += c->n * sizeof(uint16);
+		else if (c->type == PAGEMAP_RUN)
+			size += c->n * 2 * sizeof(uint16);
+		else
+			size += PAGEMAP_BITMAP_SIZE;
+	}
+
+	return size;
+}
+
+/*
+ * Serialize map into buf, which must have at least
+ * pagemap_serialized_size() bytes.
+ *
+ *  uint32 number of containers
+ *  for every container:
+ *    PageMapContainerHeader
+ *    payload
+ */
+void
+pagemap_serialize(const pagemap_t *map, char *buf)
+{
+	uint32		ncontainers = map->ncontainers;
+	int			i;
+
+	memcpy(buf, &ncontainers, sizeof(uint32));
+	buf += sizeof(uint32);
+
+	for (i = 0; i < map->ncontainers; i++)
+	{
+		const PageMapContainer *c = &map->containers[i];
+		PageMapContainerHeader header;
+		size_t		payload_size;
+
+		header.key = c->key;
+		header.type = c->type;
+		header.n = c->type == PAGEMAP_BITMAP ? 0 : c->n;
+
+		memcpy(buf, &header, sizeof(header));
+		buf += sizeof(header);
+
+		if (c->type == PAGEMAP_ARRAY)
+		{
+			payload_size = c->n * sizeof(uint16);
+			memcpy(buf, c->values, payload_size);
+		}
+		else if (c->type == PAGEMAP_RUN)
+		{
+			payload_size = c->n * 2 * sizeof(uint16);
+			memcpy(buf, c->values, payload_size);
+		}
+		else
+		{
+			payload_size = PAGEMAP_BITMAP_SIZE;
+			memcpy(buf, c->words, payload_size);
+		}
+
+		buf += payload_size;
+	}
+}
+
+/*
+ * Build map from serialized form. Returns false if buf is malformed,
+ * map is left empty in this case.
+ */
+bool
+pagemap_deserialize(pagemap_t *map, const char *buf, size_t size)
+{
+	const char *end = buf + size;
+	uint32		ncontainers;
+	uint32		i;
+
+	MemSet(map, 0, sizeof(pagemap_t));
+
+	if (size < sizeof(uint32))
+		return false;
+
+	memcpy(&ncontainers, buf, sizeof(uint32));
+	buf += sizeof(uint32);
+
+	if (ncontainers > PAGEMAP_CONTAINER_BITS)
+		return false;
+
+	map->capacity = ncontainers;
+	map->containers = pgut_malloc(Max(ncontainers, 1) * sizeof(PageMapContainer));
+
+	for (i = 0; i < ncontainers; i++)
+	{
+		PageMapContainer *c = &map->containers[i];
+		PageMapContainerHeader header;
+		size_t		payload_size;
+
+		if (end - buf < sizeof(header))
+			goto bad_format;
+
+		memcpy(&header, buf, sizeof(header));
+		buf += sizeof(header);
+
+		/* containers must be sorted by key */
+		if (i > 0 && header.key <= map->containers[i - 1].key)
+			goto bad_format;
+
+		if (header.type == PAGEMAP_ARRAY && header.n <= PAGEMAP_ARRAY_MAX)
+			payload_size = header.n * sizeof(uint16);
+		else if (header.type == PAGEMAP_RUN && header.n <= PAGEMAP_CONTAINER_BITS / 2)
+			payload_size = header.n * 2 * sizeof(uint16);
+		else if (header.type == PAGEMAP_BITMAP)
+			payload_size = PAGEMAP_BITMAP_SIZE;
+		else
+			goto bad_format;
+
+		if (end - buf < payload_size)
+			goto bad_format;
+
+		MemSet(c, 0, sizeof(PageMapContainer));
+		c->key = header.key;
+		c->type = header.type;
+		map->ncontainers++;
+
+		if (header.type == PAGEMAP_BITMAP)
+		{
+			c->words = pgut_malloc(payload_size);
+			memcpy(c->words, buf, payload_size);
+		}
+		else
+		{
+			c->n = c->capacity = header.n;
+			c->values = pgut_malloc(Max(payload_size, sizeof(uint16)));
+			memcpy(c->values, buf, payload_size);
+
+			/* runs must not cross the container boundary */
+			if (header.type == PAGEMAP_RUN)
+			{
+				uint32		j;
+
+				for (j = 0; j < c->n; j++)
+					if ((uint32) c->values[2 * j] + c->values[2 * j + 1] >=
+						PAGEMAP_CONTAINER_BITS)
+						goto bad_format;
+			}
+		}
+
+		buf += payload_size;
+	}
+
+	if (buf != end)
+		goto bad_format;
+
+	return true;
+
+bad_format:
+	pagemap_free(map);
+	return false;
+}
@@ -0,0 +1,82 @@
+/*-------------------------------------------------------------------------
+ *
+ * pagemap.h: compressed bitmap of changed blocks.
+ *
+ * Copyright (c) 2020, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef PROBACKUP_PAGEMAP_H
+#define PROBACKUP_PAGEMAP_H
+
+#include "postgres_fe.h"
+
+#include "storage/block.h"
+
+/*
+ * Set of block numbers organized in roaring bitmap fashion.
+ *
+ * Block number is split into high 16 bits (key) and low 16 bits.
+ * Blocks sharing the same key are kept in one container, containers are
+ * sorted by key. Depending on its content container is either:
+ *  - sorted array of low parts, for sparse sets;
+ *  - plain bitmap of 65536 bits, for dense sets;
+ *  - array of runs (start, length - 1), for sets of contiguous ranges.
+ *
+ * So a single changed block at the end of a 1GB segment costs a few bytes,
+ * while flat datapagemap_t would need 16kB for it.
+ *
+ * Zeroed pagemap_t is a valid empty map.
+ */
+
+#define PAGEMAP_ARRAY	0
+#define PAGEMAP_BITMAP	1
+#define PAGEMAP_RUN		2
+
+typedef struct PageMapContainer
+{
+	uint16		key;		/* high 16 bits of block numbers */
+	uint16		type;		/* PAGEMAP_ARRAY, PAGEMAP_BITMAP or PAGEMAP_RUN */
+	uint32		n;			/* number of values (array) or runs (run) */
+	uint32		capacity;	/* allocated number of values or runs */
+	uint16	   *values;		/* array: sorted low parts,
+							 * run: pairs of (start, length - 1) */
+	uint64	   *words;		/* bitmap */
+} PageMapContainer;
+
+typedef struct pagemap_t
+{
+	int			ncontainers;
+	int			capacity;
+	PageMapContainer *containers;
+} pagemap_t;
+
+/* Iterator is a plain struct, it can be copied to save position */
+typedef struct pagemap_iterator_t
+{
+	const pagemap_t *map;
+	int			container;	/* index of current container */
+	uint32		pos;		/* index of value/run or number of bit */
+	uint32		runpos;		/* offset inside current run */
+} pagemap_iterator_t;
+
+extern void pagemap_add(pagemap_t *map, BlockNumber blkno);
+extern bool pagemap_contains(const pagemap_t *map, BlockNumber blkno);
+extern bool pagemap_is_empty(const pagemap_t *map);
+extern uint32 pagemap_count(const pagemap_t *map);
+extern void pagemap_union(pagemap_t *dst, const pagemap_t *src);
+extern void pagemap_from_bitmap(pagemap_t *map, const char *bitmap, size_t bitmapsize);
+extern void pagemap_optimize(pagemap_t *map);
+extern void pagemap_free(pagemap_t *map);
+
+extern void pagemap_iterate(const pagemap_t *map, pagemap_iterator_t *iter);
+extern bool pagemap_next(pagemap_iterator_t *iter, BlockNumber *blkno);
+extern bool pagemap_next_range(pagemap_iterator_t *iter, BlockNumber *start,
+							   BlockNumber *count);
+
+extern size_t pagemap_serialized_size(const pagemap_t *map);
+extern void pagemap_serialize(const pagemap_t *map, char *buf);
+extern bool pagemap_deserialize(pagemap_t *map, const char *buf, size_t size);
+
+#endif /* PROBACKUP_PAGEMAP_H */
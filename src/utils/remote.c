@@ -4,6 +4,19 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+
+#ifndef WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 #ifdef WIN32
 #define __thread __declspec(thread)
@@ -14,6 +27,10 @@
 #include "pg_probackup.h"
 #include "file.h"
 
+#if PG_VERSION_NUM >= 100000
+#include "common/scram-common.h"
+#endif
+
 #define MAX_CMDLINE_LENGTH  4096
 #define MAX_CMDLINE_OPTIONS 256
 #define ERR_BUF_SIZE        4096
@@ -77,8 +94,13 @@ void wait_ssh(void)
  */
 #ifndef WIN32
 	int status;
+
+	/* Streams of multiplexed connection have no SSH process of their own */
+	if (child_pid == 0)
+		return;
 	waitpid(child_pid, &status, 0);
 	elog(LOG, "SSH process %d is terminated with status %d",  child_pid, status);
+	child_pid = 0;
 #endif
 }
 
@@ -103,7 +125,17 @@ static bool needs_quotes(char const* path)
 	return strchr(path, ' ') != NULL;
 }
 
-bool launch_agent(void)
+#ifndef WIN32
+static bool fio_mux_add_connection(int in, int out, int err, pid_t pid,
+								   uint8 const* keys);
+static bool fio_agent_connect(void);
+#endif
+
+/*
+ * Start SSH client running remote agent. Multiplexed agent serves streams
+ * of all threads over one connection, see fio_mux_loop().
+ */
+static bool start_agent(bool multiplexed)
 {
 	char cmd[MAX_CMDLINE_LENGTH];
 	char* ssh_argv[MAX_CMDLINE_OPTIONS];
@@ -112,6 +144,12 @@ bool launch_agent(void)
 	int infd[2];
 	int errfd[2];
 
+#ifndef WIN32
+	/* Agent started with --listen is connected directly, without SSH */
+	if (IsTcpProtocol())
+		return fio_agent_connect();
+#endif
+
 	ssh_argc = 0;
 #ifdef WIN32
 	ssh_argv[ssh_argc++] = PROGRAM_NAME_FULL;
@@ -182,6 +220,16 @@ bool launch_agent(void)
 		else
 			snprintf(cmd, sizeof(cmd), "%s agent %s", PROGRAM_NAME_FULL, PROGRAM_VERSION);
 	}
+	if (multiplexed)
+	{
+		size_t len = strlen(cmd);
+		snprintf(cmd + len, sizeof(cmd) - len, " mux");
+#ifdef HAVE_LIBZ
+		/* ask agent to compress the channel, see fio_mux_read_stream() */
+		if (instance_config.remote.compress)
+			strncat(cmd, " zlib", sizeof(cmd) - strlen(cmd) - 1);
+#endif
+	}
 
 #ifdef WIN32
 	SYS_CHECK(_pipe(infd, PIPE_SIZE, _O_BINARY)) ;
@@ -226,7 +274,1305 @@ bool launch_agent(void)
 		SYS_CHECK(close(errfd[1]));
 		/*atexit(kill_child);*/
 
+#ifndef WIN32
+		if (multiplexed)
+		{
+			/* SSH process belongs to the connection, not to this thread */
+			pid_t pid = child_pid;
+			child_pid = 0;
+			return fio_mux_add_connection(infd[0], outfd[1], errfd[0], pid, NULL);
+		}
+#endif
 		fio_redirect(infd[0], outfd[1], errfd[0]); /* write to stdout */
 	}
 	return true;
 }
+
+#ifndef WIN32
+
+/*
+ * Multiplexed agent connection.
+ *
+ * Instead of starting SSH client for each thread, threads get streams of
+ * shared connections. Stream is a local socket pair: the thread uses one end
+ * of it as fio_stdin/fio_stdout, the other end is served by the mux thread of
+ * the connection, which forwards data written into the socket to the agent as
+ * frames tagged with stream id and writes data of frames received from the
+ * agent into the socket. Agent runs the same loop in its main thread and
+ * starts fio_communicate() thread for each new stream, so fio protocol itself
+ * is not changed.
+ *
+ * Flow control is done per stream: side may have at most FIO_MUX_WINDOW bytes
+ * of stream data sent but not yet consumed by the stream reader at the other
+ * side. Receiver returns credit as data is written into stream socket, so the
+ * stream with slow reader (e.g. FIO_SEND_PAGES) can't fill the connection and
+ * stall other streams.
+ *
+ * With --remote-compress client asks the agent to compress the channel.
+ * Agent answers with HELLO frame telling whether it agreed, and then both
+ * sides send stream data as zlib compressed DATA_Z frames when it pays off.
+ * Chunks smaller than FIO_MUX_Z_MIN_CHUNK (headers, short replies) are always
+ * sent as is. Larger chunks which don't shrink by at least 1/8 are sent as is
+ * too, and compression of that stream is not tried again for a while, so
+ * already compressed data (compressed pages, .gz WAL files) costs little CPU.
+ *
+ * Direct connection authenticated with shared secret (see fio_agent_connect())
+ * has no SSH to protect it, so each frame is followed by FIO_MUX_MAC_SIZE bytes
+ * of HMAC-SHA256 of the frame and its sequence number. Keys of both directions
+ * are derived from the secret and nonces of the handshake, so frames can't be
+ * forged, altered, replayed, reordered or dropped without breaking the
+ * connection. Data is still sent unencrypted.
+ */
+#define FIO_MUX_STREAMS_PER_CONNECTION	8
+#define FIO_MUX_MAX_CONNECTIONS		64
+#define FIO_MUX_WINDOW				(256*1024)
+#define FIO_MUX_CHUNK				(64*1024)
+#define FIO_MUX_OUT_HIGH			(1024*1024) /* stop reading streams when so much data is queued */
+#define FIO_MUX_IN_BUF_SIZE			(2*(sizeof(fio_mux_header) + FIO_MUX_CHUNK + FIO_MUX_MAC_SIZE))
+#define FIO_MUX_Z_BACKOFF			16 /* chunks sent uncompressed after failed attempt */
+#define FIO_MUX_Z_MIN_CHUNK			1024 /* smaller chunks are not worth compressing */
+#define FIO_MUX_KEY_SIZE			32 /* HMAC-SHA256 key of one direction */
+#define FIO_MUX_MAC_SIZE			16 /* truncated HMAC-SHA256 of frame */
+
+typedef enum
+{
+	FIO_MUX_DATA,
+	FIO_MUX_CREDIT,
+	FIO_MUX_CLOSE,
+	FIO_MUX_HELLO,   /* size is 1 if agent agreed to compress */
+	FIO_MUX_DATA_Z   /* uint32 raw size followed by zlib data */
+} fio_mux_frame;
+
+typedef struct
+{
+	uint16 stream;
+	uint16 type;
+	uint32 size;
+} fio_mux_header;
+
+typedef struct fio_mux_stream
+{
+	uint16 id;
+	int    sock;         /* mux end of stream socket pair */
+	int    poll_index;   /* position in poll set, -1 if not polled yet */
+	bool   eof;          /* EOF is read from socket and CLOSE is sent */
+	bool   closed;       /* CLOSE is received */
+	bool   shut;         /* write side of socket is shut down */
+	bool   broken;       /* socket can't be written, received data is discarded */
+	char*  pending;      /* received data not yet written into socket */
+	size_t pending_size;
+	size_t window;       /* how much data we still may send */
+	size_t consumed;     /* written into socket but not credited yet */
+	int    z_skip;       /* chunks to send without trying to compress */
+	struct fio_mux_stream* next;
+} fio_mux_stream;
+
+typedef struct
+{
+	int    in;
+	int    out;
+	int    err;
+	pid_t  pid;
+	int    wakeup[2];
+	bool   agent;
+	bool   failed;
+	int    n_streams;
+	uint16 next_id;
+	fio_mux_stream* streams;
+	pthread_mutex_t lock;
+	char*  in_buf;
+	size_t in_size;
+	char*  out_buf;
+	size_t out_size;
+	size_t out_alloc;
+#ifdef HAVE_LIBZ
+	bool   compress;     /* compression is negotiated */
+	char*  z_buf;
+	z_stream deflate_stream;
+	z_stream inflate_stream;
+#endif
+	bool   mac;          /* frames are authenticated */
+	uint8  send_key[FIO_MUX_KEY_SIZE];
+	uint8  recv_key[FIO_MUX_KEY_SIZE];
+	uint64 send_seq;
+	uint64 recv_seq;
+} fio_mux;
+
+static fio_mux* mux_connections[FIO_MUX_MAX_CONNECTIONS];
+static int n_mux_connections;
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mux_atfork_once = PTHREAD_ONCE_INIT;
+
+static void fio_mux_set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		elog(ERROR, "Cannot make descriptor %d non-blocking: %s", fd, strerror(errno));
+}
+
+/* MAC of frame with given sequence number, payload is NULL for frames without data */
+static void fio_mux_frame_mac(uint8 const* key, uint64 seq, fio_mux_header const* hdr,
+							  char const* payload, uint8* mac)
+{
+#if PG_VERSION_NUM >= 100000
+	scram_HMAC_ctx ctx;
+	uint8 digest[SCRAM_KEY_LEN];
+
+	scram_HMAC_init(&ctx, (char const*)key, FIO_MUX_KEY_SIZE);
+	scram_HMAC_update(&ctx, (char const*)&seq, sizeof(seq));
+	scram_HMAC_update(&ctx, (char const*)hdr, sizeof(*hdr));
+	if (payload)
+		scram_HMAC_update(&ctx, payload, hdr->size);
+	scram_HMAC_final(digest, &ctx);
+	memcpy(mac, digest, FIO_MUX_MAC_SIZE);
+#else
+	elog(ERROR, "Agent authentication requires pg_probackup built with PostgreSQL 10 or newer");
+#endif
+}
+
+static bool fio_mux_check_mac(fio_mux* mux, fio_mux_header const* hdr, char const* payload,
+							  uint8 const* mac)
+{
+	uint8 expected[FIO_MUX_MAC_SIZE];
+	uint8 diff = 0;
+	int i;
+
+	fio_mux_frame_mac(mux->recv_key, mux->recv_seq++, hdr, payload, expected);
+	for (i = 0; i < FIO_MUX_MAC_SIZE; i++)
+		diff |= expected[i] ^ mac[i];
+	return diff == 0;
+}
+
+static void fio_mux_queue(fio_mux* mux, uint16 id, fio_mux_frame type, size_t size, char const* data)
+{
+	fio_mux_header hdr;
+	size_t need = sizeof(hdr) + (data ? size : 0) + (mux->mac ? FIO_MUX_MAC_SIZE : 0);
+
+	if (mux->out_size + need > mux->out_alloc)
+	{
+		mux->out_alloc = Max(mux->out_alloc*2, mux->out_size + need);
+		mux->out_buf = pgut_realloc(mux->out_buf, mux->out_alloc);
+	}
+	hdr.stream = id;
+	hdr.type = type;
+	hdr.size = (uint32)size;
+	memcpy(mux->out_buf + mux->out_size, &hdr, sizeof(hdr));
+	if (data)
+		memcpy(mux->out_buf + mux->out_size + sizeof(hdr), data, size);
+	if (mux->mac)
+		fio_mux_frame_mac(mux->send_key, mux->send_seq++, &hdr, data,
+						  (uint8*)mux->out_buf + mux->out_size + need - FIO_MUX_MAC_SIZE);
+	mux->out_size += need;
+}
+
+static bool fio_mux_send(fio_mux* mux)
+{
+	size_t done = 0;
+
+	while (done < mux->out_size)
+	{
+		ssize_t rc = write(mux->out, mux->out_buf + done, mux->out_size - done);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			break;
+		}
+		done += rc;
+	}
+	memmove(mux->out_buf, mux->out_buf + done, mux->out_size - done);
+	mux->out_size -= done;
+	return true;
+}
+
+static fio_mux_stream* fio_mux_add_stream(fio_mux* mux, uint16 id, int sock)
+{
+	fio_mux_stream* stream = pgut_new(fio_mux_stream);
+
+	memset(stream, 0, sizeof(fio_mux_stream));
+	stream->id = id;
+	stream->sock = sock;
+	stream->poll_index = -1;
+	stream->window = FIO_MUX_WINDOW;
+	stream->pending = pgut_malloc(FIO_MUX_WINDOW);
+	stream->next = mux->streams;
+	mux->streams = stream;
+	mux->n_streams += 1;
+	return stream;
+}
+
+static fio_mux_stream* fio_mux_find_stream(fio_mux* mux, uint16 id)
+{
+	fio_mux_stream* stream;
+
+	for (stream = mux->streams; stream != NULL; stream = stream->next)
+		if (stream->id == id)
+			return stream;
+	return NULL;
+}
+
+/* Write received data into stream socket and return credit for it */
+static void fio_mux_flush_stream(fio_mux* mux, fio_mux_stream* stream)
+{
+	while (stream->pending_size > 0)
+	{
+		ssize_t rc = send(stream->sock, stream->pending, stream->pending_size, MSG_NOSIGNAL);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* Nobody reads the stream anymore, just consume everything sent to it */
+			stream->broken = true;
+			rc = stream->pending_size;
+		}
+		memmove(stream->pending, stream->pending + rc, stream->pending_size - rc);
+		stream->pending_size -= rc;
+		stream->consumed += rc;
+	}
+	if (stream->consumed >= FIO_MUX_WINDOW/4
+		|| (stream->consumed > 0 && stream->pending_size == 0))
+	{
+		fio_mux_queue(mux, stream->id, FIO_MUX_CREDIT, stream->consumed, NULL);
+		stream->consumed = 0;
+	}
+}
+
+#ifdef HAVE_LIBZ
+static void fio_mux_init_compression(fio_mux* mux)
+{
+	memset(&mux->deflate_stream, 0, sizeof(z_stream));
+	memset(&mux->inflate_stream, 0, sizeof(z_stream));
+	if (deflateInit(&mux->deflate_stream, Z_BEST_SPEED) != Z_OK
+		|| inflateInit(&mux->inflate_stream) != Z_OK)
+		elog(ERROR, "Cannot initialize compression of remote agent channel");
+	mux->z_buf = pgut_malloc(sizeof(uint32) + compressBound(FIO_MUX_CHUNK));
+	mux->compress = true;
+}
+
+/* Queue chunk of stream data as DATA_Z frame, if it is worth compressing */
+static bool fio_mux_queue_compressed(fio_mux* mux, fio_mux_stream* stream, char* chunk, size_t size)
+{
+	uint32 raw_size = size;
+	size_t z_size;
+
+	/* Too small to tell anything about compressibility of the stream */
+	if (size < FIO_MUX_Z_MIN_CHUNK)
+		return false;
+
+	if (stream->z_skip > 0)
+	{
+		stream->z_skip -= 1;
+		return false;
+	}
+
+	deflateReset(&mux->deflate_stream);
+	mux->deflate_stream.next_in = (Bytef*)chunk;
+	mux->deflate_stream.avail_in = size;
+	mux->deflate_stream.next_out = (Bytef*)mux->z_buf + sizeof(raw_size);
+	mux->deflate_stream.avail_out = size - size/8;
+	if (deflate(&mux->deflate_stream, Z_FINISH) != Z_STREAM_END)
+	{
+		/* Doesn't fit into 7/8 of the original size, don't bother */
+		stream->z_skip = FIO_MUX_Z_BACKOFF;
+		return false;
+	}
+	z_size = sizeof(raw_size) + mux->deflate_stream.total_out;
+	memcpy(mux->z_buf, &raw_size, sizeof(raw_size));
+	fio_mux_queue(mux, stream->id, FIO_MUX_DATA_Z, z_size, mux->z_buf);
+	return true;
+}
+
+/* Decompress DATA_Z frame into pending data of the stream */
+static bool fio_mux_inflate(fio_mux* mux, fio_mux_stream* stream, char* data, size_t size, uint32 raw_size)
+{
+	inflateReset(&mux->inflate_stream);
+	mux->inflate_stream.next_in = (Bytef*)data;
+	mux->inflate_stream.avail_in = size;
+	mux->inflate_stream.next_out = (Bytef*)stream->pending + stream->pending_size;
+	mux->inflate_stream.avail_out = raw_size;
+	if (inflate(&mux->inflate_stream, Z_FINISH) != Z_STREAM_END
+		|| mux->inflate_stream.total_out != raw_size)
+		return false;
+	stream->pending_size += raw_size;
+	return true;
+}
+#endif
+
+static void fio_mux_read_stream(fio_mux* mux, fio_mux_stream* stream, char* chunk)
+{
+	ssize_t rc = recv(stream->sock, chunk, Min(stream->window, FIO_MUX_CHUNK), 0);
+
+	if (rc < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (rc <= 0)
+	{
+		stream->eof = true;
+		fio_mux_queue(mux, stream->id, FIO_MUX_CLOSE, 0, NULL);
+	}
+	else
+	{
+#ifdef HAVE_LIBZ
+		if (mux->compress && fio_mux_queue_compressed(mux, stream, chunk, rc))
+		{
+			stream->window -= rc;
+			return;
+		}
+#endif
+		fio_mux_queue(mux, stream->id, FIO_MUX_DATA, rc, chunk);
+		stream->window -= rc;
+	}
+}
+
+/*
+ * Agent stream worker: serve fio requests of the stream.
+ * Failure of any stream terminates the whole agent, as it used to do
+ * for agent process started for each thread.
+ */
+static void fio_mux_worker_exit(void* arg)
+{
+	exit(EXIT_FAILURE);
+}
+
+static void* fio_mux_worker(void* arg)
+{
+	int sock = *(int*)arg;
+
+	pfree(arg);
+	pthread_cleanup_push(fio_mux_worker_exit, NULL);
+	fio_communicate(sock, sock);
+	pthread_cleanup_pop(0);
+	close(sock);
+	return NULL;
+}
+
+static fio_mux_stream* fio_mux_start_worker(fio_mux* mux, uint16 id)
+{
+	int socks[2];
+	int* worker_sock;
+	pthread_t thread;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0)
+		return NULL;
+	fio_mux_set_nonblock(socks[0]);
+
+	worker_sock = pgut_new(int);
+	*worker_sock = socks[1];
+	if (pthread_create(&thread, NULL, fio_mux_worker, worker_sock) != 0)
+		return NULL;
+	pthread_detach(thread);
+
+	return fio_mux_add_stream(mux, id, socks[0]);
+}
+
+static bool fio_mux_process_frame(fio_mux* mux, fio_mux_header* hdr, char* data)
+{
+	fio_mux_stream* stream = fio_mux_find_stream(mux, hdr->stream);
+
+	/* First data of unknown stream starts new worker at agent */
+	if (stream == NULL && (hdr->type == FIO_MUX_DATA || hdr->type == FIO_MUX_DATA_Z))
+	{
+		if (!mux->agent)
+			return false;
+		stream = fio_mux_start_worker(mux, hdr->stream);
+		if (stream == NULL)
+			return false;
+	}
+
+	switch (hdr->type)
+	{
+	  case FIO_MUX_DATA:
+		if (stream->broken)
+		{
+			fio_mux_queue(mux, stream->id, FIO_MUX_CREDIT, hdr->size, NULL);
+			break;
+		}
+		if (stream->pending_size + hdr->size > FIO_MUX_WINDOW)
+			return false; /* peer doesn't respect our window */
+		memcpy(stream->pending + stream->pending_size, data, hdr->size);
+		stream->pending_size += hdr->size;
+		fio_mux_flush_stream(mux, stream);
+		break;
+#ifdef HAVE_LIBZ
+	  case FIO_MUX_DATA_Z:
+	  {
+		uint32 raw_size;
+
+		if (!mux->compress || hdr->size < sizeof(raw_size))
+			return false;
+		memcpy(&raw_size, data, sizeof(raw_size));
+		if (stream->broken)
+		{
+			fio_mux_queue(mux, stream->id, FIO_MUX_CREDIT, raw_size, NULL);
+			break;
+		}
+		if (stream->pending_size + raw_size > FIO_MUX_WINDOW
+			|| !fio_mux_inflate(mux, stream, data + sizeof(raw_size),
+								hdr->size - sizeof(raw_size), raw_size))
+			return false;
+		fio_mux_flush_stream(mux, stream);
+		break;
+	  }
+	  case FIO_MUX_HELLO:
+		if (!mux->agent && hdr->size != 0 && instance_config.remote.compress)
+			fio_mux_init_compression(mux);
+		break;
+#else
+	  case FIO_MUX_HELLO:
+		break;
+#endif
+	  case FIO_MUX_CREDIT:
+		if (stream != NULL)
+			stream->window += hdr->size;
+		break;
+	  case FIO_MUX_CLOSE:
+		if (stream != NULL)
+			stream->closed = true;
+		break;
+	  default:
+		return false;
+	}
+	return true;
+}
+
+static bool fio_mux_receive(fio_mux* mux)
+{
+	size_t offs = 0;
+	ssize_t rc = read(mux->in, mux->in_buf + mux->in_size, FIO_MUX_IN_BUF_SIZE - mux->in_size);
+
+	if (rc < 0)
+		return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+	if (rc == 0)
+		return false;
+
+	mux->in_size += rc;
+	while (mux->in_size - offs >= sizeof(fio_mux_header))
+	{
+		fio_mux_header hdr;
+		size_t payload;
+		size_t mac_size = mux->mac ? FIO_MUX_MAC_SIZE : 0;
+		char*  data = mux->in_buf + offs + sizeof(hdr);
+
+		memcpy(&hdr, mux->in_buf + offs, sizeof(hdr));
+		payload = hdr.type == FIO_MUX_DATA || hdr.type == FIO_MUX_DATA_Z ? hdr.size : 0;
+		if (payload > FIO_MUX_CHUNK + sizeof(uint32))
+			return false;
+		if (mux->in_size - offs < sizeof(hdr) + payload + mac_size)
+			break;
+		if (mux->mac
+			&& !fio_mux_check_mac(mux, &hdr, payload ? data : NULL, (uint8*)data + payload))
+		{
+			elog(WARNING, "Integrity check of remote agent connection failed");
+			return false;
+		}
+		if (!fio_mux_process_frame(mux, &hdr, data))
+			return false;
+		offs += sizeof(hdr) + payload + mac_size;
+	}
+	memmove(mux->in_buf, mux->in_buf + offs, mux->in_size - offs);
+	mux->in_size -= offs;
+	return true;
+}
+
+/* Shut down and release finished streams */
+static void fio_mux_reap(fio_mux* mux)
+{
+	fio_mux_stream** link = &mux->streams;
+
+	while (*link != NULL)
+	{
+		fio_mux_stream* stream = *link;
+
+		if (stream->closed && stream->pending_size == 0 && !stream->shut && !stream->broken)
+		{
+			/* Let reader of the stream get EOF */
+			shutdown(stream->sock, SHUT_WR);
+			stream->shut = true;
+		}
+		if (stream->eof && stream->closed && stream->pending_size == 0)
+		{
+			*link = stream->next;
+			close(stream->sock);
+			pfree(stream->pending);
+			pfree(stream);
+			mux->n_streams -= 1;
+		}
+		else
+			link = &stream->next;
+	}
+}
+
+/*
+ * Connection is lost: close all streams, so that their threads get
+ * an error on next read or write.
+ */
+static void fio_mux_fail(fio_mux* mux)
+{
+	while (mux->streams != NULL)
+	{
+		fio_mux_stream* stream = mux->streams;
+		mux->streams = stream->next;
+		close(stream->sock);
+		pfree(stream->pending);
+		pfree(stream);
+	}
+	mux->n_streams = 0;
+	mux->failed = true;
+}
+
+static void fio_mux_loop(fio_mux* mux)
+{
+	struct pollfd* fds = NULL;
+	int fds_alloc = 0;
+	char* chunk = pgut_malloc(FIO_MUX_CHUNK);
+
+	pthread_mutex_lock(&mux->lock);
+	while (true)
+	{
+		fio_mux_stream* stream;
+		int n_fds = 3;
+		int rc;
+
+		if (fds_alloc < mux->n_streams + 3)
+		{
+			fds_alloc = mux->n_streams + 3 + FIO_MUX_STREAMS_PER_CONNECTION;
+			fds = pgut_realloc(fds, fds_alloc*sizeof(struct pollfd));
+		}
+		fds[0].fd = mux->in;
+		fds[0].events = POLLIN;
+		fds[1].fd = mux->out;
+		fds[1].events = mux->out_size > 0 ? POLLOUT : 0;
+		fds[2].fd = mux->wakeup[0];
+		fds[2].events = POLLIN;
+
+		for (stream = mux->streams; stream != NULL; stream = stream->next)
+		{
+			short events = 0;
+
+			if (stream->pending_size > 0)
+				events |= POLLOUT;
+			if (!stream->eof && stream->window > 0 && mux->out_size < FIO_MUX_OUT_HIGH)
+				events |= POLLIN;
+			fds[n_fds].fd = stream->sock;
+			fds[n_fds].events = events;
+			fds[n_fds].revents = 0;
+			stream->poll_index = n_fds++;
+		}
+		pthread_mutex_unlock(&mux->lock);
+
+		rc = poll(fds, n_fds, -1);
+
+		pthread_mutex_lock(&mux->lock);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[2].revents & POLLIN)
+		{
+			char buf[64];
+			while (read(mux->wakeup[0], buf, sizeof(buf)) > 0);
+		}
+		if ((fds[0].revents & (POLLIN|POLLHUP|POLLERR)) && !fio_mux_receive(mux))
+			break;
+
+		for (stream = mux->streams; stream != NULL; stream = stream->next)
+		{
+			short revents;
+
+			if (stream->poll_index < 0)
+				continue; /* added while we were polling */
+			revents = fds[stream->poll_index].revents;
+			if ((revents & (POLLOUT|POLLHUP|POLLERR)) && stream->pending_size > 0)
+				fio_mux_flush_stream(mux, stream);
+			if ((revents & (POLLIN|POLLHUP|POLLERR)) && !stream->eof && stream->window > 0)
+				fio_mux_read_stream(mux, stream, chunk);
+		}
+		fio_mux_reap(mux);
+
+		if (mux->out_size > 0 && !fio_mux_send(mux))
+			break;
+	}
+	fio_mux_fail(mux);
+	pthread_mutex_unlock(&mux->lock);
+
+	pfree(chunk);
+	pfree(fds);
+}
+
+static void* fio_mux_thread(void* arg)
+{
+	fio_mux_loop((fio_mux*)arg);
+	return NULL;
+}
+
+/*
+ * Forked child must not touch connections of the parent, the thread which
+ * called fork() will start its own one when it needs the agent.
+ */
+static void fio_mux_atfork_child(void)
+{
+	int i;
+
+	for (i = 0; i < n_mux_connections; i++)
+	{
+		fio_mux* mux = mux_connections[i];
+		fio_mux_stream* stream;
+
+		close(mux->in);
+		close(mux->out);
+		close(mux->err);
+		close(mux->wakeup[0]);
+		close(mux->wakeup[1]);
+		for (stream = mux->streams; stream != NULL; stream = stream->next)
+			close(stream->sock);
+	}
+	n_mux_connections = 0;
+	pthread_mutex_init(&mux_lock, NULL);
+	fio_redirect(0, 0, 0);
+}
+
+static void fio_mux_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, fio_mux_atfork_child);
+}
+
+static fio_mux* fio_mux_create(int in, int out)
+{
+	fio_mux* mux = pgut_new(fio_mux);
+
+	memset(mux, 0, sizeof(fio_mux));
+	mux->in = in;
+	mux->out = out;
+	mux->err = -1;
+	mux->wakeup[0] = mux->wakeup[1] = -1;
+	mux->in_buf = pgut_malloc(FIO_MUX_IN_BUF_SIZE);
+	pthread_mutex_init(&mux->lock, NULL);
+	fio_mux_set_nonblock(in);
+	fio_mux_set_nonblock(out);
+	return mux;
+}
+
+/* Authenticate frames with keys sent and received data, see fio_agent_session_keys() */
+static void fio_mux_set_keys(fio_mux* mux, uint8 const* keys)
+{
+	mux->mac = true;
+	memcpy(mux->send_key, keys, FIO_MUX_KEY_SIZE);
+	memcpy(mux->recv_key, keys + FIO_MUX_KEY_SIZE, FIO_MUX_KEY_SIZE);
+}
+
+/*
+ * Called by start_agent() with mux_lock held.
+ * Keys are NULL if frames are not authenticated.
+ */
+static bool fio_mux_add_connection(int in, int out, int err, pid_t pid,
+								   uint8 const* keys)
+{
+	fio_mux* mux;
+	pthread_t thread;
+
+	if (n_mux_connections == FIO_MUX_MAX_CONNECTIONS)
+		elog(ERROR, "Too many connections to remote agent");
+
+	mux = fio_mux_create(in, out);
+	mux->err = err;
+	mux->pid = pid;
+	if (keys != NULL)
+		fio_mux_set_keys(mux, keys);
+	SYS_CHECK(pipe(mux->wakeup));
+	fio_mux_set_nonblock(mux->wakeup[0]);
+	fio_mux_set_nonblock(mux->wakeup[1]);
+
+	if (pthread_create(&thread, NULL, fio_mux_thread, mux) != 0)
+		elog(ERROR, "Cannot start multiplexer thread: %s", strerror(errno));
+	pthread_detach(thread);
+
+	mux_connections[n_mux_connections++] = mux;
+	return true;
+}
+
+/* Open new stream at connection with free slot, starting new connection if needed */
+static bool fio_mux_open_stream(void)
+{
+	fio_mux* mux = NULL;
+	int socks[2];
+	int i;
+
+	pthread_once(&mux_atfork_once, fio_mux_register_atfork);
+	pthread_mutex_lock(&mux_lock);
+
+	for (i = 0; i < n_mux_connections && mux == NULL; i++)
+	{
+		pthread_mutex_lock(&mux_connections[i]->lock);
+		if (!mux_connections[i]->failed
+			&& mux_connections[i]->n_streams < FIO_MUX_STREAMS_PER_CONNECTION)
+			mux = mux_connections[i];
+		else
+			pthread_mutex_unlock(&mux_connections[i]->lock);
+	}
+	if (mux == NULL)
+	{
+		if (!start_agent(true))
+		{
+			pthread_mutex_unlock(&mux_lock);
+			return false;
+		}
+		mux = mux_connections[n_mux_connections-1];
+		pthread_mutex_lock(&mux->lock);
+	}
+
+	SYS_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, socks));
+	fio_mux_set_nonblock(socks[0]);
+	do {
+		mux->next_id += 1;
+	} while (fio_mux_find_stream(mux, mux->next_id) != NULL);
+	fio_mux_add_stream(mux, mux->next_id, socks[0]);
+	pthread_mutex_unlock(&mux->lock);
+	pthread_mutex_unlock(&mux_lock);
+
+	/* Let mux thread poll new stream */
+	if (write(mux->wakeup[1], "", 1) < 0 && errno != EAGAIN)
+		elog(ERROR, "Cannot wake up multiplexer thread: %s", strerror(errno));
+
+	fio_redirect(socks[1], dup(socks[1]), mux->err);
+	return true;
+}
+
+/*
+ * Serve streams of multiplexed connection at agent side.
+ * Keys are NULL if frames are not authenticated.
+ * Returns when connection is closed by the client.
+ */
+void fio_mux_serve(int in, int out, bool compress, uint8 const* keys)
+{
+	fio_mux* mux = fio_mux_create(in, out);
+
+	mux->agent = true;
+	if (keys != NULL)
+		fio_mux_set_keys(mux, keys);
+#ifdef HAVE_LIBZ
+	if (compress)
+		fio_mux_init_compression(mux);
+	fio_mux_queue(mux, 0, FIO_MUX_HELLO, mux->compress ? 1 : 0, NULL);
+#else
+	fio_mux_queue(mux, 0, FIO_MUX_HELLO, 0, NULL);
+#endif
+	fio_mux_loop(mux);
+}
+
+/*
+ * Direct connection to the agent started by "pg_probackup agent --listen".
+ *
+ * Instead of running SSH client, master connects to the TCP port or UNIX
+ * socket the agent listens on, and after handshake serves the connection
+ * as usual multiplexed connection, so fio protocol is the same as with SSH.
+ *
+ * Agent sends fio_agent_hello with random nonce, master answers with
+ * fio_agent_login containing its own nonce and HMAC-SHA256 of the agent nonce
+ * keyed with the secret from FIO_AGENT_SECRET_ENV, and agent replies with
+ * fio_agent_status. The secret itself is never sent. Then both sides derive
+ * session keys from the secret and the handshake messages, and authenticate
+ * every frame of the connection with them, see fio_mux_frame_mac(). The
+ * channel is not encrypted, so by default agent listens only on loopback
+ * addresses.
+ */
+#define FIO_AGENT_SECRET_ENV   "PGPROBACKUP_AGENT_SECRET"
+#define FIO_AGENT_VERSION_SIZE 16
+#define FIO_AGENT_NONCE_SIZE   32
+#define FIO_AGENT_PROOF_SIZE   32 /* SHA256 digest */
+#define FIO_AGENT_BACKLOG      64
+#define FIO_AGENT_MAX_CHILDREN 64 /* max number of connections served at once */
+#define FIO_AGENT_TIMEOUT      10 /* seconds given to master to pass handshake */
+
+#define FIO_AGENT_AUTH         1 /* hello flag: agent requires proof of the secret */
+#define FIO_AGENT_COMPRESS     1 /* login flag: master asks to compress the channel */
+
+typedef enum
+{
+	FIO_AGENT_OK,
+	FIO_AGENT_BAD_VERSION,
+	FIO_AGENT_BAD_SECRET
+} fio_agent_status;
+
+typedef struct
+{
+	char   version[FIO_AGENT_VERSION_SIZE];
+	uint32 flags;
+	uint8  nonce[FIO_AGENT_NONCE_SIZE];
+} fio_agent_hello;
+
+typedef struct
+{
+	char   version[FIO_AGENT_VERSION_SIZE];
+	uint32 flags;
+	uint8  nonce[FIO_AGENT_NONCE_SIZE];
+	uint8  proof[FIO_AGENT_PROOF_SIZE]; /* must be the last field */
+} fio_agent_login;
+
+static bool fio_agent_send(int sock, void const* buf, size_t size)
+{
+	char const* ptr = (char const*)buf;
+
+	while (size > 0)
+	{
+		ssize_t rc = write(sock, ptr, size);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		ptr += rc;
+		size -= rc;
+	}
+	return true;
+}
+
+static bool fio_agent_recv(int sock, void* buf, size_t size)
+{
+	char* ptr = (char*)buf;
+
+	while (size > 0)
+	{
+		ssize_t rc = read(sock, ptr, size);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (rc == 0)
+		{
+			errno = ECONNRESET;
+			return false;
+		}
+		ptr += rc;
+		size -= rc;
+	}
+	return true;
+}
+
+static void fio_agent_proof(char const* secret, uint8 const* nonce, uint8* proof)
+{
+#if PG_VERSION_NUM >= 100000
+	scram_HMAC_ctx ctx;
+
+	scram_HMAC_init(&ctx, secret, strlen(secret));
+	scram_HMAC_update(&ctx, (char const*)nonce, FIO_AGENT_NONCE_SIZE);
+	scram_HMAC_final(proof, &ctx);
+#else
+	elog(ERROR, "Agent authentication requires pg_probackup built with PostgreSQL 10 or newer");
+#endif
+}
+
+/*
+ * Derive keys authenticating frames sent by the side (first FIO_MUX_KEY_SIZE
+ * bytes of keys) and received by it (the rest). Keys depend on nonces of both
+ * sides, so frames of one connection are useless for another.
+ */
+static void fio_agent_session_keys(char const* secret, fio_agent_hello const* hello,
+								   fio_agent_login const* login, bool agent, uint8* keys)
+{
+#if PG_VERSION_NUM >= 100000
+	char const* labels[2] = {"master", "agent"};
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		scram_HMAC_ctx ctx;
+		char const* label = labels[agent ? 1 - i : i];
+
+		scram_HMAC_init(&ctx, secret, strlen(secret));
+		scram_HMAC_update(&ctx, label, strlen(label) + 1);
+		scram_HMAC_update(&ctx, (char const*)hello, sizeof(*hello));
+		scram_HMAC_update(&ctx, (char const*)login, offsetof(fio_agent_login, proof));
+		scram_HMAC_final(keys + i*FIO_MUX_KEY_SIZE, &ctx);
+	}
+#else
+	elog(ERROR, "Agent authentication requires pg_probackup built with PostgreSQL 10 or newer");
+#endif
+}
+
+static void fio_agent_random(uint8* buf, size_t size)
+{
+	int fd = open("/dev/urandom", O_RDONLY);
+
+	if (fd < 0 || !fio_agent_recv(fd, buf, size))
+		elog(ERROR, "Cannot read \"/dev/urandom\": %s", strerror(errno));
+	close(fd);
+}
+
+/*
+ * Create socket bound to (listening) or connected to the address.
+ * Absolute path as host means UNIX socket, port is ignored then.
+ */
+static int fio_agent_socket(char const* host, char const* port, bool listening)
+{
+	int sock = -1;
+
+	if (host != NULL && is_absolute_path(host))
+	{
+		struct sockaddr_un addr;
+
+		if (strlen(host) >= sizeof(addr.sun_path))
+			elog(ERROR, "UNIX socket path is too long: \"%s\"", host);
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, host);
+
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0)
+			elog(ERROR, "Cannot create socket: %s", strerror(errno));
+		if (listening)
+		{
+			struct stat st;
+
+			/* Remove socket left by previous agent */
+			if (lstat(host, &st) == 0 && S_ISSOCK(st.st_mode))
+				unlink(host);
+			if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+				elog(ERROR, "Cannot bind socket \"%s\": %s", host, strerror(errno));
+		}
+		else if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+			elog(ERROR, "Cannot connect to agent at \"%s\": %s", host, strerror(errno));
+	}
+	else
+	{
+		struct addrinfo hints;
+		struct addrinfo* addrs;
+		struct addrinfo* addr;
+		int rc;
+		int err = 0;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+		rc = getaddrinfo(host, port, &hints, &addrs);
+		if (rc != 0)
+			elog(ERROR, "Cannot resolve agent address \"%s:%s\": %s",
+				 host ? host : "*", port, gai_strerror(rc));
+
+		for (addr = addrs; addr != NULL; addr = addr->ai_next)
+		{
+			sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+			if (sock < 0)
+			{
+				err = errno;
+				continue;
+			}
+			if (listening)
+			{
+				int on = 1;
+				setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+				if (bind(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+					break;
+			}
+			else if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+				break;
+			err = errno;
+			close(sock);
+			sock = -1;
+		}
+		freeaddrinfo(addrs);
+
+		if (sock < 0)
+			elog(ERROR, "Cannot %s agent address \"%s:%s\": %s",
+				 listening ? "bind" : "connect to",
+				 host ? host : "*", port, strerror(err));
+	}
+	return sock;
+}
+
+/* Called by start_agent() with mux_lock held */
+static bool fio_agent_connect(void)
+{
+	char const* host = instance_config.remote.host;
+	char const* port = instance_config.remote.port;
+	char const* secret = getenv(FIO_AGENT_SECRET_ENV);
+	fio_agent_hello hello;
+	fio_agent_login login;
+	uint8 keys[2*FIO_MUX_KEY_SIZE];
+	uint32 status;
+	int on = 1;
+	int sock;
+
+	if (!is_absolute_path(host) && port == NULL)
+		elog(ERROR, "Option --remote-port is required for remote protocol \"tcp\"");
+
+	sock = fio_agent_socket(host, port, false);
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); /* fails for UNIX socket */
+
+	if (!fio_agent_recv(sock, &hello, sizeof(hello)))
+		elog(ERROR, "Cannot receive greeting of agent at \"%s\": %s", host, strerror(errno));
+	hello.version[FIO_AGENT_VERSION_SIZE-1] = '\0';
+
+	memset(&login, 0, sizeof(login));
+	strncpy(login.version, PROGRAM_VERSION, FIO_AGENT_VERSION_SIZE-1);
+#ifdef HAVE_LIBZ
+	if (instance_config.remote.compress)
+		login.flags |= FIO_AGENT_COMPRESS;
+#endif
+	if (hello.flags & FIO_AGENT_AUTH)
+	{
+		if (secret == NULL || *secret == '\0')
+			elog(ERROR, "Agent at \"%s\" requires authentication, set %s environment variable",
+				 host, FIO_AGENT_SECRET_ENV);
+		fio_agent_random(login.nonce, FIO_AGENT_NONCE_SIZE);
+		fio_agent_proof(secret, hello.nonce, login.proof);
+	}
+	else if (!is_absolute_path(host))
+		elog(ERROR, "Agent at \"%s\" doesn't require authentication, which is impossible for TCP",
+			 host);
+
+	if (!fio_agent_send(sock, &login, sizeof(login))
+		|| !fio_agent_recv(sock, &status, sizeof(status)))
+		elog(ERROR, "Handshake with agent at \"%s\" failed: %s", host, strerror(errno));
+
+	if (status == FIO_AGENT_BAD_VERSION)
+		elog(ERROR, "Agent version %s doesn't match master pg_probackup version %s",
+			 hello.version, PROGRAM_VERSION);
+	else if (status != FIO_AGENT_OK)
+		elog(ERROR, "Agent at \"%s\" rejected authentication, check %s environment variable",
+			 host, FIO_AGENT_SECRET_ENV);
+
+	elog(LOG, "Connected to agent %s at \"%s\"", hello.version, host);
+	if (!(hello.flags & FIO_AGENT_AUTH))
+		return fio_mux_add_connection(sock, dup(sock), -1, 0, NULL);
+
+	fio_agent_session_keys(secret, &hello, &login, false, keys);
+	return fio_mux_add_connection(sock, dup(sock), -1, 0, keys);
+}
+
+/* Limit time socket operations may block, zero timeout removes the limit */
+static void fio_agent_set_timeout(int sock, int timeout)
+{
+	struct timeval tv;
+
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0
+		|| setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		elog(ERROR, "Cannot set socket timeout: %s", strerror(errno));
+}
+
+/*
+ * Handshake with master and serve its connection, runs in child of listener.
+ * Peer which doesn't complete handshake in FIO_AGENT_TIMEOUT seconds is
+ * dropped, so it can't hold one of FIO_AGENT_MAX_CHILDREN slots forever.
+ */
+static void fio_agent_serve(int sock, char const* secret)
+{
+	fio_agent_hello hello;
+	fio_agent_login login;
+	uint8 keys[2*FIO_MUX_KEY_SIZE];
+	uint32 status = FIO_AGENT_OK;
+
+	fio_agent_set_timeout(sock, FIO_AGENT_TIMEOUT);
+
+	memset(&hello, 0, sizeof(hello));
+	strncpy(hello.version, PROGRAM_VERSION, FIO_AGENT_VERSION_SIZE-1);
+	if (secret != NULL)
+	{
+		hello.flags |= FIO_AGENT_AUTH;
+		fio_agent_random(hello.nonce, FIO_AGENT_NONCE_SIZE);
+	}
+
+	if (!fio_agent_send(sock, &hello, sizeof(hello))
+		|| !fio_agent_recv(sock, &login, sizeof(login)))
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			elog(ERROR, "Handshake with master timed out");
+		elog(ERROR, "Handshake with master failed: %s", strerror(errno));
+	}
+	login.version[FIO_AGENT_VERSION_SIZE-1] = '\0';
+
+	if (secret != NULL)
+	{
+		uint8 proof[FIO_AGENT_PROOF_SIZE];
+		uint8 diff = 0;
+		int i;
+
+		fio_agent_proof(secret, hello.nonce, proof);
+		/* Don't let timing tell how much of the proof is right */
+		for (i = 0; i < FIO_AGENT_PROOF_SIZE; i++)
+			diff |= proof[i] ^ login.proof[i];
+		if (diff != 0)
+			status = FIO_AGENT_BAD_SECRET;
+	}
+	if (status == FIO_AGENT_OK && strcmp(login.version, PROGRAM_VERSION) != 0)
+	{
+		if (parse_program_version(login.version) < AGENT_PROTOCOL_VERSION)
+			status = FIO_AGENT_BAD_VERSION;
+		else
+			elog(WARNING, "Agent version %s doesn't match master pg_probackup version %s",
+				 PROGRAM_VERSION, login.version);
+	}
+
+	if (!fio_agent_send(sock, &status, sizeof(status)))
+		elog(ERROR, "Handshake with master failed: %s", strerror(errno));
+	if (status == FIO_AGENT_BAD_SECRET)
+		elog(ERROR, "Master failed authentication");
+	else if (status == FIO_AGENT_BAD_VERSION)
+		elog(ERROR, "Agent version %s doesn't match master pg_probackup version %s",
+			 PROGRAM_VERSION, login.version);
+
+	fio_agent_set_timeout(sock, 0);
+	if (secret != NULL)
+		fio_agent_session_keys(secret, &hello, &login, true, keys);
+	fio_mux_serve(sock, dup(sock), (login.flags & FIO_AGENT_COMPRESS) != 0,
+				  secret != NULL ? keys : NULL);
+}
+
+/* Check that socket is bound to loopback address */
+static bool fio_agent_is_loopback(int sock)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(sock, (struct sockaddr*)&addr, &len) < 0)
+		elog(ERROR, "Cannot get socket address: %s", strerror(errno));
+
+	if (addr.ss_family == AF_INET)
+		return (ntohl(((struct sockaddr_in*)&addr)->sin_addr.s_addr) >> 24) == 127;
+	if (addr.ss_family == AF_INET6)
+	{
+		struct in6_addr* in6 = &((struct sockaddr_in6*)&addr)->sin6_addr;
+
+		return IN6_IS_ADDR_LOOPBACK(in6)
+			|| (IN6_IS_ADDR_V4MAPPED(in6) && in6->s6_addr[12] == 127);
+	}
+	return false;
+}
+
+/*
+ * Accept direct connections from master, see fio_agent_connect().
+ * Address is "[host:]port" for TCP or absolute path of UNIX socket,
+ * host is localhost by default. Since the channel is not encrypted,
+ * non-loopback address is refused unless allow_external is set.
+ * Each connection is served by separate process, at most
+ * FIO_AGENT_MAX_CHILDREN at once: further connections wait in the backlog
+ * until one of the processes exits. Never returns.
+ */
+void fio_agent_listen(char const* address, bool allow_external)
+{
+	char const* secret = getenv(FIO_AGENT_SECRET_ENV);
+	bool unix_socket = is_absolute_path(address);
+	char* host = NULL;
+	char* port = NULL;
+	mode_t old_umask = 0;
+	int n_children = 0;
+	int listener;
+
+	if (secret != NULL && *secret == '\0')
+		secret = NULL;
+	if (secret == NULL && !unix_socket)
+		elog(ERROR, "Set %s environment variable to listen on TCP port", FIO_AGENT_SECRET_ENV);
+#if PG_VERSION_NUM < 100000
+	if (secret != NULL)
+		elog(ERROR, "Agent authentication requires pg_probackup built with PostgreSQL 10 or newer");
+#endif
+
+	if (unix_socket)
+	{
+		host = pg_strdup(address);
+		/* Only owner of the agent may connect to the socket */
+		old_umask = umask(S_IRWXG | S_IRWXO);
+	}
+	else
+	{
+		char* sep;
+
+		port = pg_strdup(address);
+		sep = strrchr(port, ':');
+		if (sep != NULL)
+		{
+			*sep = '\0';
+			host = port;
+			port = sep + 1;
+			/* IPv6 address in brackets */
+			if (host[0] == '[' && sep > host + 1 && sep[-1] == ']')
+			{
+				sep[-1] = '\0';
+				host += 1;
+			}
+			if (*host == '\0')
+				host = NULL;
+		}
+		if (host == NULL)
+			host = pg_strdup("localhost");
+	}
+
+	listener = fio_agent_socket(host, port, true);
+	/* Socket file is created by bind(), don't affect files of child processes */
+	if (unix_socket)
+		umask(old_umask);
+	else if (!allow_external && !fio_agent_is_loopback(listener))
+		elog(ERROR, "Address \"%s\" is not a loopback one, data sent to agent is not encrypted, "
+			 "use --allow-external option to listen on it", address);
+	if (listen(listener, FIO_AGENT_BACKLOG) < 0)
+		elog(ERROR, "Cannot listen on \"%s\": %s", address, strerror(errno));
+
+	elog(INFO, "Agent %s is listening on \"%s\"", PROGRAM_VERSION, address);
+
+	while (true)
+	{
+		int sock;
+		pid_t pid;
+
+		/* Reap exited children, wait for one of them if all slots are busy */
+		while (n_children > 0)
+		{
+			pid = waitpid(-1, NULL, n_children < FIO_AGENT_MAX_CHILDREN ? WNOHANG : 0);
+			if (pid > 0)
+				n_children -= 1;
+			else if (pid == 0)
+				break;
+			else if (errno == ECHILD)
+				n_children = 0;
+			else if (errno != EINTR)
+				elog(ERROR, "Cannot wait for agent process: %s", strerror(errno));
+		}
+
+		sock = accept(listener, NULL, NULL);
+		if (sock < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			elog(ERROR, "Cannot accept connection: %s", strerror(errno));
+		}
+
+		pid = fork();
+		if (pid == 0)
+		{
+			int on = 1;
+
+			close(listener);
+			if (!unix_socket)
+				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			fio_agent_serve(sock, secret);
+			exit(0);
+		}
+		if (pid < 0)
+			elog(WARNING, "Cannot start agent process: %s", strerror(errno));
+		else
+			n_children += 1;
+		close(sock);
+	}
+}
+
+#endif
+
+bool launch_agent(void)
+{
+#ifdef WIN32
+	return start_agent(false);
+#else
+	return fio_mux_open_stream();
+#endif
+}
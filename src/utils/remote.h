@@ -19,6 +19,7 @@ typedef struct RemoteConfig
 	char* user;
 	char *ssh_config;
 	char *ssh_options;
+	bool  compress;
 } RemoteConfig;
 
 #endif
@@ -0,0 +1,674 @@
+/*-------------------------------------------------------------------------
+ *
+ * walpack.c: consolidate archived WAL segments into pack files.
+ *
+ * Archive with a lot of small files is slow to list, to purge and to copy
+ * around. archive-pack command moves finished WAL segments of a timeline
+ * into pack files, each holding a run of consecutive segments:
+ *
+ *   member data | WalPackEntry[n_entries] | WalPackTrailer
+ *
+ * Members are stored exactly as they were archived, compressed or not.
+ * Pack file is named after its first and last segments, for example
+ * 000000010000000000000001-000000010000000000000040.pack, so the range
+ * of segments is known without opening the file.
+ *
+ * Portions Copyright (c) 2020, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <unistd.h>
+
+#if defined(WIN32)
+#define __thread __declspec(thread)
+#endif
+
+#define WAL_PACK_MAGIC		0x4B415057	/* "WPAK" */
+#define WAL_PACK_VERSION	1
+
+/* WalPackEntry flags */
+#define WAL_PACK_COMPRESSED	0x01
+
+typedef struct WalPackEntry
+{
+	uint64		segno;
+	uint64		offset;			/* offset of member in pack file */
+	uint64		size;			/* size of member in pack file */
+	pg_crc32	wal_crc;		/* CRC32C of uncompressed segment */
+	uint32		flags;
+} WalPackEntry;
+
+typedef struct WalPackTrailer
+{
+	uint32		magic;
+	uint32		version;
+	uint32		n_entries;
+	pg_crc32	crc;			/* CRC32C of entries and fields above */
+} WalPackTrailer;
+
+/* Archived segment chosen for packing */
+typedef struct WalPackMember
+{
+	xlogFile   *file;
+	xlogFile   *dup;			/* the same segment archived in another form */
+} WalPackMember;
+
+/* Pack file found by the last lookup, to avoid directory scan per segment */
+static __thread char cached_pack_path[MAXPGPATH];
+static __thread TimeLineID cached_pack_tli = 0;
+static __thread XLogSegNo cached_pack_first = 0;
+static __thread XLogSegNo cached_pack_last = 0;
+
+static int pack_wal_timeline(timelineInfo *tlinfo, const char *archive_dir,
+							 int pack_size, uint32 seg_size, bool no_sync);
+static void write_wal_pack(const char *archive_dir, TimeLineID tli,
+						   WalPackMember *members, int n_members,
+						   uint32 seg_size, bool no_sync);
+static bool read_wal_pack_member(const char *pack_path, XLogSegNo segno,
+								 uint32 seg_size, char *buf, char *errmsg,
+								 size_t errmsg_len, fio_location location);
+static bool read_wal_pack_entry(int fd, XLogSegNo segno, WalPackEntry *entry,
+								char *errmsg, size_t errmsg_len);
+
+/*
+ * Move finished WAL segments of instance archive into pack files.
+ * Only full runs of pack_size consecutive segments are packed, and the
+ * last segment of timeline is never packed, so pack files are never
+ * rewritten.
+ */
+void
+do_archive_pack(InstanceConfig *instance, int pack_size, bool no_sync)
+{
+	parray	   *timelines;
+	char		archive_dir[MAXPGPATH];
+	int			n_packs = 0;
+	int			i;
+
+	if (pack_size < 2)
+		elog(ERROR, "--pack-size must be greater than 1");
+
+	join_path_components(archive_dir, backup_path, "wal");
+	join_path_components(archive_dir, archive_dir, instance->name);
+
+	timelines = catalog_get_timelines(instance);
+
+	for (i = 0; i < parray_num(timelines); i++)
+	{
+		timelineInfo *tlinfo = (timelineInfo *) parray_get(timelines, i);
+
+		n_packs += pack_wal_timeline(tlinfo, archive_dir, pack_size,
+									 instance->xlog_seg_size, no_sync);
+	}
+
+	if (n_packs == 0)
+		elog(INFO, "Nothing to pack in WAL archive of instance '%s'",
+			 instance->name);
+	else
+		elog(INFO, "WAL archive of instance '%s' is packed, pack files created: %i",
+			 instance->name, n_packs);
+
+	parray_walk(timelines, timelineInfoFree);
+	parray_free(timelines);
+}
+
+/*
+ * Pack loose segments of timeline. Returns number of pack files created.
+ */
+static int
+pack_wal_timeline(timelineInfo *tlinfo, const char *archive_dir,
+				  int pack_size, uint32 seg_size, bool no_sync)
+{
+	WalPackMember *members;
+	int			n_members = 0;
+	int			n_packs = 0;
+	int			i;
+
+	members = palloc0(sizeof(WalPackMember) * pack_size);
+
+	/* xlog_filelist is sorted by name, hence by segno within timeline */
+	for (i = 0; i < parray_num(tlinfo->xlog_filelist); i++)
+	{
+		xlogFile   *wal_file = (xlogFile *) parray_get(tlinfo->xlog_filelist, i);
+
+		if (interrupted)
+			elog(ERROR, "interrupted during WAL archive packing");
+
+		if (wal_file->type != SEGMENT)
+			continue;
+
+		/* Newest segment may be pushed again, leave it alone */
+		if (wal_file->segno >= tlinfo->end_segno)
+			break;
+
+		if (n_members > 0)
+		{
+			WalPackMember *prev = &members[n_members - 1];
+
+			if (wal_file->segno == prev->file->segno)
+			{
+				prev->dup = wal_file;
+				continue;
+			}
+
+			/*
+			 * Run is complete or broken by a gap. Incomplete run is left
+			 * loose, it cannot be packed without rewriting its pack later.
+			 */
+			if (n_members == pack_size ||
+				wal_file->segno != prev->file->segno + 1)
+			{
+				if (n_members == pack_size)
+				{
+					write_wal_pack(archive_dir, tlinfo->tli, members,
+								   n_members, seg_size, no_sync);
+					n_packs++;
+				}
+
+				MemSet(members, 0, sizeof(WalPackMember) * pack_size);
+				n_members = 0;
+			}
+		}
+
+		members[n_members++].file = wal_file;
+	}
+
+	if (n_members == pack_size)
+	{
+		write_wal_pack(archive_dir, tlinfo->tli, members, n_members,
+					   seg_size, no_sync);
+		n_packs++;
+	}
+
+	pfree(members);
+	return n_packs;
+}
+
+/*
+ * Write members into new pack file and remove them from the archive.
+ * Pack file is made durable before any member is removed, so concurrent
+ * archive-get always finds the segment either loose or in the pack.
+ */
+static void
+write_wal_pack(const char *archive_dir, TimeLineID tli,
+			   WalPackMember *members, int n_members,
+			   uint32 seg_size, bool no_sync)
+{
+	char		first_name[MAXFNAMELEN];
+	char		last_name[MAXFNAMELEN];
+	char		pack_path[MAXPGPATH];
+	char		pack_path_part[MAXPGPATH];
+	WalPackEntry *entries;
+	WalPackTrailer trailer;
+	uint64		offset = 0;
+	char	   *buf = NULL;
+	size_t		buf_size = 0;
+	int			out;
+	int			i;
+
+	GetXLogFileName(first_name, tli, members[0].file->segno, seg_size);
+	GetXLogFileName(last_name, tli, members[n_members - 1].file->segno, seg_size);
+	snprintf(pack_path, MAXPGPATH, "%s/%s-%s.pack", archive_dir,
+			 first_name, last_name);
+	snprintf(pack_path_part, MAXPGPATH, "%s.part", pack_path);
+
+	out = fio_open(pack_path_part, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+				   FIO_BACKUP_HOST);
+	if (out < 0)
+		elog(ERROR, "Cannot open WAL pack file \"%s\": %s",
+			 pack_path_part, strerror(errno));
+
+	entries = palloc0(sizeof(WalPackEntry) * n_members);
+
+	for (i = 0; i < n_members; i++)
+	{
+		xlogFile   *wal_file = members[i].file;
+		WalPackEntry *entry = &entries[i];
+		char		wal_file_name[MAXFNAMELEN];
+		bool		compressed;
+		uint64		wal_size;
+		struct stat	st;
+		int			in;
+
+		if (interrupted)
+			elog(ERROR, "interrupted during WAL archive packing");
+
+		GetXLogFileName(wal_file_name, tli, wal_file->segno, seg_size);
+		compressed = strcmp(wal_file->file.name + XLOG_FNAME_LEN, ".gz") == 0;
+
+		/* Checksum file spares us decompression of the segment */
+		if (!read_wal_checksum(archive_dir, wal_file_name, &entry->wal_crc, &wal_size))
+			entry->wal_crc = fio_get_crc32(wal_file->file.path, FIO_BACKUP_HOST,
+										   compressed);
+
+		in = fio_open(wal_file->file.path, O_RDONLY | PG_BINARY, FIO_BACKUP_HOST);
+		if (in < 0)
+			elog(ERROR, "Cannot open WAL file \"%s\": %s",
+				 wal_file->file.path, strerror(errno));
+
+		if (fio_fstat(in, &st) < 0)
+			elog(ERROR, "Cannot stat WAL file \"%s\": %s",
+				 wal_file->file.path, strerror(errno));
+
+		if ((size_t) st.st_size > buf_size)
+		{
+			buf_size = st.st_size;
+			buf = buf ? pgut_realloc(buf, buf_size) : pgut_malloc(buf_size);
+		}
+
+		if (fio_read(in, buf, st.st_size) != (ssize_t) st.st_size)
+			elog(ERROR, "Cannot read WAL file \"%s\": %s",
+				 wal_file->file.path, strerror(errno));
+		fio_close(in);
+
+		if (fio_write(out, buf, st.st_size) != (ssize_t) st.st_size)
+			elog(ERROR, "Cannot write WAL pack file \"%s\": %s",
+				 pack_path_part, strerror(errno));
+
+		entry->segno = wal_file->segno;
+		entry->offset = offset;
+		entry->size = st.st_size;
+		entry->flags = compressed ? WAL_PACK_COMPRESSED : 0;
+		offset += st.st_size;
+	}
+
+	MemSet(&trailer, 0, sizeof(trailer));
+	trailer.magic = WAL_PACK_MAGIC;
+	trailer.version = WAL_PACK_VERSION;
+	trailer.n_entries = n_members;
+
+	INIT_FILE_CRC32(true, trailer.crc);
+	COMP_FILE_CRC32(true, trailer.crc, entries, sizeof(WalPackEntry) * n_members);
+	COMP_FILE_CRC32(true, trailer.crc, &trailer, offsetof(WalPackTrailer, crc));
+	FIN_FILE_CRC32(true, trailer.crc);
+
+	if (fio_write(out, entries, sizeof(WalPackEntry) * n_members) !=
+			(ssize_t) (sizeof(WalPackEntry) * n_members) ||
+		fio_write(out, &trailer, sizeof(trailer)) != (ssize_t) sizeof(trailer))
+		elog(ERROR, "Cannot write WAL pack file \"%s\": %s",
+			 pack_path_part, strerror(errno));
+
+	if (fio_close(out) != 0)
+		elog(ERROR, "Cannot close WAL pack file \"%s\": %s",
+			 pack_path_part, strerror(errno));
+
+	if (!no_sync && fio_sync(pack_path_part, FIO_BACKUP_HOST) != 0)
+		elog(ERROR, "Failed to sync WAL pack file \"%s\": %s",
+			 pack_path_part, strerror(errno));
+
+	if (fio_rename(pack_path_part, pack_path, FIO_BACKUP_HOST) < 0)
+		elog(ERROR, "Cannot rename file \"%s\" to \"%s\": %s",
+			 pack_path_part, pack_path, strerror(errno));
+
+	wal_state_add(pack_path, -1);
+
+#ifndef WIN32
+	if (!no_sync && fio_sync(archive_dir, FIO_BACKUP_HOST) != 0)
+		elog(ERROR, "Failed to sync directory \"%s\": %s",
+			 archive_dir, strerror(errno));
+#endif
+
+	/*
+	 * Members are in the pack now. Their checksum files are useless, while
+	 * block summary and recovery index files are still valid.
+	 */
+	for (i = 0; i < n_members; i++)
+	{
+		char		wal_file_name[MAXFNAMELEN];
+		char		crc_path[MAXPGPATH];
+
+		GetXLogFileName(wal_file_name, tli, members[i].file->segno, seg_size);
+		snprintf(crc_path, MAXPGPATH, "%s/%s.crc", archive_dir, wal_file_name);
+
+		if (fio_unlink(members[i].file->file.path, FIO_BACKUP_HOST) < 0 &&
+			errno != ENOENT)
+			elog(ERROR, "Could not remove file \"%s\": %s",
+				 members[i].file->file.path, strerror(errno));
+		wal_state_remove(members[i].file->file.path);
+
+		if (members[i].dup &&
+			fio_unlink(members[i].dup->file.path, FIO_BACKUP_HOST) < 0 &&
+			errno != ENOENT)
+			elog(ERROR, "Could not remove file \"%s\": %s",
+				 members[i].dup->file.path, strerror(errno));
+		if (members[i].dup)
+			wal_state_remove(members[i].dup->file.path);
+
+		fio_unlink(crc_path, FIO_BACKUP_HOST);
+		wal_state_remove(crc_path);
+	}
+
+	elog(LOG, "WAL pack file \"%s\" is created, segments: %i, size: " UINT64_FORMAT,
+		 pack_path, n_members, offset);
+
+	pg_free(buf);
+	pfree(entries);
+}
+
+/*
+ * Parse name of pack file or of unfinished pack file.
+ */
+bool
+parse_wal_pack_name(const char *name, uint32 seg_size, TimeLineID *tli,
+					XLogSegNo *first_segno, XLogSegNo *last_segno)
+{
+	TimeLineID	last_tli;
+
+	if (!IsWalPackFileName(name) && !IsTempWalPackFileName(name))
+		return false;
+
+	GetXLogFromFileName(name, tli, first_segno, seg_size);
+	GetXLogFromFileName(name + XLOG_FNAME_LEN + 1, &last_tli, last_segno, seg_size);
+
+	return *tli == last_tli && *first_segno <= *last_segno;
+}
+
+/*
+ * Find pack file in archive_dir, which holds segment segno of timeline tli.
+ */
+bool
+find_wal_pack(const char *archive_dir, TimeLineID tli, XLogSegNo segno,
+			  uint32 seg_size, char *pack_path, fio_location location)
+{
+	DIR		   *dir;
+	struct dirent *dir_ent;
+	bool		found = false;
+
+	if (cached_pack_tli == tli &&
+		segno >= cached_pack_first && segno <= cached_pack_last &&
+		strncmp(cached_pack_path, archive_dir, strlen(archive_dir)) == 0)
+	{
+		strncpy(pack_path, cached_pack_path, MAXPGPATH);
+		return true;
+	}
+
+	dir = fio_opendir(archive_dir, location);
+	if (dir == NULL)
+		return false;
+
+	while ((dir_ent = fio_readdir(dir)))
+	{
+		TimeLineID	pack_tli;
+		XLogSegNo	first_segno;
+		XLogSegNo	last_segno;
+
+		if (!IsWalPackFileName(dir_ent->d_name) ||
+			!parse_wal_pack_name(dir_ent->d_name, seg_size, &pack_tli,
+								 &first_segno, &last_segno))
+			continue;
+
+		if (pack_tli != tli || segno < first_segno || segno > last_segno)
+			continue;
+
+		join_path_components(pack_path, archive_dir, dir_ent->d_name);
+
+		strncpy(cached_pack_path, pack_path, MAXPGPATH);
+		cached_pack_tli = tli;
+		cached_pack_first = first_segno;
+		cached_pack_last = last_segno;
+
+		found = true;
+		break;
+	}
+	fio_closedir(dir);
+
+	return found;
+}
+
+/*
+ * Read segment segno of timeline tli from pack file in archive_dir into buf,
+ * which must have room for seg_size bytes. Path of pack file is stored in
+ * pack_path.
+ *
+ * Returns false if segment cannot be read. errmsg is empty if there is no
+ * pack file with such segment, otherwise it describes the failure.
+ */
+bool
+get_wal_from_pack(const char *archive_dir, TimeLineID tli, XLogSegNo segno,
+				  uint32 seg_size, char *buf, char *pack_path,
+				  char *errmsg, size_t errmsg_len, fio_location location)
+{
+	errmsg[0] = '\0';
+
+	if (!find_wal_pack(archive_dir, tli, segno, seg_size, pack_path, location))
+		return false;
+
+	if (read_wal_pack_member(pack_path, segno, seg_size, buf,
+							 errmsg, errmsg_len, location))
+		return true;
+
+	/* Cached pack file may have been removed by retention, look again */
+	if (errno == ENOENT && cached_pack_tli != 0)
+	{
+		cached_pack_tli = 0;
+		errmsg[0] = '\0';
+
+		if (!find_wal_pack(archive_dir, tli, segno, seg_size, pack_path, location))
+			return false;
+
+		return read_wal_pack_member(pack_path, segno, seg_size, buf,
+									errmsg, errmsg_len, location);
+	}
+
+	return false;
+}
+
+/*
+ * Find segment segno of timeline tli in pack file in archive_dir without
+ * reading it, for readers which stream the member by themselves. Path of
+ * pack file is stored in pack_path.
+ *
+ * Returns false if segment cannot be found. errmsg is empty if there is no
+ * pack file with such segment, otherwise it describes the failure.
+ */
+bool
+locate_wal_in_pack(const char *archive_dir, TimeLineID tli, XLogSegNo segno,
+				   uint32 seg_size, char *pack_path, uint64 *offset,
+				   uint64 *size, bool *compressed, char *errmsg,
+				   size_t errmsg_len, fio_location location)
+{
+	WalPackEntry entry;
+	bool		retried = false;
+	int			fd;
+
+	errmsg[0] = '\0';
+
+	for (;;)
+	{
+		if (!find_wal_pack(archive_dir, tli, segno, seg_size, pack_path, location))
+			return false;
+
+		fd = fio_open(pack_path, O_RDONLY | PG_BINARY, location);
+		if (fd >= 0)
+			break;
+
+		/* Cached pack file may have been removed by retention, look again */
+		if (errno != ENOENT || retried || cached_pack_tli == 0)
+		{
+			snprintf(errmsg, errmsg_len, "%s", strerror(errno));
+			return false;
+		}
+		cached_pack_tli = 0;
+		retried = true;
+	}
+
+	if (!read_wal_pack_entry(fd, segno, &entry, errmsg, errmsg_len))
+	{
+		fio_close(fd);
+		return false;
+	}
+	fio_close(fd);
+
+	*offset = entry.offset;
+	*size = entry.size;
+	*compressed = (entry.flags & WAL_PACK_COMPRESSED) != 0;
+	return true;
+}
+
+/*
+ * Read index of pack file opened as fd and find entry of segment segno.
+ */
+static bool
+read_wal_pack_entry(int fd, XLogSegNo segno, WalPackEntry *entry,
+					char *errmsg, size_t errmsg_len)
+{
+	WalPackTrailer trailer;
+	WalPackEntry *entries = NULL;
+	size_t		index_size;
+	struct stat	st;
+	pg_crc32	crc;
+	uint32		i;
+	bool		found = false;
+
+	if (fio_fstat(fd, &st) < 0 ||
+		st.st_size < (off_t) sizeof(trailer) ||
+		fio_seek(fd, st.st_size - sizeof(trailer)) < 0 ||
+		fio_read(fd, &trailer, sizeof(trailer)) != (ssize_t) sizeof(trailer))
+	{
+		snprintf(errmsg, errmsg_len, "cannot read pack trailer");
+		return false;
+	}
+
+	index_size = sizeof(WalPackEntry) * trailer.n_entries;
+
+	if (trailer.magic != WAL_PACK_MAGIC ||
+		trailer.version != WAL_PACK_VERSION ||
+		index_size + sizeof(trailer) > (size_t) st.st_size)
+	{
+		snprintf(errmsg, errmsg_len, "invalid pack trailer");
+		return false;
+	}
+
+	entries = pgut_malloc(index_size);
+	if (fio_seek(fd, st.st_size - sizeof(trailer) - index_size) < 0 ||
+		fio_read(fd, entries, index_size) != (ssize_t) index_size)
+	{
+		snprintf(errmsg, errmsg_len, "cannot read pack index");
+		goto cleanup;
+	}
+
+	INIT_FILE_CRC32(true, crc);
+	COMP_FILE_CRC32(true, crc, entries, index_size);
+	COMP_FILE_CRC32(true, crc, &trailer, offsetof(WalPackTrailer, crc));
+	FIN_FILE_CRC32(true, crc);
+
+	if (!EQ_CRC32C(crc, trailer.crc))
+	{
+		snprintf(errmsg, errmsg_len, "pack index checksum mismatch");
+		goto cleanup;
+	}
+
+	for (i = 0; i < trailer.n_entries; i++)
+	{
+		if (entries[i].segno == segno)
+		{
+			*entry = entries[i];
+			found = true;
+			break;
+		}
+	}
+
+	if (!found)
+		snprintf(errmsg, errmsg_len, "segment is missing in pack index");
+
+cleanup:
+	pg_free(entries);
+	return found;
+}
+
+static bool
+read_wal_pack_member(const char *pack_path, XLogSegNo segno, uint32 seg_size,
+					 char *buf, char *errmsg, size_t errmsg_len,
+					 fio_location location)
+{
+	WalPackEntry entry_data;
+	WalPackEntry *entry = &entry_data;
+	char	   *member = NULL;
+	pg_crc32	crc;
+	int			fd;
+	bool		ok = false;
+
+	fd = fio_open(pack_path, O_RDONLY | PG_BINARY, location);
+	if (fd < 0)
+	{
+		snprintf(errmsg, errmsg_len, "%s", strerror(errno));
+		return false;
+	}
+
+	if (!read_wal_pack_entry(fd, segno, entry, errmsg, errmsg_len))
+		goto cleanup;
+
+	member = pgut_malloc(entry->size);
+	if (fio_seek(fd, entry->offset) < 0 ||
+		fio_read(fd, member, entry->size) != (ssize_t) entry->size)
+	{
+		snprintf(errmsg, errmsg_len, "cannot read pack member");
+		goto cleanup;
+	}
+
+	if (entry->flags & WAL_PACK_COMPRESSED)
+	{
+#ifdef HAVE_LIBZ
+		z_stream	z;
+		int			rc;
+
+		MemSet(&z, 0, sizeof(z));
+		/* 16 is added to windowBits to accept gzip header */
+		if (inflateInit2(&z, MAX_WBITS + 16) != Z_OK)
+		{
+			snprintf(errmsg, errmsg_len, "cannot initialize decompression");
+			goto cleanup;
+		}
+
+		z.next_in = (Bytef *) member;
+		z.avail_in = entry->size;
+		z.next_out = (Bytef *) buf;
+		z.avail_out = seg_size;
+
+		rc = inflate(&z, Z_FINISH);
+		inflateEnd(&z);
+
+		if (rc != Z_STREAM_END || z.total_out != seg_size)
+		{
+			snprintf(errmsg, errmsg_len, "cannot decompress pack member: %s",
+					 z.msg ? z.msg : "unexpected size");
+			goto cleanup;
+		}
+#else
+		snprintf(errmsg, errmsg_len, "zlib support is disabled");
+		goto cleanup;
+#endif
+	}
+	else
+	{
+		if (entry->size != seg_size)
+		{
+			snprintf(errmsg, errmsg_len, "unexpected pack member size " UINT64_FORMAT,
+					 entry->size);
+			goto cleanup;
+		}
+		memcpy(buf, member, seg_size);
+	}
+
+	INIT_FILE_CRC32(true, crc);
+	COMP_FILE_CRC32(true, crc, buf, seg_size);
+	FIN_FILE_CRC32(true, crc);
+
+	if (!EQ_CRC32C(crc, entry->wal_crc))
+	{
+		snprintf(errmsg, errmsg_len, "segment checksum mismatch");
+		goto cleanup;
+	}
+
+	ok = true;
+
+cleanup:
+	fio_close(fd);
+	pg_free(member);
+	/* errno is inspected by caller only if pack file cannot be opened */
+	if (!ok && errno == ENOENT)
+		errno = 0;
+	return ok;
+}
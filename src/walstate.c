@@ -0,0 +1,747 @@
+/*-------------------------------------------------------------------------
+ *
+ * walstate.c: cached listing of WAL archive.
+ *
+ * Listing of big WAL archive with stat() of every file takes a long time,
+ * while catalog_get_timelines() needs it for every show --archive, delete
+ * and backup. The listing is therefore cached in archive.state file in the
+ * archive directory:
+ *
+ *   # pg_probackup archive state
+ *   version = 1
+ *   generation = 5
+ *   prev-journal-offset = 1234
+ *   000000010000000000000001.gz 4194304
+ *   ...
+ *   # end 2
+ *
+ * Commands changing the archive append their changes to archive.journal
+ * after the change is made:
+ *
+ *   + 000000010000000000000003.gz 4194304
+ *   - 000000010000000000000001.gz
+ *
+ * The actual listing is the state file with both journals applied, the last
+ * change of a file wins. When journal grows large, it is renamed into
+ * archive.journal.<generation> and a new state file is written with the next
+ * generation. Changes appended to the renamed journal by commands, which
+ * opened it before rename, are picked up from prev-journal-offset. If state
+ * file is missing or cannot be trusted, the archive directory is scanned and
+ * the state file is rebuilt.
+ *
+ * Files added to or removed from the archive bypassing pg_probackup, e.g. by
+ * pg_receivewal, are not journaled, so the cache is used only if it is enabled
+ * by archive-state-cache option of the instance. Commands changing the archive
+ * with the option disabled remove the state file instead of journaling, so it
+ * is rebuilt when the option is enabled again.
+ *
+ * Portions Copyright (c) 2020, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#define WAL_STATE_FILE			"archive.state"
+#define WAL_STATE_LOCK_FILE		"archive.state.lock"
+#define WAL_STATE_JOURNAL_FILE	"archive.journal"
+#define WAL_STATE_VERSION		1
+
+/* Stale lock of crashed process is removed after this number of seconds */
+#define WAL_STATE_LOCK_TIMEOUT	600
+/* Journal is compacted into state file when it has so many changes */
+#define WAL_STATE_COMPACT_LINES	10000
+
+typedef enum WalStateResult
+{
+	WAL_STATE_OK,
+	WAL_STATE_INVALID,			/* archive directory must be scanned */
+	WAL_STATE_CHANGED			/* state was changed concurrently, retry */
+} WalStateResult;
+
+typedef struct WalStateHeader
+{
+	uint32		generation;
+	int64		prev_journal_offset;	/* -1 if there is no previous journal */
+} WalStateHeader;
+
+/* File of the listing or change from journal */
+typedef struct WalStateEntry
+{
+	char		name[MAXFNAMELEN];
+	int64		size;
+	uint32		seq;			/* order of change, 0 for state file entries */
+	bool		removed;
+} WalStateEntry;
+
+static char wal_state_lock_path[MAXPGPATH];
+
+static WalStateResult wal_state_read(const char *archive_dir, parray *entries,
+									 WalStateHeader *hdr, int64 *journal_end,
+									 uint32 *n_changes);
+static bool wal_state_read_header(const char *archive_dir, WalStateHeader *hdr);
+static bool wal_state_parse_header(char **cursor, WalStateHeader *hdr);
+static bool wal_state_apply_journal(const char *archive_dir, const char *name,
+									int64 offset, parray *entries, uint32 *seq,
+									int64 *journal_end);
+static void wal_state_fold(const char *archive_dir, parray *entries, parray *files);
+static void wal_state_scan(const char *archive_dir, parray *files, uint32 generation);
+static void wal_state_compact(const char *archive_dir, parray *files,
+							  WalStateHeader *hdr, int64 journal_end);
+static void wal_state_write(const char *archive_dir, parray *files,
+							uint32 generation, int64 prev_journal_offset);
+static void wal_state_journal(const char *path, const char *line);
+static bool wal_state_lock(const char *archive_dir);
+static void wal_state_unlock(void);
+static void wal_state_unlock_callback(bool fatal, void *userdata);
+static int	wal_state_entry_compare(const void *e1, const void *e2);
+
+/*
+ * Fill files with listing of WAL archive archive_dir sorted by path.
+ * If use_cache is false, the archive directory is just listed.
+ */
+void
+wal_state_list_archive(const char *archive_dir, parray *files, bool use_cache)
+{
+	WalStateHeader hdr;
+	WalStateResult rc = WAL_STATE_INVALID;
+	int			attempt;
+
+	if (!use_cache)
+	{
+		dir_list_file(files, archive_dir, false, false, false, 0, FIO_BACKUP_HOST);
+		parray_qsort(files, pgFileComparePath);
+		return;
+	}
+
+	MemSet(&hdr, 0, sizeof(hdr));
+
+	for (attempt = 0; attempt < 3; attempt++)
+	{
+		parray	   *entries = parray_new();
+		int64		journal_end = 0;
+		uint32		n_changes = 0;
+
+		rc = wal_state_read(archive_dir, entries, &hdr, &journal_end, &n_changes);
+
+		if (rc == WAL_STATE_OK)
+		{
+			wal_state_fold(archive_dir, entries, files);
+
+			if (n_changes >= WAL_STATE_COMPACT_LINES)
+				wal_state_compact(archive_dir, files, &hdr, journal_end);
+		}
+
+		parray_walk(entries, pfree);
+		parray_free(entries);
+
+		if (rc != WAL_STATE_CHANGED)
+			break;
+	}
+
+	if (rc == WAL_STATE_OK)
+		return;
+
+	elog(LOG, "Archive state of \"%s\" is missing or outdated, scan archive directory",
+		 archive_dir);
+	wal_state_scan(archive_dir, files, hdr.generation);
+}
+
+/*
+ * Record that file was added to the archive or overwritten. If size is
+ * negative, it is taken from the file.
+ */
+void
+wal_state_add(const char *path, int64 size)
+{
+	char		line[MAXPGPATH];
+
+	if (size < 0)
+	{
+		struct stat st;
+
+		if (fio_stat(path, &st, true, FIO_BACKUP_HOST) < 0)
+		{
+			/* the file is gone already, nothing to record */
+			if (errno == ENOENT)
+				return;
+			st.st_size = 0;
+		}
+		size = st.st_size;
+	}
+
+	snprintf(line, sizeof(line), "+ %s " INT64_FORMAT "\n",
+			 last_dir_separator(path) + 1, size);
+	wal_state_journal(path, line);
+}
+
+/*
+ * Record that file was removed from the archive.
+ */
+void
+wal_state_remove(const char *path)
+{
+	char		line[MAXPGPATH];
+
+	snprintf(line, sizeof(line), "- %s\n", last_dir_separator(path) + 1);
+	wal_state_journal(path, line);
+}
+
+/*
+ * Append line to the journal of archive, where path is located.
+ * If the change cannot be recorded or the cache is disabled, state file
+ * is removed, so the next reader scans the archive directory.
+ */
+static void
+wal_state_journal(const char *path, const char *line)
+{
+	char		archive_dir[MAXPGPATH];
+	char		journal_path[MAXPGPATH];
+	ssize_t		len = strlen(line);
+	int			fd;
+
+	strncpy(archive_dir, path, MAXPGPATH);
+	get_parent_directory(archive_dir);
+
+	if (!instance_config.archive_state_cache)
+	{
+		join_path_components(journal_path, archive_dir, WAL_STATE_FILE);
+		fio_unlink(journal_path, FIO_BACKUP_HOST);
+		return;
+	}
+
+	join_path_components(journal_path, archive_dir, WAL_STATE_JOURNAL_FILE);
+
+	fd = fio_open(journal_path, O_WRONLY | O_CREAT | O_APPEND | PG_BINARY,
+				  FIO_BACKUP_HOST);
+	if (fd >= 0)
+	{
+		bool		written = fio_write(fd, line, len) == len;
+
+		if (fio_close(fd) == 0 && written)
+			return;
+	}
+
+	elog(WARNING, "Cannot write archive journal \"%s\": %s",
+		 journal_path, strerror(errno));
+
+	join_path_components(journal_path, archive_dir, WAL_STATE_FILE);
+	fio_unlink(journal_path, FIO_BACKUP_HOST);
+}
+
+/*
+ * Read state file and journals into entries. n_changes is the number of
+ * changes read from journals, journal_end is the read position in the
+ * current journal.
+ */
+static WalStateResult
+wal_state_read(const char *archive_dir, parray *entries, WalStateHeader *hdr,
+			   int64 *journal_end, uint32 *n_changes)
+{
+	WalStateHeader recheck;
+	char	   *buf;
+	char	   *cursor;
+	char		journal_name[MAXFNAMELEN];
+	char		path[MAXPGPATH];
+	uint32		n_entries = 0;
+	uint32		seq = 0;
+	bool		renamed;
+
+	buf = slurpFile(archive_dir, WAL_STATE_FILE, NULL, true, FIO_BACKUP_HOST);
+	if (buf == NULL)
+		return WAL_STATE_INVALID;
+
+	cursor = buf;
+	if (!wal_state_parse_header(&cursor, hdr))
+		goto invalid;
+
+	while (*cursor != '\0')
+	{
+		char	   *eol = strchr(cursor, '\n');
+		WalStateEntry *entry;
+		uint32		n_expected;
+
+		if (eol == NULL)
+			goto invalid;
+		*eol = '\0';
+
+		if (sscanf(cursor, "# end %u", &n_expected) == 1)
+		{
+			if (n_expected != n_entries)
+				goto invalid;
+			break;
+		}
+
+		entry = palloc0(sizeof(WalStateEntry));
+		if (sscanf(cursor, "%63s " INT64_FORMAT, entry->name, &entry->size) != 2)
+		{
+			pfree(entry);
+			goto invalid;
+		}
+		parray_append(entries, entry);
+		n_entries++;
+
+		cursor = eol + 1;
+	}
+
+	/* state file must be complete */
+	if (*cursor == '\0')
+		goto invalid;
+	pg_free(buf);
+
+	/* changes which were appended to journal after it was compacted */
+	if (hdr->generation > 0 && hdr->prev_journal_offset >= 0)
+	{
+		snprintf(journal_name, MAXFNAMELEN, "%s.%u",
+				 WAL_STATE_JOURNAL_FILE, hdr->generation - 1);
+		if (!wal_state_apply_journal(archive_dir, journal_name,
+									 hdr->prev_journal_offset, entries,
+									 &seq, journal_end))
+			return WAL_STATE_INVALID;
+	}
+
+	/*
+	 * Current journal may be renamed by concurrent compaction, which has not
+	 * written new state file yet. Then both journals are needed.
+	 */
+	snprintf(journal_name, MAXFNAMELEN, "%s.%u",
+			 WAL_STATE_JOURNAL_FILE, hdr->generation);
+	join_path_components(path, archive_dir, journal_name);
+	renamed = fio_access(path, F_OK, FIO_BACKUP_HOST) == 0;
+
+	if (renamed &&
+		!wal_state_apply_journal(archive_dir, journal_name, 0, entries,
+								 &seq, journal_end))
+		return WAL_STATE_INVALID;
+
+	*journal_end = 0;
+	if (!wal_state_apply_journal(archive_dir, WAL_STATE_JOURNAL_FILE, 0,
+								 entries, &seq, journal_end))
+		return WAL_STATE_INVALID;
+
+	*n_changes = seq;
+
+	/* Make sure that journals were not switched while we were reading them */
+	if (!wal_state_read_header(archive_dir, &recheck) ||
+		recheck.generation != hdr->generation ||
+		renamed != (fio_access(path, F_OK, FIO_BACKUP_HOST) == 0))
+		return WAL_STATE_CHANGED;
+
+	/* Compaction is in progress, leave it alone */
+	if (renamed)
+		*n_changes = 0;
+
+	return WAL_STATE_OK;
+
+invalid:
+	elog(WARNING, "Archive state file \"%s/%s\" is corrupted, ignore it",
+		 archive_dir, WAL_STATE_FILE);
+	pg_free(buf);
+	return WAL_STATE_INVALID;
+}
+
+/*
+ * Read only the header of state file.
+ */
+static bool
+wal_state_read_header(const char *archive_dir, WalStateHeader *hdr)
+{
+	char		path[MAXPGPATH];
+	char		buf[256];
+	char	   *cursor = buf;
+	ssize_t		len;
+	int			fd;
+
+	join_path_components(path, archive_dir, WAL_STATE_FILE);
+
+	fd = fio_open(path, O_RDONLY | PG_BINARY, FIO_BACKUP_HOST);
+	if (fd < 0)
+		return false;
+
+	len = fio_read(fd, buf, sizeof(buf) - 1);
+	fio_close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+
+	return wal_state_parse_header(&cursor, hdr);
+}
+
+/*
+ * Parse header lines of state file, cursor is moved to the first entry.
+ */
+static bool
+wal_state_parse_header(char **cursor, WalStateHeader *hdr)
+{
+	uint32		version;
+	int			consumed = 0;
+
+	if (sscanf(*cursor,
+			   "# pg_probackup archive state\n"
+			   "version = %u\n"
+			   "generation = %u\n"
+			   "prev-journal-offset = " INT64_FORMAT "\n%n",
+			   &version, &hdr->generation, &hdr->prev_journal_offset,
+			   &consumed) != 3 || consumed == 0)
+		return false;
+
+	if (version != WAL_STATE_VERSION)
+		return false;
+
+	*cursor += consumed;
+	return true;
+}
+
+/*
+ * Apply changes from journal starting with offset. Missing journal has no
+ * changes. Returns false if journal is corrupted.
+ */
+static bool
+wal_state_apply_journal(const char *archive_dir, const char *name,
+						int64 offset, parray *entries, uint32 *seq,
+						int64 *journal_end)
+{
+	char	   *buf;
+	char	   *cursor;
+	size_t		size;
+
+	buf = slurpFile(archive_dir, name, &size, true, FIO_BACKUP_HOST);
+	if (buf == NULL)
+		return true;
+
+	if ((size_t) offset > size)
+	{
+		pg_free(buf);
+		return true;
+	}
+
+	cursor = buf + offset;
+	while (*cursor != '\0')
+	{
+		char	   *eol = strchr(cursor, '\n');
+		WalStateEntry *entry;
+
+		if (eol == NULL)
+			goto corrupted;
+		*eol = '\0';
+
+		entry = palloc0(sizeof(WalStateEntry));
+		entry->seq = ++(*seq);
+
+		if (cursor[0] == '+' &&
+			sscanf(cursor, "+ %63s " INT64_FORMAT, entry->name, &entry->size) == 2)
+			entry->removed = false;
+		else if (cursor[0] == '-' &&
+				 sscanf(cursor, "- %63s", entry->name) == 1)
+			entry->removed = true;
+		else
+		{
+			pfree(entry);
+			goto corrupted;
+		}
+
+		parray_append(entries, entry);
+		cursor = eol + 1;
+	}
+
+	*journal_end = size;
+	pg_free(buf);
+	return true;
+
+corrupted:
+	elog(WARNING, "Archive journal \"%s/%s\" is corrupted, ignore it",
+		 archive_dir, name);
+	pg_free(buf);
+	return false;
+}
+
+/*
+ * Turn entries of state file and journal changes into sorted list of files.
+ */
+static void
+wal_state_fold(const char *archive_dir, parray *entries, parray *files)
+{
+	int			i;
+
+	parray_qsort(entries, wal_state_entry_compare);
+
+	for (i = 0; i < parray_num(entries); i++)
+	{
+		WalStateEntry *entry = (WalStateEntry *) parray_get(entries, i);
+		char		path[MAXPGPATH];
+		pgFile	   *file;
+
+		/* the last change of the file wins */
+		if (i + 1 < parray_num(entries) &&
+			strcmp(entry->name, ((WalStateEntry *) parray_get(entries, i + 1))->name) == 0)
+			continue;
+
+		if (entry->removed)
+			continue;
+
+		join_path_components(path, archive_dir, entry->name);
+		file = pgFileInit(path, entry->name);
+		file->size = entry->size;
+		file->mode = S_IFREG;
+		parray_append(files, file);
+	}
+}
+
+/*
+ * Scan archive directory and rebuild state file, if nobody else does it.
+ */
+static void
+wal_state_scan(const char *archive_dir, parray *files, uint32 generation)
+{
+	char		journal_path[MAXPGPATH];
+	char		renamed_path[MAXPGPATH];
+	bool		locked = wal_state_lock(archive_dir);
+	int			i;
+
+	/*
+	 * Changes recorded after this point go to the new journal. Changes
+	 * recorded before are made before the scan and will be seen by it.
+	 */
+	if (locked)
+	{
+		join_path_components(journal_path, archive_dir, WAL_STATE_JOURNAL_FILE);
+		snprintf(renamed_path, MAXPGPATH, "%s.%u", journal_path, generation);
+
+		if (fio_rename(journal_path, renamed_path, FIO_BACKUP_HOST) < 0 &&
+			errno != ENOENT)
+		{
+			elog(WARNING, "Cannot rename file \"%s\" to \"%s\": %s",
+				 journal_path, renamed_path, strerror(errno));
+			wal_state_unlock();
+			locked = false;
+		}
+	}
+
+	dir_list_file(files, archive_dir, false, false, false, 0, FIO_BACKUP_HOST);
+	parray_qsort(files, pgFileComparePath);
+
+	if (!locked)
+		return;
+
+	wal_state_write(archive_dir, files, generation + 1, -1);
+
+	/* journals of previous generations are not needed anymore */
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		uint32		journal_generation;
+
+		if (sscanf(file->name, WAL_STATE_JOURNAL_FILE ".%u", &journal_generation) == 1 &&
+			journal_generation != generation)
+			fio_unlink(file->path, FIO_BACKUP_HOST);
+	}
+
+	wal_state_unlock();
+}
+
+/*
+ * Write listing read from state file and journal into the state file of
+ * the next generation and start new journal.
+ */
+static void
+wal_state_compact(const char *archive_dir, parray *files, WalStateHeader *hdr,
+				  int64 journal_end)
+{
+	WalStateHeader current;
+	char		journal_path[MAXPGPATH];
+	char		renamed_path[MAXPGPATH];
+
+	if (!wal_state_lock(archive_dir))
+		return;
+
+	/* somebody has already done it */
+	if (!wal_state_read_header(archive_dir, &current) ||
+		current.generation != hdr->generation)
+	{
+		wal_state_unlock();
+		return;
+	}
+
+	join_path_components(journal_path, archive_dir, WAL_STATE_JOURNAL_FILE);
+	snprintf(renamed_path, MAXPGPATH, "%s.%u", journal_path, hdr->generation);
+
+	if (fio_rename(journal_path, renamed_path, FIO_BACKUP_HOST) < 0)
+	{
+		wal_state_unlock();
+		return;
+	}
+
+	wal_state_write(archive_dir, files, hdr->generation + 1, journal_end);
+
+	if (hdr->generation > 0)
+	{
+		snprintf(renamed_path, MAXPGPATH, "%s.%u", journal_path,
+				 hdr->generation - 1);
+		fio_unlink(renamed_path, FIO_BACKUP_HOST);
+	}
+
+	wal_state_unlock();
+
+	elog(LOG, "Archive journal \"%s\" is compacted", journal_path);
+}
+
+/*
+ * Write state file, it is not synced, since it can be rebuilt any time.
+ */
+static void
+wal_state_write(const char *archive_dir, parray *files, uint32 generation,
+				int64 prev_journal_offset)
+{
+	char		path[MAXPGPATH];
+	char		path_temp[MAXPGPATH];
+	FILE	   *out;
+	char	   *buf;
+	size_t		write_len = 0;
+	uint32		n_entries = 0;
+	int			i;
+
+	join_path_components(path, archive_dir, WAL_STATE_FILE);
+	snprintf(path_temp, sizeof(path_temp), "%s.part", path);
+
+	out = fio_fopen(path_temp, PG_BINARY_W, FIO_BACKUP_HOST);
+	if (out == NULL)
+	{
+		elog(WARNING, "Cannot open archive state file \"%s\": %s",
+			 path_temp, strerror(errno));
+		return;
+	}
+
+	buf = pgut_malloc(STDIO_BUFSIZE);
+
+	write_len = snprintf(buf, STDIO_BUFSIZE,
+						 "# pg_probackup archive state\n"
+						 "version = %u\n"
+						 "generation = %u\n"
+						 "prev-journal-offset = " INT64_FORMAT "\n",
+						 WAL_STATE_VERSION, generation, prev_journal_offset);
+
+	for (i = 0; i <= parray_num(files); i++)
+	{
+		char		line[MAXPGPATH];
+		int			len;
+
+		if (i < parray_num(files))
+		{
+			pgFile	   *file = (pgFile *) parray_get(files, i);
+
+			if (!S_ISREG(file->mode) || IsWalStateFileName(file->name))
+				continue;
+
+			len = snprintf(line, sizeof(line), "%s " INT64_FORMAT "\n",
+						   file->name, file->size);
+			n_entries++;
+		}
+		else
+			len = snprintf(line, sizeof(line), "# end %u\n", n_entries);
+
+		if (write_len + len >= STDIO_BUFSIZE)
+		{
+			if (fio_fwrite(out, buf, write_len) != write_len)
+				goto error;
+			write_len = 0;
+		}
+
+		memcpy(buf + write_len, line, len);
+		write_len += len;
+	}
+
+	if (fio_fwrite(out, buf, write_len) != write_len ||
+		fio_fflush(out) != 0)
+		goto error;
+
+	if (fio_fclose(out) != 0)
+	{
+		out = NULL;
+		goto error;
+	}
+	pg_free(buf);
+
+	if (fio_rename(path_temp, path, FIO_BACKUP_HOST) < 0)
+	{
+		elog(WARNING, "Cannot rename file \"%s\" to \"%s\": %s",
+			 path_temp, path, strerror(errno));
+		fio_unlink(path_temp, FIO_BACKUP_HOST);
+	}
+	return;
+
+error:
+	elog(WARNING, "Cannot write archive state file \"%s\": %s",
+		 path_temp, strerror(errno));
+	if (out)
+		fio_fclose(out);
+	fio_unlink(path_temp, FIO_BACKUP_HOST);
+	pg_free(buf);
+}
+
+/*
+ * Only one process at a time rebuilds or compacts the state file.
+ */
+static bool
+wal_state_lock(const char *archive_dir)
+{
+	int			attempt;
+
+	join_path_components(wal_state_lock_path, archive_dir, WAL_STATE_LOCK_FILE);
+
+	for (attempt = 0; attempt < 2; attempt++)
+	{
+		struct stat st;
+		int			fd;
+
+		fd = fio_open(wal_state_lock_path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY,
+					  FIO_BACKUP_HOST);
+		if (fd >= 0)
+		{
+			fio_close(fd);
+			pgut_atexit_push(wal_state_unlock_callback, NULL);
+			return true;
+		}
+
+		if (errno != EEXIST ||
+			fio_stat(wal_state_lock_path, &st, true, FIO_BACKUP_HOST) < 0 ||
+			time(NULL) - st.st_mtime < WAL_STATE_LOCK_TIMEOUT)
+			break;
+
+		elog(WARNING, "Remove stale lock file \"%s\"", wal_state_lock_path);
+		fio_unlink(wal_state_lock_path, FIO_BACKUP_HOST);
+	}
+
+	return false;
+}
+
+static void
+wal_state_unlock(void)
+{
+	fio_unlink(wal_state_lock_path, FIO_BACKUP_HOST);
+	pgut_atexit_pop(wal_state_unlock_callback, NULL);
+}
+
+static void
+wal_state_unlock_callback(bool fatal, void *userdata)
+{
+	fio_unlink(wal_state_lock_path, FIO_BACKUP_HOST);
+}
+
+/*
+ * Compare entries by name, then by order of change.
+ */
+static int
+wal_state_entry_compare(const void *e1, const void *e2)
+{
+	WalStateEntry *entry1 = *(WalStateEntry **) e1;
+	WalStateEntry *entry2 = *(WalStateEntry **) e2;
+	int			rc = strcmp(entry1->name, entry2->name);
+
+	if (rc != 0)
+		return rc;
+
+	return (entry1->seq > entry2->seq) - (entry1->seq < entry2->seq);
+}
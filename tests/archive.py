@@ -1,6 +1,7 @@
 import os
 import shutil
 import gzip
+import stat
 import unittest
 from .helpers.ptrack_helpers import ProbackupTest, ProbackupException, GdbException
 from datetime import datetime, timedelta
@@ -435,6 +436,142 @@ class ArchiveTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_archive_push_checksum_file(self):
+        """
+        Check that checksum file is written for every archived WAL segment
+        and is used to detect duplicates, corrupted checksum file is ignored
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=2)
+        self.switch_wal_segment(node)
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        segments = sorted(
+            f[:24] for f in os.listdir(wals_dir)
+            if len(f) in (24, 27) and not f.endswith('.crc'))
+
+        self.assertTrue(segments)
+        for segment in segments:
+            self.assertTrue(
+                os.path.exists(os.path.join(wals_dir, segment + '.crc')),
+                'Checksum file is missing for WAL segment {0}'.format(segment))
+
+        if self.get_version(node) < 100000:
+            wal_dir = os.path.join(node.data_dir, 'pg_xlog')
+        else:
+            wal_dir = os.path.join(node.data_dir, 'pg_wal')
+
+        # segment which is both archived and still present in pg_wal
+        filename = [f for f in segments if f in os.listdir(wal_dir)][-1]
+        checksum_file = os.path.join(wals_dir, filename + '.crc')
+
+        cmdline = [
+            self.probackup_path, 'archive-push', '-B', backup_dir,
+            '--instance=node', '--wal-file-name={0}'.format(filename),
+            '--log-level-console=verbose']
+        if self.archive_compress:
+            cmdline.append('--compress')
+
+        # push already archived segment, checksum file is used
+        output = subprocess.check_output(
+            cmdline, cwd=node.data_dir, env=self.test_env,
+            stderr=subprocess.STDOUT).decode('utf-8')
+
+        self.assertIn(
+            'WAL file already exists in archive with the same checksum',
+            output)
+        self.assertNotIn('is corrupted', output)
+
+        # corrupted checksum file is ignored
+        with open(checksum_file, 'r+b') as f:
+            f.seek(8)
+            f.write(b'garbage')
+            f.flush()
+
+        output = subprocess.check_output(
+            cmdline, cwd=node.data_dir, env=self.test_env,
+            stderr=subprocess.STDOUT).decode('utf-8')
+
+        self.assertIn(
+            'WAL checksum file "{0}" is corrupted'.format(checksum_file),
+            output)
+        self.assertIn(
+            'WAL file already exists in archive with the same checksum',
+            output)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_push_group_commit(self):
+        """
+        Check that batch of WAL files is committed into archive
+        as a group and ready files are renamed after that
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node)
+
+        # accumulate several ready files
+        self.set_auto_conf(node, {'archive_command': 'exit 1'})
+        node.reload()
+
+        for i in range(5):
+            node.safe_psql(
+                'postgres',
+                'create table t_{0} as select i from '
+                'generate_series(0,10000) i'.format(i))
+            self.switch_wal_segment(node)
+
+        self.set_archiving(backup_dir, 'node', node)
+        node.reload()
+        self.switch_wal_segment(node)
+        sleep(5)
+
+        with open(os.path.join(node.logs_dir, 'postgresql.log'), 'r') as f:
+            log_content = f.read()
+            self.assertRegex(log_content, r'Commit \d+ WAL files into archive')
+
+        if self.get_version(node) < 100000:
+            status_dir = os.path.join(node.data_dir, 'pg_xlog', 'archive_status')
+        else:
+            status_dir = os.path.join(node.data_dir, 'pg_wal', 'archive_status')
+
+        self.assertFalse(
+            [f for f in os.listdir(status_dir) if f.endswith('.ready')])
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        self.assertFalse(
+            [f for f in os.listdir(wals_dir) if f.endswith('.part')])
+
+        self.backup_node(backup_dir, 'node', node, backup_type='page')
+        self.validate_pb(backup_dir)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_archive_push_file_exists_overwrite(self):
         """Archive-push if file exists"""
@@ -1923,6 +2060,266 @@ class ArchiveTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_archive_push_daemon(self):
+        """
+        Check that archive-push hands WAL segments over to
+        archive-push daemon and pushes them itself when
+        the daemon is not running
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+
+        socket_path = os.path.join('/tmp', 'pg_probackup_{0}.sock'.format(fname))
+        self.set_archiving(backup_dir, 'node', node, socket=socket_path)
+
+        daemon_cmd = [
+            self.probackup_path, 'archive-push', '-B', backup_dir,
+            '--instance=node', '--daemon',
+            '--socket={0}'.format(socket_path),
+            '-j', '2', '--batch-size', '5', '--no-sync']
+        if self.archive_compress:
+            daemon_cmd.append('--compress')
+
+        daemon_log_path = os.path.join(backup_dir, 'daemon.log')
+        with open(daemon_log_path, 'w') as daemon_log:
+            daemon = subprocess.Popen(
+                daemon_cmd, stdout=daemon_log, stderr=subprocess.STDOUT,
+                env=self.test_env)
+
+        while not os.path.exists(socket_path):
+            self.assertIsNone(daemon.poll(), 'archive-push daemon has exited')
+            sleep(0.1)
+
+        # only owner may connect
+        self.assertEqual(os.stat(socket_path).st_mode & 0o777, 0o600)
+
+        node.slow_start()
+        node.pgbench_init(scale=5)
+
+        self.backup_node(backup_dir, 'node', node)
+
+        with open(os.path.join(node.logs_dir, 'postgresql.log'), 'r') as f:
+            log_content = f.read()
+            self.assertIn('is pushed by archive-push daemon', log_content)
+
+        daemon.terminate()
+        daemon.wait()
+        self.assertFalse(os.path.exists(socket_path))
+
+        with open(daemon_log_path, 'r') as f:
+            daemon_log_content = f.read()
+            self.assertIn('archive-push daemon pushed WAL file', daemon_log_content)
+            self.assertIn('archive-push daemon is stopped', daemon_log_content)
+
+        # daemon is not running, WAL is pushed by archive-push itself
+        node.pgbench_init(scale=2)
+        self.backup_node(backup_dir, 'node', node)
+
+        with open(os.path.join(node.logs_dir, 'postgresql.log'), 'r') as f:
+            log_content = f.read()
+            self.assertIn('Cannot connect to archive-push daemon', log_content)
+
+        self.validate_pb(backup_dir)
+
+        # daemon must not remove a file, which is not a socket
+        with open(socket_path, 'w') as f:
+            f.write('not a socket')
+            f.flush()
+            f.close
+
+        try:
+            self.run_pb([
+                'archive-push', '-B', backup_dir, '--instance=node',
+                '--daemon', '--socket={0}'.format(socket_path)])
+            # we should die here because exception is what we expect to happen
+            self.assertEqual(
+                1, 0,
+                "Expecting Error because socket path is a regular file.\n "
+                "Output: {0} \n CMD: {1}".format(
+                    repr(self.output), self.cmd))
+        except ProbackupException as e:
+            self.assertIn(
+                'file exists and is not a socket', e.message,
+                '\n Unexpected Error Message: {0}\n CMD: {1}'.format(
+                    repr(e.message), self.cmd))
+
+        self.assertTrue(os.path.isfile(socket_path))
+        os.remove(socket_path)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_push_daemon_options_mismatch(self):
+        """
+        Check that archive-push daemon rejects requests of archive-push
+        run with other options and archive-push pushes WAL itself
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+
+        socket_path = os.path.join('/tmp', 'pg_probackup_{0}.sock'.format(fname))
+        self.set_archiving(
+            backup_dir, 'node', node, overwrite=True, socket=socket_path)
+
+        # daemon is run without --overwrite
+        daemon_cmd = [
+            self.probackup_path, 'archive-push', '-B', backup_dir,
+            '--instance=node', '--daemon',
+            '--socket={0}'.format(socket_path)]
+        if self.archive_compress:
+            daemon_cmd.append('--compress')
+
+        daemon_log_path = os.path.join(backup_dir, 'daemon.log')
+        with open(daemon_log_path, 'w') as daemon_log:
+            daemon = subprocess.Popen(
+                daemon_cmd, stdout=daemon_log, stderr=subprocess.STDOUT,
+                env=self.test_env)
+
+        while not os.path.exists(socket_path):
+            self.assertIsNone(daemon.poll(), 'archive-push daemon has exited')
+            sleep(0.1)
+
+        node.slow_start()
+        node.pgbench_init(scale=2)
+
+        self.backup_node(backup_dir, 'node', node)
+
+        daemon.terminate()
+        daemon.wait()
+
+        with open(os.path.join(node.logs_dir, 'postgresql.log'), 'r') as f:
+            log_content = f.read()
+            self.assertIn('archive-push daemon has rejected WAL file', log_content)
+            self.assertNotIn('is pushed by archive-push daemon', log_content)
+
+        with open(daemon_log_path, 'r') as f:
+            daemon_log_content = f.read()
+            self.assertIn('option --overwrite is not set for the daemon', daemon_log_content)
+            self.assertNotIn('archive-push daemon pushed WAL file', daemon_log_content)
+
+        self.validate_pb(backup_dir)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_push_daemon_recovery_index_mismatch(self):
+        """
+        Check that archive-push daemon rejects requests of archive-push
+        run with --recovery-index and the client writes index itself
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+
+        socket_path = os.path.join('/tmp', 'pg_probackup_{0}.sock'.format(fname))
+        self.set_archiving(
+            backup_dir, 'node', node, recovery_index=True, socket=socket_path)
+
+        # daemon is run without --recovery-index
+        daemon_cmd = [
+            self.probackup_path, 'archive-push', '-B', backup_dir,
+            '--instance=node', '--daemon', '--no-sync',
+            '--socket={0}'.format(socket_path)]
+        if self.archive_compress:
+            daemon_cmd.append('--compress')
+
+        daemon_log_path = os.path.join(backup_dir, 'daemon.log')
+        with open(daemon_log_path, 'w') as daemon_log:
+            daemon = subprocess.Popen(
+                daemon_cmd, stdout=daemon_log, stderr=subprocess.STDOUT,
+                env=self.test_env)
+
+        while not os.path.exists(socket_path):
+            self.assertIsNone(daemon.poll(), 'archive-push daemon has exited')
+            sleep(0.1)
+
+        node.slow_start()
+        self.switch_wal_segment(node)
+
+        daemon.terminate()
+        daemon.wait()
+
+        with open(daemon_log_path, 'r') as f:
+            self.assertIn(
+                'option --recovery-index is not set for the daemon', f.read())
+
+        wal_dir = os.path.join(backup_dir, 'wal', 'node')
+        self.assertTrue(
+            [f for f in os.listdir(wal_dir) if f.endswith('.ridx')],
+            'No recovery target indexes in archive')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_archive_push_parallel_compression(self):
+        """
+        Check that single WAL segment is compressed by several
+        threads and is readable by archive-get and validate
+        """
+        if not self.archive_compress:
+            return unittest.skip(
+                'You need to enable ARCHIVE_COMPRESSION for this test to run')
+
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node)
+
+        node.pgbench_init(scale=5)
+        pgdata = self.pgdata_content(node.data_dir)
+        self.switch_wal_segment(node)
+
+        with open(os.path.join(node.logs_dir, 'postgresql.log'), 'r') as f:
+            log_content = f.read()
+            self.assertRegex(
+                log_content, r'Compressing WAL file ".*" using \d+ threads')
+
+        self.validate_pb(backup_dir, 'node')
+
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+
+        node.slow_start()
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.expectedFailure
     # @unittest.skip("skip")
     def test_archive_pg_receivexlog_partial_handling(self):
@@ -2209,6 +2606,371 @@ class ArchiveTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    def test_archive_get_async_prefetch(self):
+        """
+        Make sure that background prefetch worker is started
+        and WAL segments prefetched by it are used by archive-get.
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'autovacuum': 'off'})
+
+        if self.get_version(node) < self.version_to_num('9.6.0'):
+            self.del_test_dir(module_name, fname)
+            return unittest.skip(
+                'Skipped because backup from replica is not supported in PG 9.5')
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node, options=['--stream'])
+
+        node.pgbench_init(scale=50)
+
+        replica = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'replica'))
+        replica.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', replica, replica.data_dir)
+        self.set_replica(node, replica, log_shipping=True)
+
+        if node.major_version >= 12:
+            self.set_auto_conf(replica, {'restore_command': 'exit 1'})
+        else:
+            replica.append_conf('recovery.conf', "restore_command = 'exit 1'")
+
+        replica.slow_start(replica=True)
+
+        # at this point replica is consistent
+        restore_command = self.get_restore_command(backup_dir, 'node', replica)
+
+        restore_command += ' -j 2 --batch-size=5 --async-prefetch --log-level-console=LOG'
+
+        if node.major_version >= 12:
+            self.set_auto_conf(replica, {'restore_command': restore_command})
+        else:
+            replica.append_conf(
+                'recovery.conf', "restore_command = '{0}'".format(restore_command))
+
+        replica.restart()
+
+        sleep(10)
+
+        with open(os.path.join(replica.logs_dir, 'postgresql.log'), 'r') as f:
+            postgres_log_content = f.read()
+
+        self.assertIn('Started prefetch worker', postgres_log_content)
+        self.assertIn(
+            'prefetched by background worker', postgres_log_content)
+
+        # segments are copied into staging directory of the worker
+        if self.get_version(node) < 100000:
+            wal_dir = os.path.join(replica.data_dir, 'pg_xlog')
+        else:
+            wal_dir = os.path.join(replica.data_dir, 'pg_wal')
+
+        self.assertTrue(
+            os.path.isdir(os.path.join(wal_dir, 'pbk_prefetch', 'pbk_staging')))
+
+        # requests are passed to the worker through FIFO
+        self.assertTrue(stat.S_ISFIFO(os.stat(
+            os.path.join(wal_dir, 'pbk_prefetch', 'prefetch.fifo')).st_mode))
+        self.assertFalse(
+            os.path.exists(os.path.join(wal_dir, 'pbk_prefetch', 'prefetch.request')))
+
+        replica.stop()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def test_archive_pack(self):
+        """
+        Make sure that packed WAL segments are used by
+        validate and restore and purged by retention.
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+
+        node.slow_start()
+
+        full_id = self.backup_node(backup_dir, 'node', node)
+
+        node.pgbench_init(scale=5)
+        for i in range(6):
+            self.switch_wal_segment(node)
+
+        target_lsn = node.safe_psql(
+            'postgres', 'SELECT pg_current_wal_lsn()' if
+            self.get_version(node) >= 100000 else
+            'SELECT pg_current_xlog_location()').rstrip()
+        pgdata = self.pgdata_content(node.data_dir)
+        self.switch_wal_segment(node)
+        node.stop()
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        tli_before = self.show_archive(backup_dir, 'node', tli=1)
+
+        output = self.run_pb([
+            'archive-pack', '-B', backup_dir,
+            '--instance=node', '--pack-size=2'])
+        self.assertIn('is packed, pack files created', output)
+
+        packs = [f for f in os.listdir(wals_dir) if f.endswith('.pack')]
+        self.assertTrue(packs)
+
+        # packed segments are not kept loose anymore
+        for pack in packs:
+            first, last = pack[:-len('.pack')].split('-')
+            self.assertFalse(os.path.exists(os.path.join(wals_dir, first + '.gz')))
+            self.assertFalse(os.path.exists(os.path.join(wals_dir, last + '.gz')))
+
+        # archive is still contiguous
+        tli_after = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(tli_before['min-segno'], tli_after['min-segno'])
+        self.assertEqual(tli_before['max-segno'], tli_after['max-segno'])
+        self.assertEqual(tli_before['n-segments'], tli_after['n-segments'])
+        self.assertFalse(tli_after['lost-segments'])
+
+        self.validate_pb(
+            backup_dir, 'node',
+            options=['--recovery-target-lsn={0}'.format(target_lsn)])
+
+        # restore fetches WAL from pack files via archive-get
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored,
+            options=[
+                '--recovery-target-lsn={0}'.format(target_lsn),
+                '--recovery-target-action=promote'])
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+        node_restored.stop()
+
+        # pack files are purged like loose segments
+        node.slow_start()
+        self.backup_node(backup_dir, 'node', node)
+        self.delete_pb(backup_dir, 'node', full_id)
+        self.delete_pb(backup_dir, 'node', options=['--delete-wal'])
+
+        for pack in packs:
+            self.assertFalse(os.path.exists(os.path.join(wals_dir, pack)))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def test_archive_state_cache(self):
+        """
+        Make sure that cached archive listing follows archive-push
+        and WAL purge, and is rebuilt when removed.
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+
+        node.slow_start()
+
+        full_id = self.backup_node(backup_dir, 'node', node)
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        state_file = os.path.join(wals_dir, 'archive.state')
+        journal_file = os.path.join(wals_dir, 'archive.journal')
+
+        # cache is disabled by default
+        self.show_archive(backup_dir, 'node', tli=1)
+        self.assertFalse(os.path.exists(state_file))
+
+        self.set_config(
+            backup_dir, 'node', options=['--archive-state-cache'])
+
+        tli_before = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertTrue(os.path.exists(state_file))
+
+        # new segments are picked up from journal
+        for i in range(3):
+            self.switch_wal_segment(node)
+
+        tli_after = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertGreater(tli_after['max-segno'], tli_before['max-segno'])
+
+        # listing built from scratch must be the same
+        os.remove(state_file)
+        tli_scanned = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(tli_after['min-segno'], tli_scanned['min-segno'])
+        self.assertEqual(tli_after['max-segno'], tli_scanned['max-segno'])
+        self.assertEqual(tli_after['n-segments'], tli_scanned['n-segments'])
+
+        # removed segments are journaled by WAL purge
+        self.backup_node(backup_dir, 'node', node)
+        self.delete_pb(backup_dir, 'node', full_id)
+        self.delete_pb(backup_dir, 'node', options=['--delete-wal'])
+
+        with open(journal_file, 'r') as f:
+            self.assertIn('- ', f.read())
+
+        tli_purged = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertGreater(tli_purged['min-segno'], tli_after['min-segno'])
+
+        os.remove(state_file)
+        tli_scanned = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(tli_purged['min-segno'], tli_scanned['min-segno'])
+        self.assertEqual(tli_purged['n-segments'], tli_scanned['n-segments'])
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def test_archive_state_journal(self):
+        """
+        Make sure that corrupted archive.state and archive.journal
+        are ignored, journal is compacted, and files added to archive
+        by hand are seen once the cache is disabled.
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        self.set_config(
+            backup_dir, 'node', options=['--archive-state-cache'])
+
+        node.slow_start()
+
+        self.backup_node(backup_dir, 'node', node)
+
+        for i in range(3):
+            self.switch_wal_segment(node)
+
+        wals_dir = os.path.join(backup_dir, 'wal', 'node')
+        state_file = os.path.join(wals_dir, 'archive.state')
+        journal_file = os.path.join(wals_dir, 'archive.journal')
+
+        tli = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertTrue(os.path.exists(state_file))
+
+        # truncated state file is ignored and rebuilt
+        with open(state_file, 'r') as f:
+            content = f.read()
+        with open(state_file, 'w') as f:
+            f.write(content[:len(content) // 2])
+
+        tli_scanned = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(tli['max-segno'], tli_scanned['max-segno'])
+        self.assertEqual(tli['n-segments'], tli_scanned['n-segments'])
+
+        with open(state_file, 'r') as f:
+            self.assertTrue(f.read().splitlines()[-1].startswith('# end '))
+
+        # corrupted journal is ignored too
+        with open(journal_file, 'a') as f:
+            f.write('garbage')
+
+        tli_scanned = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(tli['max-segno'], tli_scanned['max-segno'])
+        self.assertEqual(tli['n-segments'], tli_scanned['n-segments'])
+        self.assertFalse(os.path.exists(journal_file))
+
+        # big journal is compacted into the next generation of state file
+        with open(state_file, 'r') as f:
+            generation = int(f.read().splitlines()[2].split(' = ')[1])
+
+        with open(journal_file, 'a') as f:
+            for i in range(5000):
+                f.write('+ dummy 1\n- dummy\n')
+
+        tli_compacted = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(tli['n-segments'], tli_compacted['n-segments'])
+        self.assertFalse(os.path.exists(journal_file))
+        self.assertTrue(os.path.exists(
+            '{0}.{1}'.format(journal_file, generation)))
+
+        with open(state_file, 'r') as f:
+            content = f.read()
+        self.assertIn('generation = {0}\n'.format(generation + 1), content)
+        self.assertNotIn('dummy', content)
+
+        # segment copied into archive by hand is not seen via cache
+        max_file = [
+            f for f in os.listdir(wals_dir)
+            if f in [tli['max-segno'], tli['max-segno'] + '.gz']][0]
+        log_id = int(tli['max-segno'][8:16], 16)
+        seg_id = int(tli['max-segno'][16:], 16) + 1
+        if seg_id > 0xFF:
+            log_id += 1
+            seg_id = 0
+        next_segno = '{0}{1:08X}{2:08X}'.format(
+            tli['max-segno'][:8], log_id, seg_id)
+
+        shutil.copyfile(
+            os.path.join(wals_dir, max_file),
+            os.path.join(wals_dir, next_segno + max_file[24:]))
+
+        tli_cached = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(tli['max-segno'], tli_cached['max-segno'])
+
+        # with cache disabled, archive directory is listed
+        conf_file = os.path.join(
+            backup_dir, 'backups', 'node', 'pg_probackup.conf')
+        with open(conf_file, 'r') as f:
+            conf = f.read()
+        with open(conf_file, 'w') as f:
+            f.write(conf.replace(
+                'archive-state-cache = true', 'archive-state-cache = false'))
+
+        tli_listed = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertEqual(next_segno, tli_listed['max-segno'])
+        self.assertEqual(tli['n-segments'] + 1, tli_listed['n-segments'])
+
+        # archive-push with cache disabled drops the state file,
+        # so it is rebuilt when cache is enabled again
+        os.remove(os.path.join(wals_dir, next_segno + max_file[24:]))
+        node.safe_psql("postgres", "CREATE TABLE t1 (a int)")
+        self.switch_wal_segment(node)
+        self.assertFalse(os.path.exists(state_file))
+
+        self.set_config(
+            backup_dir, 'node', options=['--archive-state-cache'])
+
+        tli_scanned = self.show_archive(backup_dir, 'node', tli=1)
+        self.assertTrue(os.path.exists(state_file))
+        self.assertEqual(next_segno, tli_scanned['max-segno'])
+        self.assertEqual(tli['n-segments'] + 1, tli_scanned['n-segments'])
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     def test_archive_get_prefetch_corruption(self):
         """
         Make sure that WAL corruption is detected.
@@ -3,6 +3,7 @@ import os
 from .helpers.ptrack_helpers import ProbackupTest, ProbackupException
 import subprocess
 from sys import exit
+from time import sleep
 
 
 module_name = 'delete'
@@ -300,7 +301,8 @@ class DeleteTest(ProbackupTest, unittest.TestCase):
 
         # Delete last backup
         self.delete_pb(backup_dir, 'node', backup_3_id, options=['--wal'])
-        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f))]
+        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f))
+                and not f.startswith('archive.')]
         self.assertEqual (0, len(wals), "Number of wals should be equal to 0")
 
         # Clean after yourself
@@ -873,3 +875,66 @@ class DeleteTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_delete_backup_trash(self):
+        """
+        Delete backups in parallel threads and with --trash,
+        make sure that trash directory is purged in background
+        """
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=5)
+
+        backup_id_1 = self.backup_node(backup_dir, 'node', node)
+        backup_id_2 = self.backup_node(backup_dir, 'node', node)
+        backup_id_3 = self.backup_node(backup_dir, 'node', node)
+
+        backups_dir = os.path.join(backup_dir, 'backups', 'node')
+        trash_dir = os.path.join(backups_dir, '.trash')
+
+        # parallel delete in place
+        self.delete_pb(
+            backup_dir, 'node', backup_id_1, options=['-j', '4'])
+        self.assertFalse(
+            os.path.exists(os.path.join(backups_dir, backup_id_1)))
+
+        # delete into trash
+        output = self.delete_pb(
+            backup_dir, 'node', backup_id_2,
+            options=['-j', '4', '--trash', '--log-level-console=LOG'])
+        self.assertIn('is moved into trash directory', output)
+        self.assertFalse(
+            os.path.exists(os.path.join(backups_dir, backup_id_2)))
+
+        show_backups = self.show_pb(backup_dir, 'node')
+        self.assertEqual(len(show_backups), 1)
+        self.assertEqual(show_backups[0]['id'], backup_id_3)
+
+        # wait for background purge
+        for i in range(60):
+            if not os.listdir(trash_dir):
+                break
+            sleep(1)
+
+        self.assertFalse(os.listdir(trash_dir))
+
+        # remaining backup is intact
+        node.cleanup()
+        self.restore_node(backup_dir, 'node', node)
+
+        # instance with trash directory can be deleted
+        self.del_instance(backup_dir, 'node')
+        self.assertFalse(os.path.exists(backups_dir))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -1147,7 +1147,8 @@ class ProbackupTest(object):
     def set_archiving(
             self, backup_dir, instance, node, replica=False,
             overwrite=False, compress=True, old_binary=False,
-            log_level=False, archive_timeout=False):
+            log_level=False, archive_timeout=False, block_summary=False,
+            recovery_index=False, socket=None):
 
         # parse postgresql.auto.conf
         options = {}
@@ -1177,6 +1178,15 @@ class ProbackupTest(object):
         if overwrite:
             options['archive_command'] += '--overwrite '
 
+        if block_summary:
+            options['archive_command'] += '--block-summary '
+
+        if recovery_index:
+            options['archive_command'] += '--recovery-index '
+
+        if socket:
+            options['archive_command'] += '--socket={0} '.format(socket)
+
         options['archive_command'] += '--log-level-console=verbose '
         options['archive_command'] += '-j 5 '
         options['archive_command'] += '--batch-size 10 '
@@ -739,7 +739,8 @@ class PageTest(ProbackupTest, unittest.TestCase):
         # delete last wal segment
         wals_dir = os.path.join(backup_dir, 'wal', 'node')
         wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(
-            wals_dir, f)) and not f.endswith('.backup') and not f.endswith('.part')]
+            wals_dir, f)) and not f.endswith('.backup') and not f.endswith('.part')
+            and not f.endswith('.crc') and not f.startswith('archive.')]
         wals = map(str, wals)
         file = os.path.join(wals_dir, max(wals))
         os.remove(file)
@@ -973,7 +974,8 @@ class PageTest(ProbackupTest, unittest.TestCase):
         # copy latest wal segment
         wals_dir = os.path.join(backup_dir, 'wal', 'alien_node')
         wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(
-            wals_dir, f)) and not f.endswith('.backup')]
+            wals_dir, f)) and not f.endswith('.backup')
+            and not f.endswith('.crc') and not f.startswith('archive.')]
         wals = map(str, wals)
         filename = max(wals)
         file = os.path.join(wals_dir, filename)
@@ -1365,3 +1367,145 @@ class PageTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_page_block_summary(self):
+        """
+        Make node with archive-push --block-summary, take PAGE backup
+        using block summaries and check that restored data is correct
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'autovacuum': 'off'})
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node, block_summary=True)
+        node.slow_start()
+
+        node.pgbench_init(scale=5)
+
+        self.backup_node(backup_dir, 'node', node)
+
+        pgbench = node.pgbench(options=['-T', '10', '-c', '2', '--no-vacuum'])
+        pgbench.wait()
+
+        self.switch_wal_segment(node)
+
+        summaries = [
+            f for f in os.listdir(os.path.join(backup_dir, 'wal', 'node'))
+            if f.endswith('.bsum')]
+        self.assertTrue(summaries, 'No block summaries in archive')
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='page',
+            options=['--log-level-file=LOG'])
+
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            log_content = f.read()
+            self.assertIn('block summaries for timeline', log_content)
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(backup_dir, 'node', node_restored)
+
+        if self.paranoia:
+            pgdata_restored = self.pgdata_content(node_restored.data_dir)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        self.assertEqual(
+            node.safe_psql("postgres", "select sum(abalance) from pgbench_accounts"),
+            node_restored.safe_psql("postgres", "select sum(abalance) from pgbench_accounts"))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def test_page_pagemap_container_boundary(self):
+        """
+        Make table of 70000 pages with one row per page, change
+        sparse and dense ranges of pages on both sides of block 65536,
+        take PAGE backup and check that restored data is correct
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'autovacuum': 'off'})
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap (id int, text text) with (fillfactor=10); "
+            "insert into t_heap select i, repeat('x', 1000) "
+            "from generate_series(0,69999) i")
+
+        self.assertEqual(
+            int(node.safe_psql(
+                "postgres",
+                "select pg_relation_size('t_heap') / 8192")),
+            70000)
+
+        self.backup_node(backup_dir, 'node', node)
+
+        # last block of the first container and first block of the second
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'boundary' "
+            "where ctid in ('(65535,1)', '(65536,1)')")
+
+        # dense range in the first container is kept as bitmap or run
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'dense' "
+            "where ctid >= '(1000,0)' and ctid < '(11000,0)'")
+
+        # sparse ranges are kept as arrays
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'sparse' "
+            "where (ctid::text::point)[0]::int % 97 = 0 "
+            "and ctid >= '(20000,0)'")
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='page', options=['-j', '4'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=['-j', '4'])
+
+        if self.paranoia:
+            pgdata_restored = self.pgdata_content(node_restored.data_dir)
+            self.compare_pgdata(pgdata, pgdata_restored)
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        query = "select text, count(*) from t_heap group by text order by text"
+        self.assertEqual(
+            node.safe_psql("postgres", query),
+            node_restored.safe_psql("postgres", query))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
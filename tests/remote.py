@@ -1,6 +1,8 @@
 import unittest
 import os
-from time import sleep
+import subprocess
+import socket
+from time import sleep, time
 from .helpers.ptrack_helpers import ProbackupTest, ProbackupException
 from .helpers.cfs_helpers import find_by_name
 
@@ -48,3 +50,679 @@ class RemoteTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_corruption_heal_via_ptrack(self):
+        """corrupt page, check that remote backup fetches it via ptrack"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+        if not self.ptrack:
+            return unittest.skip('Skipped because ptrack support is disabled')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            ptrack_enable=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        if node.major_version >= 12:
+            node.safe_psql(
+                "postgres",
+                "CREATE EXTENSION ptrack WITH SCHEMA pg_catalog")
+
+        node.safe_psql(
+            "postgres",
+            "create table t_heap as select 1 as id, md5(i::text) as text, "
+            "md5(repeat(i::text,10))::tsvector as tsvector "
+            "from generate_series(0,1000) i")
+        node.safe_psql(
+            "postgres",
+            "CHECKPOINT")
+
+        heap_path = node.safe_psql(
+            "postgres",
+            "select pg_relation_filepath('t_heap')").rstrip()
+
+        with open(os.path.join(node.data_dir, heap_path), "rb+", 0) as f:
+                f.seek(9000)
+                f.write(b"bla")
+                f.flush()
+                f.close
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type="full",
+            options=["-j", "4", "--stream", "--log-level-file=VERBOSE"])
+
+        # open log file and check
+        with open(os.path.join(backup_dir, 'log', 'pg_probackup.log')) as f:
+            log_content = f.read()
+            self.assertIn('block 1, try to fetch via shared buffer', log_content)
+            self.assertIn('SELECT pg_catalog.pg_ptrack_get_block', log_content)
+            f.close
+
+        self.assertEqual(
+            'OK', self.show_pb(backup_dir, 'node')[0]['status'],
+            "Backup Status should be OK")
+
+        # page from shared buffer is valid
+        self.validate_pb(backup_dir)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_backup_pg_log(self):
+        """remote backup skips server log directory unless --backup-pg-log"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        if self.get_version(node) < self.version_to_num('10.0'):
+            log_dir = 'pg_log'
+        else:
+            log_dir = 'log'
+
+        os.makedirs(os.path.join(node.data_dir, log_dir), exist_ok=True)
+        with open(os.path.join(node.data_dir, log_dir, 'postgresql.log'), 'w') as f:
+            f.write('server log')
+            f.flush()
+            f.close
+
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, options=['--stream'])
+
+        self.assertFalse(
+            os.path.exists(os.path.join(
+                backup_dir, 'backups', 'node', backup_id,
+                'database', log_dir, 'postgresql.log')),
+            'Server log is copied without --backup-pg-log')
+
+        backup_id = self.backup_node(
+            backup_dir, 'node', node,
+            options=['--stream', '--backup-pg-log'])
+
+        self.assertTrue(
+            os.path.exists(os.path.join(
+                backup_dir, 'backups', 'node', backup_id,
+                'database', log_dir, 'postgresql.log')),
+            'Server log is not copied with --backup-pg-log')
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_multiplexed_threads(self):
+        """many threads of remote backup and restore share SSH connections"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=10)
+
+        log_file = os.path.join(backup_dir, 'log', 'pg_probackup.log')
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            options=['--stream', '-j', '16', '--log-level-file=LOG'])
+
+        # main thread and 16 workers need at most 17 streams, 8 per connection
+        with open(log_file) as f:
+            self.assertLessEqual(
+                f.read().count('Start SSH client process'), 3)
+
+        pgdata = self.pgdata_content(node.data_dir)
+        node.stop()
+        node.cleanup()
+        os.remove(log_file)
+
+        self.restore_node(
+            backup_dir, 'node', node,
+            options=['-j', '16', '--log-level-file=LOG'])
+
+        with open(log_file) as f:
+            self.assertLessEqual(
+                f.read().count('Start SSH client process'), 3)
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        node.slow_start()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_compress(self):
+        """remote backup and restore with compressed agent channel"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=10)
+
+        # raw pages and non-data files
+        self.backup_node(
+            backup_dir, 'node', node,
+            options=['--stream', '-j', '4', '--remote-compress'])
+
+        pgbench = node.pgbench(options=['-T', '10', '-c', '2', '--no-vacuum'])
+        pgbench.wait()
+
+        # compressed pages are sent as is
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='delta',
+            options=[
+                '--stream', '-j', '4', '--remote-compress',
+                '--compress-algorithm=zlib'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+        node.stop()
+        node.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node, options=['-j', '4', '--remote-compress'])
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        node.slow_start()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_page_sparse_pagemap(self):
+        """remote PAGE backup of few changed blocks and long ranges"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'autovacuum': 'off'})
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        # one row per page
+        node.safe_psql(
+            "postgres",
+            "create table t_heap (id int, text text) with (fillfactor=10); "
+            "insert into t_heap select i, repeat('x', 1000) "
+            "from generate_series(0,2999) i")
+
+        self.backup_node(backup_dir, 'node', node)
+
+        # few blocks at high block numbers and range longer than one read
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = 'changed' "
+            "where ctid in ('(2000,1)', '(2500,1)', '(2999,1)') "
+            "or (ctid >= '(100,0)' and ctid < '(230,0)')")
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='page', options=['-j', '4'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.restore_node(
+            backup_dir, 'node', node_restored, options=['-j', '4'])
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        self.assertEqual(
+            133,
+            int(node_restored.safe_psql(
+                "postgres",
+                "select count(*) from t_heap where text = 'changed'")))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_restore_scattered_blocks(self):
+        """remote restore of incremental backup writing scattered blocks"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'],
+            pg_options={'autovacuum': 'off'})
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        # one row per page
+        node.safe_psql(
+            "postgres",
+            "create table t_heap (id int, text text) with (fillfactor=10); "
+            "insert into t_heap select i, repeat('x', 1000) "
+            "from generate_series(0,1999) i")
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream', '--compress'])
+
+        # every 7th block is changed, so restore of DELTA backup
+        # writes blocks with gaps between them
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = repeat('y', 1000) where id % 7 = 0")
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='delta',
+            options=['--stream', '--compress'])
+
+        # uncompressed blocks are written in batches too
+        node.safe_psql(
+            "postgres",
+            "update t_heap set text = repeat('z', 1000) where id % 11 = 0")
+
+        self.backup_node(
+            backup_dir, 'node', node, backup_type='delta', options=['--stream'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+        node.stop()
+        node.cleanup()
+
+        self.restore_node(backup_dir, 'node', node, options=['-j', '4'])
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        node.slow_start()
+
+        self.assertEqual(
+            182,
+            int(node.safe_psql(
+                "postgres",
+                "select count(*) from t_heap where text = repeat('z', 1000)")))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_file_sizes(self):
+        """remote backup of files around chunk and read buffer sizes"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=5)
+
+        # 64kB read buffer, 128kB chunk and frames larger than 1MB
+        for size in [0, 1, 65535, 65536, 65537, 131071, 131073, 3 * 1024 * 1024 + 7]:
+            with open(os.path.join(node.data_dir, 'file_{0}'.format(size)), 'wb') as f:
+                f.write(os.urandom(size))
+                f.flush()
+                f.close
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--stream', '-j', '4'])
+
+        pgdata = self.pgdata_content(node.data_dir)
+        node.stop()
+        node.cleanup()
+
+        self.restore_node(backup_dir, 'node', node, options=['-j', '4'])
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        node.slow_start()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_restore_deferred_error(self):
+        """
+        remote restore reports error of request, which is not
+        confirmed by the agent, and exits with error
+        """
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        external_dir = self.get_tblspace_path(node, 'external_dir')
+        os.makedirs(external_dir)
+        with open(os.path.join(external_dir, 'file'), 'w') as f:
+            f.write('external')
+            f.flush()
+            f.close
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            options=['--stream', '--external-dirs={0}'.format(external_dir)])
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        # files of external directory cannot be created by the agent
+        readonly_dir = os.path.join(
+            self.tmp_path, module_name, fname, 'readonly')
+        os.makedirs(readonly_dir)
+        os.chmod(readonly_dir, 0o500)
+
+        try:
+            self.restore_node(
+                backup_dir, 'node', node_restored,
+                options=[
+                    '--external-mapping={0}={1}'.format(
+                        external_dir,
+                        os.path.join(readonly_dir, 'external_dir'))])
+            # we should die here because exception is what we expect to happen
+            self.assertEqual(
+                1, 0,
+                "Expecting Error because external directory is read-only."
+                "\n Output: {0} \n CMD: {1}".format(
+                    repr(self.output), self.cmd))
+        except ProbackupException as e:
+            self.assertIn(
+                'ERROR: Cannot open file "{0}"'.format(
+                    os.path.join(readonly_dir, 'external_dir', 'file')),
+                e.message,
+                "\n Unexpected Error Message: {0}\n CMD: {1}".format(
+                    repr(e.message), self.cmd))
+            # error comes from the agent alive, not from lost connection
+            self.assertNotIn('Agent error', e.message)
+            self.assertNotIn('Communication error', e.message)
+
+        os.chmod(readonly_dir, 0o700)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    def start_agent(self, backup_dir, address, secret=None, options=[]):
+        """Start agent accepting direct connections at address"""
+        env = self.test_env.copy()
+        if secret:
+            env['PGPROBACKUP_AGENT_SECRET'] = secret
+
+        agent_log_path = os.path.join(backup_dir, 'agent.log')
+        with open(agent_log_path, 'w') as agent_log:
+            agent = subprocess.Popen(
+                [self.probackup_path, 'agent',
+                 '--listen={0}'.format(address)] + options,
+                stdout=agent_log, stderr=subprocess.STDOUT, env=env)
+
+        while True:
+            self.assertIsNone(agent.poll(), 'agent has exited')
+            with open(agent_log_path, 'r') as f:
+                if 'is listening on' in f.read():
+                    return agent
+            sleep(0.1)
+
+    # @unittest.skip("skip")
+    def test_remote_direct_connection(self):
+        """backup and restore via agent listening on UNIX socket"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        if self.get_version(node) < self.version_to_num('10.0'):
+            return unittest.skip('You need PostgreSQL >= 10 for this test')
+
+        node.pgbench_init(scale=2)
+
+        socket_path = os.path.join('/tmp', 'pg_probackup_{0}.sock'.format(fname))
+        agent = self.start_agent(backup_dir, socket_path, secret='secret')
+        remote_options = [
+            '--remote-proto=tcp', '--remote-host={0}'.format(socket_path)]
+
+        # master has no secret
+        try:
+            self.backup_node(
+                backup_dir, 'node', node, no_remote=True,
+                options=['--stream'] + remote_options)
+            # we should die here because exception is what we expect to happen
+            self.assertEqual(
+                1, 0,
+                "Expecting Error because agent requires authentication."
+                "\n Output: {0} \n CMD: {1}".format(
+                    repr(self.output), self.cmd))
+        except ProbackupException as e:
+            self.assertIn(
+                'requires authentication, set PGPROBACKUP_AGENT_SECRET',
+                e.message,
+                "\n Unexpected Error Message: {0}\n CMD: {1}".format(
+                    repr(e.message), self.cmd))
+
+        # wrong secret
+        self.test_env['PGPROBACKUP_AGENT_SECRET'] = 'wrong'
+        try:
+            self.backup_node(
+                backup_dir, 'node', node, no_remote=True,
+                options=['--stream'] + remote_options)
+            # we should die here because exception is what we expect to happen
+            self.assertEqual(
+                1, 0,
+                "Expecting Error because of wrong shared secret."
+                "\n Output: {0} \n CMD: {1}".format(
+                    repr(self.output), self.cmd))
+        except ProbackupException as e:
+            self.assertIn(
+                'rejected authentication',
+                e.message,
+                "\n Unexpected Error Message: {0}\n CMD: {1}".format(
+                    repr(e.message), self.cmd))
+
+        self.test_env['PGPROBACKUP_AGENT_SECRET'] = 'secret'
+        output = self.backup_node(
+            backup_dir, 'node', node, no_remote=True, return_id=False,
+            options=['--stream', '-j', '4'] + remote_options)
+        self.assertIn('remote: true', output)
+
+        pgdata = self.pgdata_content(node.data_dir)
+        node.stop()
+        node.cleanup()
+
+        self.run_pb([
+            'restore', '-B', backup_dir, '--instance=node',
+            '-D', node.data_dir, '-j', '4', '--no-sync'] + remote_options)
+
+        pgdata_restored = self.pgdata_content(node.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        agent.terminate()
+        agent.wait()
+        del self.test_env['PGPROBACKUP_AGENT_SECRET']
+
+        node.slow_start()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_agent_handshake_timeout(self):
+        """agent drops connection which doesn't pass handshake in time"""
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+
+        socket_path = os.path.join('/tmp', 'pg_probackup_{0}.sock'.format(fname))
+        agent = self.start_agent(backup_dir, socket_path)
+
+        # socket is accessible only to owner of the agent
+        self.assertEqual(0, os.stat(socket_path).st_mode & 0o077)
+
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(60)
+        sock.connect(socket_path)
+
+        # read hello and never send login
+        start = time()
+        while sock.recv(4096):
+            pass
+        self.assertLess(time() - start, 60)
+        sock.close()
+
+        with open(os.path.join(backup_dir, 'agent.log'), 'r') as f:
+            self.assertIn('Handshake with master timed out', f.read())
+
+        agent.terminate()
+        agent.wait()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_agent_listen_external(self):
+        """agent listens on non-loopback address only if it is allowed"""
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+
+        env = self.test_env.copy()
+        env['PGPROBACKUP_AGENT_SECRET'] = 'secret'
+        agent = subprocess.Popen(
+            [self.probackup_path, 'agent', '--listen=0.0.0.0:4849'],
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env=env)
+        output = agent.communicate(timeout=60)[0].decode('utf-8')
+        self.assertNotEqual(0, agent.returncode)
+        self.assertIn('is not a loopback one', output)
+
+        # port alone means localhost
+        agent = self.start_agent(backup_dir, '4849', secret='secret')
+        sock = socket.create_connection(('127.0.0.1', 4849), timeout=60)
+        self.assertTrue(sock.recv(4096))
+        sock.close()
+        agent.terminate()
+        agent.wait()
+
+        agent = self.start_agent(
+            backup_dir, '0.0.0.0:4849', secret='secret',
+            options=['--allow-external'])
+        agent.terminate()
+        agent.wait()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_remote_transport_benchmark(self):
+        """compare backup throughput via SSH and direct connection"""
+        if not self.remote:
+            return unittest.skip('You must enable PGPROBACKUP_SSH_REMOTE')
+
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=100)
+        size = int(node.safe_psql(
+            'postgres', 'select pg_database_size(\'postgres\')'))
+
+        agent = self.start_agent(backup_dir, '127.0.0.1:4848', secret='secret')
+        self.test_env['PGPROBACKUP_AGENT_SECRET'] = 'secret'
+
+        timings = {}
+        for proto in ['ssh', 'tcp']:
+            options = ['--stream', '-j', '4',
+                '--remote-proto={0}'.format(proto), '--remote-host=127.0.0.1']
+            if proto == 'tcp':
+                options += ['--remote-port=4848']
+
+            start = time()
+            self.backup_node(
+                backup_dir, 'node', node, no_remote=True, options=options)
+            timings[proto] = time() - start
+
+        agent.terminate()
+        agent.wait()
+        del self.test_env['PGPROBACKUP_AGENT_SECRET']
+
+        for proto in ['ssh', 'tcp']:
+            print('{0}: {1:.2f}s, {2:.1f}MB/s'.format(
+                proto, timings[proto], size / timings[proto] / 1024 / 1024))
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
@@ -418,6 +418,230 @@ class RestoreTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_restore_stage_wal(self):
+        """recovery to target lsn with WAL staged into pg_wal"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=['--data-checksums'])
+
+        if self.get_version(node) < self.version_to_num('10.0'):
+            self.del_test_dir(module_name, fname)
+            return
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=2)
+        with node.connect("postgres") as con:
+            con.execute("CREATE TABLE tbl0005 (a int)")
+            con.commit()
+
+        backup_id = self.backup_node(backup_dir, 'node', node)
+
+        pgbench = node.pgbench(
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        pgbench.wait()
+        pgbench.stdout.close()
+
+        before = node.safe_psql("postgres", "SELECT * FROM pgbench_branches")
+        with node.connect("postgres") as con:
+            con.execute("INSERT INTO tbl0005 VALUES (1)")
+            con.commit()
+            res = con.execute("SELECT pg_current_wal_lsn()")
+            con.commit()
+            xlogid, xrecoff = res[0][0].split('/')
+            xrecoff = hex(int(xrecoff, 16) + 1)[2:]
+            target_lsn = "{0}/{1}".format(xlogid, xrecoff)
+
+        self.switch_wal_segment(node)
+
+        pgbench = node.pgbench(
+            stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        pgbench.wait()
+        pgbench.stdout.close()
+
+        self.switch_wal_segment(node)
+
+        node.stop()
+        node.cleanup()
+
+        output = self.restore_node(
+            backup_dir, 'node', node,
+            options=[
+                "-j", "4", '--lsn={0}'.format(target_lsn),
+                "--recovery-target-action=promote", "--stage-wal"])
+
+        self.assertIn(
+            "INFO: Restore of backup {0} completed.".format(backup_id),
+            output,
+            '\n Unexpected Error Message: {0}\n CMD: {1}'.format(
+                repr(self.output), self.cmd))
+
+        self.assertIn("INFO: WAL files are staged", output)
+
+        self.assertIn(
+            'archive-get', self.get_recovery_conf(node)['restore_command'])
+
+        node.slow_start()
+
+        after = node.safe_psql("postgres", "SELECT * FROM pgbench_branches")
+        self.assertEqual(before, after)
+        self.assertEqual(
+            len(node.execute("postgres", "SELECT * FROM tbl0005")), 1)
+
+        # staged segments are read from pg_wal, not from archive
+        with open(node.pg_log_file, 'r') as f:
+            self.assertIn('is staged into', f.read())
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_stage_wal_time(self):
+        """recovery to target time stages WAL up to the target only"""
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=['--data-checksums'])
+
+        if self.get_version(node) < self.version_to_num('10.0'):
+            self.del_test_dir(module_name, fname)
+            return
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.safe_psql("postgres", "CREATE TABLE t1 (a int)")
+
+        self.backup_node(backup_dir, 'node', node)
+
+        node.safe_psql("postgres", "INSERT INTO t1 VALUES (1)")
+        self.switch_wal_segment(node)
+
+        target_time = node.safe_psql(
+            "postgres",
+            "SELECT to_char(now(), 'YYYY-MM-DD HH24:MI:SS.US')").rstrip()
+
+        sleep(1)
+        node.safe_psql("postgres", "INSERT INTO t1 VALUES (2)")
+        self.switch_wal_segment(node)
+        node.safe_psql("postgres", "INSERT INTO t1 VALUES (3)")
+        self.switch_wal_segment(node)
+        last_segment = node.safe_psql(
+            "postgres",
+            "SELECT pg_walfile_name(pg_current_wal_lsn())").rstrip()
+        node.safe_psql("postgres", "INSERT INTO t1 VALUES (4)")
+        self.switch_wal_segment(node)
+        node.stop()
+        node.cleanup()
+
+        output = self.restore_node(
+            backup_dir, 'node', node,
+            options=[
+                "-j", "4", "--stage-wal",
+                '--time={0}'.format(target_time),
+                "--recovery-target-action=promote"])
+
+        self.assertNotIn("Recovery target is not resolved", output)
+
+        # WAL past the target is not staged
+        self.assertFalse(
+            os.path.exists(
+                os.path.join(node.data_dir, 'pg_wal', last_segment)))
+
+        node.slow_start()
+
+        self.assertEqual(
+            node.execute("postgres", "SELECT a FROM t1"), [(1,)])
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_stage_wal_latest_timeline(self):
+        """
+        restore with staged WAL follows the latest timeline
+        and does not collide with timelines in archive
+        """
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            initdb_params=['--data-checksums'])
+
+        if self.get_version(node) < self.version_to_num('12.0'):
+            self.del_test_dir(module_name, fname)
+            return unittest.skip(
+                'recovery_target_timeline is latest by default since PG 12')
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.safe_psql("postgres", "CREATE TABLE t1 (a int)")
+
+        self.backup_node(backup_dir, 'node', node)
+
+        node.safe_psql("postgres", "INSERT INTO t1 VALUES (1)")
+        self.switch_wal_segment(node)
+        node.stop()
+        node.cleanup()
+
+        # timeline 2
+        self.restore_node(
+            backup_dir, 'node', node,
+            options=[
+                '--recovery-target=immediate',
+                '--recovery-target-action=promote'])
+        node.slow_start()
+
+        node.safe_psql("postgres", "INSERT INTO t1 VALUES (2)")
+        self.switch_wal_segment(node)
+        node.stop()
+        node.cleanup()
+
+        output = self.restore_node(
+            backup_dir, 'node', node,
+            options=[
+                "-j", "4", "--stage-wal",
+                "--recovery-target-action=promote"])
+
+        self.assertIn(
+            "WARNING: Recovery target is not resolved to LSN", output)
+
+        node.slow_start()
+
+        self.assertEqual(
+            node.execute("postgres", "SELECT a FROM t1"), [(2,)])
+
+        # list of staged segments is removed once recovery is past them
+        self.assertFalse(
+            os.path.exists(
+                os.path.join(node.data_dir, 'pg_wal', 'pbk_staged')))
+
+        # timeline 3, not the one already in archive
+        self.assertEqual(
+            node.execute(
+                "postgres", "SELECT timeline_id FROM pg_control_checkpoint()"),
+            [(3,)])
+
+        # WAL of new timeline is archived
+        node.safe_psql("postgres", "INSERT INTO t1 VALUES (3)")
+        self.switch_wal_segment(node)
+        self.validate_pb(backup_dir)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_restore_to_lsn_not_inclusive(self):
         """recovery to target lsn"""
@@ -1547,6 +1771,68 @@ class RestoreTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_restore_remote_apply(self):
+        """
+        make node, take compressed FULL, DELTA and PAGE backups,
+        restore the chain with backup files applied by remote agent
+        """
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=2)
+
+        self.backup_node(
+            backup_dir, 'node', node, options=['--compress'])
+
+        pgbench = node.pgbench(options=['-T', '10', '-c', '2', '--no-vacuum'])
+        pgbench.wait()
+
+        self.backup_node(
+            backup_dir, 'node', node,
+            backup_type='delta', options=['--compress'])
+
+        node.safe_psql(
+            "postgres",
+            "delete from pgbench_accounts where aid > 100000; "
+            "vacuum pgbench_accounts")
+
+        backup_id = self.backup_node(
+            backup_dir, 'node', node, backup_type='page')
+
+        pgdata = self.pgdata_content(node.data_dir)
+        node.stop()
+
+        node_restored = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node_restored'))
+        node_restored.cleanup()
+
+        self.assertIn(
+            "INFO: Restore of backup {0} completed.".format(backup_id),
+            self.restore_node(
+                backup_dir, 'node', node_restored,
+                options=["-j", "4", "--remote-apply"]),
+            '\n Unexpected Error Message: {0}\n CMD: {1}'.format(
+                repr(self.output), self.cmd))
+
+        pgdata_restored = self.pgdata_content(node_restored.data_dir)
+        self.compare_pgdata(pgdata, pgdata_restored)
+
+        self.set_auto_conf(node_restored, {'port': node_restored.port})
+        node_restored.slow_start()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     # @unittest.skip("skip")
     def test_restore_chain_with_corrupted_backup(self):
         """more complex test_restore_chain()"""
@@ -3423,3 +3709,69 @@ class RestoreTest(ProbackupTest, unittest.TestCase):
 
         # Clean after yourself
         self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_restore_long_chain_dropped_and_recreated_files(self):
+        """
+        Restore the middle and the tail of a long incremental chain,
+        where relations are changed, dropped and recreated in between.
+        """
+        fname = self.id().split('.')[3]
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        node.slow_start()
+
+        node.pgbench_init(scale=1)
+
+        # FULL
+        self.backup_node(backup_dir, 'node', node, options=['--stream'])
+
+        backup_ids = []
+        pgdata_list = []
+        for i in range(6):
+            if i == 2:
+                node.safe_psql('postgres', 'DROP TABLE pgbench_history')
+            elif i == 4:
+                node.safe_psql(
+                    'postgres',
+                    'CREATE TABLE pgbench_history AS '
+                    'SELECT i AS aid FROM generate_series(0,10000) i')
+            else:
+                pgbench = node.pgbench(options=['-t', '100', '-c', '1'])
+                pgbench.wait()
+
+            # non-data file copied only in the middle of the chain
+            if i == 1:
+                with open(os.path.join(node.data_dir, 'chain_note'), 'w') as f:
+                    f.write('changed in backup {0}'.format(i))
+                    f.flush()
+                    f.close
+
+            node.safe_psql('postgres', 'CHECKPOINT')
+
+            backup_ids.append(self.backup_node(
+                backup_dir, 'node', node,
+                backup_type='delta' if i % 2 else 'page',
+                options=['--stream']))
+
+            pgdata_list.append(self.pgdata_content(node.data_dir))
+
+        node.cleanup()
+
+        for idx in [2, 5]:
+            self.restore_node(
+                backup_dir, 'node', node, backup_id=backup_ids[idx])
+
+            pgdata_restored = self.pgdata_content(node.data_dir)
+            self.compare_pgdata(pgdata_list[idx], pgdata_restored)
+
+            node.cleanup()
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
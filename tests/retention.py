@@ -60,7 +60,8 @@ class RetentionTest(ProbackupTest, unittest.TestCase):
         max_wal = output_after['max-segno']
 
         for wal_name in os.listdir(os.path.join(backup_dir, 'wal', 'node')):
-            if not wal_name.endswith(".backup"):
+            if not wal_name.endswith(".backup") and not wal_name.endswith(".crc") \
+                    and not wal_name.startswith("archive."):
 
                 if self.archive_compress:
                     wal_name = wal_name[-27:]
@@ -228,8 +229,9 @@ class RetentionTest(ProbackupTest, unittest.TestCase):
         #     backup_dir, 'node',
         #     options=['--retention-window=1', '--expired', '--wal'])
 
-        # count again
-        n_wals = len(os.listdir(wals_dir))
+        # count again, archive listing cache is not WAL
+        n_wals = len(
+            [f for f in os.listdir(wals_dir) if not f.startswith('archive.')])
         self.assertTrue(n_wals == 0)
 
         # Clean after yourself
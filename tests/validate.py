@@ -1343,7 +1343,8 @@ class ValidateTest(ProbackupTest, unittest.TestCase):
 
         # Corrupt WAL
         wals_dir = os.path.join(backup_dir, 'wal', 'node')
-        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f)) and not f.endswith('.backup')]
+        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f)) and not f.endswith('.backup')
+                and not f.endswith('.crc') and not f.startswith('archive.')]
         wals.sort()
         for wal in wals:
             with open(os.path.join(wals_dir, wal), "rb+", 0) as f:
@@ -1408,7 +1409,8 @@ class ValidateTest(ProbackupTest, unittest.TestCase):
 
         # Corrupt WAL
         wals_dir = os.path.join(backup_dir, 'wal', 'node')
-        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f)) and not f.endswith('.backup')]
+        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f)) and not f.endswith('.backup')
+                and not f.endswith('.crc') and not f.startswith('archive.')]
         wals.sort()
         for wal in wals:
             with open(os.path.join(wals_dir, wal), "rb+", 0) as f:
@@ -1471,7 +1473,8 @@ class ValidateTest(ProbackupTest, unittest.TestCase):
 
         # Delete wal segment
         wals_dir = os.path.join(backup_dir, 'wal', 'node')
-        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f)) and not f.endswith('.backup')]
+        wals = [f for f in os.listdir(wals_dir) if os.path.isfile(os.path.join(wals_dir, f)) and not f.endswith('.backup')
+                and not f.endswith('.crc') and not f.startswith('archive.')]
         wals.sort()
         file = os.path.join(backup_dir, 'wal', 'node', wals[-1])
         os.remove(file)
@@ -3508,6 +3511,152 @@ class ValidateTest(ProbackupTest, unittest.TestCase):
         # Clean after yourself
         self.del_test_dir(module_name, fname)
 
+    # @unittest.skip("skip")
+    def test_validate_recovery_index(self):
+        """
+        Make node with archive-push --recovery-index, check that
+        validation to recovery target name finds the restore point
+        in the indexes and that indexes of segments without checksum
+        files are not used
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node, recovery_index=True)
+        node.slow_start()
+
+        backup_id = self.backup_node(backup_dir, 'node', node)
+
+        node.safe_psql("postgres", "create table t_heap (id int)")
+        for i in range(5):
+            node.safe_psql(
+                "postgres",
+                "insert into t_heap select generate_series(0,10000)")
+            self.switch_wal_segment(node)
+
+        node.safe_psql("postgres", "select pg_create_restore_point('rp')")
+        self.switch_wal_segment(node)
+
+        wal_dir = os.path.join(backup_dir, 'wal', 'node')
+        indexes = [f for f in os.listdir(wal_dir) if f.endswith('.ridx')]
+        self.assertTrue(indexes, 'No recovery target indexes in archive')
+
+        output = self.validate_pb(
+            backup_dir, 'node', backup_id,
+            options=['--recovery-target-name=rp'])
+        self.assertIn('Restore point "rp" is found at', output)
+
+        # validation itself doesn't write indexes
+        for index in indexes:
+            os.remove(os.path.join(wal_dir, index))
+
+        self.validate_pb(
+            backup_dir, 'node', backup_id,
+            options=['--recovery-target-name=rp'])
+
+        self.assertFalse(
+            [f for f in os.listdir(wal_dir) if f.endswith('.ridx')],
+            'Recovery target indexes are written by validation')
+
+        # index is not used without checksum file of the segment
+        node.safe_psql("postgres", "select pg_create_restore_point('rp2')")
+        self.switch_wal_segment(node)
+
+        for f in os.listdir(wal_dir):
+            if f.endswith('.crc'):
+                os.remove(os.path.join(wal_dir, f))
+
+        output = self.validate_pb(
+            backup_dir, 'node', backup_id,
+            options=['--recovery-target-name=rp2', '--log-level-console=LOG'])
+        self.assertIn(
+            'Restore point "rp2" is not found in recovery target indexes',
+            output)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
+    # @unittest.skip("skip")
+    def test_validate_recovery_target_index_time_xid(self):
+        """
+        Check that validation to recovery target time, xid and lsn
+        parses only WAL segments, where the target can be reached
+        according to recovery target indexes
+        """
+        fname = self.id().split('.')[3]
+        backup_dir = os.path.join(self.tmp_path, module_name, fname, 'backup')
+        node = self.make_simple_node(
+            base_dir=os.path.join(module_name, fname, 'node'),
+            set_replication=True,
+            initdb_params=['--data-checksums'])
+
+        self.init_pb(backup_dir)
+        self.add_instance(backup_dir, 'node', node)
+        self.set_archiving(backup_dir, 'node', node, recovery_index=True)
+        node.slow_start()
+
+        backup_id = self.backup_node(backup_dir, 'node', node)
+
+        node.safe_psql("postgres", "create table t_heap (id int)")
+        for i in range(5):
+            node.safe_psql(
+                "postgres",
+                "insert into t_heap select generate_series(0,10000)")
+            self.switch_wal_segment(node)
+
+        with node.connect("postgres") as con:
+            res = con.execute(
+                "INSERT INTO t_heap VALUES (1) RETURNING (xmin)")
+            con.commit()
+            target_xid = res[0][0]
+
+        targets = ['--recovery-target-xid={0}'.format(target_xid)]
+
+        if self.get_version(node) >= self.version_to_num('10.0'):
+            with node.connect("postgres") as con:
+                res = con.execute("SELECT pg_current_wal_lsn()")
+                targets.append('--recovery-target-lsn={0}'.format(res[0][0]))
+
+        time.sleep(1)
+        targets.append('--recovery-target-time={0}'.format(
+            datetime.now().strftime("%Y-%m-%d %H:%M:%S")))
+        time.sleep(1)
+
+        # commit after the target time
+        node.safe_psql("postgres", "insert into t_heap values (2)")
+        self.switch_wal_segment(node)
+
+        for option in targets:
+            output = self.validate_pb(
+                backup_dir, 'node', backup_id,
+                options=[option, '--log-level-console=LOG'])
+            self.assertIn(
+                'is skipped according to recovery target indexes', output)
+            self.assertIn('Backup validation completed successfully', output)
+
+        # without indexes all WAL is parsed
+        wal_dir = os.path.join(backup_dir, 'wal', 'node')
+        for f in os.listdir(wal_dir):
+            if f.endswith('.ridx'):
+                os.remove(os.path.join(wal_dir, f))
+
+        for option in targets:
+            output = self.validate_pb(
+                backup_dir, 'node', backup_id,
+                options=[option, '--log-level-console=LOG'])
+            self.assertNotIn(
+                'is skipped according to recovery target indexes', output)
+            self.assertIn('Backup validation completed successfully', output)
+
+        # Clean after yourself
+        self.del_test_dir(module_name, fname)
+
     @unittest.skip("skip")
     def test_partial_validate_empty_and_mangled_database_map(self):
         """